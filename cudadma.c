@@ -1,14 +1,18 @@
 /*
  * cudadma - test for DMA transfer on CUDA device
  */
+#define _GNU_SOURCE
 #include <errno.h>
+#include <getopt.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <unistd.h>
 #include <cuda.h>
+#include "dmautil.h"
 
 #define lengthof(array) (sizeof (array) / sizeof ((array)[0]))
 #define error_exit(fmt,...)					\
@@ -20,9 +24,33 @@
 	} while(0)
 
 static int		is_blocking = 1;
+static int		is_duplex = 0;
+static int		is_p2p = 0;
+static const char *filename = NULL;		/* storage to device streaming */
+static int		num_slots = DMA_STREAM_NUM_SLOTS;
+static int		is_zerocopy = 0;
+static const char *zerocopy_fractions = DMA_ZEROCOPY_FRACTIONS;
 static int		num_trial = 100;			/* 100 times */
 static size_t	buffer_size = 128 << 20;	/* 128MB */
 static size_t	chunk_size = 0;
+static int		sweep_mode = 0;
+static char	   *sweep_points = NULL;		/* custom sweep points */
+static int		sweep_format = DMA_FORMAT_CSV;
+static int		ops_mode = 0;
+static char	   *ops_sizes = DMA_OPS_SIZES;	/* sizes of small transfers */
+static size_t	strided_width = 0;			/* --strided, if > 0 */
+static size_t	strided_pitch = 0;
+static size_t	strided_rows = 0;
+static unsigned int host_methods = 0;		/* mask of DMA_HOSTMEM_* */
+static int		numa_node = -1;				/* node of host buffer, if >= 0 */
+static int		device_numa_node = -1;		/* node of the current device */
+static int		cpus_bound = 0;				/* CPU set is given by -C */
+static int		num_warmup = 1;				/* warm-up runs */
+static int		max_runs = 1;				/* measured runs */
+static double	ci_target = 0.0;			/* early stop by CI, in percent */
+static int		verify_threads = 0;			/* --verify, if > 0 */
+static dma_verifier *verifier = NULL;		/* round-trip verification */
+static int		parallel_mode = 0;			/* run devices concurrently */
 
 static const char *
 cuGetErrorString(CUresult errcode)
@@ -123,105 +151,1719 @@ cuGetErrorString(CUresult errcode)
 }
 
 
+/*
+ * Host and device buffers being used for the send/recv test; they are
+ * allocated once, then reused for each measurement.
+ */
+typedef struct {
+	CUstream	stream;
+	char	   *hmem;
+	CUdeviceptr	dmem;
+	dma_hostmem	hostmem;
+} dma_buffer;
+
+/* host memory allocation strategy, if not specified by -a */
+static int
+default_host_method(void)
+{
+	return (is_blocking ? DMA_HOSTMEM_MALLOC : DMA_HOSTMEM_PINNED);
+}
+
+/*
+ * Host memory driver for CUDA
+ */
+static void *
+cuda_mem_register(void *private, void *addr, size_t length)
+{
+	CUresult	rc;
+
+	rc = cuMemHostRegister(addr, length, CU_MEMHOSTREGISTER_PORTABLE);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuMemHostRegister : %s", cuGetErrorString(rc));
+	return NULL;
+}
+
+static void
+cuda_mem_unregister(void *private, void *addr, size_t length, void *handle)
+{
+	cuMemHostUnregister(addr);
+}
+
+static void *
+cuda_mem_alloc(void *private, size_t length, void **p_handle)
+{
+	void	   *addr;
+	CUresult	rc;
+
+	rc = cuMemAllocHost(&addr, length);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuMemAllocHost : %s", cuGetErrorString(rc));
+	*p_handle = NULL;
+
+	return addr;
+}
+
+static void
+cuda_mem_free(void *private, void *addr, size_t length, void *handle)
+{
+	cuMemFreeHost(addr);
+}
+
+static const dma_host_driver cuda_host_driver = {
+	"cuda",
+	NULL,
+	cuda_mem_register,
+	cuda_mem_unregister,
+	cuda_mem_alloc,
+	cuda_mem_free,
+};
+
+/*
+ * NUMA node of the device, according to its PCI bus id
+ */
+static int
+cuda_device_numa_node(CUdevice device)
+{
+	char		busid[64];
+	CUresult	rc;
+
+	rc = cuDeviceGetPCIBusId(busid, sizeof(busid), device);
+	if (rc != CUDA_SUCCESS)
+		return -1;
+	return dma_pci_numa_node(busid);
+}
+
+/*
+ * bind_node_cpus
+ *
+ * It binds the current thread to the CPUs of the NUMA node, unless CPU set
+ * is explicitly given by -C.
+ */
+static void
+bind_node_cpus(int node)
+{
+	cpu_set_t	cpuset;
+
+	if (cpus_bound || node < 0)
+		return;
+	if (dma_numa_node_cpus(node, &cpuset) != 0)
+		error_exit("failed to get CPUs of NUMA node %d", node);
+	if (dma_bind_cpus(&cpuset) != 0)
+		error_exit("failed on sched_setaffinity : %s", strerror(errno));
+}
+
+/*
+ * setup_buffer
+ *
+ * It allocates host buffer according to the strategy, and device buffer.
+ * Returns 0 on success, or -1 if the strategy is not available.
+ */
+static int
+setup_buffer(dma_buffer *dbuf, CUstream stream, int method)
+{
+	CUresult	rc;
+
+	memset(dbuf, 0, sizeof(dma_buffer));
+	dbuf->stream = stream;
+
+	if (dma_hostmem_alloc(&dbuf->hostmem, method, buffer_size,
+						  numa_node, &cuda_host_driver) != 0)
+		return -1;
+	dbuf->hmem = dbuf->hostmem.addr;
+
+	rc = cuMemAlloc(&dbuf->dmem, buffer_size);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuMemAlloc : %s", cuGetErrorString(rc));
+	return 0;
+}
+
+static void
+release_buffer(dma_buffer *dbuf)
+{
+	cuMemFree(dbuf->dmem);
+	dma_hostmem_free(&dbuf->hostmem, &cuda_host_driver);
+}
+
+/*
+ * Ring of the events recorded between the copies
+ *
+ * The k-th copy operation is wrapped by the (k-1)-th and the k-th events.
+ * Its elapsed time is folded into the histogram before the slot of its
+ * starting event is reused, so the number of events is bounded by
+ * EVENT_RING_DEPTH regardless of the number of chunks and trials.
+ */
+#define EVENT_RING_DEPTH	256
+
+static void
+fold_copy(CUevent *ev, unsigned long seq, int num_chunks, dma_result *res)
+{
+	float		elapsed;
+	CUresult	rc;
+
+	rc = cuEventSynchronize(ev[seq % EVENT_RING_DEPTH]);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuEventSynchronize : %s", cuGetErrorString(rc));
+	rc = cuEventElapsedTime(&elapsed,
+							ev[(seq - 1) % EVENT_RING_DEPTH],
+							ev[seq % EVENT_RING_DEPTH]);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuEventElapsedTime : %s", cuGetErrorString(rc));
+	/* a trial consists of num_chunks writes and a read */
+	dma_histogram_add((seq - 1) % (num_chunks + 1) < num_chunks
+					  ? &res->h2d : &res->d2h,
+					  (uint64_t)((double)elapsed * 1000000.0));
+}
+
+static void
+record_event(CUevent *ev, unsigned long seq, CUstream stream,
+			 int num_chunks, dma_result *res)
+{
+	CUresult	rc;
+
+	if (seq >= EVENT_RING_DEPTH)
+		fold_copy(ev, seq - EVENT_RING_DEPTH + 1, num_chunks, res);
+	rc = cuEventRecord(ev[seq % EVENT_RING_DEPTH], stream);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuEventRecord : %s", cuGetErrorString(rc));
+}
+
+/*
+ * measure_dma
+ *
+ * It sends the buffer by chunks, then receives it at once, num_trial times.
+ * If chunk size is not aligned to the buffer size, the remaining tail is
+ * not transferred.
+ *
+ * The bandwidth is computed from the events around the whole of copies,
+ * so folding of the per-chunk latency on the host side is not counted.
+ * Only the tail of verification, not overlapped with the transfer, is
+ * added by the host timer.
+ */
+static void
+measure_dma(dma_buffer *dbuf, size_t chunk_sz, dma_result *res)
+{
+	CUstream	stream = dbuf->stream;
+	CUevent		ev[EVENT_RING_DEPTH];
+	CUevent		ev_start;		/* prior to the first write */
+	CUevent		ev_read;		/* end of the last read */
+	int			num_chunks = buffer_size / chunk_sz;
+	size_t		length = num_chunks * chunk_sz;
+	unsigned long k, seq;
+	int			i, j;
+	CUresult	rc;
+	float		elapsed;
+	double		tv1, tv2;
+
+	for (k=0; k < EVENT_RING_DEPTH; k++)
+	{
+		rc = cuEventCreate(&ev[k], CU_EVENT_DEFAULT);
+		if (rc != CUDA_SUCCESS)
+			error_exit("failed on cuEventCreate : %s", cuGetErrorString(rc));
+	}
+	rc = cuEventCreate(&ev_start, CU_EVENT_DEFAULT);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuEventCreate : %s", cuGetErrorString(rc));
+	rc = cuEventCreate(&ev_read, CU_EVENT_DEFAULT);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuEventCreate : %s", cuGetErrorString(rc));
+	dma_histogram_init(&res->h2d);
+	dma_histogram_init(&res->d2h);
+
+	rc = cuEventRecord(ev_start, stream);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuEventRecord : %s", cuGetErrorString(rc));
+	record_event(ev, 0, stream, num_chunks, res);
+
+	for (i=0, k=1; i < num_trial; i++)
+	{
+		for (j=0; j < num_chunks; j++)
+		{
+			if (is_blocking)
+			{
+				rc = cuMemcpyHtoD(dbuf->dmem + j * chunk_sz,
+								  dbuf->hmem + j * chunk_sz,
+								  chunk_sz);
+				if (rc != CUDA_SUCCESS)
+					error_exit("failed on cuMemcpyHtoD : %s",
+							   cuGetErrorString(rc));
+			}
+			else
+			{
+				rc = cuMemcpyHtoDAsync(dbuf->dmem + j * chunk_sz,
+									   dbuf->hmem + j * chunk_sz,
+									   chunk_sz,
+									   stream);
+				if (rc != CUDA_SUCCESS)
+					error_exit("failed on cuMemcpyHtoDAsync : %s",
+                               cuGetErrorString(rc));
+			}
+			record_event(ev, k++, stream, num_chunks, res);
+		}
+
+		/*
+		 * Verification of the previous trial is overlapped with the writes
+		 * of this trial, and must be done prior to the next read.
+		 */
+		if (verifier && i > 0)
+		{
+			if (!is_blocking)
+			{
+				rc = cuEventSynchronize(ev_read);
+				if (rc != CUDA_SUCCESS)
+					error_exit("failed on cuEventSynchronize : %s",
+							   cuGetErrorString(rc));
+				dma_verify_submit(verifier);
+			}
+			dma_verify_wait(verifier);
+		}
+
+		if (is_blocking)
+		{
+			rc = cuMemcpyDtoH(dbuf->hmem, dbuf->dmem, length);
+			if (rc != CUDA_SUCCESS)
+				error_exit("failed on cuMemcpyDtoH : %s",
+						   cuGetErrorString(rc));
+		}
+		else
+		{
+			rc = cuMemcpyDtoHAsync(dbuf->hmem, dbuf->dmem, length, stream);
+			if (rc != CUDA_SUCCESS)
+                error_exit("failed on cuMemcpyDtoHAsync : %s",
+                           cuGetErrorString(rc));
+		}
+		record_event(ev, k++, stream, num_chunks, res);
+		rc = cuEventRecord(ev_read, stream);
+		if (rc != CUDA_SUCCESS)
+			error_exit("failed on cuEventRecord : %s", cuGetErrorString(rc));
+		/* the read is already done, if blocking */
+		if (verifier && is_blocking)
+			dma_verify_submit(verifier);
+	}
+	/* wait for completion */
+	rc = cuCtxSynchronize();
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuCtxSynchronize : %s", cuGetErrorString(rc));
+	tv1 = dma_timer_now();
+	if (verifier)
+	{
+		if (!is_blocking)
+			dma_verify_submit(verifier);
+		dma_verify_wait(verifier);
+	}
+	tv2 = dma_timer_now();
+
+	rc = cuEventElapsedTime(&elapsed, ev_start, ev_read);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuEventElapsedTime : %s", cuGetErrorString(rc));
+	res->chunk_size = chunk_sz;
+	res->total_size = length * num_trial;
+	res->elapsed = (double)elapsed / 1000.0 + (tv2 - tv1);
+
+	/* per-chunk latency of the copies still on the ring */
+	for (seq = (k > EVENT_RING_DEPTH ? k - EVENT_RING_DEPTH + 1 : 1);
+		 seq < k; seq++)
+		fold_copy(ev, seq, num_chunks, res);
+
+	for (k=0; k < EVENT_RING_DEPTH; k++)
+		cuEventDestroy(ev[k]);
+	cuEventDestroy(ev_start);
+	cuEventDestroy(ev_read);
+}
+
+static void
+run_test(const char *namebuf, CUcontext context, CUstream stream)
+{
+	dma_buffer	dbuf;
+	dma_result	res;
+	dma_histogram h2d;
+	dma_histogram d2h;
+	dma_stats	stats;
+	double	   *speeds;
+	size_t		total_size = 0;
+	double		elapsed = 0.0;
+	double		plain_speed = 0.0;
+	int			i, num_runs;
+
+	if (setup_buffer(&dbuf, stream, default_host_method()) != 0)
+		error_exit("failed to allocate host buffer : %s", strerror(errno));
+	speeds = calloc(max_runs, sizeof(double));
+	if (!speeds)
+		error_exit("out of memory : %s", strerror(errno));
+
+	/* warm-up runs; not counted */
+	for (i=0; i < num_warmup; i++)
+		measure_dma(&dbuf, chunk_size, &res);
+
+	/* throughput without verification, for comparison */
+	if (verify_threads > 0)
+	{
+		measure_dma(&dbuf, chunk_size, &res);
+		plain_speed = (double)(res.total_size >> 20) / res.elapsed;
+		verifier = dma_verify_create(verify_threads, dbuf.hmem,
+									 (buffer_size / chunk_size) * chunk_size,
+									 chunk_size, DMA_VERIFY_SEED);
+	}
+
+	/* measured runs, until the CI of the mean gets tight enough */
+	dma_histogram_init(&h2d);
+	dma_histogram_init(&d2h);
+	for (num_runs=0; num_runs < max_runs; )
+	{
+		measure_dma(&dbuf, chunk_size, &res);
+		speeds[num_runs++] = (double)(res.total_size >> 20) / res.elapsed;
+		total_size += res.total_size;
+		elapsed += res.elapsed;
+		dma_histogram_merge(&h2d, &res.h2d);
+		dma_histogram_merge(&d2h, &res.d2h);
+
+		if (ci_target > 0.0 && num_runs >= DMA_STATS_MIN_RUNS)
+		{
+			dma_stats_compute(speeds, num_runs, &stats);
+			if (stats.ci95 <= stats.mean * ci_target / 100.0)
+				break;
+		}
+	}
+	dma_stats_compute(speeds, num_runs, &stats);
+
+	printf("DMA send/recv test result\n"
+		   "device:         %s\n"
+		   "size:           %luMB\n"
+		   "chunks:         %lu%s x %lu\n"
+		   "ntrials:        %d\n"
+		   "total_size:     %luMB\n"
+		   "time:           %.2fs\n"
+		   "speed:          %.2fMB/s\n"
+		   "mode:           %s\n",
+		   namebuf,
+		   buffer_size >> 20,
+		   chunk_size > (1UL<<20) ? chunk_size >> 20 : chunk_size >> 10,
+		   chunk_size > (1UL<<20) ? "MB" : "KB",
+		   buffer_size / chunk_size,
+		   num_trial,
+		   total_size >> 20,
+		   elapsed,
+		   stats.mean,
+		   is_blocking ? "sync" : "async");
+	if (num_runs > 1)
+	{
+		printf("runs:           %d (warm-up: %d)\n", num_runs, num_warmup);
+		dma_stats_print(stdout, "speed(stats):", "MB/s", &stats);
+	}
+	if (verifier)
+	{
+		printf("speed(plain):   %.2fMB/s (verify overhead: %.1f%%)\n",
+			   plain_speed, 100.0 * (plain_speed - stats.mean) / plain_speed);
+		dma_verify_print(stdout, verifier);
+	}
+	dma_histogram_print(stdout, "latency(H2D):", &h2d);
+	dma_histogram_print(stdout, "latency(D2H):", &d2h);
+	printf("numa:           host node %d, device node %d (%s)\n",
+		   dbuf.hostmem.numa_node,
+		   device_numa_node,
+		   dma_numa_placement(dbuf.hostmem.numa_node, device_numa_node));
+
+	/* release resources */
+	release_buffer(&dbuf);
+	free(speeds);
+	if (verifier)
+	{
+		uint64_t	num_errors = dma_verify_errors(verifier);
+
+		dma_verify_destroy(verifier);
+		verifier = NULL;
+		/* burn-in scripts can detect the corruption by exit code */
+		if (num_errors > 0)
+			exit(2);
+	}
+}
+
+/*
+ * run_sweep
+ *
+ * It measures bandwidth and latency for each chunk size on the sweep
+ * points, using same buffers and context.
+ */
+static void
+run_sweep(const char *namebuf, CUstream stream)
+{
+	dma_buffer	dbuf;
+	dma_result	res;
+	size_t	   *points;
+	int			i, count;
+
+	count = dma_sweep_points(buffer_size, sweep_points, &points);
+	if (count < 0)
+		error_exit("invalid sweep points: %s", sweep_points);
+
+	fprintf(stderr, "chunk size sweep on %s (%s, %luMB x %d)\n",
+			namebuf, is_blocking ? "sync" : "async",
+			buffer_size >> 20, num_trial);
+
+	if (setup_buffer(&dbuf, stream, default_host_method()) != 0)
+		error_exit("failed to allocate host buffer : %s", strerror(errno));
+	for (i=0; i < count; i++)
+	{
+		measure_dma(&dbuf, points[i], &res);
+		dma_sweep_print(stdout, sweep_format, &res, i, count);
+	}
+	release_buffer(&dbuf);
+	free(points);
+}
+
+/*
+ * run_ops
+ *
+ * It measures calls/sec and latency of small transfers for each size,
+ * from the page-locked host buffer.
+ */
+static void
+cuda_ops_submit(void *private, size_t length)
+{
+	dma_buffer *dbuf = private;
+	CUresult	rc;
+
+	rc = cuMemcpyHtoDAsync(dbuf->dmem, dbuf->hmem, length, dbuf->stream);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuMemcpyHtoDAsync : %s", cuGetErrorString(rc));
+}
+
+static void
+cuda_ops_sync(void *private)
+{
+	dma_buffer *dbuf = private;
+	CUresult	rc;
+
+	rc = cuStreamSynchronize(dbuf->stream);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuStreamSynchronize : %s",
+				   cuGetErrorString(rc));
+}
+
+static void
+run_ops(const char *namebuf, CUstream stream)
+{
+	dma_buffer	dbuf;
+	dma_ops_driver driver;
+	dma_ops_result res;
+	size_t	   *points;
+	int			i, count;
+
+	count = dma_parse_sizes(ops_sizes, buffer_size, &points);
+	if (count < 0)
+		error_exit("invalid sizes of small transfers: %s", ops_sizes);
+
+	fprintf(stderr, "small transfers on %s (%d calls per size)\n",
+			namebuf, DMA_OPS_NUM_CALLS);
+
+	if (setup_buffer(&dbuf, stream, DMA_HOSTMEM_PINNED) != 0)
+		error_exit("failed to allocate host buffer : %s", strerror(errno));
+	driver.name = "cuda";
+	driver.private = &dbuf;
+	driver.submit = cuda_ops_submit;
+	driver.sync = cuda_ops_sync;
+	for (i=0; i < count; i++)
+	{
+		dma_ops_measure(&driver, points[i], DMA_OPS_NUM_CALLS, &res);
+		dma_ops_print(stdout, sweep_format, &res, i, count);
+	}
+	release_buffer(&dbuf);
+	free(points);
+}
+
+/*
+ * run_strided
+ *
+ * It extracts strided elements of the host buffer into the device buffer
+ * by cuMemcpy2DAsync, by the host gather plus a 1D copy, and by a copy
+ * per row, then compares the payload bandwidth.
+ */
+static void
+run_strided(const char *namebuf, CUstream stream)
+{
+	dma_buffer	dbuf;
+	dma_hostmem	staging;
+	dma_strided_result res;
+	CUDA_MEMCPY2D cp;
+	size_t		payload = strided_width * strided_rows;
+	size_t		j;
+	double		tv1, tv2, tv3;
+	CUresult	rc;
+	int			i;
+
+	if (setup_buffer(&dbuf, stream, DMA_HOSTMEM_PINNED) != 0)
+		error_exit("failed to allocate host buffer : %s", strerror(errno));
+	if (dma_hostmem_alloc(&staging, DMA_HOSTMEM_PINNED, payload,
+						  numa_node, &cuda_host_driver) != 0)
+		error_exit("failed to allocate staging buffer : %s",
+				   strerror(errno));
+	memset(&res, 0, sizeof(dma_strided_result));
+	res.width = strided_width;
+	res.pitch = strided_pitch;
+	res.rows = strided_rows;
+
+	/* 2D DMA */
+	memset(&cp, 0, sizeof(CUDA_MEMCPY2D));
+	cp.srcMemoryType = CU_MEMORYTYPE_HOST;
+	cp.srcHost = dbuf.hmem;
+	cp.srcPitch = strided_pitch;
+	cp.dstMemoryType = CU_MEMORYTYPE_DEVICE;
+	cp.dstDevice = dbuf.dmem;
+	cp.dstPitch = strided_width;
+	cp.WidthInBytes = strided_width;
+	cp.Height = strided_rows;
+
+	tv1 = dma_timer_now();
+	for (i=0; i < num_trial; i++)
+	{
+		rc = cuMemcpy2DAsync(&cp, stream);
+		if (rc != CUDA_SUCCESS)
+			error_exit("failed on cuMemcpy2DAsync : %s",
+					   cuGetErrorString(rc));
+	}
+	rc = cuStreamSynchronize(stream);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuStreamSynchronize : %s",
+				   cuGetErrorString(rc));
+	res.rect_time = dma_timer_now() - tv1;
+
+	/* host gather + 1D copy; staging buffer is reused after the copy */
+	for (i=0; i < num_trial; i++)
+	{
+		tv1 = dma_timer_now();
+		dma_gather(staging.addr, dbuf.hmem,
+				   strided_width, strided_pitch, strided_rows);
+		tv2 = dma_timer_now();
+		rc = cuMemcpyHtoDAsync(dbuf.dmem, staging.addr, payload, stream);
+		if (rc != CUDA_SUCCESS)
+			error_exit("failed on cuMemcpyHtoDAsync : %s",
+					   cuGetErrorString(rc));
+		rc = cuStreamSynchronize(stream);
+		if (rc != CUDA_SUCCESS)
+			error_exit("failed on cuStreamSynchronize : %s",
+					   cuGetErrorString(rc));
+		tv3 = dma_timer_now();
+		res.gather_time += tv2 - tv1;
+		res.gather_copy_time += tv3 - tv1;
+	}
+
+	/* a copy per row */
+	tv1 = dma_timer_now();
+	for (i=0; i < num_trial; i++)
+	{
+		for (j=0; j < strided_rows; j++)
+		{
+			rc = cuMemcpyHtoDAsync(dbuf.dmem + j * strided_width,
+								   dbuf.hmem + j * strided_pitch,
+								   strided_width, stream);
+			if (rc != CUDA_SUCCESS)
+				error_exit("failed on cuMemcpyHtoDAsync : %s",
+						   cuGetErrorString(rc));
+		}
+		rc = cuStreamSynchronize(stream);
+		if (rc != CUDA_SUCCESS)
+			error_exit("failed on cuStreamSynchronize : %s",
+					   cuGetErrorString(rc));
+	}
+	res.small_time = dma_timer_now() - tv1;
+
+	printf("strided transfer test result\n"
+		   "device:         %s\n",
+		   namebuf);
+	dma_strided_print(stdout, &res, num_trial);
+
+	dma_hostmem_free(&staging, &cuda_host_driver);
+	release_buffer(&dbuf);
+}
+
+/*
+ * run_numa
+ *
+ * It measures bandwidth for each combination of NUMA node of the host
+ * buffer and device, then prints the node x device matrix.
+ */
+static void
+run_numa(uint64_t device_mask, uint64_t node_mask)
+{
+	int			devices[DMA_MAX_IDS];
+	int			nodes[DMA_MAX_IDS];
+	int			num_devices = 0;
+	int			num_nodes = 0;
+	double	   *values;
+	char	   *marks;
+	int			i, j;
+
+	for (i=0; i < DMA_MAX_IDS; i++)
+	{
+		if (device_mask & (1UL << i))
+			devices[num_devices++] = i;
+		if (node_mask & (1UL << i))
+			nodes[num_nodes++] = i;
+	}
+	values = calloc(num_nodes * num_devices, sizeof(double));
+	marks = calloc(num_nodes * num_devices, sizeof(char));
+	if (!values || !marks)
+		error_exit("out of memory : %s", strerror(errno));
+
+	for (j=0; j < num_devices; j++)
+	{
+		CUdevice	device;
+		CUcontext	context;
+		char		namebuf[1024];
+		CUresult	rc;
+
+		rc = cuDeviceGet(&device, devices[j]);
+		if (rc != CUDA_SUCCESS)
+			error_exit("failed on cuDeviceGet(%d) : %s",
+					   devices[j], cuGetErrorString(rc));
+		rc = cuDeviceGetName(namebuf, sizeof(namebuf), device);
+		if (rc != CUDA_SUCCESS)
+			error_exit("failed on cuDeviceGetName : %s",
+					   cuGetErrorString(rc));
+		rc = cuCtxCreate(&context, CU_CTX_SCHED_AUTO, device);
+		if (rc != CUDA_SUCCESS)
+			error_exit("failed on cuCtxCreate : %s", cuGetErrorString(rc));
+		device_numa_node = cuda_device_numa_node(device);
+
+		for (i=0; i < num_nodes; i++)
+		{
+			dma_buffer	dbuf;
+			dma_result	res;
+			double		speed = -1.0;
+			const char *placement;
+
+			bind_node_cpus(nodes[i]);
+			numa_node = nodes[i];
+			if (setup_buffer(&dbuf, NULL, default_host_method()) == 0)
+			{
+				measure_dma(&dbuf, chunk_size, &res);
+				speed = (double)(res.total_size >> 20) / res.elapsed;
+				placement = dma_numa_placement(dbuf.hostmem.numa_node,
+											   device_numa_node);
+				release_buffer(&dbuf);
+			}
+			else
+				placement = "not available";
+
+			values[i * num_devices + j] = speed;
+			marks[i * num_devices + j] =
+				(strcmp(placement, "remote") == 0 ? '*' : ' ');
+			printf("device %d (%s, node %d) x host node %d: "
+				   "%.2fMB/s (%s)\n",
+				   devices[j], namebuf, device_numa_node,
+				   nodes[i], speed, placement);
+		}
+		cuCtxDestroy(context);
+	}
+	dma_print_matrix(stdout,
+					 "bandwidth [MB/s] of host node x device "
+					 "('*' = remote placement)",
+					 "node", num_nodes, nodes,
+					 "dev", num_devices, devices,
+					 values, marks);
+	free(values);
+	free(marks);
+}
+
+/*
+ * run_parallel
+ *
+ * It runs the send/recv test on the multiple devices; first, each device
+ * solely, then all the devices concurrently. Every device is driven by its
+ * own worker thread with its own context and buffers, and the workers
+ * start the measurement at the same time on the barrier.
+ */
+typedef struct {
+	int			device_id;
+	char		namebuf[256];
+	pthread_barrier_t *barrier;	/* NULL, if solo run */
+	dma_result	res;
+} dma_worker;
+
+static void *
+worker_main(void *private)
+{
+	dma_worker *dw = private;
+	dma_buffer	dbuf;
+	CUdevice	device;
+	CUcontext	context;
+	CUresult	rc;
+
+	rc = cuDeviceGet(&device, dw->device_id);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuDeviceGet(%d) : %s",
+				   dw->device_id, cuGetErrorString(rc));
+	rc = cuDeviceGetName(dw->namebuf, sizeof(dw->namebuf), device);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuDeviceGetName : %s", cuGetErrorString(rc));
+	/* new context is also current on this thread */
+	rc = cuCtxCreate(&context, CU_CTX_SCHED_AUTO, device);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuCtxCreate : %s", cuGetErrorString(rc));
+
+	if (setup_buffer(&dbuf, NULL, default_host_method()) != 0)
+		error_exit("failed to allocate host buffer : %s", strerror(errno));
+
+	if (dw->barrier)
+		pthread_barrier_wait(dw->barrier);
+	measure_dma(&dbuf, chunk_size, &dw->res);
+
+	release_buffer(&dbuf);
+	cuCtxDestroy(context);
+
+	return NULL;
+}
+
+static void
+run_parallel(uint64_t device_mask)
+{
+	dma_worker *workers;
+	pthread_t  *threads;
+	pthread_barrier_t barrier;
+	double	   *solo;
+	double		max_elapsed = 0.0;
+	double		sum_solo = 0.0;
+	double		aggregate;
+	size_t		sum_size = 0;
+	int			num_workers = 0;
+	int			i;
+
+	workers = calloc(DMA_MAX_IDS, sizeof(dma_worker));
+	threads = calloc(DMA_MAX_IDS, sizeof(pthread_t));
+	solo = calloc(DMA_MAX_IDS, sizeof(double));
+	if (!workers || !threads || !solo)
+		error_exit("out of memory : %s", strerror(errno));
+	for (i=0; i < DMA_MAX_IDS; i++)
+	{
+		if (device_mask & (1UL << i))
+			workers[num_workers++].device_id = i;
+	}
+
+	/* solo run for each device */
+	for (i=0; i < num_workers; i++)
+	{
+		workers[i].barrier = NULL;
+		if (pthread_create(&threads[i], NULL, worker_main, &workers[i]) != 0)
+			error_exit("failed on pthread_create : %s", strerror(errno));
+		pthread_join(threads[i], NULL);
+		solo[i] = (double)(workers[i].res.total_size >> 20) /
+			workers[i].res.elapsed;
+		sum_solo += solo[i];
+	}
+
+	/* concurrent run */
+	if (pthread_barrier_init(&barrier, NULL, num_workers) != 0)
+		error_exit("failed on pthread_barrier_init : %s", strerror(errno));
+	for (i=0; i < num_workers; i++)
+	{
+		workers[i].barrier = &barrier;
+		if (pthread_create(&threads[i], NULL, worker_main, &workers[i]) != 0)
+			error_exit("failed on pthread_create : %s", strerror(errno));
+	}
+	for (i=0; i < num_workers; i++)
+		pthread_join(threads[i], NULL);
+	pthread_barrier_destroy(&barrier);
+
+	printf("DMA send/recv multi-device test result\n"
+		   "size:           %luMB\n"
+		   "chunks:         %lu%s x %lu\n"
+		   "ntrials:        %d\n"
+		   "mode:           %s\n",
+		   buffer_size >> 20,
+		   chunk_size > (1UL<<20) ? chunk_size >> 20 : chunk_size >> 10,
+		   chunk_size > (1UL<<20) ? "MB" : "KB",
+		   buffer_size / chunk_size,
+		   num_trial,
+		   is_blocking ? "sync" : "async");
+	for (i=0; i < num_workers; i++)
+	{
+		dma_result *res = &workers[i].res;
+		double		speed = (double)(res->total_size >> 20) / res->elapsed;
+
+		printf("device %d:       %.2fMB/s (solo: %.2fMB/s, slowdown: %.2fx) "
+			   "%s\n",
+			   workers[i].device_id, speed, solo[i], solo[i] / speed,
+			   workers[i].namebuf);
+		sum_size += res->total_size;
+		if (res->elapsed > max_elapsed)
+			max_elapsed = res->elapsed;
+	}
+	aggregate = (double)(sum_size >> 20) / max_elapsed;
+	printf("aggregate:      %.2fMB/s (sum of solo: %.2fMB/s, "
+		   "efficiency: %.1f%%)\n",
+		   aggregate, sum_solo, 100.0 * aggregate / sum_solo);
+
+	free(workers);
+	free(threads);
+	free(solo);
+}
+
+/*
+ * run_hostmem
+ *
+ * It measures the allocation/pinning cost and bandwidth for each host
+ * memory allocation strategy.
+ */
+static void
+run_hostmem(const char *namebuf, CUstream stream)
+{
+	dma_buffer	dbuf;
+	dma_result	res;
+	int			i, index = 0;
+
+	fprintf(stderr, "host memory strategies on %s (%s, %luMB x %d)\n",
+			namebuf, is_blocking ? "sync" : "async",
+			buffer_size >> 20, num_trial);
+
+	for (i=0; i < DMA_HOSTMEM_NUM_METHODS; i++)
+	{
+		if ((host_methods & (1U << i)) == 0)
+			continue;
+		if (setup_buffer(&dbuf, stream, i) != 0)
+		{
+			dma_hostmem_print(stdout, &dbuf.hostmem, NULL, index++);
+			continue;
+		}
+		measure_dma(&dbuf, chunk_size, &res);
+		dma_hostmem_print(stdout, &dbuf.hostmem, &res, index++);
+		release_buffer(&dbuf);
+	}
+}
+
+/*
+ * run_duplex
+ *
+ * Bidirectional copy test. H2D and D2H copies are issued on dedicated
+ * streams, so they can run concurrently if the device has multiple copy
+ * engines. Number of streams follows CU_DEVICE_ATTRIBUTE_ASYNC_ENGINE_COUNT.
+ */
+#define DMA_DIR_H2D		0x0001
+#define DMA_DIR_D2H		0x0002
+
+typedef struct {
+	int			num_streams;
+	CUstream   *streams;
+	CUevent		start;
+	CUevent		stop;
+	char	   *hmem;
+	CUdeviceptr	dmem;
+	double		elapsed;	/* sec */
+} duplex_dir;
+
+static void
+duplex_transfer(duplex_dir *h2d, duplex_dir *d2h, int dir_flags)
+{
+	int			num_chunks = buffer_size / chunk_size;
+	int			i, j;
+	float		elapsed;
+	CUresult	rc;
+
+	/* all the streams start at the same point */
+	rc = cuEventRecord(h2d->start, h2d->streams[0]);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuEventRecord : %s", cuGetErrorString(rc));
+	rc = cuEventRecord(d2h->start, h2d->streams[0]);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuEventRecord : %s", cuGetErrorString(rc));
+	for (i=1; i < h2d->num_streams; i++)
+	{
+		rc = cuStreamWaitEvent(h2d->streams[i], h2d->start, 0);
+		if (rc != CUDA_SUCCESS)
+			error_exit("failed on cuStreamWaitEvent : %s",
+					   cuGetErrorString(rc));
+	}
+	for (i=0; i < d2h->num_streams; i++)
+	{
+		rc = cuStreamWaitEvent(d2h->streams[i], d2h->start, 0);
+		if (rc != CUDA_SUCCESS)
+			error_exit("failed on cuStreamWaitEvent : %s",
+					   cuGetErrorString(rc));
+	}
+
+	for (i=0; i < num_trial; i++)
+	{
+		for (j=0; j < num_chunks; j++)
+		{
+			size_t	offset = j * chunk_size;
+
+			if (dir_flags & DMA_DIR_H2D)
+			{
+				rc = cuMemcpyHtoDAsync(h2d->dmem + offset,
+									   h2d->hmem + offset,
+									   chunk_size,
+									   h2d->streams[j % h2d->num_streams]);
+				if (rc != CUDA_SUCCESS)
+					error_exit("failed on cuMemcpyHtoDAsync : %s",
+							   cuGetErrorString(rc));
+			}
+			if (dir_flags & DMA_DIR_D2H)
+			{
+				rc = cuMemcpyDtoHAsync(d2h->hmem + offset,
+									   d2h->dmem + offset,
+									   chunk_size,
+									   d2h->streams[j % d2h->num_streams]);
+				if (rc != CUDA_SUCCESS)
+					error_exit("failed on cuMemcpyDtoHAsync : %s",
+							   cuGetErrorString(rc));
+			}
+		}
+	}
+
+	/* stop event of each direction waits for all of its streams */
+	for (i=1; i < h2d->num_streams; i++)
+	{
+		rc = cuEventRecord(h2d->stop, h2d->streams[i]);
+		if (rc != CUDA_SUCCESS)
+			error_exit("failed on cuEventRecord : %s", cuGetErrorString(rc));
+		rc = cuStreamWaitEvent(h2d->streams[0], h2d->stop, 0);
+		if (rc != CUDA_SUCCESS)
+			error_exit("failed on cuStreamWaitEvent : %s",
+					   cuGetErrorString(rc));
+	}
+	rc = cuEventRecord(h2d->stop, h2d->streams[0]);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuEventRecord : %s", cuGetErrorString(rc));
+
+	for (i=1; i < d2h->num_streams; i++)
+	{
+		rc = cuEventRecord(d2h->stop, d2h->streams[i]);
+		if (rc != CUDA_SUCCESS)
+			error_exit("failed on cuEventRecord : %s", cuGetErrorString(rc));
+		rc = cuStreamWaitEvent(d2h->streams[0], d2h->stop, 0);
+		if (rc != CUDA_SUCCESS)
+			error_exit("failed on cuStreamWaitEvent : %s",
+					   cuGetErrorString(rc));
+	}
+	rc = cuEventRecord(d2h->stop, d2h->streams[0]);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuEventRecord : %s", cuGetErrorString(rc));
+
+	rc = cuCtxSynchronize();
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuCtxSynchronize : %s", cuGetErrorString(rc));
+
+	rc = cuEventElapsedTime(&elapsed, h2d->start, h2d->stop);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuEventElapsedTime : %s", cuGetErrorString(rc));
+	h2d->elapsed = (double)elapsed / 1000.0;	/* msec -> sec */
+
+	rc = cuEventElapsedTime(&elapsed, d2h->start, d2h->stop);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuEventElapsedTime : %s", cuGetErrorString(rc));
+	d2h->elapsed = (double)elapsed / 1000.0;	/* msec -> sec */
+}
+
+static void
+duplex_setup(duplex_dir *dir, int num_streams)
+{
+	int			i;
+	CUresult	rc;
+
+	dir->num_streams = num_streams;
+	dir->streams = calloc(num_streams, sizeof(CUstream));
+	if (!dir->streams)
+		error_exit("out of memory : %s", strerror(errno));
+	for (i=0; i < num_streams; i++)
+	{
+		rc = cuStreamCreate(&dir->streams[i], CU_STREAM_NON_BLOCKING);
+		if (rc != CUDA_SUCCESS)
+			error_exit("failed on cuStreamCreate : %s", cuGetErrorString(rc));
+	}
+	rc = cuEventCreate(&dir->start, CU_EVENT_DEFAULT);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuEventCreate : %s", cuGetErrorString(rc));
+	rc = cuEventCreate(&dir->stop, CU_EVENT_DEFAULT);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuEventCreate : %s", cuGetErrorString(rc));
+	rc = cuMemAllocHost((void **)&dir->hmem, buffer_size);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuMemAllocHost : %s", cuGetErrorString(rc));
+	rc = cuMemAlloc(&dir->dmem, buffer_size);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuMemAlloc : %s", cuGetErrorString(rc));
+}
+
+static void
+duplex_cleanup(duplex_dir *dir)
+{
+	int			i;
+
+	for (i=0; i < dir->num_streams; i++)
+		cuStreamDestroy(dir->streams[i]);
+	cuEventDestroy(dir->start);
+	cuEventDestroy(dir->stop);
+	cuMemFreeHost(dir->hmem);
+	cuMemFree(dir->dmem);
+	free(dir->streams);
+}
+
+static void
+run_duplex(const char *namebuf, CUdevice device)
+{
+	duplex_dir	h2d;
+	duplex_dir	d2h;
+	int			num_engines;
+	double		simplex_h2d;
+	double		simplex_d2h;
+	double		total_mb = (double)((buffer_size >> 20) * num_trial);
+	CUresult	rc;
+
+	rc = cuDeviceGetAttribute(&num_engines,
+							  CU_DEVICE_ATTRIBUTE_ASYNC_ENGINE_COUNT,
+							  device);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuDeviceGetAttribute : %s",
+				   cuGetErrorString(rc));
+
+	/* copy engines are shared by the two directions */
+	duplex_setup(&h2d, num_engines > 1 ? (num_engines + 1) / 2 : 1);
+	duplex_setup(&d2h, num_engines > 1 ? num_engines / 2 : 1);
+
+	duplex_transfer(&h2d, &d2h, DMA_DIR_H2D);
+	simplex_h2d = h2d.elapsed;
+	duplex_transfer(&h2d, &d2h, DMA_DIR_D2H);
+	simplex_d2h = d2h.elapsed;
+	duplex_transfer(&h2d, &d2h, DMA_DIR_H2D | DMA_DIR_D2H);
+
+	printf("DMA duplex test result\n"
+		   "device:         %s\n"
+		   "copy engines:   %d%s\n"
+		   "streams:        %d (H2D), %d (D2H)\n"
+		   "size:           %luMB\n"
+		   "chunks:         %lu%s x %d\n"
+		   "ntrials:        %d\n"
+		   "total_size:     %luMB per direction\n"
+		   "                  simplex         duplex\n"
+		   "H2D speed:      %10.2fMB/s %10.2fMB/s\n"
+		   "D2H speed:      %10.2fMB/s %10.2fMB/s\n"
+		   "total speed:    %10.2fMB/s %10.2fMB/s\n",
+		   namebuf,
+		   num_engines,
+		   num_engines < 2 ? " (duplex copies will serialize)" : "",
+		   h2d.num_streams,
+		   d2h.num_streams,
+		   buffer_size >> 20,
+		   chunk_size > (1UL<<20) ? chunk_size >> 20 : chunk_size >> 10,
+		   chunk_size > (1UL<<20) ? "MB" : "KB",
+		   (int)(buffer_size / chunk_size),
+		   num_trial,
+		   (buffer_size >> 20) * num_trial,
+		   total_mb / simplex_h2d, total_mb / h2d.elapsed,
+		   total_mb / simplex_d2h, total_mb / d2h.elapsed,
+		   2.0 * total_mb / (simplex_h2d + simplex_d2h),
+		   2.0 * total_mb / (h2d.elapsed > d2h.elapsed ?
+							 h2d.elapsed : d2h.elapsed));
+
+	duplex_cleanup(&h2d);
+	duplex_cleanup(&d2h);
+}
+
+/*
+ * run_p2p
+ *
+ * It measures the device to device copy for every ordered pair of the
+ * devices. cuMemcpyPeerAsync is used if peer access is available between
+ * them; elsewhere, the copy is staged through the pinned host buffers by
+ * chunk_size, using two buffers to overlap D2H and H2D. The copy within
+ * a device goes to the second buffer of the device, because a copy onto
+ * the source itself is undefined.
+ */
+typedef struct {
+	int			ndevs;
+	CUcontext  *contexts;
+	CUstream   *streams;
+	CUdeviceptr *dmem;
+	CUdeviceptr *dmem_self;	/* destination of the copy within a device */
+	CUevent	   *events;		/* 2 events per device */
+	char	   *can_access;	/* ndevs x ndevs */
+	void	   *stage[2];
+} cuda_p2p_state;
+
+static int
+cuda_p2p_can_access_peer(void *private, int src, int dst)
+{
+	cuda_p2p_state *p2p = private;
+
+	return p2p->can_access[src * p2p->ndevs + dst];
+}
+
+static void
+cuda_p2p_copy(void *private, int dst, int src,
+			  size_t length, int count, int staged)
+{
+	cuda_p2p_state *p2p = private;
+	size_t		unitsz = (length < chunk_size ? length : chunk_size);
+	size_t		offset;
+	int			i, k = 0;
+	CUresult	rc;
+
+	if (!staged)
+	{
+		rc = cuCtxSetCurrent(p2p->contexts[src]);
+		if (rc != CUDA_SUCCESS)
+			error_exit("failed on cuCtxSetCurrent : %s",
+					   cuGetErrorString(rc));
+		for (i=0; i < count; i++)
+		{
+			if (src == dst)
+			{
+				rc = cuMemcpyDtoDAsync(p2p->dmem_self[src], p2p->dmem[src],
+									   length, p2p->streams[src]);
+				if (rc != CUDA_SUCCESS)
+					error_exit("failed on cuMemcpyDtoDAsync : %s",
+							   cuGetErrorString(rc));
+				continue;
+			}
+			rc = cuMemcpyPeerAsync(p2p->dmem[dst], p2p->contexts[dst],
+								   p2p->dmem[src], p2p->contexts[src],
+								   length, p2p->streams[src]);
+			if (rc != CUDA_SUCCESS)
+				error_exit("failed on cuMemcpyPeerAsync : %s",
+						   cuGetErrorString(rc));
+		}
+		rc = cuStreamSynchronize(p2p->streams[src]);
+		if (rc != CUDA_SUCCESS)
+			error_exit("failed on cuStreamSynchronize : %s",
+					   cuGetErrorString(rc));
+		return;
+	}
+
+	for (i=0; i < count; i++)
+	{
+		for (offset=0; offset < length; offset += unitsz, k++)
+		{
+			size_t		sz = (length - offset < unitsz
+							  ? length - offset : unitsz);
+			int			b = k % 2;
+			CUevent		d2h_ev = p2p->events[2 * src + b];
+			CUevent		h2d_ev = p2p->events[2 * dst + b];
+
+			/* src -> stage[b], once H2D of the previous use is done */
+			rc = cuCtxSetCurrent(p2p->contexts[src]);
+			if (rc != CUDA_SUCCESS)
+				error_exit("failed on cuCtxSetCurrent : %s",
+						   cuGetErrorString(rc));
+			if (k >= 2)
+			{
+				rc = cuStreamWaitEvent(p2p->streams[src], h2d_ev, 0);
+				if (rc != CUDA_SUCCESS)
+					error_exit("failed on cuStreamWaitEvent : %s",
+							   cuGetErrorString(rc));
+			}
+			rc = cuMemcpyDtoHAsync(p2p->stage[b], p2p->dmem[src] + offset,
+								   sz, p2p->streams[src]);
+			if (rc != CUDA_SUCCESS)
+				error_exit("failed on cuMemcpyDtoHAsync : %s",
+						   cuGetErrorString(rc));
+			rc = cuEventRecord(d2h_ev, p2p->streams[src]);
+			if (rc != CUDA_SUCCESS)
+				error_exit("failed on cuEventRecord : %s",
+						   cuGetErrorString(rc));
+
+			/* stage[b] -> dst, once D2H is done */
+			rc = cuCtxSetCurrent(p2p->contexts[dst]);
+			if (rc != CUDA_SUCCESS)
+				error_exit("failed on cuCtxSetCurrent : %s",
+						   cuGetErrorString(rc));
+			rc = cuStreamWaitEvent(p2p->streams[dst], d2h_ev, 0);
+			if (rc != CUDA_SUCCESS)
+				error_exit("failed on cuStreamWaitEvent : %s",
+						   cuGetErrorString(rc));
+			rc = cuMemcpyHtoDAsync(p2p->dmem[dst] + offset, p2p->stage[b],
+								   sz, p2p->streams[dst]);
+			if (rc != CUDA_SUCCESS)
+				error_exit("failed on cuMemcpyHtoDAsync : %s",
+						   cuGetErrorString(rc));
+			rc = cuEventRecord(h2d_ev, p2p->streams[dst]);
+			if (rc != CUDA_SUCCESS)
+				error_exit("failed on cuEventRecord : %s",
+						   cuGetErrorString(rc));
+		}
+	}
+	rc = cuStreamSynchronize(p2p->streams[dst]);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuStreamSynchronize : %s",
+				   cuGetErrorString(rc));
+}
+
 static void
-run_test(const char *namebuf, CUcontext context, CUstream stream)
+run_p2p(uint64_t device_mask)
 {
-	char	   *hmem;
+	cuda_p2p_state p2p;
+	dma_p2p_driver driver;
+	CUdevice	devices[DMA_MAX_IDS];
+	int			dev_ids[DMA_MAX_IDS];
+	int			ndevs = 0;
+	int			i, j;
+	CUresult	rc;
+
+	for (i=0; i < DMA_MAX_IDS; i++)
+	{
+		if (device_mask & (1UL << i))
+			dev_ids[ndevs++] = i;
+	}
+	memset(&p2p, 0, sizeof(p2p));
+	p2p.ndevs = ndevs;
+	p2p.contexts = calloc(ndevs, sizeof(CUcontext));
+	p2p.streams = calloc(ndevs, sizeof(CUstream));
+	p2p.dmem = calloc(ndevs, sizeof(CUdeviceptr));
+	p2p.dmem_self = calloc(ndevs, sizeof(CUdeviceptr));
+	p2p.events = calloc(2 * ndevs, sizeof(CUevent));
+	p2p.can_access = calloc(ndevs * ndevs, sizeof(char));
+	if (!p2p.contexts || !p2p.streams || !p2p.dmem || !p2p.dmem_self ||
+		!p2p.events || !p2p.can_access)
+		error_exit("out of memory : %s", strerror(errno));
+
+	for (i=0; i < ndevs; i++)
+	{
+		char		namebuf[256];
+
+		rc = cuDeviceGet(&devices[i], dev_ids[i]);
+		if (rc != CUDA_SUCCESS)
+			error_exit("failed on cuDeviceGet(%d) : %s",
+					   dev_ids[i], cuGetErrorString(rc));
+		rc = cuDeviceGetName(namebuf, sizeof(namebuf), devices[i]);
+		if (rc != CUDA_SUCCESS)
+			error_exit("failed on cuDeviceGetName : %s",
+					   cuGetErrorString(rc));
+		printf("dev%d: %s\n", dev_ids[i], namebuf);
+
+		/* new context is also current */
+		rc = cuCtxCreate(&p2p.contexts[i], CU_CTX_SCHED_AUTO, devices[i]);
+		if (rc != CUDA_SUCCESS)
+			error_exit("failed on cuCtxCreate : %s", cuGetErrorString(rc));
+		rc = cuStreamCreate(&p2p.streams[i], CU_STREAM_NON_BLOCKING);
+		if (rc != CUDA_SUCCESS)
+			error_exit("failed on cuStreamCreate : %s", cuGetErrorString(rc));
+		rc = cuMemAlloc(&p2p.dmem[i], buffer_size);
+		if (rc != CUDA_SUCCESS)
+			error_exit("failed on cuMemAlloc : %s", cuGetErrorString(rc));
+		rc = cuMemAlloc(&p2p.dmem_self[i], buffer_size);
+		if (rc != CUDA_SUCCESS)
+			error_exit("failed on cuMemAlloc : %s", cuGetErrorString(rc));
+		for (j=0; j < 2; j++)
+		{
+			rc = cuEventCreate(&p2p.events[2 * i + j],
+							   CU_EVENT_DISABLE_TIMING);
+			if (rc != CUDA_SUCCESS)
+				error_exit("failed on cuEventCreate : %s",
+						   cuGetErrorString(rc));
+		}
+	}
+	/* staging buffers are visible to all the contexts */
+	for (j=0; j < 2; j++)
+	{
+		rc = cuMemHostAlloc(&p2p.stage[j], chunk_size,
+							CU_MEMHOSTALLOC_PORTABLE);
+		if (rc != CUDA_SUCCESS)
+			error_exit("failed on cuMemHostAlloc : %s", cuGetErrorString(rc));
+	}
+
+	/* enable peer access where available */
+	for (i=0; i < ndevs; i++)
+	{
+		for (j=0; j < ndevs; j++)
+		{
+			int		can_access;
+
+			if (i == j)
+				continue;
+			rc = cuDeviceCanAccessPeer(&can_access, devices[i], devices[j]);
+			if (rc != CUDA_SUCCESS)
+				error_exit("failed on cuDeviceCanAccessPeer : %s",
+						   cuGetErrorString(rc));
+			if (!can_access)
+				continue;
+			rc = cuCtxSetCurrent(p2p.contexts[i]);
+			if (rc != CUDA_SUCCESS)
+				error_exit("failed on cuCtxSetCurrent : %s",
+						   cuGetErrorString(rc));
+			rc = cuCtxEnablePeerAccess(p2p.contexts[j], 0);
+			if (rc != CUDA_SUCCESS &&
+				rc != CUDA_ERROR_PEER_ACCESS_ALREADY_ENABLED)
+				error_exit("failed on cuCtxEnablePeerAccess : %s",
+						   cuGetErrorString(rc));
+			p2p.can_access[i * ndevs + j] = 1;
+		}
+	}
+
+	driver.name = "cuda";
+	driver.private = &p2p;
+	driver.can_access_peer = cuda_p2p_can_access_peer;
+	driver.copy = cuda_p2p_copy;
+	printf("DMA P2P test: size %luMB, chunks %lu%s (staged), ntrials %d\n",
+		   buffer_size >> 20,
+		   chunk_size > (1UL<<20) ? chunk_size >> 20 : chunk_size >> 10,
+		   chunk_size > (1UL<<20) ? "MB" : "KB",
+		   num_trial);
+	dma_p2p_matrix(stdout, &driver, ndevs, dev_ids, buffer_size, num_trial);
+
+	/* cleanup resources */
+	for (j=0; j < 2; j++)
+		cuMemFreeHost(p2p.stage[j]);
+	for (i=0; i < ndevs; i++)
+		cuCtxDestroy(p2p.contexts[i]);
+	free(p2p.contexts);
+	free(p2p.streams);
+	free(p2p.dmem);
+	free(p2p.dmem_self);
+	free(p2p.events);
+	free(p2p.can_access);
+}
+
+/*
+ * run_p2p_stub
+ *
+ * It runs the P2P matrix on the host memory stand-in devices; no GPU is
+ * needed.
+ */
+static void
+run_p2p_stub(int ndevs)
+{
+	dma_p2p_driver driver;
+	int			dev_ids[DMA_MAX_IDS];
+	int			i;
+
+	for (i=0; i < ndevs; i++)
+		dev_ids[i] = i;
+	dma_p2p_stub_init(&driver, ndevs, buffer_size);
+	printf("DMA P2P test (stub): size %luMB, ntrials %d\n",
+		   buffer_size >> 20, num_trial);
+	dma_p2p_matrix(stdout, &driver, ndevs, dev_ids, buffer_size, num_trial);
+	dma_p2p_stub_cleanup(&driver);
+}
+
+/*
+ * run_file
+ *
+ * It streams the file (-f) to the device buffer through a ring of pinned
+ * chunks; the reads by the reader thread are overlapped with the DMA.
+ */
+typedef struct {
+	CUstream	stream;
 	CUdeviceptr	dmem;
-	int			num_chunks = buffer_size / chunk_size;
-	int			i, j, k;
+	CUevent	   *start;			/* per slot */
+	CUevent	   *stop;			/* per slot */
+} cuda_stream_state;
+
+static void
+cuda_stream_submit(void *private, int slot, void *addr,
+				   size_t length, size_t offset)
+{
+	cuda_stream_state *cst = private;
+	CUresult	rc;
+
+	rc = cuEventRecord(cst->start[slot], cst->stream);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuEventRecord : %s", cuGetErrorString(rc));
+	rc = cuMemcpyHtoDAsync(cst->dmem + offset, addr, length, cst->stream);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuMemcpyHtoDAsync : %s", cuGetErrorString(rc));
+	rc = cuEventRecord(cst->stop[slot], cst->stream);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuEventRecord : %s", cuGetErrorString(rc));
+}
+
+static uint64_t
+cuda_stream_wait(void *private, int slot)
+{
+	cuda_stream_state *cst = private;
+	float		elapsed;
 	CUresult	rc;
-	struct timeval tv1, tv2;
 
-	if (is_blocking)
+	rc = cuEventSynchronize(cst->stop[slot]);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuEventSynchronize : %s", cuGetErrorString(rc));
+	rc = cuEventElapsedTime(&elapsed, cst->start[slot], cst->stop[slot]);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuEventElapsedTime : %s", cuGetErrorString(rc));
+	return (uint64_t)(elapsed * 1000000.0);
+}
+
+static void
+run_file(const char *namebuf, CUstream stream)
+{
+	cuda_stream_state cst;
+	dma_stream_driver driver;
+	dma_stream_result res;
+	dma_hostmem	ring;
+	CUresult	rc;
+	int			i;
+
+	if (dma_hostmem_alloc(&ring, DMA_HOSTMEM_PINNED, chunk_size * num_slots,
+						  numa_node, &cuda_host_driver) != 0)
+		error_exit("failed to allocate host buffer : %s", strerror(errno));
+
+	cst.stream = stream;
+	rc = cuMemAlloc(&cst.dmem, buffer_size);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuMemAlloc : %s", cuGetErrorString(rc));
+	cst.start = calloc(num_slots, sizeof(CUevent));
+	cst.stop = calloc(num_slots, sizeof(CUevent));
+	if (!cst.start || !cst.stop)
+		error_exit("out of memory : %s", strerror(errno));
+	for (i=0; i < num_slots; i++)
 	{
-		hmem = malloc(buffer_size);
-		if (!hmem)
-			error_exit("failed on malloc : %s", strerror(rc));
+		rc = cuEventCreate(&cst.start[i], CU_EVENT_DEFAULT);
+		if (rc == CUDA_SUCCESS)
+			rc = cuEventCreate(&cst.stop[i], CU_EVENT_DEFAULT);
+		if (rc != CUDA_SUCCESS)
+			error_exit("failed on cuEventCreate : %s", cuGetErrorString(rc));
 	}
-	else
+
+	driver.name = "cuda";
+	driver.private = &cst;
+	driver.submit = cuda_stream_submit;
+	driver.wait = cuda_stream_wait;
+	if (dma_stream_file(filename, ring.addr, chunk_size, num_slots,
+						buffer_size, &driver, &res) != 0)
+		error_exit("failed to read \"%s\" : %s", filename, strerror(errno));
+
+	printf("device:         %s\n", namebuf);
+	dma_stream_print(stdout, filename, &res);
+
+	for (i=0; i < num_slots; i++)
+	{
+		cuEventDestroy(cst.start[i]);
+		cuEventDestroy(cst.stop[i]);
+	}
+	free(cst.start);
+	free(cst.stop);
+	cuMemFree(cst.dmem);
+	dma_hostmem_free(&ring, &cuda_host_driver);
+}
+
+/*
+ * run_zerocopy
+ *
+ * It compares the kernel which reads a fraction of the mapped host buffer
+ * (CU_MEMHOSTALLOC_DEVICEMAP) directly with explicit copy of the whole
+ * buffer followed by the same kernel on the device buffer.
+ *
+ * The kernel is given as PTX, to avoid dependency on nvcc or nvrtc;
+ * it is equivalent to the following code.
+ *
+ *   __global__ void
+ *   zerocopy_scan(const uint4 *buf, size_t nblocks,
+ *                 unsigned int threshold, unsigned int *result)
+ *   {
+ *       size_t       i = blockIdx.x * blockDim.x + threadIdx.x;
+ *       unsigned int sum = 0;
+ *
+ *       if (i >= nblocks ||
+ *           ((((unsigned int)i * 0x9e3779b1U) >> 16) % 1000) >= threshold)
+ *           return;
+ *       for (int j=0; j < 8; j++)
+ *           sum ^= buf[i*8+j].x ^ buf[i*8+j].y ^ buf[i*8+j].z ^ buf[i*8+j].w;
+ *       if (sum == 0xdeadbeefU)
+ *           *result = sum;
+ *   }
+ */
+#define ZEROCOPY_PTX_LOAD(offset)								\
+	"  ld.global.v4.u32 {%r10, %r11, %r12, %r13}, [%rd7+" #offset "];\n"	\
+	"  xor.b32 %r9, %r9, %r10;\n"								\
+	"  xor.b32 %r9, %r9, %r11;\n"								\
+	"  xor.b32 %r9, %r9, %r12;\n"								\
+	"  xor.b32 %r9, %r9, %r13;\n"
+
+static const char *zerocopy_ptx =
+	".version 4.0\n"
+	".target sm_30\n"
+	".address_size 64\n"
+	"\n"
+	".visible .entry zerocopy_scan(\n"
+	"  .param .u64 param_buf,\n"
+	"  .param .u64 param_nblocks,\n"
+	"  .param .u32 param_threshold,\n"
+	"  .param .u64 param_result)\n"
+	"{\n"
+	"  .reg .pred %p<4>;\n"
+	"  .reg .b32 %r<16>;\n"
+	"  .reg .b64 %rd<8>;\n"
+	"\n"
+	"  ld.param.u64 %rd1, [param_buf];\n"
+	"  ld.param.u64 %rd2, [param_nblocks];\n"
+	"  ld.param.u32 %r1, [param_threshold];\n"
+	"  ld.param.u64 %rd3, [param_result];\n"
+	"  mov.u32 %r2, %ctaid.x;\n"
+	"  mov.u32 %r3, %ntid.x;\n"
+	"  mov.u32 %r4, %tid.x;\n"
+	"  mul.wide.u32 %rd4, %r2, %r3;\n"
+	"  cvt.u64.u32 %rd5, %r4;\n"
+	"  add.u64 %rd4, %rd4, %rd5;\n"
+	"  setp.ge.u64 %p1, %rd4, %rd2;\n"
+	"  @%p1 bra DONE;\n"
+	"  cvt.u32.u64 %r5, %rd4;\n"
+	"  mul.lo.u32 %r6, %r5, 0x9e3779b1;\n"
+	"  shr.u32 %r7, %r6, 16;\n"
+	"  rem.u32 %r8, %r7, 1000;\n"
+	"  setp.ge.u32 %p2, %r8, %r1;\n"
+	"  @%p2 bra DONE;\n"
+	"  shl.b64 %rd6, %rd4, 7;\n"
+	"  add.u64 %rd7, %rd1, %rd6;\n"
+	"  mov.u32 %r9, 0;\n"
+	ZEROCOPY_PTX_LOAD(0)
+	ZEROCOPY_PTX_LOAD(16)
+	ZEROCOPY_PTX_LOAD(32)
+	ZEROCOPY_PTX_LOAD(48)
+	ZEROCOPY_PTX_LOAD(64)
+	ZEROCOPY_PTX_LOAD(80)
+	ZEROCOPY_PTX_LOAD(96)
+	ZEROCOPY_PTX_LOAD(112)
+	"  setp.ne.u32 %p3, %r9, 0xdeadbeef;\n"
+	"  @%p3 bra DONE;\n"
+	"  st.global.u32 [%rd3], %r9;\n"
+	"DONE:\n"
+	"  ret;\n"
+	"}\n";
+
+static double
+zerocopy_kernel(CUfunction kernel, CUstream stream, CUdeviceptr buf,
+				CUdeviceptr result, unsigned int threshold,
+				CUevent ev_start, CUevent ev_stop)
+{
+	size_t		nblocks = buffer_size / DMA_ZEROCOPY_BLOCK_SIZE;
+	unsigned int block_sz = 256;
+	unsigned int grid_sz = (nblocks + block_sz - 1) / block_sz;
+	void	   *kern_args[4];
+	float		elapsed;
+	CUresult	rc;
+
+	kern_args[0] = &buf;
+	kern_args[1] = &nblocks;
+	kern_args[2] = &threshold;
+	kern_args[3] = &result;
+
+	rc = cuEventRecord(ev_start, stream);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuEventRecord : %s", cuGetErrorString(rc));
+	rc = cuLaunchKernel(kernel,
+						grid_sz, 1, 1,
+						block_sz, 1, 1,
+						0,
+						stream,
+						kern_args,
+						NULL);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuLaunchKernel : %s", cuGetErrorString(rc));
+	rc = cuEventRecord(ev_stop, stream);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuEventRecord : %s", cuGetErrorString(rc));
+	rc = cuEventSynchronize(ev_stop);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuEventSynchronize : %s", cuGetErrorString(rc));
+	rc = cuEventElapsedTime(&elapsed, ev_start, ev_stop);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuEventElapsedTime : %s", cuGetErrorString(rc));
+
+	return (double) elapsed / 1000.0;
+}
+
+static void
+run_zerocopy(const char *namebuf, CUstream stream)
+{
+	dma_zerocopy_result *results;
+	double	   *fractions;
+	int			num_fractions;
+	dma_buffer	dbuf;
+	CUmodule	module;
+	CUfunction	kernel;
+	CUevent		ev[3];
+	CUdeviceptr	result;
+	CUdeviceptr	zmem;
+	void	   *zaddr;
+	float		elapsed;
+	CUresult	rc;
+	int			i, j;
+
+	num_fractions = dma_parse_fractions(zerocopy_fractions, &fractions);
+	if (num_fractions < 0)
+		error_exit("invalid fraction list: %s", zerocopy_fractions);
+	results = calloc(num_fractions, sizeof(dma_zerocopy_result));
+	if (!results)
+		error_exit("out of memory : %s", strerror(errno));
+
+	rc = cuModuleLoadData(&module, zerocopy_ptx);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuModuleLoadData : %s", cuGetErrorString(rc));
+	rc = cuModuleGetFunction(&kernel, module, "zerocopy_scan");
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuModuleGetFunction : %s",
+				   cuGetErrorString(rc));
+	for (i=0; i < lengthof(ev); i++)
 	{
-		rc = cuMemAllocHost((void **)&hmem, buffer_size);
+		rc = cuEventCreate(&ev[i], CU_EVENT_DEFAULT);
 		if (rc != CUDA_SUCCESS)
-			error_exit("failed on cuMemAllocHost : %s", cuGetErrorString(rc));
+			error_exit("failed on cuEventCreate : %s", cuGetErrorString(rc));
 	}
-	rc = cuMemAlloc(&dmem, buffer_size);
+	rc = cuMemAlloc(&result, sizeof(unsigned int));
 	if (rc != CUDA_SUCCESS)
 		error_exit("failed on cuMemAlloc : %s", cuGetErrorString(rc));
 
-	gettimeofday(&tv1, NULL);
-	for (i=0, k=0; i < num_trial; i++)
+	/* mapped host buffer to be accessed by the kernel directly */
+	rc = cuMemHostAlloc(&zaddr, buffer_size, CU_MEMHOSTALLOC_DEVICEMAP);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuMemHostAlloc : %s", cuGetErrorString(rc));
+	memset(zaddr, 0x5a, buffer_size);
+	rc = cuMemHostGetDevicePointer(&zmem, zaddr, 0);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuMemHostGetDevicePointer : %s",
+				   cuGetErrorString(rc));
+
+	/* pinned host buffer and device buffer for explicit copy */
+	if (setup_buffer(&dbuf, stream, DMA_HOSTMEM_PINNED) != 0)
+		error_exit("failed to allocate host buffer : %s", strerror(errno));
+	memset(dbuf.hmem, 0x5a, buffer_size);
+
+	for (i=0; i < num_fractions; i++)
 	{
-		for (j=0; j < num_chunks; j++)
-		{
-			if (is_blocking)
-			{
-				rc = cuMemcpyHtoD(dmem + j * chunk_size,
-								  hmem + j * chunk_size,
-								  chunk_size);
-				if (rc != CUDA_SUCCESS)
-					error_exit("failed on cuMemcpyHtoD : %s",
-							   cuGetErrorString(rc));
-			}
-			else
-			{
-				rc = cuMemcpyHtoDAsync(dmem + j * chunk_size,
-									   hmem + j * chunk_size,
-									   chunk_size,
-									   stream);
-				if (rc != CUDA_SUCCESS)
-					error_exit("failed on cuMemcpyHtoDAsync : %s",
-                               cuGetErrorString(rc));
-			}
-		}
+		dma_zerocopy_result *zr = &results[i];
+		unsigned int threshold = (unsigned int)(fractions[i] * 10.0 + 0.5);
 
-		if (is_blocking)
+		zr->fraction = fractions[i];
+		for (j=0; j < num_trial; j++)
 		{
-			rc = cuMemcpyDtoH(hmem, dmem, buffer_size);
+			zr->zerocopy_time += zerocopy_kernel(kernel, stream, zmem,
+												 result, threshold,
+												 ev[0], ev[1]);
+
+			rc = cuEventRecord(ev[2], stream);
 			if (rc != CUDA_SUCCESS)
-				error_exit("failed on cuMemcpyDtoH : %s",
+				error_exit("failed on cuEventRecord : %s",
 						   cuGetErrorString(rc));
-		}
-		else
-		{
-			rc = cuMemcpyDtoHAsync(hmem, dmem, buffer_size, stream);
+			rc = cuMemcpyHtoDAsync(dbuf.dmem, dbuf.hmem, buffer_size, stream);
 			if (rc != CUDA_SUCCESS)
-                error_exit("failed on cuMemcpyDtoHAsync : %s",
-                           cuGetErrorString(rc));
+				error_exit("failed on cuMemcpyHtoDAsync : %s",
+						   cuGetErrorString(rc));
+			zr->kernel_time += zerocopy_kernel(kernel, stream, dbuf.dmem,
+											   result, threshold,
+											   ev[0], ev[1]);
+			/* ev[0] is recorded just after the copy */
+			rc = cuEventElapsedTime(&elapsed, ev[2], ev[0]);
+			if (rc != CUDA_SUCCESS)
+				error_exit("failed on cuEventElapsedTime : %s",
+						   cuGetErrorString(rc));
+			zr->copy_time += (double) elapsed / 1000.0;
 		}
 	}
-	/* wait for completion */
-	rc = cuCtxSynchronize();
-	if (rc != CUDA_SUCCESS)
-		error_exit("failed on cuCtxSynchronize : %s", cuGetErrorString(rc));
-
-	gettimeofday(&tv2, NULL);
 
-	printf("DMA send/recv test result\n"
+	printf("zero-copy vs explicit copy test result\n"
 		   "device:         %s\n"
 		   "size:           %luMB\n"
-		   "chunks:         %lu%s x %d\n"
-		   "ntrials:        %d\n"
-		   "total_size:     %luMB\n"
-		   "time:           %.2fs\n"
-		   "speed:          %.2fMB/s\n"
-		   "mode:           %s\n",
+		   "ntrials:        %d\n",
 		   namebuf,
 		   buffer_size >> 20,
-		   chunk_size > (1UL<<20) ? chunk_size >> 20 : chunk_size >> 10,
-		   chunk_size > (1UL<<20) ? "MB" : "KB",
-		   num_chunks,
-		   num_trial,
-		   (buffer_size >> 20) * num_trial,
-		   (double)((tv2.tv_sec * 1000000 + tv2.tv_usec) -
-					(tv1.tv_sec * 1000000 + tv1.tv_usec)) / 1000000.0,
-		   (double)(((buffer_size >> 20) * num_trial) * 1000000) /
-           (double)((tv2.tv_sec * 1000000 + tv2.tv_usec) -
-                    (tv1.tv_sec * 1000000 + tv1.tv_usec)),
-		   is_blocking ? "sync" : "async");
-	/* release resources */
-	cuMemFree(dmem);
-	cuMemFreeHost(hmem);
+		   num_trial);
+	dma_zerocopy_print(stdout, results, num_fractions,
+					   buffer_size, num_trial);
+
+	release_buffer(&dbuf);
+	cuMemFreeHost(zaddr);
+	cuMemFree(result);
+	for (i=0; i < lengthof(ev); i++)
+		cuEventDestroy(ev[i]);
+	cuModuleUnload(module);
+	free(results);
+	free(fractions);
 }
 
 static void usage(const char *cmdname)
@@ -230,49 +1872,189 @@ static void usage(const char *cmdname)
 			"usage: %s [<options> ..]\n"
 			"\n"
 			"options:\n"
-			"  -d <device id>             (default: 0)\n"
-			"  -m (sync|async)            (default: sync)\n"
+			"  -d <device id>[,...]      (default: 0, or all on p2p)\n"
+			"  -m <mode>                  (sync, async, duplex, p2p or\n"
+			"                              zerocopy; default: sync)\n"
 			"  -n <number of trials>      (default: 100)\n"
+			"  -w <number of warm-ups>    (default: 1)\n"
+			"  -R <number of runs>        (measured runs; default: 1)\n"
+			"  --ci=<percent>             (stop runs once 95%% CI is within\n"
+			"                              the percent of the mean)\n"
+			"  --verify[=<threads>]       (verify the data read back by\n"
+			"                              CRC32C on the threads; default: 2)\n"
 			"  -s <size of buffer in MB>  (default: 128 = 128MB)\n"
-			"  -c <size of chunks in KB>  (default: buffer size)\n",
+			"  -c <size of chunks in KB>  (default: buffer size)\n"
+			"  -a <strategy>[,...]        (host memory strategies: malloc,\n"
+			"                              register, pinned, hugetlb, thp,\n"
+			"                              mlock or all)\n"
+			"  -N <numa node>[,...]      (NUMA node of host buffer; or all)\n"
+			"  -P                         (run the devices concurrently)\n"
+			"  -C <cpu list>              (CPUs of the submitting thread;\n"
+			"                              default: CPUs of the NUMA node)\n"
+			"  --sweep[=<size>,...]       (chunk size sweep from 4KB to\n"
+			"                              buffer size, plus custom points)\n"
+			"  --format=(csv|json)        (format of sweep or ops;\n"
+			"                              default: csv)\n"
+			"  --ops[=<bytes>,...]        (calls/sec of small transfers;\n"
+			"                              default: 4 to 64k bytes)\n"
+			"  --strided=<width>,<pitch>[,<rows>]\n"
+			"                             (2D DMA vs host gather vs a copy\n"
+			"                              per row; default rows: 16384)\n"
+			"  --p2p-stub=<num devices>   (p2p on host memory stand-ins)\n"
+			"  -f <file>                  (stream the file to the device;\n"
+			"                              default chunk size: 4MB)\n"
+			"  --ring=<num slots>         (ring of chunks for -f; default: 4)\n"
+			"  --host-device              (-f on host memory stand-in)\n"
+			"  --host-stub                (-a on the stub driver; no GPU)\n"
+			"  --fraction=<percent>[,...] (fractions read on zerocopy;\n"
+			"                              default: " DMA_ZEROCOPY_FRACTIONS ")\n",
 			cmdname);
 	exit(1);
 }
 
 int main(int argc, char *argv[])
 {
-	int				device_id = 0;
+	const char	   *device_list = NULL;
+	const char	   *node_list = NULL;
+	uint64_t		device_mask;
+	uint64_t		node_mask = 0;
+	int				device_id;
+	int				num_devices;
+	cpu_set_t		cpuset;
 	CUdevice		device;
 	CUcontext		context = NULL;
 	CUstream		stream = NULL;
 	CUresult		rc;
 	int				c;
+	int				p2p_stub = 0;
+	int				host_device = 0;
+	int				host_stub = 0;
 	char			namebuf[1024];
+	static struct option long_options[] = {
+		{"sweep",	optional_argument,	NULL,	1000},
+		{"format",	required_argument,	NULL,	1001},
+		{"p2p-stub", required_argument,	NULL,	1002},
+		{"ring",	required_argument,	NULL,	1003},
+		{"host-device", no_argument,	NULL,	1004},
+		{"host-stub", no_argument,		NULL,	1012},
+		{"fraction", required_argument,	NULL,	1005},
+		{"ci",		required_argument,	NULL,	1006},
+		{"verify",	optional_argument,	NULL,	1007},
+		{"ops",		optional_argument,	NULL,	1009},
+		{"strided",	required_argument,	NULL,	1010},
+		{NULL,		0,					NULL,	0},
+	};
 
-	while ((c = getopt(argc, argv, "d:m:n:s:c:")) >= 0)
+	while ((c = getopt_long(argc, argv, "d:m:n:s:c:a:N:C:Pf:w:R:",
+							long_options, NULL)) >= 0)
 	{
 		switch (c)
 		{
 			case 'd':
-				device_id = atoi(optarg);
+				device_list = optarg;
 				break;
 			case 'm':
 				if (strcmp(optarg, "sync") == 0)
 					is_blocking = 1;
 				else if (strcmp(optarg, "async") == 0)
 					is_blocking = 0;
+				else if (strcmp(optarg, "duplex") == 0)
+					is_duplex = 1;
+				else if (strcmp(optarg, "p2p") == 0)
+					is_p2p = 1;
+				else if (strcmp(optarg, "zerocopy") == 0)
+					is_zerocopy = 1;
 				else
 					usage(basename(argv[0]));
 				break;
 			case 'n':
 				num_trial = atoi(optarg);
 				break;
+			case 'w':
+				num_warmup = atoi(optarg);
+				if (num_warmup < 0)
+					usage(basename(argv[0]));
+				break;
+			case 'R':
+				max_runs = atoi(optarg);
+				if (max_runs < 1)
+					usage(basename(argv[0]));
+				break;
 			case 's':
 				buffer_size = atoi(optarg) << 20;
 				break;
 			case 'c':
 				chunk_size = atoi(optarg) << 10;
 				break;
+			case 'a':
+				if (dma_hostmem_parse(optarg, &host_methods) != 0)
+					usage(basename(argv[0]));
+				break;
+			case 'N':
+				node_list = optarg;
+				break;
+			case 'P':
+				parallel_mode = 1;
+				break;
+			case 'f':
+				filename = optarg;
+				break;
+			case 'C':
+				if (dma_parse_cpulist(optarg, &cpuset) != 0)
+					usage(basename(argv[0]));
+				cpus_bound = 1;
+				break;
+			case 1000:	/* --sweep */
+				sweep_mode = 1;
+				sweep_points = optarg;
+				break;
+			case 1001:	/* --format */
+				if (strcmp(optarg, "csv") == 0)
+					sweep_format = DMA_FORMAT_CSV;
+				else if (strcmp(optarg, "json") == 0)
+					sweep_format = DMA_FORMAT_JSON;
+				else
+					usage(basename(argv[0]));
+				break;
+			case 1002:	/* --p2p-stub */
+				p2p_stub = atoi(optarg);
+				if (p2p_stub < 1 || p2p_stub > DMA_MAX_IDS)
+					usage(basename(argv[0]));
+				break;
+			case 1003:	/* --ring */
+				num_slots = atoi(optarg);
+				if (num_slots < 2)
+					usage(basename(argv[0]));
+				break;
+			case 1004:	/* --host-device */
+				host_device = 1;
+				break;
+			case 1012:	/* --host-stub */
+				host_stub = 1;
+				break;
+			case 1005:	/* --fraction */
+				zerocopy_fractions = optarg;
+				break;
+			case 1006:	/* --ci */
+				ci_target = atof(optarg);
+				if (ci_target <= 0.0)
+					usage(basename(argv[0]));
+				break;
+			case 1007:	/* --verify */
+				verify_threads = (optarg ? atoi(optarg) : DMA_VERIFY_THREADS);
+				if (verify_threads < 1)
+					usage(basename(argv[0]));
+				break;
+			case 1009:	/* --ops */
+				ops_mode = 1;
+				if (optarg)
+					ops_sizes = optarg;
+				break;
+			case 1010:	/* --strided */
+				if (dma_parse_strided(optarg, &strided_width,
+									  &strided_pitch, &strided_rows) != 0)
+					usage(basename(argv[0]));
+				break;
 			default:
 				usage(basename(argv[0]));
 				break;
@@ -281,7 +2063,103 @@ int main(int argc, char *argv[])
 	if (optind != argc)
 		usage(basename(argv[0]));
 
-	if (chunk_size == 0)
+	if (host_stub)
+	{
+		if (host_methods == 0)
+			usage(basename(argv[0]));
+		if (sweep_mode || parallel_mode || is_duplex || is_p2p ||
+			p2p_stub > 0 || filename || is_zerocopy || ops_mode ||
+			strided_width > 0)
+		{
+			fprintf(stderr, "--host-stub is supported only with -a\n");
+			return 1;
+		}
+		if (chunk_size == 0)
+			chunk_size = buffer_size;
+		else if (buffer_size % chunk_size != 0 || buffer_size < chunk_size)
+		{
+			fprintf(stderr, "chunk_size (-c) must be aligned "
+					"to buffer_size\n");
+			return 1;
+		}
+	}
+	if (verify_threads > 0 &&
+		(sweep_mode || host_methods != 0 || parallel_mode || is_duplex ||
+		 is_p2p || p2p_stub > 0 || filename || is_zerocopy || ops_mode ||
+		 strided_width > 0 || host_stub))
+	{
+		fprintf(stderr, "--verify is supported only in sync/async mode\n");
+		return 1;
+	}
+	if (strided_width > 0)
+	{
+		if (sweep_mode || host_methods != 0 || parallel_mode ||
+			is_duplex || is_p2p || p2p_stub > 0 || filename ||
+			is_zerocopy || ops_mode)
+		{
+			fprintf(stderr, "--strided cannot be used with other "
+					"test modes\n");
+			return 1;
+		}
+		if (strided_rows == 0)
+			strided_rows = (buffer_size / strided_pitch < DMA_STRIDED_ROWS
+							? buffer_size / strided_pitch : DMA_STRIDED_ROWS);
+		if (strided_rows == 0 ||
+			strided_rows > buffer_size / strided_pitch)
+		{
+			fprintf(stderr, "rows x pitch of --strided must fit "
+					"in the buffer size (-s)\n");
+			return 1;
+		}
+	}
+	if (ops_mode &&
+		(sweep_mode || host_methods != 0 || parallel_mode || is_duplex ||
+		 is_p2p || p2p_stub > 0 || filename || is_zerocopy))
+	{
+		fprintf(stderr, "--ops cannot be used with other test modes\n");
+		return 1;
+	}
+	if (is_zerocopy &&
+		(sweep_mode || host_methods != 0 || parallel_mode ||
+		 p2p_stub > 0 || filename))
+	{
+		fprintf(stderr, "zerocopy mode does not support --sweep, -a, -P, "
+				"--p2p-stub or -f\n");
+		return 1;
+	}
+	if (filename)
+	{
+		if (sweep_mode || host_methods != 0 || parallel_mode ||
+			is_duplex || is_p2p || p2p_stub > 0)
+		{
+			fprintf(stderr, "-f is supported only in sync/async mode\n");
+			return 1;
+		}
+		if (chunk_size == 0)
+			chunk_size = (buffer_size < DMA_STREAM_CHUNK_SIZE
+						  ? buffer_size : DMA_STREAM_CHUNK_SIZE);
+		if (chunk_size % DMA_STREAM_ALIGN != 0)
+		{
+			fprintf(stderr, "chunk_size (-c) must be aligned to 4KB "
+					"for O_DIRECT\n");
+			return 1;
+		}
+	}
+	else if (host_device)
+		usage(basename(argv[0]));
+
+	if (sweep_mode || host_methods != 0)
+	{
+		if (is_duplex || is_p2p || p2p_stub > 0)
+		{
+			fprintf(stderr, "--sweep or -a is not supported "
+					"in duplex or p2p mode\n");
+			return 1;
+		}
+		if (chunk_size == 0)
+			chunk_size = buffer_size;
+	}
+	else if (chunk_size == 0)
 		chunk_size = buffer_size;
 	else if (buffer_size % chunk_size != 0 || buffer_size < chunk_size)
 	{
@@ -289,6 +2167,29 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	if (p2p_stub > 0)
+	{
+		run_p2p_stub(p2p_stub);
+		return 0;
+	}
+	if (host_device)
+	{
+		if (dma_stream_stub(stdout, filename, chunk_size, num_slots,
+							buffer_size) != 0)
+			error_exit("failed to read \"%s\" : %s",
+					   filename, strerror(errno));
+		return 0;
+	}
+
+	if (host_stub)
+	{
+		fprintf(stderr, "host memory strategies on stub (%luMB x %d)\n",
+				buffer_size >> 20, num_trial);
+		dma_hostmem_stub(stdout, host_methods, buffer_size,
+						 chunk_size, num_trial);
+		return 0;
+	}
+
 	/*
 	 * Initialize CUDA device
 	 */
@@ -296,6 +2197,86 @@ int main(int argc, char *argv[])
 	if (rc != CUDA_SUCCESS)
 		error_exit("failed on cuInit : %s", cuGetErrorString(rc));
 
+	rc = cuDeviceGetCount(&num_devices);
+	if (rc != CUDA_SUCCESS)
+		error_exit("failed on cuDeviceGetCount : %s", cuGetErrorString(rc));
+	if (!device_list)
+		device_list = (is_p2p ? "all" : "0");
+	if (dma_parse_idlist(device_list, num_devices, &device_mask) != 0)
+		error_exit("invalid device list: %s", device_list);
+	if (node_list &&
+		dma_parse_idlist(node_list, dma_numa_num_nodes(), &node_mask) != 0)
+		error_exit("invalid numa node list: %s", node_list);
+
+	if (cpus_bound && dma_bind_cpus(&cpuset) != 0)
+		error_exit("failed on sched_setaffinity : %s", strerror(errno));
+
+	/* device to device copy matrix */
+	if (is_p2p)
+	{
+		if (parallel_mode || (node_mask & (node_mask - 1)) != 0)
+		{
+			fprintf(stderr, "p2p mode is supported only "
+					"with a single numa node\n");
+			return 1;
+		}
+		if (node_mask != 0)
+		{
+			numa_node = __builtin_ctzll(node_mask);
+			bind_node_cpus(numa_node);
+		}
+		run_p2p(device_mask);
+		return 0;
+	}
+
+	/* concurrent run on the multiple devices */
+	if (parallel_mode)
+	{
+		if (sweep_mode || host_methods != 0 || is_duplex ||
+			(node_mask & (node_mask - 1)) != 0)
+		{
+			fprintf(stderr, "-P is supported only in sync/async mode "
+					"with a single numa node\n");
+			return 1;
+		}
+		if (node_mask != 0)
+		{
+			numa_node = __builtin_ctzll(node_mask);
+			bind_node_cpus(numa_node);
+		}
+		run_parallel(device_mask);
+		return 0;
+	}
+
+	/* node x device matrix, if multiple devices or nodes are given */
+	if ((device_mask & (device_mask - 1)) != 0 ||
+		(node_mask & (node_mask - 1)) != 0)
+	{
+		if (sweep_mode || host_methods != 0 || is_duplex ||
+			filename || is_zerocopy || ops_mode || strided_width > 0)
+		{
+			fprintf(stderr, "multiple devices or numa nodes are "
+					"supported only in sync/async mode\n");
+			return 1;
+		}
+		if (verify_threads > 0)
+		{
+			fprintf(stderr, "--verify is supported only with a single "
+					"device and numa node\n");
+			return 1;
+		}
+		if (node_mask == 0)
+			dma_parse_idlist("all", dma_numa_num_nodes(), &node_mask);
+		run_numa(device_mask, node_mask);
+		return 0;
+	}
+	device_id = __builtin_ctzll(device_mask);
+	if (node_mask != 0)
+	{
+		numa_node = __builtin_ctzll(node_mask);
+		bind_node_cpus(numa_node);
+	}
+
 	rc = cuDeviceGet(&device, device_id);
 	if (rc != CUDA_SUCCESS)
 		error_exit("failed on cuDeviceGet(%d) : %s",
@@ -306,17 +2287,34 @@ int main(int argc, char *argv[])
 	if (rc != CUDA_SUCCESS)
 		error_exit("failed on cuDeviceGetName : %s", cuGetErrorString(rc));
 
-	/* Construct an CUDA context */
-	rc = cuCtxCreate(&context, CU_CTX_SCHED_AUTO, device);
+	/* Construct an CUDA context; zerocopy needs mapped host memory */
+	rc = cuCtxCreate(&context, CU_CTX_SCHED_AUTO |
+					 (is_zerocopy ? CU_CTX_MAP_HOST : 0), device);
 	if (rc != CUDA_SUCCESS)
 		error_exit("failed on cuCtxCreate : %s", cuGetErrorString(rc));
 
 	rc = cuCtxSetCurrent(context);
 	if (rc != CUDA_SUCCESS)
 		error_exit("failed on cuCtxSetCurrent : %s", cuGetErrorString(rc));
+	device_numa_node = cuda_device_numa_node(device);
 
 	/* do the job */
-	run_test(namebuf, context, stream);
+	if (sweep_mode)
+		run_sweep(namebuf, stream);
+	else if (ops_mode)
+		run_ops(namebuf, stream);
+	else if (strided_width > 0)
+		run_strided(namebuf, stream);
+	else if (host_methods != 0)
+		run_hostmem(namebuf, stream);
+	else if (is_duplex)
+		run_duplex(namebuf, device);
+	else if (filename)
+		run_file(namebuf, stream);
+	else if (is_zerocopy)
+		run_zerocopy(namebuf, stream);
+	else
+		run_test(namebuf, context, stream);
 
 	return 0;
 }
@@ -0,0 +1,2458 @@
+/*
+ * dmautil.c - common routines for DMA benchmark tools (gpudma, cudadma)
+ */
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+/* memory policy of Linux; to avoid dependency on libnuma */
+#ifndef MPOL_DEFAULT
+#define MPOL_DEFAULT			0
+#define MPOL_BIND				2
+#define MPOL_F_NODE				(1<<0)
+#define MPOL_F_ADDR				(1<<1)
+#endif
+#include "dmautil.h"
+
+/*
+ * Latency histogram
+ */
+void
+dma_histogram_init(dma_histogram *hist)
+{
+	memset(hist, 0, sizeof(dma_histogram));
+	hist->min = UINT64_MAX;
+}
+
+static inline int
+dma_histogram_index(uint64_t nsec)
+{
+	int		exp;
+
+	if (nsec < DMA_HIST_SUB_BUCKETS)
+		return (int)nsec;
+	exp = 63 - __builtin_clzll(nsec);
+	return ((exp - DMA_HIST_SUB_BITS + 1) * DMA_HIST_SUB_BUCKETS +
+			(int)((nsec >> (exp - DMA_HIST_SUB_BITS)) &
+				  (DMA_HIST_SUB_BUCKETS - 1)));
+}
+
+/* upper bound (inclusive) of the values to be stored in the bucket */
+static inline uint64_t
+dma_histogram_value(int index)
+{
+	int			exp;
+	uint64_t	sub;
+
+	if (index < DMA_HIST_SUB_BUCKETS)
+		return (uint64_t)index;
+	exp = index / DMA_HIST_SUB_BUCKETS + DMA_HIST_SUB_BITS - 1;
+	sub = DMA_HIST_SUB_BUCKETS + index % DMA_HIST_SUB_BUCKETS;
+
+	return ((sub + 1) << (exp - DMA_HIST_SUB_BITS)) - 1;
+}
+
+void
+dma_histogram_add(dma_histogram *hist, uint64_t nsec)
+{
+	hist->buckets[dma_histogram_index(nsec)]++;
+	hist->count++;
+	hist->sum += (double)nsec;
+	if (nsec < hist->min)
+		hist->min = nsec;
+	if (nsec > hist->max)
+		hist->max = nsec;
+}
+
+uint64_t
+dma_histogram_percentile(const dma_histogram *hist, double percent)
+{
+	uint64_t	threshold;
+	uint64_t	total = 0;
+	int			i;
+
+	if (hist->count == 0)
+		return 0;
+	threshold = (uint64_t)((double)hist->count * percent / 100.0 + 0.5);
+	if (threshold < 1)
+		threshold = 1;
+	for (i=0; i < DMA_HIST_NBUCKETS; i++)
+	{
+		total += hist->buckets[i];
+		if (total >= threshold)
+		{
+			uint64_t	value = dma_histogram_value(i);
+
+			return (value < hist->max ? value : hist->max);
+		}
+	}
+	return hist->max;
+}
+
+void
+dma_histogram_merge(dma_histogram *dst, const dma_histogram *src)
+{
+	int			i;
+
+	for (i=0; i < DMA_HIST_NBUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+void
+dma_histogram_print(FILE *filp, const char *label, const dma_histogram *hist)
+{
+	if (hist->count == 0)
+	{
+		fprintf(filp, "%-16s(no samples)\n", label);
+		return;
+	}
+	fprintf(filp,
+			"%-16sp50=%.1fus p90=%.1fus p99=%.1fus p99.9=%.1fus "
+			"max=%.1fus (avg=%.1fus, n=%lu)\n",
+			label,
+			(double)dma_histogram_percentile(hist, 50.0) / 1000.0,
+			(double)dma_histogram_percentile(hist, 90.0) / 1000.0,
+			(double)dma_histogram_percentile(hist, 99.0) / 1000.0,
+			(double)dma_histogram_percentile(hist, 99.9) / 1000.0,
+			(double)hist->max / 1000.0,
+			hist->sum / (double)hist->count / 1000.0,
+			hist->count);
+}
+
+/*
+ * Statistics of the repeated runs
+ */
+static int
+dma_double_compare(const void *a, const void *b)
+{
+	double		x = *((const double *) a);
+	double		y = *((const double *) b);
+
+	return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+static double
+dma_median(const double *sorted, int count)
+{
+	if (count == 0)
+		return NAN;
+	if (count % 2 == 1)
+		return sorted[count / 2];
+	return (sorted[count / 2 - 1] + sorted[count / 2]) / 2.0;
+}
+
+/* two-sided 95% quantile of Student's t distribution */
+static double
+dma_t95(int df)
+{
+	static const double t95[] = {
+		12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+		2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+		2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+	};
+
+	if (df < 1)
+		return NAN;
+	if (df <= sizeof(t95) / sizeof(double))
+		return t95[df - 1];
+	return 1.960;
+}
+
+void
+dma_stats_compute(const double *values, int count, dma_stats *stats)
+{
+	double	   *sorted;
+	double	   *devs;
+	double		median, mad, sum = 0.0, sqsum = 0.0;
+	int			i, n = 0;
+
+	memset(stats, 0, sizeof(dma_stats));
+	sorted = calloc(count + 1, sizeof(double));
+	devs = calloc(count + 1, sizeof(double));
+	if (!sorted || !devs)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	memcpy(sorted, values, sizeof(double) * count);
+	qsort(sorted, count, sizeof(double), dma_double_compare);
+	median = dma_median(sorted, count);
+	for (i=0; i < count; i++)
+		devs[i] = fabs(sorted[i] - median);
+	qsort(devs, count, sizeof(double), dma_double_compare);
+	mad = dma_median(devs, count);
+
+	/* reject outliers; 1.4826 x MAD estimates stddev of normal dist */
+	for (i=0; i < count; i++)
+	{
+		if (mad > 0.0 &&
+			fabs(sorted[i] - median) / (1.4826 * mad) > DMA_STATS_OUTLIER_Z)
+		{
+			stats->num_outliers++;
+			continue;
+		}
+		sorted[n++] = sorted[i];
+	}
+	for (i=0; i < n; i++)
+		sum += sorted[i];
+	stats->count = n;
+	stats->mean = sum / (double) n;
+	stats->median = dma_median(sorted, n);
+	stats->min = (n > 0 ? sorted[0] : NAN);
+	stats->max = (n > 0 ? sorted[n - 1] : NAN);
+	if (n > 1)
+	{
+		for (i=0; i < n; i++)
+			sqsum += (sorted[i] - stats->mean) * (sorted[i] - stats->mean);
+		stats->stddev = sqrt(sqsum / (double)(n - 1));
+		stats->ci95 = dma_t95(n - 1) * stats->stddev / sqrt((double) n);
+	}
+	else
+		stats->ci95 = NAN;
+	free(sorted);
+	free(devs);
+}
+
+void
+dma_stats_print(FILE *filp, const char *label, const char *unit,
+				const dma_stats *stats)
+{
+	fprintf(filp,
+			"%-16smean=%.2f%s median=%.2f%s stddev=%.2f%s "
+			"ci95=+/-%.2f%s (%.2f%%) min=%.2f%s max=%.2f%s "
+			"(n=%d, outliers=%d)\n",
+			label,
+			stats->mean, unit,
+			stats->median, unit,
+			stats->stddev, unit,
+			stats->ci95, unit, 100.0 * stats->ci95 / stats->mean,
+			stats->min, unit,
+			stats->max, unit,
+			stats->count, stats->num_outliers);
+}
+
+/*
+ * dma_parse_size
+ *
+ * It parses a size string with optional unit suffix (k, m or g).
+ * Returns 0 on success, or -1 on invalid string.
+ */
+int
+dma_parse_size(const char *str, size_t *p_size)
+{
+	char	   *end;
+	size_t		size;
+
+	if (!isdigit(*str))
+		return -1;
+	size = strtoul(str, &end, 10);
+	if (strcasecmp(end, "") == 0)
+		*p_size = size;
+	else if (strcasecmp(end, "k") == 0 || strcasecmp(end, "kb") == 0)
+		*p_size = size << 10;
+	else if (strcasecmp(end, "m") == 0 || strcasecmp(end, "mb") == 0)
+		*p_size = size << 20;
+	else if (strcasecmp(end, "g") == 0 || strcasecmp(end, "gb") == 0)
+		*p_size = size << 30;
+	else
+		return -1;
+	return 0;
+}
+
+static int
+dma_sweep_compare(const void *a, const void *b)
+{
+	size_t		x = *((const size_t *) a);
+	size_t		y = *((const size_t *) b);
+
+	return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+/*
+ * dma_sweep_points
+ *
+ * It builds a sorted list of chunk sizes to be measured; power-of-two
+ * sizes from DMA_SWEEP_MIN_SIZE to max_size, and comma separated custom
+ * points, if any. Returns number of the points, or -1 on invalid list.
+ */
+int
+dma_sweep_points(size_t max_size, const char *custom, size_t **p_points)
+{
+	size_t	   *points;
+	size_t		size;
+	int			nitems = 0;
+	int			nrooms = 64;
+	int			i, j;
+
+	points = malloc(sizeof(size_t) * nrooms);
+	if (!points)
+		return -1;
+	for (size = DMA_SWEEP_MIN_SIZE; size < max_size; size <<= 1)
+		points[nitems++] = size;
+	points[nitems++] = max_size;
+
+	if (custom)
+	{
+		char   *temp = strdup(custom);
+		char   *tok;
+		char   *pos;
+
+		if (!temp)
+		{
+			free(points);
+			return -1;
+		}
+		for (tok = strtok_r(temp, ",", &pos);
+			 tok != NULL;
+			 tok = strtok_r(NULL, ",", &pos))
+		{
+			if (dma_parse_size(tok, &size) != 0 ||
+				size == 0 || size > max_size)
+			{
+				free(temp);
+				free(points);
+				return -1;
+			}
+			if (nitems == nrooms)
+			{
+				nrooms *= 2;
+				points = realloc(points, sizeof(size_t) * nrooms);
+				if (!points)
+					return -1;
+			}
+			points[nitems++] = size;
+		}
+		free(temp);
+	}
+	qsort(points, nitems, sizeof(size_t), dma_sweep_compare);
+
+	/* remove duplicated points */
+	for (i=1, j=1; i < nitems; i++)
+	{
+		if (points[i] != points[j-1])
+			points[j++] = points[i];
+	}
+	*p_points = points;
+
+	return j;
+}
+
+/*
+ * dma_sweep_print
+ *
+ * It prints a row of the sweep result in CSV or JSON format. Header or
+ * footer shall be printed together with the first or last row.
+ */
+void
+dma_sweep_print(FILE *filp, int format, const dma_result *res,
+				int index, int count)
+{
+	double		speed = ((double)res->total_size /
+						 (double)(1UL << 20)) / res->elapsed;
+
+	if (format == DMA_FORMAT_JSON)
+	{
+		if (index == 0)
+			fputs("[\n", filp);
+		fprintf(filp,
+				"  {\"chunk_size\": %zu, \"total_size\": %zu, "
+				"\"time\": %.6f, \"speed_mbps\": %.2f, "
+				"\"h2d_p50_us\": %.1f, \"h2d_p99_us\": %.1f, "
+				"\"h2d_max_us\": %.1f, "
+				"\"d2h_p50_us\": %.1f, \"d2h_p99_us\": %.1f, "
+				"\"d2h_max_us\": %.1f}%s\n",
+				res->chunk_size, res->total_size, res->elapsed, speed,
+				(double)dma_histogram_percentile(&res->h2d, 50.0) / 1000.0,
+				(double)dma_histogram_percentile(&res->h2d, 99.0) / 1000.0,
+				(double)res->h2d.max / 1000.0,
+				(double)dma_histogram_percentile(&res->d2h, 50.0) / 1000.0,
+				(double)dma_histogram_percentile(&res->d2h, 99.0) / 1000.0,
+				(double)res->d2h.max / 1000.0,
+				index < count - 1 ? "," : "");
+		if (index == count - 1)
+			fputs("]\n", filp);
+	}
+	else
+	{
+		if (index == 0)
+			fputs("chunk_size,total_size,time,speed_mbps,"
+				  "h2d_p50_us,h2d_p99_us,h2d_max_us,"
+				  "d2h_p50_us,d2h_p99_us,d2h_max_us\n", filp);
+		fprintf(filp, "%zu,%zu,%.6f,%.2f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+				res->chunk_size, res->total_size, res->elapsed, speed,
+				(double)dma_histogram_percentile(&res->h2d, 50.0) / 1000.0,
+				(double)dma_histogram_percentile(&res->h2d, 99.0) / 1000.0,
+				(double)res->h2d.max / 1000.0,
+				(double)dma_histogram_percentile(&res->d2h, 50.0) / 1000.0,
+				(double)dma_histogram_percentile(&res->d2h, 99.0) / 1000.0,
+				(double)res->d2h.max / 1000.0);
+	}
+	fflush(filp);
+}
+
+/*
+ * dma_parse_sizes
+ *
+ * It builds a sorted list of byte sizes from the comma separated list;
+ * unlike the sweep points, sizes need not be power of two nor multiple
+ * of KB. Returns number of the sizes, or -1 on invalid list.
+ */
+int
+dma_parse_sizes(const char *str, size_t max_size, size_t **p_points)
+{
+	char	   *temp = strdup(str);
+	char	   *tok;
+	char	   *pos;
+	size_t	   *points;
+	size_t		size;
+	int			nitems = 0;
+	int			i, j;
+
+	if (!temp)
+		return -1;
+	/* number of items is at most number of commas + 1 */
+	for (i=0, j=1; temp[i] != '\0'; i++)
+	{
+		if (temp[i] == ',')
+			j++;
+	}
+	points = malloc(sizeof(size_t) * j);
+	if (!points)
+	{
+		free(temp);
+		return -1;
+	}
+	for (tok = strtok_r(temp, ",", &pos);
+		 tok != NULL;
+		 tok = strtok_r(NULL, ",", &pos))
+	{
+		if (dma_parse_size(tok, &size) != 0 ||
+			size == 0 || size > max_size)
+		{
+			free(temp);
+			free(points);
+			return -1;
+		}
+		points[nitems++] = size;
+	}
+	free(temp);
+	if (nitems == 0)
+	{
+		free(points);
+		return -1;
+	}
+	qsort(points, nitems, sizeof(size_t), dma_sweep_compare);
+
+	/* remove duplicated points */
+	for (i=1, j=1; i < nitems; i++)
+	{
+		if (points[i] != points[j-1])
+			points[j++] = points[i];
+	}
+	*p_points = points;
+
+	return j;
+}
+
+/*
+ * dma_ops_measure
+ *
+ * It issues num_calls copies back-to-back, and records the time spent in
+ * each submit call; calls/sec is num_calls by the time until all of them
+ * get completed. Then, it issues num_calls copies again, but waits for
+ * each of them to record the completion latency.
+ */
+void
+dma_ops_measure(const dma_ops_driver *driver, size_t size,
+				int num_calls, dma_ops_result *res)
+{
+	double		tv_start, tv1, tv2;
+	int			i;
+
+	memset(res, 0, sizeof(dma_ops_result));
+	res->size = size;
+	res->num_calls = num_calls;
+	dma_histogram_init(&res->enqueue);
+	dma_histogram_init(&res->completion);
+
+	/* warm up the path, not to count the first call */
+	driver->submit(driver->private, size);
+	driver->sync(driver->private);
+
+	tv_start = dma_timer_now();
+	for (i=0; i < num_calls; i++)
+	{
+		tv1 = dma_timer_now();
+		driver->submit(driver->private, size);
+		tv2 = dma_timer_now();
+		dma_histogram_add(&res->enqueue, (uint64_t)((tv2 - tv1) * 1.0e9));
+	}
+	driver->sync(driver->private);
+	res->elapsed = dma_timer_now() - tv_start;
+
+	for (i=0; i < num_calls; i++)
+	{
+		tv1 = dma_timer_now();
+		driver->submit(driver->private, size);
+		driver->sync(driver->private);
+		tv2 = dma_timer_now();
+		dma_histogram_add(&res->completion, (uint64_t)((tv2 - tv1) * 1.0e9));
+	}
+}
+
+/*
+ * dma_ops_print
+ *
+ * It prints a row of the small transfer result in CSV or JSON format, like
+ * dma_sweep_print().
+ */
+void
+dma_ops_print(FILE *filp, int format, const dma_ops_result *res,
+			  int index, int count)
+{
+	double		calls = (double)res->num_calls / res->elapsed;
+
+	if (format == DMA_FORMAT_JSON)
+	{
+		if (index == 0)
+			fputs("[\n", filp);
+		fprintf(filp,
+				"  {\"size\": %zu, \"calls\": %d, "
+				"\"calls_per_sec\": %.0f, \"speed_mbps\": %.2f, "
+				"\"enqueue_p50_us\": %.2f, \"enqueue_p99_us\": %.2f, "
+				"\"enqueue_max_us\": %.2f, "
+				"\"completion_p50_us\": %.2f, \"completion_p99_us\": %.2f, "
+				"\"completion_max_us\": %.2f}%s\n",
+				res->size, res->num_calls, calls,
+				calls * (double)res->size / (double)(1UL << 20),
+				(double)dma_histogram_percentile(&res->enqueue, 50.0) / 1000.0,
+				(double)dma_histogram_percentile(&res->enqueue, 99.0) / 1000.0,
+				(double)res->enqueue.max / 1000.0,
+				(double)dma_histogram_percentile(&res->completion, 50.0) / 1000.0,
+				(double)dma_histogram_percentile(&res->completion, 99.0) / 1000.0,
+				(double)res->completion.max / 1000.0,
+				index < count - 1 ? "," : "");
+		if (index == count - 1)
+			fputs("]\n", filp);
+	}
+	else
+	{
+		if (index == 0)
+			fputs("size,calls,calls_per_sec,speed_mbps,"
+				  "enqueue_p50_us,enqueue_p99_us,enqueue_max_us,"
+				  "completion_p50_us,completion_p99_us,completion_max_us\n",
+				  filp);
+		fprintf(filp, "%zu,%d,%.0f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f\n",
+				res->size, res->num_calls, calls,
+				calls * (double)res->size / (double)(1UL << 20),
+				(double)dma_histogram_percentile(&res->enqueue, 50.0) / 1000.0,
+				(double)dma_histogram_percentile(&res->enqueue, 99.0) / 1000.0,
+				(double)res->enqueue.max / 1000.0,
+				(double)dma_histogram_percentile(&res->completion, 50.0) / 1000.0,
+				(double)dma_histogram_percentile(&res->completion, 99.0) / 1000.0,
+				(double)res->completion.max / 1000.0);
+	}
+	fflush(filp);
+}
+
+/*
+ * dma_parse_strided
+ *
+ * It parses "<width>,<pitch>[,<rows>]" of the strided transfer; rows is
+ * left as is, if not given. Returns 0 on success, or -1 on invalid string.
+ */
+int
+dma_parse_strided(const char *str, size_t *p_width,
+				  size_t *p_pitch, size_t *p_rows)
+{
+	char	   *temp = strdup(str);
+	char	   *tok;
+	char	   *pos;
+	size_t		values[3];
+	int			count = 0;
+
+	if (!temp)
+		return -1;
+	for (tok = strtok_r(temp, ",", &pos);
+		 tok != NULL;
+		 tok = strtok_r(NULL, ",", &pos))
+	{
+		if (count == 3 || dma_parse_size(tok, &values[count]) != 0 ||
+			values[count] == 0)
+		{
+			free(temp);
+			return -1;
+		}
+		count++;
+	}
+	free(temp);
+	if (count < 2 || values[0] > values[1])
+		return -1;
+	*p_width = values[0];
+	*p_pitch = values[1];
+	if (count == 3)
+		*p_rows = values[2];
+	return 0;
+}
+
+/*
+ * dma_gather
+ *
+ * It packs rows elements of width bytes, at every pitch bytes of src, into
+ * dst. Common widths of columns are handled by 16B vector stores that pack
+ * multiple rows, and the rows ahead are prefetched, because each element
+ * is likely on a distinct cache line.
+ */
+void
+dma_gather(void *dst, const void *src, size_t width,
+		   size_t pitch, size_t rows)
+{
+	const char *s = src;
+	char	   *d = dst;
+	size_t		i = 0;
+
+#if defined(__x86_64__)
+	if (width == 4)
+	{
+		for (; i + 4 <= rows; i += 4, s += 4 * pitch, d += 16)
+		{
+			__builtin_prefetch(s + DMA_GATHER_PREFETCH * pitch);
+			_mm_storeu_si128((__m128i *)d,
+							 _mm_set_epi32(*((const int *)(s + 3 * pitch)),
+										   *((const int *)(s + 2 * pitch)),
+										   *((const int *)(s + pitch)),
+										   *((const int *)s)));
+		}
+	}
+	else if (width == 8)
+	{
+		for (; i + 2 <= rows; i += 2, s += 2 * pitch, d += 16)
+		{
+			__builtin_prefetch(s + DMA_GATHER_PREFETCH * pitch);
+			_mm_storeu_si128((__m128i *)d,
+							 _mm_set_epi64x(*((const long long *)(s + pitch)),
+											*((const long long *)s)));
+		}
+	}
+	else if (width % 16 == 0)
+	{
+		for (; i < rows; i++, s += pitch, d += width)
+		{
+			size_t	off;
+
+			__builtin_prefetch(s + DMA_GATHER_PREFETCH * pitch);
+			for (off = 0; off < width; off += 16)
+				_mm_storeu_si128((__m128i *)(d + off),
+								 _mm_loadu_si128((const __m128i *)(s + off)));
+		}
+	}
+#endif
+	/* remaining rows, or other widths */
+	for (; i < rows; i++, s += pitch, d += width)
+	{
+		__builtin_prefetch(s + DMA_GATHER_PREFETCH * pitch);
+		memcpy(d, s, width);
+	}
+}
+
+/*
+ * dma_strided_print
+ *
+ * It prints payload bandwidth of the strided transfer for each path.
+ */
+void
+dma_strided_print(FILE *filp, const dma_strided_result *res, int ntrials)
+{
+	double		payload = ((double)(res->width * res->rows) * ntrials /
+						   (double)(1UL << 20));
+
+	fprintf(filp,
+			"geometry:       %zu rows x %zuB, pitch %zuB\n"
+			"payload:        %.2fMB x %d\n",
+			res->rows, res->width, res->pitch,
+			payload / (double)ntrials, ntrials);
+	fprintf(filp, "%-16s %12s %14s\n", "path", "time[ms]", "payload[MB/s]");
+	fprintf(filp, "%-16s %12.2f %14.2f\n", "2D DMA",
+			res->rect_time * 1000.0, payload / res->rect_time);
+	fprintf(filp, "%-16s %12.2f %14.2f  (gather: %.2fms, %.2fMB/s)\n",
+			"gather + copy",
+			res->gather_copy_time * 1000.0, payload / res->gather_copy_time,
+			res->gather_time * 1000.0, payload / res->gather_time);
+	fprintf(filp, "%-16s %12.2f %14.2f\n", "small copies",
+			res->small_time * 1000.0, payload / res->small_time);
+}
+
+/*
+ * dma_timer_now - current time in sec
+ *
+ * CLOCK_MONOTONIC_RAW is not affected by NTP frequency adjustment.
+ */
+double
+dma_timer_now(void)
+{
+	struct timespec	ts;
+
+#ifdef CLOCK_MONOTONIC_RAW
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+/*
+ * Host memory allocation strategies
+ */
+const char *dma_hostmem_names[DMA_HOSTMEM_NUM_METHODS] = {
+	"malloc",
+	"register",
+	"pinned",
+	"hugetlb",
+	"thp",
+	"mlock",
+};
+
+/*
+ * dma_host_stub_driver
+ *
+ * A driver without GPU; it pins host memory using mlock(2). It is used for
+ * the "mlock" strategy, and allows to run the allocation strategies on
+ * machines without GPU device.
+ */
+static void *
+dma_stub_register(void *private, void *addr, size_t length)
+{
+	if (mlock(addr, length) != 0)
+	{
+		fprintf(stderr, "failed on mlock(%zu) : %s\n",
+				length, strerror(errno));
+		exit(1);
+	}
+	return NULL;
+}
+
+static void
+dma_stub_unregister(void *private, void *addr, size_t length, void *handle)
+{
+	munlock(addr, length);
+}
+
+static void *
+dma_stub_alloc(void *private, size_t length, void **p_handle)
+{
+	void	   *addr;
+
+	if (posix_memalign(&addr, sysconf(_SC_PAGESIZE), length) != 0)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	dma_stub_register(private, addr, length);
+	*p_handle = NULL;
+
+	return addr;
+}
+
+static void
+dma_stub_free(void *private, void *addr, size_t length, void *handle)
+{
+	dma_stub_unregister(private, addr, length, handle);
+	free(addr);
+}
+
+const dma_host_driver dma_host_stub_driver = {
+	"stub",
+	NULL,
+	dma_stub_register,
+	dma_stub_unregister,
+	dma_stub_alloc,
+	dma_stub_free,
+};
+
+/*
+ * dma_hostmem_parse
+ *
+ * It parses comma separated list of the strategy names, or "all".
+ * Returns 0 on success, or -1 on invalid name.
+ */
+int
+dma_hostmem_parse(const char *str, unsigned int *p_mask)
+{
+	char	   *temp = strdup(str);
+	char	   *tok;
+	char	   *pos;
+	unsigned int mask = 0;
+	int			i;
+
+	if (!temp)
+		return -1;
+	for (tok = strtok_r(temp, ",", &pos);
+		 tok != NULL;
+		 tok = strtok_r(NULL, ",", &pos))
+	{
+		if (strcmp(tok, "all") == 0)
+		{
+			mask |= (1U << DMA_HOSTMEM_NUM_METHODS) - 1;
+			continue;
+		}
+		for (i=0; i < DMA_HOSTMEM_NUM_METHODS; i++)
+		{
+			if (strcmp(tok, dma_hostmem_names[i]) == 0)
+			{
+				mask |= (1U << i);
+				break;
+			}
+		}
+		if (i == DMA_HOSTMEM_NUM_METHODS)
+		{
+			free(temp);
+			return -1;
+		}
+	}
+	free(temp);
+	*p_mask = mask;
+
+	return (mask != 0 ? 0 : -1);
+}
+
+/*
+ * dma_hostmem_alloc
+ *
+ * It allocates host memory according to the strategy, then touches all
+ * the pages and pins them if needed. Returns 0 on success, or -1 if the
+ * strategy is not available on this system (e.g, no huge pages).
+ * If numa_node is not negative, pages are allocated on the NUMA node.
+ */
+int
+dma_hostmem_alloc(dma_hostmem *hmem, int method, size_t length,
+				  int numa_node, const dma_host_driver *driver)
+{
+	size_t		pagesz = sysconf(_SC_PAGESIZE);
+	size_t		hugesz = (2UL << 20);
+	struct rusage ru1, ru2;
+	double		tv1, tv2;
+	void	   *addr;
+
+	memset(hmem, 0, sizeof(dma_hostmem));
+	hmem->method = method;
+	hmem->length = length;
+
+	/* pages are allocated on the first touch under the policy */
+	if (numa_node >= 0 && dma_numa_set_policy(numa_node) != 0)
+		return -1;
+
+	getrusage(RUSAGE_SELF, &ru1);
+	tv1 = dma_timer_now();
+	switch (method)
+	{
+		case DMA_HOSTMEM_MALLOC:
+			addr = malloc(length);
+			if (!addr)
+				goto failed;
+			break;
+		case DMA_HOSTMEM_REGISTER:
+		case DMA_HOSTMEM_MLOCK:
+			if (posix_memalign(&addr, pagesz, length) != 0)
+				goto failed;
+			break;
+		case DMA_HOSTMEM_PINNED:
+			addr = driver->mem_alloc(driver->private, length, &hmem->handle);
+			break;
+		case DMA_HOSTMEM_HUGETLB:
+			hmem->mapped = (length + hugesz - 1) & ~(hugesz - 1);
+			addr = mmap(NULL, hmem->mapped,
+						PROT_READ | PROT_WRITE,
+						MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+						-1, 0);
+			if (addr == MAP_FAILED)
+				goto failed;
+			break;
+		case DMA_HOSTMEM_THP:
+			hmem->mapped = (length + hugesz - 1) & ~(hugesz - 1);
+			addr = mmap(NULL, hmem->mapped,
+						PROT_READ | PROT_WRITE,
+						MAP_PRIVATE | MAP_ANONYMOUS,
+						-1, 0);
+			if (addr == MAP_FAILED)
+				goto failed;
+			if (madvise(addr, hmem->mapped, MADV_HUGEPAGE) != 0)
+			{
+				munmap(addr, hmem->mapped);
+				goto failed;
+			}
+			break;
+		default:
+			goto failed;
+	}
+	/* first touch, to count the page faults */
+	memset(addr, 0, length);
+	tv2 = dma_timer_now();
+	getrusage(RUSAGE_SELF, &ru2);
+
+	if (numa_node >= 0)
+		dma_numa_set_policy(-1);
+
+	hmem->addr = addr;
+	hmem->numa_node = dma_numa_addr_node(addr);
+	hmem->alloc_time = tv2 - tv1;
+	hmem->minflt = ru2.ru_minflt - ru1.ru_minflt;
+	hmem->majflt = ru2.ru_majflt - ru1.ru_majflt;
+
+	/* pinning */
+	tv1 = dma_timer_now();
+	switch (method)
+	{
+		case DMA_HOSTMEM_REGISTER:
+		case DMA_HOSTMEM_HUGETLB:
+		case DMA_HOSTMEM_THP:
+			hmem->handle = driver->mem_register(driver->private,
+												addr, length);
+			break;
+		case DMA_HOSTMEM_MLOCK:
+			dma_host_stub_driver.mem_register(NULL, addr, length);
+			break;
+		default:
+			break;
+	}
+	tv2 = dma_timer_now();
+	hmem->pin_time = tv2 - tv1;
+
+	return 0;
+
+failed:
+	if (numa_node >= 0)
+		dma_numa_set_policy(-1);
+	return -1;
+}
+
+void
+dma_hostmem_free(dma_hostmem *hmem, const dma_host_driver *driver)
+{
+	switch (hmem->method)
+	{
+		case DMA_HOSTMEM_MALLOC:
+			free(hmem->addr);
+			break;
+		case DMA_HOSTMEM_REGISTER:
+			driver->mem_unregister(driver->private, hmem->addr,
+								   hmem->length, hmem->handle);
+			free(hmem->addr);
+			break;
+		case DMA_HOSTMEM_MLOCK:
+			dma_host_stub_driver.mem_unregister(NULL, hmem->addr,
+												hmem->length, NULL);
+			free(hmem->addr);
+			break;
+		case DMA_HOSTMEM_PINNED:
+			driver->mem_free(driver->private, hmem->addr,
+							 hmem->length, hmem->handle);
+			break;
+		case DMA_HOSTMEM_HUGETLB:
+		case DMA_HOSTMEM_THP:
+			driver->mem_unregister(driver->private, hmem->addr,
+								   hmem->length, hmem->handle);
+			munmap(hmem->addr, hmem->mapped);
+			break;
+	}
+	hmem->addr = NULL;
+}
+
+/*
+ * dma_hostmem_print
+ *
+ * It prints a row of the allocation strategy matrix. Header shall be
+ * printed together with the first row. If res is NULL, the strategy was
+ * not available.
+ */
+void
+dma_hostmem_print(FILE *filp, const dma_hostmem *hmem,
+				  const dma_result *res, int index)
+{
+	if (index == 0)
+		fprintf(filp, "%-10s %10s %10s %8s %8s %12s %10s %10s\n",
+				"strategy", "alloc(ms)", "pin(ms)", "minflt", "majflt",
+				"speed(MB/s)", "H2D p50", "H2D p99");
+	if (!res)
+	{
+		fprintf(filp, "%-10s (not available)\n",
+				dma_hostmem_names[hmem->method]);
+		return;
+	}
+	fprintf(filp, "%-10s %10.2f %10.2f %8ld %8ld %12.2f %8.1fus %8.1fus\n",
+			dma_hostmem_names[hmem->method],
+			hmem->alloc_time * 1000.0,
+			hmem->pin_time * 1000.0,
+			hmem->minflt,
+			hmem->majflt,
+			(double)(res->total_size >> 20) / res->elapsed,
+			(double)dma_histogram_percentile(&res->h2d, 50.0) / 1000.0,
+			(double)dma_histogram_percentile(&res->h2d, 99.0) / 1000.0);
+	fflush(filp);
+}
+
+/*
+ * dma_hostmem_stub
+ *
+ * It runs the allocation strategy matrix on the stub driver, and copies
+ * the buffer to a host memory stand-in of the device by memcpy; no GPU
+ * is needed. It exercises the allocation, pinning and page-fault paths.
+ */
+void
+dma_hostmem_stub(FILE *filp, unsigned int methods, size_t length,
+				 size_t chunk_sz, int num_trial)
+{
+	dma_hostmem	hmem;
+	dma_result	res;
+	char	   *dmem;
+	double		tv1, tv2;
+	int			i, j, k, index = 0;
+
+	if (!(dmem = malloc(length)))
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	memset(dmem, 0, length);
+
+	for (i=0; i < DMA_HOSTMEM_NUM_METHODS; i++)
+	{
+		if ((methods & (1U << i)) == 0)
+			continue;
+		if (dma_hostmem_alloc(&hmem, i, length, -1,
+							  &dma_host_stub_driver) != 0)
+		{
+			hmem.method = i;
+			dma_hostmem_print(filp, &hmem, NULL, index++);
+			continue;
+		}
+		memset(&res, 0, sizeof(dma_result));
+		res.chunk_size = chunk_sz;
+		dma_histogram_init(&res.h2d);
+		dma_histogram_init(&res.d2h);
+		for (j=0; j < num_trial; j++)
+		{
+			for (k=0; k < length / chunk_sz; k++)
+			{
+				tv1 = dma_timer_now();
+				memcpy(dmem + k * chunk_sz, hmem.addr + k * chunk_sz,
+					   chunk_sz);
+				tv2 = dma_timer_now();
+				res.elapsed += (tv2 - tv1);
+				res.total_size += chunk_sz;
+				dma_histogram_add(&res.h2d,
+								  (uint64_t)((tv2 - tv1) * 1.0e9));
+			}
+		}
+		dma_hostmem_print(filp, &hmem, &res, index++);
+		dma_hostmem_free(&hmem, &dma_host_stub_driver);
+	}
+	free(dmem);
+}
+
+/*
+ * dma_parse_idlist
+ *
+ * It parses a list of ids like "0,2-3", or "all", into a bitmask.
+ * Returns 0 on success, or -1 on invalid list.
+ */
+int
+dma_parse_idlist(const char *str, int max_id, uint64_t *p_mask)
+{
+	const char *pos = str;
+	uint64_t	mask = 0;
+	long		lo, hi;
+	char	   *end;
+
+	if (max_id > DMA_MAX_IDS)
+		max_id = DMA_MAX_IDS;
+	if (strcmp(str, "all") == 0)
+	{
+		*p_mask = (max_id < 64 ? (1UL << max_id) - 1 : ~0UL);
+		return 0;
+	}
+	while (*pos != '\0')
+	{
+		if (!isdigit(*pos))
+			return -1;
+		lo = hi = strtol(pos, &end, 10);
+		if (*end == '-')
+		{
+			if (!isdigit(end[1]))
+				return -1;
+			hi = strtol(end + 1, &end, 10);
+		}
+		if (lo > hi || hi >= max_id)
+			return -1;
+		while (lo <= hi)
+			mask |= (1UL << lo++);
+		if (*end == ',')
+			end++;
+		else if (*end != '\0')
+			return -1;
+		pos = end;
+	}
+	*p_mask = mask;
+
+	return (mask != 0 ? 0 : -1);
+}
+
+/*
+ * dma_parse_cpulist
+ *
+ * It parses a CPU list in the format of sysfs, like "0-7,16-23".
+ */
+int
+dma_parse_cpulist(const char *str, cpu_set_t *cpuset)
+{
+	const char *pos = str;
+	long		lo, hi;
+	char	   *end;
+
+	CPU_ZERO(cpuset);
+	while (*pos != '\0' && *pos != '\n')
+	{
+		if (!isdigit(*pos))
+			return -1;
+		lo = hi = strtol(pos, &end, 10);
+		if (*end == '-')
+		{
+			if (!isdigit(end[1]))
+				return -1;
+			hi = strtol(end + 1, &end, 10);
+		}
+		if (lo > hi || hi >= CPU_SETSIZE)
+			return -1;
+		while (lo <= hi)
+			CPU_SET(lo++, cpuset);
+		if (*end == ',')
+			end++;
+		else if (*end != '\0' && *end != '\n')
+			return -1;
+		pos = end;
+	}
+	return (CPU_COUNT(cpuset) > 0 ? 0 : -1);
+}
+
+static int
+dma_read_sysfs(const char *path, char *buffer, size_t length)
+{
+	FILE	   *filp = fopen(path, "r");
+
+	if (!filp)
+		return -1;
+	if (!fgets(buffer, length, filp))
+	{
+		fclose(filp);
+		return -1;
+	}
+	fclose(filp);
+	return 0;
+}
+
+/*
+ * dma_numa_num_nodes - number of NUMA nodes; 1 on non-NUMA system
+ */
+int
+dma_numa_num_nodes(void)
+{
+	char		buffer[256];
+	char	   *pos;
+
+	if (dma_read_sysfs("/sys/devices/system/node/possible",
+					   buffer, sizeof(buffer)) != 0)
+		return 1;
+	/* e.g, "0-1"; the last number is the highest node id */
+	pos = buffer + strcspn(buffer, "\n");
+	while (pos > buffer && isdigit(pos[-1]))
+		pos--;
+	return atoi(pos) + 1;
+}
+
+/*
+ * dma_numa_node_cpus - CPUs that belong to the NUMA node
+ */
+int
+dma_numa_node_cpus(int node, cpu_set_t *cpuset)
+{
+	char		path[256];
+	char		buffer[4096];
+
+	snprintf(path, sizeof(path),
+			 "/sys/devices/system/node/node%d/cpulist", node);
+	if (dma_read_sysfs(path, buffer, sizeof(buffer)) != 0)
+		return -1;
+	return dma_parse_cpulist(buffer, cpuset);
+}
+
+/*
+ * dma_numa_set_policy
+ *
+ * It binds the memory allocation of the current thread to the node,
+ * or resets the policy if node is negative.
+ */
+int
+dma_numa_set_policy(int node)
+{
+	unsigned long	nodemask[DMA_MAX_IDS / (8 * sizeof(long))];
+
+	if (node < 0)
+		return syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+	if (node >= DMA_MAX_IDS)
+		return -1;
+	memset(nodemask, 0, sizeof(nodemask));
+	nodemask[node / (8 * sizeof(long))] |= (1UL << (node % (8 * sizeof(long))));
+
+	return syscall(SYS_set_mempolicy, MPOL_BIND,
+				   nodemask, (unsigned long) DMA_MAX_IDS + 1);
+}
+
+/*
+ * dma_numa_addr_node - NUMA node of the page, or -1 if unknown
+ */
+int
+dma_numa_addr_node(void *addr)
+{
+	int		node;
+
+	if (syscall(SYS_get_mempolicy, &node, NULL, 0,
+				addr, MPOL_F_NODE | MPOL_F_ADDR) != 0)
+		return -1;
+	return node;
+}
+
+/*
+ * dma_pci_numa_node
+ *
+ * NUMA node of the PCI device (like "0000:03:00.0") according to sysfs,
+ * or -1 if unknown.
+ */
+int
+dma_pci_numa_node(const char *pci_busid)
+{
+	char		path[256];
+	char		buffer[64];
+	char		busid[64];
+	int			i;
+
+	/* sysfs uses lower case hex digits */
+	for (i=0; pci_busid[i] != '\0' && i < sizeof(busid) - 1; i++)
+		busid[i] = tolower(pci_busid[i]);
+	busid[i] = '\0';
+
+	snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/numa_node", busid);
+	if (dma_read_sysfs(path, buffer, sizeof(buffer)) != 0)
+		return -1;
+	return atoi(buffer);
+}
+
+/*
+ * dma_bind_cpus - binds the current thread to the CPU set
+ */
+int
+dma_bind_cpus(const cpu_set_t *cpuset)
+{
+	return sched_setaffinity(0, sizeof(cpu_set_t), cpuset);
+}
+
+const char *
+dma_numa_placement(int host_node, int device_node)
+{
+	if (host_node < 0 || device_node < 0)
+		return "unknown";
+	return (host_node == device_node ? "local" : "remote");
+}
+
+/*
+ * dma_print_matrix
+ *
+ * It prints a matrix of values (e.g, MB/s); values[r * ncols + c] is
+ * the value of r-th row and c-th column. A negative or NaN value is
+ * printed as "-". If marks is not NULL, its character is appended to
+ * each value, and explained by the caller.
+ */
+void
+dma_print_matrix(FILE *filp, const char *title,
+				 const char *row_label, int nrows, const int *row_ids,
+				 const char *col_label, int ncols, const int *col_ids,
+				 const double *values, const char *marks)
+{
+	char		label[64];
+	int			r, c;
+
+	fprintf(filp, "%s\n%-10s", title, "");
+	for (c=0; c < ncols; c++)
+	{
+		snprintf(label, sizeof(label), "%s%d", col_label, col_ids[c]);
+		fprintf(filp, " %11s", label);
+	}
+	fputc('\n', filp);
+
+	for (r=0; r < nrows; r++)
+	{
+		snprintf(label, sizeof(label), "%s%d", row_label, row_ids[r]);
+		fprintf(filp, "%-10s", label);
+		for (c=0; c < ncols; c++)
+		{
+			double	value = values[r * ncols + c];
+			char	mark = (marks ? marks[r * ncols + c] : ' ');
+
+			if (isnan(value) || value < 0.0)
+				fprintf(filp, " %10s%c", "-", mark);
+			else
+				fprintf(filp, " %10.2f%c", value, mark);
+		}
+		fputc('\n', filp);
+	}
+	fflush(filp);
+}
+
+/*
+ * dma_p2p_stub_driver
+ *
+ * A driver without GPU; each device is a host buffer, and copies are
+ * memcpy. Pairs of the even and the next odd device pretend to be able
+ * to access each other directly, and others are staged through another
+ * host buffer, so both paths of the matrix logic can be run on machines
+ * without GPU device. Each buffer has twice the length; copies go to its
+ * second half, so a copy within a device does not degenerate to a no-op.
+ */
+typedef struct {
+	int			ndevs;
+	size_t		length;
+	char	  **buffers;
+	char	   *stage;
+} dma_p2p_stub;
+
+static int
+dma_p2p_stub_can_access_peer(void *private, int src, int dst)
+{
+	return (src / 2 == dst / 2);
+}
+
+static void
+dma_p2p_stub_copy(void *private, int dst, int src,
+				  size_t length, int count, int staged)
+{
+	dma_p2p_stub *stub = private;
+	int			i;
+
+	for (i=0; i < count; i++)
+	{
+		if (staged)
+		{
+			memcpy(stub->stage, stub->buffers[src], length);
+			memcpy(stub->buffers[dst] + stub->length, stub->stage, length);
+		}
+		else
+			memcpy(stub->buffers[dst] + stub->length,
+				   stub->buffers[src], length);
+	}
+}
+
+void
+dma_p2p_stub_init(dma_p2p_driver *driver, int ndevs, size_t length)
+{
+	dma_p2p_stub *stub;
+	int			i;
+
+	stub = calloc(1, sizeof(dma_p2p_stub));
+	if (!stub || !(stub->buffers = calloc(ndevs, sizeof(char *))))
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	stub->ndevs = ndevs;
+	stub->length = length;
+	for (i=0; i <= ndevs; i++)
+	{
+		char	   *addr = malloc(2 * length);
+
+		if (!addr)
+		{
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		memset(addr, i, 2 * length);
+		if (i < ndevs)
+			stub->buffers[i] = addr;
+		else
+			stub->stage = addr;
+	}
+	driver->name = "stub";
+	driver->private = stub;
+	driver->can_access_peer = dma_p2p_stub_can_access_peer;
+	driver->copy = dma_p2p_stub_copy;
+}
+
+void
+dma_p2p_stub_cleanup(dma_p2p_driver *driver)
+{
+	dma_p2p_stub *stub = driver->private;
+	int			i;
+
+	for (i=0; i < stub->ndevs; i++)
+		free(stub->buffers[i]);
+	free(stub->buffers);
+	free(stub->stage);
+	free(stub);
+	driver->private = NULL;
+}
+
+/*
+ * dma_p2p_matrix
+ *
+ * It measures bandwidth and latency of the copy for every ordered pair of
+ * the devices, then prints the src x dst matrices. Copies between devices
+ * without direct peer access are staged through the host.
+ */
+void
+dma_p2p_matrix(FILE *filp, const dma_p2p_driver *driver,
+			   int ndevs, const int *dev_ids,
+			   size_t length, int ntrials)
+{
+	double	   *bandwidth;
+	double	   *latency;
+	char	   *marks;
+	int			src, dst, i;
+
+	bandwidth = calloc(ndevs * ndevs, sizeof(double));
+	latency = calloc(ndevs * ndevs, sizeof(double));
+	marks = calloc(ndevs * ndevs, sizeof(char));
+	if (!bandwidth || !latency || !marks)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	for (src=0; src < ndevs; src++)
+	{
+		for (dst=0; dst < ndevs; dst++)
+		{
+			dma_histogram hist;
+			int			k = src * ndevs + dst;
+			int			staged;
+			double		tv1, tv2;
+
+			staged = (src != dst &&
+					  !driver->can_access_peer(driver->private, src, dst));
+			marks[k] = (staged ? 'h' : ' ');
+
+			/* warm-up */
+			driver->copy(driver->private, dst, src, length, 1, staged);
+
+			tv1 = dma_timer_now();
+			driver->copy(driver->private, dst, src, length, ntrials, staged);
+			tv2 = dma_timer_now();
+			bandwidth[k] = (double)((length * ntrials) >> 20) / (tv2 - tv1);
+
+			dma_histogram_init(&hist);
+			for (i=0; i < ntrials; i++)
+			{
+				tv1 = dma_timer_now();
+				driver->copy(driver->private, dst, src,
+							 DMA_P2P_LATENCY_SIZE, 1, staged);
+				tv2 = dma_timer_now();
+				dma_histogram_add(&hist, (uint64_t)((tv2 - tv1) * 1.0e9));
+			}
+			latency[k] = (double)dma_histogram_percentile(&hist, 50.0) / 1000.0;
+
+			fprintf(filp, "dev%d -> dev%d: %.2fMB/s, p50 latency %.2fus%s\n",
+					dev_ids[src], dev_ids[dst], bandwidth[k], latency[k],
+					staged ? " (staged through host)" : "");
+		}
+	}
+	dma_print_matrix(filp,
+					 "bandwidth [MB/s] of src x dst "
+					 "('h' = staged through host)",
+					 "dev", ndevs, dev_ids,
+					 "dev", ndevs, dev_ids,
+					 bandwidth, marks);
+	dma_print_matrix(filp,
+					 "p50 latency [us] of src x dst "
+					 "('h' = staged through host)",
+					 "dev", ndevs, dev_ids,
+					 "dev", ndevs, dev_ids,
+					 latency, marks);
+	free(bandwidth);
+	free(latency);
+	free(marks);
+}
+
+/*
+ * dma_stream_file
+ *
+ * It streams the file to the device buffer through the ring of num_slots
+ * chunks; ring must be aligned for O_DIRECT, and chunk_sz must be aligned
+ * to the device_size. Up to half of the slots are in flight of DMA, and
+ * the others are available for the reader. Returns 0 on success, or -1
+ * with errno on I/O error.
+ */
+#define DMA_SLOT_FREE		0
+#define DMA_SLOT_FILLED		1
+#define DMA_SLOT_SUBMITTED	2
+
+typedef struct {
+	int			fd;
+	char	   *ring;
+	size_t		chunk_sz;
+	int			num_slots;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int		   *state;			/* DMA_SLOT_* */
+	size_t	   *length;			/* bytes read into the slot */
+	uint64_t	num_chunks;		/* number of chunks read, valid on eof */
+	int			eof;
+	int			errcode;
+	double		read_time;
+	double		read_stall;
+} dma_stream_state;
+
+static void *
+dma_stream_reader(void *private)
+{
+	dma_stream_state *st = private;
+	uint64_t	k;
+
+	for (k=0; ; k++)
+	{
+		int			slot = k % st->num_slots;
+		ssize_t		nbytes;
+		double		tv1, tv2;
+
+		tv1 = dma_timer_now();
+		pthread_mutex_lock(&st->lock);
+		while (st->state[slot] != DMA_SLOT_FREE)
+			pthread_cond_wait(&st->cond, &st->lock);
+		pthread_mutex_unlock(&st->lock);
+		tv2 = dma_timer_now();
+		st->read_stall += tv2 - tv1;
+
+		do {
+			nbytes = pread(st->fd, st->ring + slot * st->chunk_sz,
+						   st->chunk_sz, k * st->chunk_sz);
+		} while (nbytes < 0 && errno == EINTR);
+		tv1 = dma_timer_now();
+		st->read_time += tv1 - tv2;
+
+		pthread_mutex_lock(&st->lock);
+		if (nbytes > 0)
+		{
+			st->length[slot] = nbytes;
+			st->state[slot] = DMA_SLOT_FILLED;
+		}
+		if (nbytes < 0)
+			st->errcode = errno;
+		if (nbytes < (ssize_t) st->chunk_sz)
+		{
+			st->num_chunks = (nbytes > 0 ? k + 1 : k);
+			st->eof = 1;
+		}
+		pthread_cond_broadcast(&st->cond);
+		pthread_mutex_unlock(&st->lock);
+
+		if (nbytes < (ssize_t) st->chunk_sz)
+			break;
+	}
+	return NULL;
+}
+
+int
+dma_stream_file(const char *filename, char *ring,
+				size_t chunk_sz, int num_slots,
+				size_t device_size,
+				const dma_stream_driver *driver,
+				dma_stream_result *res)
+{
+	dma_stream_state st;
+	pthread_t	reader;
+	uint64_t	device_chunks = device_size / chunk_sz;
+	uint64_t	k, head = 0;
+	int			max_inflight = (num_slots / 2 > 0 ? num_slots / 2 : 1);
+	double		tv1, tv2, tv_start;
+
+	memset(res, 0, sizeof(dma_stream_result));
+	res->chunk_size = chunk_sz;
+	res->num_slots = num_slots;
+
+	memset(&st, 0, sizeof(dma_stream_state));
+	st.fd = open(filename, O_RDONLY | O_DIRECT);
+	if (st.fd >= 0)
+		res->direct_io = 1;
+	else if (errno == EINVAL)
+	{
+		/* e.g, tmpfs does not support O_DIRECT */
+		fprintf(stderr, "O_DIRECT is not supported on %s, "
+				"use buffered read\n", filename);
+		st.fd = open(filename, O_RDONLY);
+	}
+	if (st.fd < 0)
+		return -1;
+	st.ring = ring;
+	st.chunk_sz = chunk_sz;
+	st.num_slots = num_slots;
+	st.state = calloc(num_slots, sizeof(int));
+	st.length = calloc(num_slots, sizeof(size_t));
+	if (!st.state || !st.length)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	pthread_mutex_init(&st.lock, NULL);
+	pthread_cond_init(&st.cond, NULL);
+
+	tv_start = dma_timer_now();
+	if ((errno = pthread_create(&reader, NULL, dma_stream_reader, &st)) != 0)
+	{
+		fprintf(stderr, "failed on pthread_create : %s\n", strerror(errno));
+		exit(1);
+	}
+
+	for (k=0; ; k++)
+	{
+		int			slot = k % num_slots;
+		int			filled;
+
+		/* wait for the reader */
+		tv1 = dma_timer_now();
+		pthread_mutex_lock(&st.lock);
+		while (st.state[slot] != DMA_SLOT_FILLED &&
+			   !(st.eof && k >= st.num_chunks))
+			pthread_cond_wait(&st.cond, &st.lock);
+		filled = (st.state[slot] == DMA_SLOT_FILLED);
+		if (filled)
+			st.state[slot] = DMA_SLOT_SUBMITTED;
+		pthread_mutex_unlock(&st.lock);
+		tv2 = dma_timer_now();
+		res->dma_stall += tv2 - tv1;
+		if (!filled)
+			break;
+
+		driver->submit(driver->private, slot,
+					   ring + slot * chunk_sz, st.length[slot],
+					   (k % device_chunks) * chunk_sz);
+		res->total_size += st.length[slot];
+
+		/* release the oldest slots, to keep the reader running */
+		while (k + 1 - head > max_inflight)
+		{
+			int		oldest = head % num_slots;
+
+			res->dma_time += (double)driver->wait(driver->private,
+												  oldest) / 1.0e9;
+			pthread_mutex_lock(&st.lock);
+			st.state[oldest] = DMA_SLOT_FREE;
+			pthread_cond_broadcast(&st.cond);
+			pthread_mutex_unlock(&st.lock);
+			head++;
+		}
+	}
+	/* drain */
+	for (; head < k; head++)
+		res->dma_time += (double)driver->wait(driver->private,
+											  head % num_slots) / 1.0e9;
+	pthread_join(reader, NULL);
+	res->elapsed = dma_timer_now() - tv_start;
+	res->read_time = st.read_time;
+	res->read_stall = st.read_stall;
+
+	close(st.fd);
+	pthread_mutex_destroy(&st.lock);
+	pthread_cond_destroy(&st.cond);
+	free(st.state);
+	free(st.length);
+
+	if (st.errcode != 0)
+	{
+		errno = st.errcode;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * dma_stream_print
+ *
+ * The bottleneck is the stage that kept busy longer; the other one waited
+ * for it.
+ */
+void
+dma_stream_print(FILE *filp, const char *filename,
+				 const dma_stream_result *res)
+{
+	double		total_mb = (double) res->total_size / (double)(1UL << 20);
+
+	fprintf(filp,
+			"storage to device streaming result\n"
+			"file:           %s (%s)\n"
+			"size:           %.1fMB\n"
+			"ring:           %lu%s x %d\n"
+			"disk:           %.2fMB/s (read %.3fs, stall %.3fs)\n"
+			"dma:            %.2fMB/s (copy %.3fs, stall %.3fs)\n"
+			"end-to-end:     %.2fMB/s (%.3fs)\n"
+			"bottleneck:     %s\n",
+			filename, res->direct_io ? "O_DIRECT" : "buffered",
+			total_mb,
+			res->chunk_size > (1UL<<20)
+			? res->chunk_size >> 20 : res->chunk_size >> 10,
+			res->chunk_size > (1UL<<20) ? "MB" : "KB",
+			res->num_slots,
+			total_mb / res->read_time, res->read_time, res->read_stall,
+			total_mb / res->dma_time, res->dma_time, res->dma_stall,
+			total_mb / res->elapsed, res->elapsed,
+			res->read_time >= res->dma_time ? "disk" : "dma");
+	fflush(filp);
+}
+
+/*
+ * dma_stream_stub
+ *
+ * It streams the file to a host memory stand-in of the device by memcpy,
+ * to run the I/O side on machines without GPU device.
+ */
+typedef struct {
+	char	   *dmem;
+	uint64_t   *elapsed;		/* nsec of the copy for each slot */
+} dma_stream_stub_device;
+
+static void
+dma_stream_stub_submit(void *private, int slot, void *addr,
+					   size_t length, size_t offset)
+{
+	dma_stream_stub_device *dev = private;
+	double		tv1, tv2;
+
+	tv1 = dma_timer_now();
+	memcpy(dev->dmem + offset, addr, length);
+	tv2 = dma_timer_now();
+	dev->elapsed[slot] = (uint64_t)((tv2 - tv1) * 1.0e9);
+}
+
+static uint64_t
+dma_stream_stub_wait(void *private, int slot)
+{
+	dma_stream_stub_device *dev = private;
+
+	return dev->elapsed[slot];
+}
+
+int
+dma_stream_stub(FILE *filp, const char *filename,
+				size_t chunk_sz, int num_slots,
+				size_t device_size)
+{
+	dma_stream_stub_device dev;
+	dma_stream_driver driver;
+	dma_stream_result res;
+	void	   *ring;
+	int			rc;
+
+	if (posix_memalign(&ring, sysconf(_SC_PAGESIZE),
+					   chunk_sz * num_slots) != 0 ||
+		!(dev.dmem = malloc(device_size)) ||
+		!(dev.elapsed = calloc(num_slots, sizeof(uint64_t))))
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	memset(dev.dmem, 0, device_size);
+
+	driver.name = "stub";
+	driver.private = &dev;
+	driver.submit = dma_stream_stub_submit;
+	driver.wait = dma_stream_stub_wait;
+	rc = dma_stream_file(filename, ring, chunk_sz, num_slots,
+						 device_size, &driver, &res);
+	if (rc == 0)
+		dma_stream_print(filp, filename, &res);
+
+	free(ring);
+	free(dev.dmem);
+	free(dev.elapsed);
+
+	return rc;
+}
+
+/*
+ * dma_parse_fractions
+ *
+ * It parses comma separated list of percentages (0 < x <= 100), then sorts
+ * them. Returns number of the items, or -1 on invalid input.
+ */
+int
+dma_parse_fractions(const char *str, double **p_fractions)
+{
+	double	   *fractions;
+	char	   *copy, *tok, *pos, *end;
+	int			count = 0;
+
+	copy = strdup(str);
+	fractions = calloc(strlen(str) / 2 + 1, sizeof(double));
+	if (!copy || !fractions)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (tok = strtok_r(copy, ",", &pos);
+		 tok != NULL;
+		 tok = strtok_r(NULL, ",", &pos))
+	{
+		double	value = strtod(tok, &end);
+
+		if (end == tok || *end != '\0' || value <= 0.0 || value > 100.0)
+		{
+			free(copy);
+			free(fractions);
+			return -1;
+		}
+		fractions[count++] = value;
+	}
+	free(copy);
+	if (count == 0)
+	{
+		free(fractions);
+		return -1;
+	}
+	qsort(fractions, count, sizeof(double), dma_double_compare);
+	*p_fractions = fractions;
+
+	return count;
+}
+
+/*
+ * dma_zerocopy_print
+ *
+ * It prints the effective bandwidth, that is bytes actually read by the
+ * kernel per second, of zero-copy access and explicit copy for each
+ * fraction, then the crossover point.
+ */
+void
+dma_zerocopy_print(FILE *filp, const dma_zerocopy_result *results,
+				   int count, size_t buffer_size, int ntrials)
+{
+	double		crossover = -1.0;
+	int			i;
+
+	fprintf(filp, "%9s %16s %16s %10s %10s %10s  %s\n",
+			"fraction", "zero-copy[MB/s]", "explicit[MB/s]",
+			"zc[ms]", "copy[ms]", "kernel[ms]", "winner");
+	for (i=0; i < count; i++)
+	{
+		const dma_zerocopy_result *zr = &results[i];
+		double	useful_mb = ((double)(buffer_size >> 20) * ntrials *
+							 zr->fraction / 100.0);
+		double	explicit_time = zr->copy_time + zr->kernel_time;
+		int		zerocopy_wins = (zr->zerocopy_time < explicit_time);
+
+		fprintf(filp, "%8.2f%% %16.2f %16.2f %10.3f %10.3f %10.3f  %s\n",
+				zr->fraction,
+				useful_mb / zr->zerocopy_time,
+				useful_mb / explicit_time,
+				1000.0 * zr->zerocopy_time / ntrials,
+				1000.0 * zr->copy_time / ntrials,
+				1000.0 * zr->kernel_time / ntrials,
+				zerocopy_wins ? "zero-copy" : "explicit");
+		if (!zerocopy_wins && crossover < 0.0)
+			crossover = zr->fraction;
+	}
+	if (crossover < 0.0)
+		fprintf(filp, "crossover: zero-copy wins on all the fractions\n");
+	else
+		fprintf(filp, "crossover: explicit copy wins at %.2f%% "
+				"or more of the buffer\n", crossover);
+	fflush(filp);
+}
+
+/*
+ * CRC32C (Castagnoli)
+ *
+ * The CRC32 instruction of SSE4.2 or ARMv8 is used if available, and
+ * a table driven code otherwise. SSE4.2 is checked at runtime, so the
+ * binary does not need to be built with -msse4.2.
+ */
+static uint32_t		dma_crc32c_table[256];
+static pthread_once_t dma_crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t	  (*dma_crc32c_func)(uint32_t crc, const unsigned char *p,
+									 size_t length);
+static const char  *dma_crc32c_name;
+
+static uint32_t
+dma_crc32c_sw(uint32_t crc, const unsigned char *p, size_t length)
+{
+	while (length-- > 0)
+		crc = dma_crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t
+dma_crc32c_hw(uint32_t crc, const unsigned char *p, size_t length)
+{
+	uint64_t	crc64 = crc;
+	uint64_t	v;
+
+	for (; length >= 8; p += 8, length -= 8)
+	{
+		memcpy(&v, p, 8);
+		crc64 = _mm_crc32_u64(crc64, v);
+	}
+	crc = (uint32_t) crc64;
+	for (; length > 0; p++, length--)
+		crc = _mm_crc32_u8(crc, *p);
+	return crc;
+}
+#elif defined(__ARM_FEATURE_CRC32)
+static uint32_t
+dma_crc32c_hw(uint32_t crc, const unsigned char *p, size_t length)
+{
+	uint64_t	v;
+
+	for (; length >= 8; p += 8, length -= 8)
+	{
+		memcpy(&v, p, 8);
+		crc = __crc32cd(crc, v);
+	}
+	for (; length > 0; p++, length--)
+		crc = __crc32cb(crc, *p);
+	return crc;
+}
+#endif
+
+static void
+dma_crc32c_init(void)
+{
+	uint32_t	i, j, crc;
+
+	for (i=0; i < 256; i++)
+	{
+		crc = i;
+		for (j=0; j < 8; j++)
+			crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78 : (crc >> 1);
+		dma_crc32c_table[i] = crc;
+	}
+	dma_crc32c_func = dma_crc32c_sw;
+	dma_crc32c_name = "crc32c (table)";
+#if defined(__x86_64__)
+	{
+		unsigned int eax, ebx, ecx, edx;
+
+		if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2))
+		{
+			dma_crc32c_func = dma_crc32c_hw;
+			dma_crc32c_name = "crc32c (sse4.2)";
+		}
+	}
+#elif defined(__ARM_FEATURE_CRC32)
+	dma_crc32c_func = dma_crc32c_hw;
+	dma_crc32c_name = "crc32c (armv8)";
+#endif
+}
+
+uint32_t
+dma_crc32c(uint32_t crc, const void *data, size_t length)
+{
+	pthread_once(&dma_crc32c_once, dma_crc32c_init);
+	return ~dma_crc32c_func(~crc, data, length);
+}
+
+const char *
+dma_crc32c_impl(void)
+{
+	pthread_once(&dma_crc32c_once, dma_crc32c_init);
+	return dma_crc32c_name;
+}
+
+/*
+ * dma_fill_pattern
+ *
+ * It fills the buffer with a pseudo random pattern; each 8 bytes depends
+ * only on the seed and its offset, so any part of the buffer can be
+ * rebuilt independently.
+ */
+void
+dma_fill_pattern(void *addr, size_t length, size_t offset, uint64_t seed)
+{
+	uint64_t   *p = addr;
+	size_t		i;
+
+	for (i=0; i < length / sizeof(uint64_t); i++)
+	{
+		/* splitmix64 of the position */
+		uint64_t	x = seed + (offset / sizeof(uint64_t) + i + 1) *
+			0x9e3779b97f4a7c15ULL;
+
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+		p[i] = x ^ (x >> 31);
+	}
+}
+
+/*
+ * dma_verifier
+ */
+struct dma_verifier
+{
+	char	   *addr;
+	size_t		length;
+	size_t		chunk_sz;
+	uint64_t	seed;
+	int			num_chunks;
+	uint32_t   *reference;		/* CRC32C of each chunk */
+	int			num_threads;
+	pthread_t  *threads;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int			next_chunk;		/* next chunk to be checked */
+	int			num_done;		/* chunks checked in this round */
+	int			shutdown;
+	/* statistics */
+	uint64_t	num_checked;
+	uint64_t	num_errors;
+	double		busy_time;		/* sec, sum of the workers */
+};
+
+static void *
+dma_verify_worker(void *private)
+{
+	dma_verifier *v = private;
+
+	pthread_mutex_lock(&v->lock);
+	for (;;)
+	{
+		int			index;
+		size_t		offset, length;
+		uint32_t	crc;
+		double		tv1, tv2;
+
+		while (v->next_chunk >= v->num_chunks && !v->shutdown)
+			pthread_cond_wait(&v->cond, &v->lock);
+		if (v->shutdown)
+			break;
+		index = v->next_chunk++;
+		pthread_mutex_unlock(&v->lock);
+
+		offset = (size_t) index * v->chunk_sz;
+		length = (offset + v->chunk_sz <= v->length
+				  ? v->chunk_sz : v->length - offset);
+		tv1 = dma_timer_now();
+		crc = dma_crc32c(0, v->addr + offset, length);
+		if (crc != v->reference[index])
+		{
+			fprintf(stderr, "verify: chunk %d (offset %zu) mismatch, "
+					"crc32c %08x expected %08x\n",
+					index, offset, crc, v->reference[index]);
+			dma_fill_pattern(v->addr + offset, length, offset, v->seed);
+		}
+		tv2 = dma_timer_now();
+
+		pthread_mutex_lock(&v->lock);
+		if (crc != v->reference[index])
+			v->num_errors++;
+		v->num_checked++;
+		v->busy_time += tv2 - tv1;
+		if (++v->num_done == v->num_chunks)
+			pthread_cond_broadcast(&v->cond);
+	}
+	pthread_mutex_unlock(&v->lock);
+
+	return NULL;
+}
+
+dma_verifier *
+dma_verify_create(int num_threads, char *addr, size_t length,
+				  size_t chunk_sz, uint64_t seed)
+{
+	dma_verifier *v;
+	int			i;
+
+	v = calloc(1, sizeof(dma_verifier));
+	if (!v)
+		goto out_of_memory;
+	v->addr = addr;
+	v->length = length;
+	v->chunk_sz = chunk_sz;
+	v->seed = seed;
+	v->num_chunks = (length + chunk_sz - 1) / chunk_sz;
+	v->reference = calloc(v->num_chunks, sizeof(uint32_t));
+	v->num_threads = num_threads;
+	v->threads = calloc(num_threads, sizeof(pthread_t));
+	if (!v->reference || !v->threads)
+		goto out_of_memory;
+
+	dma_fill_pattern(addr, length, 0, seed);
+	for (i=0; i < v->num_chunks; i++)
+	{
+		size_t	offset = (size_t) i * chunk_sz;
+
+		v->reference[i] = dma_crc32c(0, addr + offset,
+									 offset + chunk_sz <= length
+									 ? chunk_sz : length - offset);
+	}
+	/* no round is in progress */
+	v->next_chunk = v->num_chunks;
+	v->num_done = v->num_chunks;
+
+	pthread_mutex_init(&v->lock, NULL);
+	pthread_cond_init(&v->cond, NULL);
+	for (i=0; i < num_threads; i++)
+	{
+		if ((errno = pthread_create(&v->threads[i], NULL,
+									dma_verify_worker, v)) != 0)
+		{
+			fprintf(stderr, "failed on pthread_create : %s\n",
+					strerror(errno));
+			exit(1);
+		}
+	}
+	return v;
+
+out_of_memory:
+	fprintf(stderr, "out of memory\n");
+	exit(1);
+}
+
+void
+dma_verify_submit(dma_verifier *v)
+{
+	pthread_mutex_lock(&v->lock);
+	v->next_chunk = 0;
+	v->num_done = 0;
+	pthread_cond_broadcast(&v->cond);
+	pthread_mutex_unlock(&v->lock);
+}
+
+void
+dma_verify_wait(dma_verifier *v)
+{
+	pthread_mutex_lock(&v->lock);
+	while (v->num_done < v->num_chunks)
+		pthread_cond_wait(&v->cond, &v->lock);
+	pthread_mutex_unlock(&v->lock);
+}
+
+uint64_t
+dma_verify_errors(const dma_verifier *v)
+{
+	return v->num_errors;
+}
+
+void
+dma_verify_print(FILE *filp, const dma_verifier *v)
+{
+	double		total_mb = (double)(v->num_checked * v->chunk_sz) /
+		(double)(1UL << 20);
+
+	fprintf(filp, "verify:         %lu chunks, %lu errors, %s "
+			"%.2fMB/s per thread x %d\n",
+			v->num_checked, v->num_errors, dma_crc32c_impl(),
+			v->busy_time > 0.0 ? total_mb / v->busy_time : 0.0,
+			v->num_threads);
+}
+
+void
+dma_verify_destroy(dma_verifier *v)
+{
+	int			i;
+
+	pthread_mutex_lock(&v->lock);
+	v->shutdown = 1;
+	pthread_cond_broadcast(&v->cond);
+	pthread_mutex_unlock(&v->lock);
+	for (i=0; i < v->num_threads; i++)
+		pthread_join(v->threads[i], NULL);
+	pthread_mutex_destroy(&v->lock);
+	pthread_cond_destroy(&v->cond);
+	free(v->reference);
+	free(v->threads);
+	free(v);
+}
+
+/*
+ * dma_sg_blocks
+ *
+ * It builds the list of block numbers less than max_blocks by the pattern;
+ * count is ignored if the list is read from a file. Returns number of the
+ * blocks, or -1 on error.
+ */
+static inline uint64_t
+dma_sg_random(uint64_t *state)
+{
+	uint64_t	x = (*state += 0x9e3779b97f4a7c15ULL);
+
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+int
+dma_sg_blocks(const char *pattern, uint32_t max_blocks,
+			  int count, uint32_t **p_blocks)
+{
+	uint32_t   *blocks;
+	uint64_t	state = DMA_SG_SEED;
+	int			i;
+
+	if (max_blocks == 0)
+		return -1;
+	if (strcmp(pattern, "random") == 0 ||
+		strcmp(pattern, "clustered") == 0)
+	{
+		int		cluster = (strcmp(pattern, "random") == 0
+						   ? 1 : DMA_SG_CLUSTER);
+
+		blocks = malloc(sizeof(uint32_t) * count);
+		if (!blocks)
+			return -1;
+		for (i=0; i < count; i++)
+		{
+			if (i % cluster == 0)
+				blocks[i] = dma_sg_random(&state) % max_blocks;
+			else
+				blocks[i] = (blocks[i-1] + 1) % max_blocks;
+		}
+	}
+	else
+	{
+		FILE	   *filp = fopen(pattern, "r");
+		int			nrooms = 1024;
+		unsigned long blkno;
+
+		if (!filp)
+			return -1;
+		blocks = malloc(sizeof(uint32_t) * nrooms);
+		if (!blocks)
+		{
+			fclose(filp);
+			return -1;
+		}
+		count = 0;
+		while (fscanf(filp, "%lu", &blkno) == 1)
+		{
+			if (blkno >= max_blocks)
+			{
+				fclose(filp);
+				free(blocks);
+				errno = ERANGE;
+				return -1;
+			}
+			if (count == nrooms)
+			{
+				uint32_t   *temp;
+
+				nrooms *= 2;
+				temp = realloc(blocks, sizeof(uint32_t) * nrooms);
+				if (!temp)
+				{
+					fclose(filp);
+					free(blocks);
+					return -1;
+				}
+				blocks = temp;
+			}
+			blocks[count++] = blkno;
+		}
+		if (!feof(filp) || count == 0)
+		{
+			fclose(filp);
+			free(blocks);
+			errno = EINVAL;
+			return -1;
+		}
+		fclose(filp);
+	}
+	*p_blocks = blocks;
+
+	return count;
+}
+
+/*
+ * dma_sg_pool
+ *
+ * Workers pick DMA_SG_GRAIN blocks at once from the current batch, and
+ * copy them into the consecutive slots of the staging buffer. Unlike the
+ * verifier, it never exits the process on errors, because it is also used
+ * inside of the PostgreSQL backend.
+ */
+#define DMA_SG_GRAIN			16
+
+struct dma_sg_pool
+{
+	int			num_threads;
+	pthread_t  *threads;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* current batch */
+	char	   *dst;
+	const char *src;
+	const uint32_t *blocks;
+	size_t		block_sz;
+	int			count;
+	int			next;			/* next block to be copied */
+	int			num_done;		/* blocks copied in this batch */
+	int			shutdown;
+};
+
+static void *
+dma_sg_worker(void *private)
+{
+	dma_sg_pool *pool = private;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;)
+	{
+		int			i, head, tail;
+
+		while (pool->next >= pool->count && !pool->shutdown)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		if (pool->shutdown)
+			break;
+		head = pool->next;
+		tail = (head + DMA_SG_GRAIN < pool->count
+				? head + DMA_SG_GRAIN : pool->count);
+		pool->next = tail;
+		pthread_mutex_unlock(&pool->lock);
+
+		for (i=head; i < tail; i++)
+			memcpy(pool->dst + (size_t) i * pool->block_sz,
+				   pool->src + (size_t) pool->blocks[i] * pool->block_sz,
+				   pool->block_sz);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->num_done += tail - head;
+		if (pool->num_done == pool->count)
+			pthread_cond_broadcast(&pool->cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+static void
+dma_sg_stop(dma_sg_pool *pool, int num_threads)
+{
+	int			i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+	for (i=0; i < num_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->cond);
+	free(pool->threads);
+	free(pool);
+}
+
+/* returns NULL with errno on failure */
+dma_sg_pool *
+dma_sg_pool_create(int num_threads)
+{
+	dma_sg_pool *pool;
+	int			i, rc;
+
+	pool = calloc(1, sizeof(dma_sg_pool));
+	if (!pool)
+		return NULL;
+	pool->threads = calloc(num_threads, sizeof(pthread_t));
+	if (!pool->threads)
+	{
+		free(pool);
+		return NULL;
+	}
+	pool->num_threads = num_threads;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	for (i=0; i < num_threads; i++)
+	{
+		rc = pthread_create(&pool->threads[i], NULL, dma_sg_worker, pool);
+		if (rc != 0)
+		{
+			dma_sg_stop(pool, i);
+			errno = rc;
+			return NULL;
+		}
+	}
+	return pool;
+}
+
+/*
+ * dma_sg_gather
+ *
+ * It copies the count blocks of src into dst, then returns once all the
+ * blocks are copied.
+ */
+void
+dma_sg_gather(dma_sg_pool *pool, char *dst, const char *src,
+			  const uint32_t *blocks, int count, size_t block_sz)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->dst = dst;
+	pool->src = src;
+	pool->blocks = blocks;
+	pool->block_sz = block_sz;
+	pool->count = count;
+	pool->next = 0;
+	pool->num_done = 0;
+	pthread_cond_broadcast(&pool->cond);
+	while (pool->num_done < count)
+		pthread_cond_wait(&pool->cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void
+dma_sg_pool_destroy(dma_sg_pool *pool)
+{
+	dma_sg_stop(pool, pool->num_threads);
+}
+
+/*
+ * dma_sg_print
+ *
+ * It prints blocks/sec and bandwidth of each scatter-gather strategy.
+ */
+void
+dma_sg_print(FILE *filp, const dma_sg_result *results, int count,
+			 size_t block_sz)
+{
+	int			i;
+
+	fprintf(filp, "%-16s %8s %14s %12s\n",
+			"strategy", "batch", "blocks/sec", "speed[MB/s]");
+	for (i=0; i < count; i++)
+	{
+		const dma_sg_result *sr = &results[i];
+
+		fprintf(filp, "%-16s %8d %14.0f %12.2f\n",
+				sr->label, sr->batch,
+				(double) sr->count / sr->elapsed,
+				(double)(sr->count * block_sz) /
+				(double)(1UL << 20) / sr->elapsed);
+	}
+}
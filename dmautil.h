@@ -0,0 +1,468 @@
+/*
+ * dmautil.h - common routines for DMA benchmark tools (gpudma, cudadma)
+ */
+#ifndef DMAUTIL_H
+#define DMAUTIL_H
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Log-bucketed latency histogram (HDR-style)
+ *
+ * Each power-of-two range of nanoseconds is split into DMA_HIST_SUB_BUCKETS
+ * linear sub-buckets, so relative error of the percentiles is bounded by
+ * 1/DMA_HIST_SUB_BUCKETS regardless of the magnitude. The histogram has
+ * fixed size; recording a value never allocates memory.
+ */
+#define DMA_HIST_SUB_BITS		5
+#define DMA_HIST_SUB_BUCKETS	(1 << DMA_HIST_SUB_BITS)
+#define DMA_HIST_NBUCKETS		((64 - DMA_HIST_SUB_BITS + 1) * \
+								 DMA_HIST_SUB_BUCKETS)
+
+typedef struct {
+	uint64_t	count;
+	uint64_t	min;			/* nsec */
+	uint64_t	max;			/* nsec */
+	double		sum;			/* nsec */
+	uint64_t	buckets[DMA_HIST_NBUCKETS];
+} dma_histogram;
+
+extern void		dma_histogram_init(dma_histogram *hist);
+extern void		dma_histogram_add(dma_histogram *hist, uint64_t nsec);
+extern uint64_t	dma_histogram_percentile(const dma_histogram *hist,
+										 double percent);
+extern void		dma_histogram_merge(dma_histogram *dst,
+									const dma_histogram *src);
+extern void		dma_histogram_print(FILE *filp, const char *label,
+									const dma_histogram *hist);
+
+/*
+ * Result of a measurement with a particular chunk size
+ */
+typedef struct {
+	size_t		chunk_size;
+	size_t		total_size;		/* bytes transferred per direction */
+	double		elapsed;		/* sec */
+	dma_histogram h2d;
+	dma_histogram d2h;
+} dma_result;
+
+/*
+ * Statistics of the repeated runs
+ *
+ * Outliers are rejected by the modified Z-score (median and MAD), then
+ * mean, stddev and 95% confidence interval of the mean (Student's t) are
+ * computed on the remaining values.
+ */
+#define DMA_STATS_MIN_RUNS		3		/* min runs for early stop */
+#define DMA_STATS_OUTLIER_Z		3.5		/* threshold of modified Z-score */
+
+typedef struct {
+	int			count;			/* number of values, except for outliers */
+	int			num_outliers;
+	double		mean;
+	double		median;
+	double		stddev;
+	double		ci95;			/* half width of 95% CI of the mean */
+	double		min;
+	double		max;
+} dma_stats;
+
+extern void		dma_stats_compute(const double *values, int count,
+								  dma_stats *stats);
+extern void		dma_stats_print(FILE *filp, const char *label,
+								const char *unit, const dma_stats *stats);
+
+/*
+ * Chunk size sweep
+ */
+#define DMA_SWEEP_MIN_SIZE		(4UL << 10)		/* 4KB */
+
+#define DMA_FORMAT_CSV			0
+#define DMA_FORMAT_JSON			1
+
+extern int		dma_parse_size(const char *str, size_t *p_size);
+extern int		dma_sweep_points(size_t max_size, const char *custom,
+								 size_t **p_points);
+extern void		dma_sweep_print(FILE *filp, int format,
+								const dma_result *res,
+								int index, int count);
+
+/*
+ * Small transfer overhead
+ *
+ * For tiny transfers the fixed cost per call dominates. The driver issues
+ * an asynchronous copy of a given size from the host buffer; calls/sec is
+ * measured on back-to-back calls, and completion latency on calls waited
+ * one by one.
+ */
+#define DMA_OPS_SIZES			"4,8,16,32,64,128,256,512,1k,2k,4k,8k,16k,32k,64k"
+#define DMA_OPS_NUM_CALLS		10000
+
+typedef struct {
+	const char *name;
+	void	   *private;
+	/* enqueues an asynchronous copy of length bytes to the device */
+	void	  (*submit)(void *private, size_t length);
+	/* waits for completion of all the enqueued copies */
+	void	  (*sync)(void *private);
+} dma_ops_driver;
+
+typedef struct {
+	size_t		size;			/* bytes per call */
+	int			num_calls;
+	double		elapsed;		/* sec, back-to-back calls until completion */
+	dma_histogram enqueue;		/* time spent inside the API call */
+	dma_histogram completion;	/* submit until completion, one by one */
+} dma_ops_result;
+
+extern int		dma_parse_sizes(const char *str, size_t max_size,
+								size_t **p_points);
+extern void		dma_ops_measure(const dma_ops_driver *driver, size_t size,
+								int num_calls, dma_ops_result *res);
+extern void		dma_ops_print(FILE *filp, int format,
+							  const dma_ops_result *res,
+							  int index, int count);
+
+/*
+ * Strided transfer
+ *
+ * rows elements of width bytes are extracted from the host buffer with
+ * row pitch, into a contiguous device buffer. The tools compare the 2D DMA
+ * of the driver, a host gather into a pinned buffer plus a 1D copy, and a
+ * copy per row.
+ */
+#define DMA_STRIDED_ROWS		16384	/* default number of rows */
+#define DMA_GATHER_PREFETCH		16		/* rows to prefetch ahead */
+
+typedef struct {
+	size_t		width;			/* bytes of an element */
+	size_t		pitch;			/* bytes between the elements */
+	size_t		rows;
+	double		rect_time;		/* sec, 2D DMA */
+	double		gather_time;	/* sec, host gather only */
+	double		gather_copy_time; /* sec, host gather + 1D copy */
+	double		small_time;		/* sec, a copy per row */
+} dma_strided_result;
+
+extern int		dma_parse_strided(const char *str, size_t *p_width,
+								  size_t *p_pitch, size_t *p_rows);
+extern void		dma_gather(void *dst, const void *src, size_t width,
+						   size_t pitch, size_t rows);
+extern void		dma_strided_print(FILE *filp, const dma_strided_result *res,
+								  int ntrials);
+
+/*
+ * Host memory allocation strategies
+ *
+ * Allocation, first touch and pinning are done in this module; the
+ * GPU specific part (registration or allocation of page-locked memory)
+ * is supplied by the tool as a dma_host_driver.
+ */
+#define DMA_HOSTMEM_MALLOC		0	/* malloc, pageable */
+#define DMA_HOSTMEM_REGISTER	1	/* posix_memalign + driver registration */
+#define DMA_HOSTMEM_PINNED		2	/* page-locked memory by the driver */
+#define DMA_HOSTMEM_HUGETLB		3	/* mmap(MAP_HUGETLB) + registration */
+#define DMA_HOSTMEM_THP			4	/* mmap + MADV_HUGEPAGE + registration */
+#define DMA_HOSTMEM_MLOCK		5	/* posix_memalign + mlock, no driver */
+#define DMA_HOSTMEM_NUM_METHODS	6
+
+typedef struct {
+	const char *name;
+	void	   *private;
+	/* registers / unregisters host memory; returns driver's handle */
+	void	 *(*mem_register)(void *private, void *addr, size_t length);
+	void	  (*mem_unregister)(void *private, void *addr, size_t length,
+								void *handle);
+	/* allocates / releases page-locked memory */
+	void	 *(*mem_alloc)(void *private, size_t length, void **p_handle);
+	void	  (*mem_free)(void *private, void *addr, size_t length,
+						  void *handle);
+} dma_host_driver;
+
+typedef struct {
+	int			method;
+	int			numa_node;		/* node of the first page, or -1 */
+	char	   *addr;
+	size_t		length;			/* requested length */
+	size_t		mapped;			/* length of mmap, if any */
+	void	   *handle;			/* handle of the driver, if any */
+	double		alloc_time;		/* sec, allocation + first touch */
+	double		pin_time;		/* sec, registration */
+	long		minflt;			/* minor page faults on first touch */
+	long		majflt;			/* major page faults on first touch */
+} dma_hostmem;
+
+extern const char *dma_hostmem_names[DMA_HOSTMEM_NUM_METHODS];
+extern const dma_host_driver dma_host_stub_driver;
+
+extern double	dma_timer_now(void);
+extern int		dma_hostmem_parse(const char *str, unsigned int *p_mask);
+extern int		dma_hostmem_alloc(dma_hostmem *hmem, int method,
+								  size_t length, int numa_node,
+								  const dma_host_driver *driver);
+extern void		dma_hostmem_free(dma_hostmem *hmem,
+								 const dma_host_driver *driver);
+extern void		dma_hostmem_print(FILE *filp, const dma_hostmem *hmem,
+								  const dma_result *res, int index);
+extern void		dma_hostmem_stub(FILE *filp, unsigned int methods,
+								 size_t length, size_t chunk_sz,
+								 int num_trial);
+
+/*
+ * NUMA and CPU affinity
+ */
+#define DMA_MAX_IDS				64
+
+extern int		dma_parse_idlist(const char *str, int max_id,
+								 uint64_t *p_mask);
+extern int		dma_parse_cpulist(const char *str, cpu_set_t *cpuset);
+extern int		dma_numa_num_nodes(void);
+extern int		dma_numa_node_cpus(int node, cpu_set_t *cpuset);
+extern int		dma_numa_set_policy(int node);
+extern int		dma_numa_addr_node(void *addr);
+extern int		dma_pci_numa_node(const char *pci_busid);
+extern int		dma_bind_cpus(const cpu_set_t *cpuset);
+extern const char *dma_numa_placement(int host_node, int device_node);
+extern void		dma_print_matrix(FILE *filp, const char *title,
+								 const char *row_label, int nrows,
+								 const int *row_ids,
+								 const char *col_label, int ncols,
+								 const int *col_ids,
+								 const double *values,
+								 const char *marks);
+
+/*
+ * Device to device copy (P2P)
+ *
+ * Devices are identified by index (0..ndevs-1) of the driver; the driver
+ * owns the buffers of each device, and the matrix logic is in this module.
+ */
+#define DMA_P2P_LATENCY_SIZE	4		/* bytes, for latency measurement */
+
+typedef struct {
+	const char *name;
+	void	   *private;
+	/* returns non-zero, if src can access dst directly */
+	int		  (*can_access_peer)(void *private, int src, int dst);
+	/* copies length bytes from src to dst count times, then waits for it */
+	void	  (*copy)(void *private, int dst, int src,
+					  size_t length, int count, int staged);
+} dma_p2p_driver;
+
+extern void		dma_p2p_stub_init(dma_p2p_driver *driver,
+								  int ndevs, size_t length);
+extern void		dma_p2p_stub_cleanup(dma_p2p_driver *driver);
+extern void		dma_p2p_matrix(FILE *filp, const dma_p2p_driver *driver,
+							   int ndevs, const int *dev_ids,
+							   size_t length, int ntrials);
+
+/*
+ * Storage to device streaming
+ *
+ * A reader thread reads the file into a ring of chunks (with O_DIRECT, if
+ * possible), and the caller's thread sends the filled chunks to the device
+ * buffer by the driver, so the reads are overlapped with the DMA.
+ */
+#define DMA_STREAM_NUM_SLOTS	4		/* default number of ring slots */
+#define DMA_STREAM_CHUNK_SIZE	(4UL << 20)	/* default chunk size, 4MB */
+#define DMA_STREAM_ALIGN		4096	/* alignment of chunks for O_DIRECT */
+
+typedef struct {
+	const char *name;
+	void	   *private;
+	/* enqueues the copy of the slot to the device buffer at offset */
+	void	  (*submit)(void *private, int slot, void *addr,
+						size_t length, size_t offset);
+	/* waits for the copy of the slot; returns nsec consumed by the copy */
+	uint64_t  (*wait)(void *private, int slot);
+} dma_stream_driver;
+
+typedef struct {
+	size_t		total_size;		/* bytes read and sent */
+	size_t		chunk_size;
+	int			num_slots;
+	int			direct_io;		/* O_DIRECT was used */
+	double		elapsed;		/* sec, end-to-end */
+	double		read_time;		/* sec, spent in read(2) */
+	double		dma_time;		/* sec, spent by the copies */
+	double		read_stall;		/* sec, reader waited for free slots */
+	double		dma_stall;		/* sec, DMA waited for filled slots */
+} dma_stream_result;
+
+extern int		dma_stream_file(const char *filename, char *ring,
+								size_t chunk_sz, int num_slots,
+								size_t device_size,
+								const dma_stream_driver *driver,
+								dma_stream_result *res);
+extern void		dma_stream_print(FILE *filp, const char *filename,
+								 const dma_stream_result *res);
+extern int		dma_stream_stub(FILE *filp, const char *filename,
+								size_t chunk_sz, int num_slots,
+								size_t device_size);
+
+/*
+ * Zero-copy access vs explicit copy
+ *
+ * A kernel reads a fraction of the buffer by DMA_ZEROCOPY_BLOCK_SIZE
+ * blocks; the blocks are selected by hash of the block index, so they are
+ * scattered over the buffer. The threshold argument of the kernel is
+ * the fraction in per mille.
+ */
+#define DMA_ZEROCOPY_BLOCK_SIZE		128
+#define DMA_ZEROCOPY_FRACTIONS		"1,2,5,10,20,50,100"
+
+typedef struct {
+	double		fraction;		/* percent of the buffer read */
+	double		zerocopy_time;	/* sec, kernel on the host memory */
+	double		copy_time;		/* sec, copy of the buffer */
+	double		kernel_time;	/* sec, kernel on the device memory */
+} dma_zerocopy_result;
+
+extern int		dma_parse_fractions(const char *str, double **p_fractions);
+extern void		dma_zerocopy_print(FILE *filp,
+								   const dma_zerocopy_result *results,
+								   int count, size_t buffer_size,
+								   int ntrials);
+
+/*
+ * Round-trip data verification
+ *
+ * The host buffer is filled with a seeded pattern, and CRC32C of each
+ * chunk is kept as the reference. Once the buffer is read back from the
+ * device, dma_verify_submit() lets the worker threads checksum the chunks
+ * while the next transfers are running; dma_verify_wait() must be called
+ * before the buffer is overwritten again. A corrupted chunk is reported,
+ * then restored from the pattern.
+ */
+#define DMA_VERIFY_SEED			0x5eed5eedUL
+#define DMA_VERIFY_THREADS		2		/* default number of workers */
+
+typedef struct dma_verifier dma_verifier;
+
+extern uint32_t	dma_crc32c(uint32_t crc, const void *data, size_t length);
+extern const char *dma_crc32c_impl(void);
+extern void		dma_fill_pattern(void *addr, size_t length, size_t offset,
+								 uint64_t seed);
+extern dma_verifier *dma_verify_create(int num_threads, char *addr,
+									   size_t length, size_t chunk_sz,
+									   uint64_t seed);
+extern void		dma_verify_submit(dma_verifier *v);
+extern void		dma_verify_wait(dma_verifier *v);
+extern void		dma_verify_print(FILE *filp, const dma_verifier *v);
+extern uint64_t	dma_verify_errors(const dma_verifier *v);
+extern void		dma_verify_destroy(dma_verifier *v);
+
+/*
+ * Scatter-gather of blocks
+ *
+ * A list of block numbers is built by the pattern: "random", "clustered"
+ * (runs of DMA_SG_CLUSTER consecutive blocks at random positions), or
+ * name of a file with a block number per line. The gather pool packs the
+ * listed blocks into a staging buffer by the worker threads, so a batch of
+ * scattered blocks can be sent by a single DMA.
+ */
+#define DMA_SG_BLOCK_SIZE		8192	/* BLCKSZ of PostgreSQL */
+#define DMA_SG_NUM_BLOCKS		65536	/* default number of blocks */
+#define DMA_SG_CLUSTER			16		/* blocks per cluster */
+#define DMA_SG_BATCHES			"16,64,256,1024"
+#define DMA_SG_THREADS			4		/* default number of workers */
+#define DMA_SG_SEED				0x5ca77e12UL
+
+/*
+ * OpenCL kernel to gather the blocks on the device; each work-item copies
+ * 16 bytes. BLOCK_UNITS (block size / 16) shall be given at the build.
+ */
+#define DMA_SG_GATHER_OPENCL									\
+	"__kernel void\n"											\
+	"sg_gather(__global const uint4 *src,\n"					\
+	"          __global const uint *blocks,\n"					\
+	"          uint base,\n"									\
+	"          uint nblocks,\n"									\
+	"          __global uint4 *dst)\n"							\
+	"{\n"														\
+	"  size_t  i = get_global_id(0) / BLOCK_UNITS;\n"			\
+	"  size_t  j = get_global_id(0) % BLOCK_UNITS;\n"			\
+	"\n"														\
+	"  if (i >= nblocks)\n"										\
+	"    return;\n"												\
+	"  dst[i * BLOCK_UNITS + j] =\n"							\
+	"    src[(size_t)blocks[base + i] * BLOCK_UNITS + j];\n"	\
+	"}\n"
+
+/*
+ * PTX of the same kernel for CUDA, to avoid dependency on nvcc or nvrtc;
+ * block size / 16 is given as the units argument, instead of BLOCK_UNITS.
+ * A thread copies the 16 bytes at dst[gid].
+ */
+#define DMA_SG_GATHER_PTX										\
+	".version 4.0\n"											\
+	".target sm_30\n"											\
+	".address_size 64\n"										\
+	"\n"														\
+	".visible .entry sg_gather(\n"								\
+	"  .param .u64 param_src,\n"								\
+	"  .param .u64 param_blocks,\n"								\
+	"  .param .u32 param_base,\n"								\
+	"  .param .u32 param_nblocks,\n"							\
+	"  .param .u32 param_units,\n"								\
+	"  .param .u64 param_dst)\n"								\
+	"{\n"														\
+	"  .reg .pred %p<2>;\n"										\
+	"  .reg .b32 %r<16>;\n"										\
+	"  .reg .b64 %rd<12>;\n"									\
+	"\n"														\
+	"  ld.param.u64 %rd1, [param_src];\n"						\
+	"  ld.param.u64 %rd2, [param_blocks];\n"					\
+	"  ld.param.u32 %r1, [param_base];\n"						\
+	"  ld.param.u32 %r2, [param_nblocks];\n"					\
+	"  ld.param.u32 %r3, [param_units];\n"						\
+	"  ld.param.u64 %rd3, [param_dst];\n"						\
+	"  mov.u32 %r4, %ctaid.x;\n"								\
+	"  mov.u32 %r5, %ntid.x;\n"									\
+	"  mov.u32 %r6, %tid.x;\n"									\
+	"  mad.lo.u32 %r7, %r4, %r5, %r6;\n"						\
+	"  div.u32 %r8, %r7, %r3;\n"								\
+	"  rem.u32 %r9, %r7, %r3;\n"								\
+	"  setp.ge.u32 %p1, %r8, %r2;\n"							\
+	"  @%p1 bra DONE;\n"										\
+	"  add.u32 %r10, %r1, %r8;\n"								\
+	"  mul.wide.u32 %rd4, %r10, 4;\n"							\
+	"  add.u64 %rd5, %rd2, %rd4;\n"								\
+	"  ld.global.u32 %r11, [%rd5];\n"							\
+	"  mul.wide.u32 %rd6, %r11, %r3;\n"							\
+	"  cvt.u64.u32 %rd7, %r9;\n"								\
+	"  add.u64 %rd6, %rd6, %rd7;\n"								\
+	"  shl.b64 %rd6, %rd6, 4;\n"								\
+	"  add.u64 %rd8, %rd1, %rd6;\n"								\
+	"  ld.global.v4.u32 {%r12, %r13, %r14, %r15}, [%rd8];\n"	\
+	"  cvt.u64.u32 %rd9, %r7;\n"								\
+	"  shl.b64 %rd9, %rd9, 4;\n"								\
+	"  add.u64 %rd10, %rd3, %rd9;\n"							\
+	"  st.global.v4.u32 [%rd10], {%r12, %r13, %r14, %r15};\n"	\
+	"DONE:\n"													\
+	"  ret;\n"													\
+	"}\n"
+
+typedef struct {
+	const char *label;			/* strategy */
+	int			batch;			/* blocks per DMA or kernel call */
+	size_t		count;			/* blocks sent */
+	double		elapsed;		/* sec */
+} dma_sg_result;
+
+typedef struct dma_sg_pool dma_sg_pool;
+
+extern int		dma_sg_blocks(const char *pattern, uint32_t max_blocks,
+							  int count, uint32_t **p_blocks);
+extern dma_sg_pool *dma_sg_pool_create(int num_threads);
+extern void		dma_sg_gather(dma_sg_pool *pool, char *dst, const char *src,
+							  const uint32_t *blocks, int count,
+							  size_t block_sz);
+extern void		dma_sg_pool_destroy(dma_sg_pool *pool);
+extern void		dma_sg_print(FILE *filp, const dma_sg_result *results,
+							 int count, size_t block_sz);
+
+#endif	/* DMAUTIL_H */
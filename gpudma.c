@@ -1,14 +1,19 @@
 /*
  * gpudma - test for DMA transfer
  */
+#define _GNU_SOURCE
 #include <errno.h>
+#include <getopt.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <unistd.h>
 #include <CL/cl.h>
+#include <CL/cl_ext.h>
+#include "dmautil.h"
 
 #define lengthof(array) (sizeof (array) / sizeof ((array)[0]))
 #define error_exit(fmt,...)					\
@@ -27,116 +32,2047 @@ static cl_bool	is_blocking = CL_TRUE;
 static cl_int	num_trial = 100;			/* 100 times */
 static size_t	buffer_size = 128 << 20;	/* 128MB */
 static size_t	chunk_size = 0;
+static cl_int	num_queues = 0;				/* pipeline mode, if > 0 */
+static int		sweep_mode = 0;
+static char	   *sweep_points = NULL;		/* custom sweep points */
+static int		sweep_format = DMA_FORMAT_CSV;
+static int		ops_mode = 0;
+static char	   *ops_sizes = DMA_OPS_SIZES;	/* sizes of small transfers */
+static size_t	strided_width = 0;			/* --strided, if > 0 */
+static size_t	strided_pitch = 0;
+static size_t	strided_rows = 0;
+static const char *sg_pattern = NULL;		/* --scatter */
+static unsigned int host_methods = 0;		/* mask of DMA_HOSTMEM_* */
+static int		numa_node = -1;				/* node of host buffer, if >= 0 */
+static int		device_numa_node = -1;		/* node of the current device */
+static int		cpus_bound = 0;				/* CPU set is given by -C */
+static int		num_warmup = 1;				/* warm-up runs */
+static int		max_runs = 1;				/* measured runs */
+static double	ci_target = 0.0;			/* early stop by CI, in percent */
+static int		verify_threads = 0;			/* --verify, if > 0 */
+static dma_verifier *verifier = NULL;		/* round-trip verification */
+static int		submit_threads = 0;			/* -T, if > 0 */
+static int		shared_queue = 0;			/* -T with a single queue */
+static int		parallel_mode = 0;			/* run devices concurrently */
+static const char *filename = NULL;		/* storage to device streaming */
+static int		num_slots = DMA_STREAM_NUM_SLOTS;
+static int		is_zerocopy = 0;
+static const char *zerocopy_fractions = DMA_ZEROCOPY_FRACTIONS;
+
+/* start and end of the command in nsec of the device, by event profiling */
+static void
+event_timestamps(cl_event event, cl_ulong *p_start, cl_ulong *p_end)
+{
+	cl_int		rc;
+
+	rc = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START,
+								 sizeof(cl_ulong), p_start, NULL);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clGetEventProfilingInfo (%s)",
+				   opencl_strerror(rc));
+	rc = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END,
+								 sizeof(cl_ulong), p_end, NULL);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clGetEventProfilingInfo (%s)",
+				   opencl_strerror(rc));
+}
+
+/* elapsed time of the command in nsec, by event profiling */
+static uint64_t
+event_duration(cl_event event)
+{
+	cl_ulong	tv1, tv2;
+
+	event_timestamps(event, &tv1, &tv2);
+	return tv2 - tv1;
+}
+
+/*
+ * Host and device buffers being used for the send/recv test; they are
+ * allocated once, then reused for each measurement.
+ */
+typedef struct {
+	cl_context	context;
+	cl_command_queue cmdq;
+	char	   *hmem;
+	cl_mem		dmem;
+	dma_hostmem	hostmem;
+	dma_host_driver driver;
+} dma_buffer;
+
+/*
+ * NUMA node of the device, if PCI location is available by the extension
+ */
+static int
+opencl_device_numa_node(cl_device_id device)
+{
+#if defined(CL_DEVICE_PCI_BUS_ID_NV) && defined(CL_DEVICE_PCI_SLOT_ID_NV)
+	cl_uint		bus_id;
+	cl_uint		slot_id;
+	char		busid[64];
+
+	if (clGetDeviceInfo(device, CL_DEVICE_PCI_BUS_ID_NV,
+						sizeof(cl_uint), &bus_id, NULL) != CL_SUCCESS ||
+		clGetDeviceInfo(device, CL_DEVICE_PCI_SLOT_ID_NV,
+						sizeof(cl_uint), &slot_id, NULL) != CL_SUCCESS)
+		return -1;
+	snprintf(busid, sizeof(busid), "0000:%02x:%02x.0", bus_id, slot_id);
+	return dma_pci_numa_node(busid);
+#else
+	return -1;
+#endif
+}
+
+/*
+ * bind_node_cpus
+ *
+ * It binds the current thread to the CPUs of the NUMA node, unless CPU set
+ * is explicitly given by -C.
+ */
+static void
+bind_node_cpus(int node)
+{
+	cpu_set_t	cpuset;
+
+	if (cpus_bound || node < 0)
+		return;
+	if (dma_numa_node_cpus(node, &cpuset) != 0)
+		error_exit("failed to get CPUs of NUMA node %d", node);
+	if (dma_bind_cpus(&cpuset) != 0)
+		error_exit("failed on sched_setaffinity (%s)", strerror(errno));
+}
+
+/*
+ * open_device - constructs an OpenCL context and command queue
+ */
+static void
+open_device(cl_device_id device, char *namebuf, size_t namebuf_sz,
+			cl_context *p_context, cl_command_queue *p_cmdq)
+{
+	cl_int		rc;
+
+	/* Get name of opencl device */
+	rc = clGetDeviceInfo(device,
+						 CL_DEVICE_NAME,
+						 namebuf_sz, namebuf, NULL);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clGetDeviceInfo (%s)", opencl_strerror(rc));
+
+	/* Construct an OpenCL context */
+	*p_context = clCreateContext(NULL,
+								 1,
+								 &device,
+								 NULL,
+								 NULL,
+								 &rc);
+	if (rc != CL_SUCCESS)
+		error_exit("failed to create an opencl context (%s)",
+				   opencl_strerror(rc));
+
+	/* Construct an OpenCL command queue */
+	*p_cmdq = clCreateCommandQueue(*p_context,
+								   device,
+								   CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE |
+								   CL_QUEUE_PROFILING_ENABLE,
+								   &rc);
+	if (rc != CL_SUCCESS)
+		error_exit("failed to create an opencl command queue (%s)",
+				   opencl_strerror(rc));
+}
+
+/* host memory allocation strategy, if not specified by -a */
+static int
+default_host_method(void)
+{
+	return (is_blocking ? DMA_HOSTMEM_MALLOC : DMA_HOSTMEM_REGISTER);
+}
+
+/*
+ * Host memory driver for OpenCL; registration of host memory is
+ * a buffer object with CL_MEM_USE_HOST_PTR, and page-locked memory
+ * is a mapped buffer object with CL_MEM_ALLOC_HOST_PTR.
+ */
+static void *
+opencl_mem_register(void *private, void *addr, size_t length)
+{
+	dma_buffer *dbuf = private;
+	cl_mem		pinned;
+	cl_int		rc;
+
+	pinned = clCreateBuffer(dbuf->context,
+							CL_MEM_READ_WRITE |
+							CL_MEM_USE_HOST_PTR,
+							length,
+							addr,
+							&rc);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clCreateBuffer(size=%lu) (%s)",
+				   length, opencl_strerror(rc));
+	return pinned;
+}
+
+static void
+opencl_mem_unregister(void *private, void *addr, size_t length, void *handle)
+{
+	clReleaseMemObject((cl_mem) handle);
+}
+
+static void *
+opencl_mem_alloc(void *private, size_t length, void **p_handle)
+{
+	dma_buffer *dbuf = private;
+	cl_mem		pinned;
+	void	   *addr;
+	cl_int		rc;
+
+	pinned = clCreateBuffer(dbuf->context,
+							CL_MEM_READ_WRITE |
+							CL_MEM_ALLOC_HOST_PTR,
+							length,
+							NULL,
+							&rc);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clCreateBuffer(size=%lu) (%s)",
+				   length, opencl_strerror(rc));
+
+	addr = clEnqueueMapBuffer(dbuf->cmdq,
+							  pinned,
+							  CL_TRUE,
+							  CL_MAP_READ | CL_MAP_WRITE,
+							  0,
+							  length,
+							  0,
+							  NULL,
+							  NULL,
+							  &rc);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clEnqueueMapBuffer (%s)", opencl_strerror(rc));
+	*p_handle = pinned;
+
+	return addr;
+}
+
+static void
+opencl_mem_free(void *private, void *addr, size_t length, void *handle)
+{
+	dma_buffer *dbuf = private;
+
+	clEnqueueUnmapMemObject(dbuf->cmdq, (cl_mem) handle, addr, 0, NULL, NULL);
+	clFinish(dbuf->cmdq);
+	clReleaseMemObject((cl_mem) handle);
+}
+
+static void
+init_host_driver(dma_buffer *dbuf, cl_context context, cl_command_queue cmdq)
+{
+	memset(dbuf, 0, sizeof(dma_buffer));
+	dbuf->context = context;
+	dbuf->cmdq = cmdq;
+	dbuf->driver.name = "opencl";
+	dbuf->driver.private = dbuf;
+	dbuf->driver.mem_register = opencl_mem_register;
+	dbuf->driver.mem_unregister = opencl_mem_unregister;
+	dbuf->driver.mem_alloc = opencl_mem_alloc;
+	dbuf->driver.mem_free = opencl_mem_free;
+}
+
+/*
+ * setup_buffer
+ *
+ * It allocates host buffer according to the strategy, and device buffer.
+ * Returns 0 on success, or -1 if the strategy is not available.
+ */
+static int
+setup_buffer(dma_buffer *dbuf, cl_context context, cl_command_queue cmdq,
+			 int method)
+{
+	cl_int		rc;
+
+	init_host_driver(dbuf, context, cmdq);
+	if (dma_hostmem_alloc(&dbuf->hostmem, method, buffer_size,
+						  numa_node, &dbuf->driver) != 0)
+		return -1;
+	dbuf->hmem = dbuf->hostmem.addr;
+
+	dbuf->dmem = clCreateBuffer(context,
+								CL_MEM_READ_WRITE,
+								buffer_size,
+								NULL,
+								&rc);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clCreateBuffer(size=%lu) (%s)",
+				   buffer_size, opencl_strerror(rc));
+	return 0;
+}
+
+static void
+release_buffer(dma_buffer *dbuf)
+{
+	clReleaseMemObject(dbuf->dmem);
+	dma_hostmem_free(&dbuf->hostmem, &dbuf->driver);
+}
+
+/*
+ * Ring of the events being in-flight
+ *
+ * Events are acquired in order of the sequence number, and the oldest one
+ * is retired (waited for, recorded to the histogram, then released) when
+ * its slot is reused. So, memory usage and the number of driver's event
+ * objects are bounded by EVENT_RING_DEPTH regardless of the run length.
+ * An event older than EVENT_RING_DEPTH is already completed, so dependency
+ * on it can be omitted. The device timestamps of the first and the last
+ * retired commands are kept to compute the bandwidth.
+ */
+#define EVENT_RING_DEPTH	256
+
+typedef struct {
+	cl_event	events[EVENT_RING_DEPTH];
+	dma_histogram *hists[EVENT_RING_DEPTH];	/* where to record */
+	uint64_t	head;			/* oldest live sequence */
+	uint64_t	tail;			/* next sequence */
+	cl_ulong	first_start;	/* START of the sequence 0 */
+	cl_ulong	last_end;		/* END of the last retired one */
+} event_ring;
+
+static void
+event_ring_retire(event_ring *ring)
+{
+	int			slot = ring->head % EVENT_RING_DEPTH;
+	cl_ulong	start, end;
+	cl_int		rc;
+
+	rc = clWaitForEvents(1, &ring->events[slot]);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clWaitForEvents (%s)", opencl_strerror(rc));
+	event_timestamps(ring->events[slot], &start, &end);
+	if (ring->head == 0)
+		ring->first_start = start;
+	ring->last_end = end;
+	dma_histogram_add(ring->hists[slot], end - start);
+	clReleaseEvent(ring->events[slot]);
+	ring->events[slot] = NULL;
+	ring->head++;
+}
+
+/* reserves a slot for the next event; returns its sequence number */
+static uint64_t
+event_ring_acquire(event_ring *ring, dma_histogram *hist)
+{
+	if (ring->tail - ring->head >= EVENT_RING_DEPTH)
+		event_ring_retire(ring);
+	ring->hists[ring->tail % EVENT_RING_DEPTH] = hist;
+	return ring->tail++;
+}
+
+static inline cl_event *
+event_ring_slot(event_ring *ring, uint64_t seq)
+{
+	return &ring->events[seq % EVENT_RING_DEPTH];
+}
+
+/*
+ * measure_dma
+ *
+ * It sends the buffer by chunks, then receives it at once, num_trial times.
+ * If chunk size is not aligned to the buffer size, the remaining tail is
+ * not transferred. Per-chunk latency is recorded when the event is retired
+ * from the ring.
+ *
+ * The bandwidth is computed from the device timestamps, from the START of
+ * the first write to the END of the last read, so the retirement of the
+ * events on the host side is not counted. Only the tail of verification,
+ * not overlapped with the transfer, is added by the host timer.
+ */
+static void
+measure_dma(dma_buffer *dbuf, size_t chunk_sz, dma_result *res)
+{
+	cl_command_queue cmdq = dbuf->cmdq;
+	event_ring	   *ring;
+	cl_event		waits[EVENT_RING_DEPTH];
+	cl_int			num_waits;
+	cl_int			num_chunks = buffer_size / chunk_sz;
+	size_t			length = num_chunks * chunk_sz;
+	uint64_t		trial_head;
+	uint64_t		read_seq = 0;
+	uint64_t		seq, x;
+	cl_int			rc, i, j;
+	double			tv1, tv2;
+
+	ring = calloc(1, sizeof(event_ring));
+	if (!ring)
+		error_exit("out of memory (%s)", strerror(errno));
+	dma_histogram_init(&res->h2d);
+	dma_histogram_init(&res->d2h);
+
+	for (i=0; i < num_trial; i++)
+	{
+		trial_head = ring->tail;
+		for (j=0; j < num_chunks; j++)
+		{
+			seq = event_ring_acquire(ring, &res->h2d);
+			/* wait for the previous read, unless already retired */
+			num_waits = (i > 0 && read_seq >= ring->head ? 1 : 0);
+			rc = clEnqueueWriteBuffer(cmdq,
+									  dbuf->dmem,
+									  is_blocking,
+									  j * chunk_sz,
+									  chunk_sz,
+									  dbuf->hmem + j * chunk_sz,
+									  num_waits,
+									  num_waits > 0
+									  ? event_ring_slot(ring, read_seq)
+									  : NULL,
+									  event_ring_slot(ring, seq));
+			if (rc != CL_SUCCESS)
+				error_exit("failed on clEnqueueWriteBuffer (%s)",
+						   opencl_strerror(rc));
+		}
+
+		/*
+		 * Verification of the previous trial is overlapped with the writes
+		 * of this trial, and must be done prior to the next read.
+		 */
+		if (verifier && i > 0)
+		{
+			if (!is_blocking)
+			{
+				if (read_seq >= ring->head)
+				{
+					rc = clWaitForEvents(1, event_ring_slot(ring, read_seq));
+					if (rc != CL_SUCCESS)
+						error_exit("failed on clWaitForEvents (%s)",
+								   opencl_strerror(rc));
+				}
+				dma_verify_submit(verifier);
+			}
+			dma_verify_wait(verifier);
+		}
+
+		/* read waits for the writes of this trial, still in the ring */
+		read_seq = event_ring_acquire(ring, &res->d2h);
+		num_waits = 0;
+		for (x = (trial_head > ring->head ? trial_head : ring->head);
+			 x < read_seq; x++)
+			waits[num_waits++] = *event_ring_slot(ring, x);
+		rc = clEnqueueReadBuffer(cmdq,
+								 dbuf->dmem,
+								 is_blocking,
+								 0,
+								 length,
+								 dbuf->hmem,
+								 num_waits,
+								 num_waits > 0 ? waits : NULL,
+								 event_ring_slot(ring, read_seq));
+		if (rc != CL_SUCCESS)
+			error_exit("failed on clEnqueueReadBuffer (%s)",
+					   opencl_strerror(rc));
+		/* the read is already done, if blocking */
+		if (verifier && is_blocking)
+			dma_verify_submit(verifier);
+	}
+	/* the last read depends on all the commands prior to it */
+	rc = clWaitForEvents(1, event_ring_slot(ring, read_seq));
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clWaitForEvents (%s)", opencl_strerror(rc));
+	tv1 = dma_timer_now();
+	if (verifier)
+	{
+		if (!is_blocking)
+			dma_verify_submit(verifier);
+		dma_verify_wait(verifier);
+	}
+	tv2 = dma_timer_now();
+
+	/* out of the measurement */
+	while (ring->head < ring->tail)
+		event_ring_retire(ring);
+
+	res->chunk_size = chunk_sz;
+	res->total_size = length * num_trial;
+	res->elapsed = ((double)(ring->last_end - ring->first_start) / 1.0e9 +
+					(tv2 - tv1));
+
+	free(ring);
+}
 
 static void
 run_test(const char *namebuf, cl_context context, cl_command_queue cmdq)
 {
-	cl_event	   *ev;
-	char		   *hmem;
-	cl_mem			dmem;
-	cl_mem			pinned = NULL;
-	cl_int			num_chunks;
-	cl_int			rc, i, j, k;
-	struct timeval	tv1, tv2;
+	dma_buffer		dbuf;
+	dma_result		res;
+	dma_histogram	h2d;
+	dma_histogram	d2h;
+	dma_stats		stats;
+	double		   *speeds;
+	size_t			total_size = 0;
+	double			elapsed = 0.0;
+	double			plain_speed = 0.0;
+	int				i, num_runs;
+
+	if (setup_buffer(&dbuf, context, cmdq, default_host_method()) != 0)
+		error_exit("failed to allocate host buffer (%s)", strerror(errno));
+	speeds = calloc(max_runs, sizeof(double));
+	if (!speeds)
+		error_exit("out of memory (%s)", strerror(errno));
+
+	/* warm-up runs; not counted */
+	for (i=0; i < num_warmup; i++)
+		measure_dma(&dbuf, chunk_size, &res);
+
+	/* throughput without verification, for comparison */
+	if (verify_threads > 0)
+	{
+		measure_dma(&dbuf, chunk_size, &res);
+		plain_speed = (double)(res.total_size >> 20) / res.elapsed;
+		verifier = dma_verify_create(verify_threads, dbuf.hmem,
+									 (buffer_size / chunk_size) * chunk_size,
+									 chunk_size, DMA_VERIFY_SEED);
+	}
+
+	/* measured runs, until the CI of the mean gets tight enough */
+	dma_histogram_init(&h2d);
+	dma_histogram_init(&d2h);
+	for (num_runs=0; num_runs < max_runs; )
+	{
+		measure_dma(&dbuf, chunk_size, &res);
+		speeds[num_runs++] = (double)(res.total_size >> 20) / res.elapsed;
+		total_size += res.total_size;
+		elapsed += res.elapsed;
+		dma_histogram_merge(&h2d, &res.h2d);
+		dma_histogram_merge(&d2h, &res.d2h);
+
+		if (ci_target > 0.0 && num_runs >= DMA_STATS_MIN_RUNS)
+		{
+			dma_stats_compute(speeds, num_runs, &stats);
+			if (stats.ci95 <= stats.mean * ci_target / 100.0)
+				break;
+		}
+	}
+	dma_stats_compute(speeds, num_runs, &stats);
+
+	printf("DMA send/recv test result\n"
+		   "device:         %s\n"
+		   "size:           %luMB\n"
+		   "chunks:         %lu%s x %lu\n"
+		   "ntrials:        %d\n"
+		   "total_size:     %luMB\n"
+		   "time:           %.2fs\n"
+		   "speed:          %.2fMB/s\n"
+		   "mode:           %s\n",
+		   namebuf,
+		   buffer_size >> 20,
+		   chunk_size > (1UL<<20) ? chunk_size >> 20 : chunk_size >> 10,
+		   chunk_size > (1UL<<20) ? "MB" : "KB",
+		   buffer_size / chunk_size,
+		   num_trial,
+		   total_size >> 20,
+		   elapsed,
+		   stats.mean,
+		   is_blocking ? "sync" : "async");
+	if (num_runs > 1)
+	{
+		printf("runs:           %d (warm-up: %d)\n", num_runs, num_warmup);
+		dma_stats_print(stdout, "speed(stats):", "MB/s", &stats);
+	}
+	if (verifier)
+	{
+		printf("speed(plain):   %.2fMB/s (verify overhead: %.1f%%)\n",
+			   plain_speed, 100.0 * (plain_speed - stats.mean) / plain_speed);
+		dma_verify_print(stdout, verifier);
+	}
+	dma_histogram_print(stdout, "latency(H2D):", &h2d);
+	dma_histogram_print(stdout, "latency(D2H):", &d2h);
+	printf("numa:           host node %d, device node %d (%s)\n",
+		   dbuf.hostmem.numa_node,
+		   device_numa_node,
+		   dma_numa_placement(dbuf.hostmem.numa_node, device_numa_node));
+
+	/* release resources */
+	release_buffer(&dbuf);
+	free(speeds);
+	if (verifier)
+	{
+		uint64_t	num_errors = dma_verify_errors(verifier);
+
+		dma_verify_destroy(verifier);
+		verifier = NULL;
+		/* burn-in scripts can detect the corruption by exit code */
+		if (num_errors > 0)
+			exit(2);
+	}
+}
+
+/*
+ * run_sweep
+ *
+ * It measures bandwidth and latency for each chunk size on the sweep
+ * points, using same buffers and context.
+ */
+static void
+run_sweep(const char *namebuf, cl_context context, cl_command_queue cmdq)
+{
+	dma_buffer		dbuf;
+	dma_result		res;
+	size_t		   *points;
+	int				i, count;
+
+	count = dma_sweep_points(buffer_size, sweep_points, &points);
+	if (count < 0)
+		error_exit("invalid sweep points: %s", sweep_points);
+
+	fprintf(stderr, "chunk size sweep on %s (%s, %luMB x %d)\n",
+			namebuf, is_blocking ? "sync" : "async",
+			buffer_size >> 20, num_trial);
+
+	if (setup_buffer(&dbuf, context, cmdq, default_host_method()) != 0)
+		error_exit("failed to allocate host buffer (%s)", strerror(errno));
+	for (i=0; i < count; i++)
+	{
+		measure_dma(&dbuf, points[i], &res);
+		dma_sweep_print(stdout, sweep_format, &res, i, count);
+	}
+	release_buffer(&dbuf);
+	free(points);
+}
+
+/*
+ * run_ops
+ *
+ * It measures calls/sec and latency of small transfers for each size,
+ * from the page-locked host buffer.
+ */
+static void
+opencl_ops_submit(void *private, size_t length)
+{
+	dma_buffer *dbuf = private;
+	cl_int		rc;
+
+	rc = clEnqueueWriteBuffer(dbuf->cmdq,
+							  dbuf->dmem,
+							  CL_FALSE,
+							  0,
+							  length,
+							  dbuf->hmem,
+							  0,
+							  NULL,
+							  NULL);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clEnqueueWriteBuffer (%s)",
+				   opencl_strerror(rc));
+}
+
+static void
+opencl_ops_sync(void *private)
+{
+	dma_buffer *dbuf = private;
+	cl_int		rc;
+
+	rc = clFinish(dbuf->cmdq);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clFinish (%s)", opencl_strerror(rc));
+}
+
+static void
+run_ops(const char *namebuf, cl_context context, cl_command_queue cmdq)
+{
+	dma_buffer		dbuf;
+	dma_ops_driver	driver;
+	dma_ops_result	res;
+	size_t		   *points;
+	int				i, count;
+
+	count = dma_parse_sizes(ops_sizes, buffer_size, &points);
+	if (count < 0)
+		error_exit("invalid sizes of small transfers: %s", ops_sizes);
+
+	fprintf(stderr, "small transfers on %s (%d calls per size)\n",
+			namebuf, DMA_OPS_NUM_CALLS);
+
+	if (setup_buffer(&dbuf, context, cmdq, DMA_HOSTMEM_PINNED) != 0)
+		error_exit("failed to allocate host buffer (%s)", strerror(errno));
+	driver.name = "opencl";
+	driver.private = &dbuf;
+	driver.submit = opencl_ops_submit;
+	driver.sync = opencl_ops_sync;
+	for (i=0; i < count; i++)
+	{
+		dma_ops_measure(&driver, points[i], DMA_OPS_NUM_CALLS, &res);
+		dma_ops_print(stdout, sweep_format, &res, i, count);
+	}
+	release_buffer(&dbuf);
+	free(points);
+}
+
+/*
+ * run_strided
+ *
+ * It extracts strided elements of the host buffer into the device buffer
+ * by clEnqueueWriteBufferRect, by the host gather plus a 1D copy, and by
+ * a copy per row, then compares the payload bandwidth.
+ */
+static void
+run_strided(const char *namebuf, cl_context context, cl_command_queue cmdq)
+{
+	dma_buffer	dbuf;
+	dma_hostmem	staging;
+	dma_strided_result res;
+	size_t		payload = strided_width * strided_rows;
+	size_t		origin[3] = { 0, 0, 0 };
+	size_t		region[3] = { strided_width, strided_rows, 1 };
+	size_t		j;
+	double		tv1, tv2, tv3;
+	cl_int		rc, i;
+
+	if (setup_buffer(&dbuf, context, cmdq, DMA_HOSTMEM_PINNED) != 0)
+		error_exit("failed to allocate host buffer (%s)", strerror(errno));
+	if (dma_hostmem_alloc(&staging, DMA_HOSTMEM_PINNED, payload,
+						  numa_node, &dbuf.driver) != 0)
+		error_exit("failed to allocate staging buffer (%s)",
+				   strerror(errno));
+	memset(&res, 0, sizeof(dma_strided_result));
+	res.width = strided_width;
+	res.pitch = strided_pitch;
+	res.rows = strided_rows;
+
+	/* 2D DMA */
+	tv1 = dma_timer_now();
+	for (i=0; i < num_trial; i++)
+	{
+		rc = clEnqueueWriteBufferRect(cmdq,
+									  dbuf.dmem,
+									  CL_FALSE,
+									  origin,
+									  origin,
+									  region,
+									  strided_width,
+									  0,
+									  strided_pitch,
+									  0,
+									  dbuf.hmem,
+									  0,
+									  NULL,
+									  NULL);
+		if (rc != CL_SUCCESS)
+			error_exit("failed on clEnqueueWriteBufferRect (%s)",
+					   opencl_strerror(rc));
+	}
+	rc = clFinish(cmdq);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clFinish (%s)", opencl_strerror(rc));
+	res.rect_time = dma_timer_now() - tv1;
+
+	/* host gather + 1D copy; staging buffer is reused after the copy */
+	for (i=0; i < num_trial; i++)
+	{
+		tv1 = dma_timer_now();
+		dma_gather(staging.addr, dbuf.hmem,
+				   strided_width, strided_pitch, strided_rows);
+		tv2 = dma_timer_now();
+		rc = clEnqueueWriteBuffer(cmdq,
+								  dbuf.dmem,
+								  CL_TRUE,
+								  0,
+								  payload,
+								  staging.addr,
+								  0,
+								  NULL,
+								  NULL);
+		if (rc != CL_SUCCESS)
+			error_exit("failed on clEnqueueWriteBuffer (%s)",
+					   opencl_strerror(rc));
+		tv3 = dma_timer_now();
+		res.gather_time += tv2 - tv1;
+		res.gather_copy_time += tv3 - tv1;
+	}
+
+	/* a copy per row */
+	tv1 = dma_timer_now();
+	for (i=0; i < num_trial; i++)
+	{
+		for (j=0; j < strided_rows; j++)
+		{
+			rc = clEnqueueWriteBuffer(cmdq,
+									  dbuf.dmem,
+									  CL_FALSE,
+									  j * strided_width,
+									  strided_width,
+									  dbuf.hmem + j * strided_pitch,
+									  0,
+									  NULL,
+									  NULL);
+			if (rc != CL_SUCCESS)
+				error_exit("failed on clEnqueueWriteBuffer (%s)",
+						   opencl_strerror(rc));
+		}
+		rc = clFinish(cmdq);
+		if (rc != CL_SUCCESS)
+			error_exit("failed on clFinish (%s)", opencl_strerror(rc));
+	}
+	res.small_time = dma_timer_now() - tv1;
+
+	printf("strided transfer test result\n"
+		   "device:         %s\n",
+		   namebuf);
+	dma_strided_print(stdout, &res, num_trial);
+
+	dma_hostmem_free(&staging, &dbuf.driver);
+	release_buffer(&dbuf);
+}
+
+/*
+ * run_numa
+ *
+ * It measures bandwidth for each combination of NUMA node of the host
+ * buffer and device, then prints the node x device matrix.
+ */
+static void
+run_numa(cl_device_id *device_ids, uint64_t device_mask, uint64_t node_mask)
+{
+	int			devices[DMA_MAX_IDS];
+	int			nodes[DMA_MAX_IDS];
+	int			num_devices = 0;
+	int			num_nodes = 0;
+	double	   *values;
+	char	   *marks;
+	int			i, j;
+
+	for (i=0; i < DMA_MAX_IDS; i++)
+	{
+		if (device_mask & (1UL << i))
+			devices[num_devices++] = i;
+		if (node_mask & (1UL << i))
+			nodes[num_nodes++] = i;
+	}
+	values = calloc(num_nodes * num_devices, sizeof(double));
+	marks = calloc(num_nodes * num_devices, sizeof(char));
+	if (!values || !marks)
+		error_exit("out of memory (%s)", strerror(errno));
+
+	for (j=0; j < num_devices; j++)
+	{
+		cl_device_id device = device_ids[devices[j] - 1];
+		cl_context	context;
+		cl_command_queue cmdq;
+		char		namebuf[1024];
+
+		open_device(device, namebuf, sizeof(namebuf), &context, &cmdq);
+		device_numa_node = opencl_device_numa_node(device);
+
+		for (i=0; i < num_nodes; i++)
+		{
+			dma_buffer	dbuf;
+			dma_result	res;
+			double		speed = -1.0;
+			const char *placement;
+
+			bind_node_cpus(nodes[i]);
+			numa_node = nodes[i];
+			if (setup_buffer(&dbuf, context, cmdq,
+							 default_host_method()) == 0)
+			{
+				measure_dma(&dbuf, chunk_size, &res);
+				speed = (double)(res.total_size >> 20) / res.elapsed;
+				placement = dma_numa_placement(dbuf.hostmem.numa_node,
+											   device_numa_node);
+				release_buffer(&dbuf);
+			}
+			else
+				placement = "not available";
+
+			values[i * num_devices + j] = speed;
+			marks[i * num_devices + j] =
+				(strcmp(placement, "remote") == 0 ? '*' : ' ');
+			printf("device %d (%s, node %d) x host node %d: "
+				   "%.2fMB/s (%s)\n",
+				   devices[j], namebuf, device_numa_node,
+				   nodes[i], speed, placement);
+		}
+		clReleaseCommandQueue(cmdq);
+		clReleaseContext(context);
+	}
+	dma_print_matrix(stdout,
+					 "bandwidth [MB/s] of host node x device "
+					 "('*' = remote placement)",
+					 "node", num_nodes, nodes,
+					 "dev", num_devices, devices,
+					 values, marks);
+	free(values);
+	free(marks);
+}
+
+/*
+ * run_parallel
+ *
+ * It runs the send/recv test on the multiple devices; first, each device
+ * solely, then all the devices concurrently. Every device is driven by its
+ * own worker thread with its own context, command queue and buffers, and
+ * the workers start the measurement at the same time on the barrier.
+ */
+typedef struct {
+	int			device_idx;
+	cl_device_id device;
+	char		namebuf[1024];
+	pthread_barrier_t *barrier;	/* NULL, if solo run */
+	dma_result	res;
+} dma_worker;
+
+static void *
+worker_main(void *private)
+{
+	dma_worker *dw = private;
+	dma_buffer	dbuf;
+	cl_context	context;
+	cl_command_queue cmdq;
+
+	open_device(dw->device, dw->namebuf, sizeof(dw->namebuf),
+				&context, &cmdq);
+	if (setup_buffer(&dbuf, context, cmdq, default_host_method()) != 0)
+		error_exit("failed to allocate host buffer (%s)", strerror(errno));
+
+	if (dw->barrier)
+		pthread_barrier_wait(dw->barrier);
+	measure_dma(&dbuf, chunk_size, &dw->res);
+
+	release_buffer(&dbuf);
+	clReleaseCommandQueue(cmdq);
+	clReleaseContext(context);
+
+	return NULL;
+}
+
+static void
+run_parallel(cl_device_id *device_ids, uint64_t device_mask)
+{
+	dma_worker *workers;
+	pthread_t  *threads;
+	pthread_barrier_t barrier;
+	double	   *solo;
+	double		max_elapsed = 0.0;
+	double		sum_solo = 0.0;
+	double		aggregate;
+	size_t		sum_size = 0;
+	int			num_workers = 0;
+	int			i;
+
+	workers = calloc(DMA_MAX_IDS, sizeof(dma_worker));
+	threads = calloc(DMA_MAX_IDS, sizeof(pthread_t));
+	solo = calloc(DMA_MAX_IDS, sizeof(double));
+	if (!workers || !threads || !solo)
+		error_exit("out of memory (%s)", strerror(errno));
+	for (i=0; i < DMA_MAX_IDS; i++)
+	{
+		if (device_mask & (1UL << i))
+		{
+			workers[num_workers].device_idx = i;
+			workers[num_workers].device = device_ids[i - 1];
+			num_workers++;
+		}
+	}
+
+	/* solo run for each device */
+	for (i=0; i < num_workers; i++)
+	{
+		workers[i].barrier = NULL;
+		if (pthread_create(&threads[i], NULL, worker_main, &workers[i]) != 0)
+			error_exit("failed on pthread_create (%s)", strerror(errno));
+		pthread_join(threads[i], NULL);
+		solo[i] = (double)(workers[i].res.total_size >> 20) /
+			workers[i].res.elapsed;
+		sum_solo += solo[i];
+	}
+
+	/* concurrent run */
+	if (pthread_barrier_init(&barrier, NULL, num_workers) != 0)
+		error_exit("failed on pthread_barrier_init (%s)", strerror(errno));
+	for (i=0; i < num_workers; i++)
+	{
+		workers[i].barrier = &barrier;
+		if (pthread_create(&threads[i], NULL, worker_main, &workers[i]) != 0)
+			error_exit("failed on pthread_create (%s)", strerror(errno));
+	}
+	for (i=0; i < num_workers; i++)
+		pthread_join(threads[i], NULL);
+	pthread_barrier_destroy(&barrier);
+
+	printf("DMA send/recv multi-device test result\n"
+		   "size:           %luMB\n"
+		   "chunks:         %lu%s x %lu\n"
+		   "ntrials:        %d\n"
+		   "mode:           %s\n",
+		   buffer_size >> 20,
+		   chunk_size > (1UL<<20) ? chunk_size >> 20 : chunk_size >> 10,
+		   chunk_size > (1UL<<20) ? "MB" : "KB",
+		   buffer_size / chunk_size,
+		   num_trial,
+		   is_blocking ? "sync" : "async");
+	for (i=0; i < num_workers; i++)
+	{
+		dma_result *res = &workers[i].res;
+		double		speed = (double)(res->total_size >> 20) / res->elapsed;
+
+		printf("device %d:       %.2fMB/s (solo: %.2fMB/s, slowdown: %.2fx) "
+			   "%s\n",
+			   workers[i].device_idx, speed, solo[i], solo[i] / speed,
+			   workers[i].namebuf);
+		sum_size += res->total_size;
+		if (res->elapsed > max_elapsed)
+			max_elapsed = res->elapsed;
+	}
+	aggregate = (double)(sum_size >> 20) / max_elapsed;
+	printf("aggregate:      %.2fMB/s (sum of solo: %.2fMB/s, "
+		   "efficiency: %.1f%%)\n",
+		   aggregate, sum_solo, 100.0 * aggregate / sum_solo);
+
+	free(workers);
+	free(threads);
+	free(solo);
+}
+
+/*
+ * run_hostmem
+ *
+ * It measures the allocation/pinning cost and bandwidth for each host
+ * memory allocation strategy.
+ */
+static void
+run_hostmem(const char *namebuf, cl_context context, cl_command_queue cmdq)
+{
+	dma_buffer		dbuf;
+	dma_result		res;
+	int				i, index = 0;
+
+	fprintf(stderr, "host memory strategies on %s (%s, %luMB x %d)\n",
+			namebuf, is_blocking ? "sync" : "async",
+			buffer_size >> 20, num_trial);
+
+	for (i=0; i < DMA_HOSTMEM_NUM_METHODS; i++)
+	{
+		if ((host_methods & (1U << i)) == 0)
+			continue;
+		if (setup_buffer(&dbuf, context, cmdq, i) != 0)
+		{
+			dma_hostmem_print(stdout, &dbuf.hostmem, NULL, index++);
+			continue;
+		}
+		measure_dma(&dbuf, chunk_size, &res);
+		dma_hostmem_print(stdout, &dbuf.hostmem, &res, index++);
+		release_buffer(&dbuf);
+	}
+}
+
+/*
+ * run_pipeline
+ *
+ * Multi-queue pipelined mode. Every command queue owns a slice of the
+ * device buffer and a pair of pinned staging buffers; host side fills
+ * one staging buffer while the other one is under H2D/D2H transfer, and
+ * transfers on the different queues run concurrently.
+ * The queues are out-of-order, so H2D of a chunk can overlap with D2H of
+ * the previous one; D2H waits for H2D of the same chunk by the event.
+ */
+typedef struct {
+	cl_command_queue cmdq;
+	cl_mem		stage_mem[2];	/* pinned staging buffers */
+	char	   *stage_ptr[2];	/* host address of the staging buffers */
+	cl_event	stage_ev[2];	/* completion of the last D2H per stage */
+	cl_event	first_ev;		/* first H2D on this queue */
+	size_t		base;			/* offset of the slice on dmem */
+} pipeline_queue;
+
+static double
+pipeline_elapsed(cl_event first_ev, cl_event last_ev)
+{
+	cl_ulong	tv1, tv2;
+	cl_int		rc;
+
+	rc = clGetEventProfilingInfo(first_ev, CL_PROFILING_COMMAND_START,
+								 sizeof(cl_ulong), &tv1, NULL);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clGetEventProfilingInfo (%s)",
+				   opencl_strerror(rc));
+	rc = clGetEventProfilingInfo(last_ev, CL_PROFILING_COMMAND_END,
+								 sizeof(cl_ulong), &tv2, NULL);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clGetEventProfilingInfo (%s)",
+				   opencl_strerror(rc));
+	return (double)(tv2 - tv1) / 1000000000.0;	/* nsec -> sec */
+}
+
+static void
+run_pipeline(const char *namebuf, cl_context context, cl_device_id device)
+{
+	pipeline_queue *pq;
+	cl_mem			dmem;
+	size_t			slice_size = buffer_size / num_queues;
+	cl_int			num_chunks = slice_size / chunk_size;
+	cl_int			rc, i, j, k, b;
+	double			tv1, tv2;
+	double			elapsed;
+
+	pq = calloc(num_queues, sizeof(pipeline_queue));
+	if (!pq)
+		error_exit("out of memory (%s)", strerror(errno));
+
+	dmem = clCreateBuffer(context,
+						  CL_MEM_READ_WRITE,
+						  buffer_size,
+						  NULL,
+						  &rc);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clCreateBuffer(size=%lu) (%s)",
+				   buffer_size, opencl_strerror(rc));
+
+	for (k=0; k < num_queues; k++)
+	{
+		pq[k].cmdq = clCreateCommandQueue(context,
+										  device,
+										  CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE |
+										  CL_QUEUE_PROFILING_ENABLE,
+										  &rc);
+		if (rc != CL_SUCCESS)
+			error_exit("failed to create an opencl command queue (%s)",
+					   opencl_strerror(rc));
+		pq[k].base = k * slice_size;
+
+		for (b=0; b < 2; b++)
+		{
+			pq[k].stage_mem[b] = clCreateBuffer(context,
+												CL_MEM_READ_WRITE |
+												CL_MEM_ALLOC_HOST_PTR,
+												chunk_size,
+												NULL,
+												&rc);
+			if (rc != CL_SUCCESS)
+				error_exit("failed on clCreateBuffer(size=%lu) (%s)",
+						   chunk_size, opencl_strerror(rc));
+
+			pq[k].stage_ptr[b] = clEnqueueMapBuffer(pq[k].cmdq,
+													pq[k].stage_mem[b],
+													CL_TRUE,
+													CL_MAP_READ |
+													CL_MAP_WRITE,
+													0,
+													chunk_size,
+													0,
+													NULL,
+													NULL,
+													&rc);
+			if (rc != CL_SUCCESS)
+				error_exit("failed on clEnqueueMapBuffer (%s)",
+						   opencl_strerror(rc));
+		}
+	}
+
+	tv1 = dma_timer_now();
+
+	for (i=0; i < num_trial; i++)
+	{
+		for (j=0; j < num_chunks; j++)
+		{
+			b = (i * num_chunks + j) % 2;
+			for (k=0; k < num_queues; k++)
+			{
+				size_t	offset = pq[k].base + j * chunk_size;
+				cl_event ev_write;
+				cl_int	num_waits;
+
+				/* staging buffer must be released by the previous D2H */
+				if (pq[k].stage_ev[b])
+				{
+					rc = clWaitForEvents(1, &pq[k].stage_ev[b]);
+					if (rc != CL_SUCCESS)
+						error_exit("failed on clWaitForEvents (%s)",
+								   opencl_strerror(rc));
+					clReleaseEvent(pq[k].stage_ev[b]);
+					pq[k].stage_ev[b] = NULL;
+				}
+				/* host side preparation of the next chunk */
+				memset(pq[k].stage_ptr[b], i + j, chunk_size);
+
+				/*
+				 * Reads prior to the previous one are already waited for;
+				 * the previous one touches the same region only if the
+				 * slice has a single chunk.
+				 */
+				num_waits = (num_chunks == 1 && pq[k].stage_ev[1 - b] ? 1 : 0);
+				rc = clEnqueueWriteBuffer(pq[k].cmdq,
+										  dmem,
+										  CL_FALSE,
+										  offset,
+										  chunk_size,
+										  pq[k].stage_ptr[b],
+										  num_waits,
+										  num_waits > 0
+										  ? &pq[k].stage_ev[1 - b]
+										  : NULL,
+										  &ev_write);
+				if (rc != CL_SUCCESS)
+					error_exit("failed on clEnqueueWriteBuffer (%s)",
+							   opencl_strerror(rc));
+
+				rc = clEnqueueReadBuffer(pq[k].cmdq,
+										 dmem,
+										 CL_FALSE,
+										 offset,
+										 chunk_size,
+										 pq[k].stage_ptr[b],
+										 1,
+										 &ev_write,
+										 &pq[k].stage_ev[b]);
+				if (rc != CL_SUCCESS)
+					error_exit("failed on clEnqueueReadBuffer (%s)",
+							   opencl_strerror(rc));
+				if (!pq[k].first_ev)
+					pq[k].first_ev = ev_write;
+				else
+					clReleaseEvent(ev_write);
+
+				rc = clFlush(pq[k].cmdq);
+				if (rc != CL_SUCCESS)
+					error_exit("failed on clFlush (%s)", opencl_strerror(rc));
+			}
+		}
+	}
+
+	for (k=0; k < num_queues; k++)
+	{
+		rc = clFinish(pq[k].cmdq);
+		if (rc != CL_SUCCESS)
+			error_exit("failed on clFinish (%s)", opencl_strerror(rc));
+	}
+	tv2 = dma_timer_now();
+	elapsed = tv2 - tv1;
+
+	printf("DMA send/recv test result\n"
+		   "device:         %s\n"
+		   "size:           %luMB\n"
+		   "chunks:         %lu%s x %d x %d queues\n"
+		   "ntrials:        %d\n"
+		   "total_size:     %luMB\n"
+		   "time:           %.2fs\n"
+		   "speed:          %.2fMB/s\n"
+		   "mode:           pipeline\n",
+		   namebuf,
+		   buffer_size >> 20,
+		   chunk_size > (1UL<<20) ? chunk_size >> 20 : chunk_size >> 10,
+		   chunk_size > (1UL<<20) ? "MB" : "KB",
+		   num_chunks,
+		   num_queues,
+		   num_trial,
+		   (buffer_size >> 20) * num_trial,
+		   elapsed,
+		   (double)((buffer_size >> 20) * num_trial) / elapsed);
+
+	/* the last D2H on each queue used the stage of the last chunk */
+	b = (num_trial * num_chunks - 1) % 2;
+	for (k=0; k < num_queues; k++)
+	{
+		double	qtime = pipeline_elapsed(pq[k].first_ev, pq[k].stage_ev[b]);
+
+		printf("queue[%d]:       %.2fMB/s (%.2fs)\n",
+			   k, (double)((slice_size >> 20) * num_trial) / qtime, qtime);
+	}
+
+	/* release resources */
+	for (k=0; k < num_queues; k++)
+	{
+		for (b=0; b < 2; b++)
+		{
+			if (pq[k].stage_ev[b])
+				clReleaseEvent(pq[k].stage_ev[b]);
+			clEnqueueUnmapMemObject(pq[k].cmdq,
+									pq[k].stage_mem[b],
+									pq[k].stage_ptr[b],
+									0, NULL, NULL);
+		}
+		clFinish(pq[k].cmdq);
+		for (b=0; b < 2; b++)
+			clReleaseMemObject(pq[k].stage_mem[b]);
+		clReleaseEvent(pq[k].first_ev);
+		clReleaseCommandQueue(pq[k].cmdq);
+	}
+	clReleaseMemObject(dmem);
+	free(pq);
+}
+
+/*
+ * run_file
+ *
+ * It streams the file (-f) to the device buffer through a ring of pinned
+ * chunks; the reads by the reader thread are overlapped with the DMA.
+ */
+typedef struct {
+	cl_command_queue cmdq;
+	cl_mem		dmem;
+	cl_event   *events;			/* per slot */
+} opencl_stream_state;
+
+static void
+opencl_stream_submit(void *private, int slot, void *addr,
+					 size_t length, size_t offset)
+{
+	opencl_stream_state *ost = private;
+	cl_int		rc;
+
+	rc = clEnqueueWriteBuffer(ost->cmdq,
+							  ost->dmem,
+							  CL_FALSE,
+							  offset,
+							  length,
+							  addr,
+							  0,
+							  NULL,
+							  &ost->events[slot]);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clEnqueueWriteBuffer (%s)",
+				   opencl_strerror(rc));
+	rc = clFlush(ost->cmdq);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clFlush (%s)", opencl_strerror(rc));
+}
+
+static uint64_t
+opencl_stream_wait(void *private, int slot)
+{
+	opencl_stream_state *ost = private;
+	uint64_t	duration;
+	cl_int		rc;
+
+	rc = clWaitForEvents(1, &ost->events[slot]);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clWaitForEvents (%s)", opencl_strerror(rc));
+	duration = event_duration(ost->events[slot]);
+	clReleaseEvent(ost->events[slot]);
+
+	return duration;
+}
+
+static void
+run_file(const char *namebuf, cl_context context, cl_command_queue cmdq)
+{
+	opencl_stream_state ost;
+	dma_stream_driver driver;
+	dma_stream_result res;
+	dma_buffer	ring;
+	cl_int		rc;
+
+	init_host_driver(&ring, context, cmdq);
+	if (dma_hostmem_alloc(&ring.hostmem, DMA_HOSTMEM_PINNED,
+						  chunk_size * num_slots,
+						  numa_node, &ring.driver) != 0)
+		error_exit("failed to allocate host buffer (%s)", strerror(errno));
+	ring.hmem = ring.hostmem.addr;
+	ring.dmem = clCreateBuffer(context,
+							   CL_MEM_READ_WRITE,
+							   buffer_size,
+							   NULL,
+							   &rc);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clCreateBuffer(size=%lu) (%s)",
+				   buffer_size, opencl_strerror(rc));
+
+	ost.cmdq = cmdq;
+	ost.dmem = ring.dmem;
+	ost.events = calloc(num_slots, sizeof(cl_event));
+	if (!ost.events)
+		error_exit("out of memory (%s)", strerror(errno));
+
+	driver.name = "opencl";
+	driver.private = &ost;
+	driver.submit = opencl_stream_submit;
+	driver.wait = opencl_stream_wait;
+	if (dma_stream_file(filename, ring.hmem, chunk_size, num_slots,
+						buffer_size, &driver, &res) != 0)
+		error_exit("failed to read \"%s\" (%s)", filename, strerror(errno));
+
+	printf("device:         %s\n", namebuf);
+	dma_stream_print(stdout, filename, &res);
+
+	free(ost.events);
+	release_buffer(&ring);
+}
+
+/*
+ * run_zerocopy
+ *
+ * It compares the kernel which reads a fraction of the host buffer
+ * directly (CL_MEM_ALLOC_HOST_PTR) with explicit copy of the whole buffer
+ * followed by the same kernel on the device buffer.
+ */
+static const char *zerocopy_source =
+	"__kernel void\n"
+	"zerocopy_scan(__global const uint4 *buf,\n"
+	"              ulong nblocks,\n"
+	"              uint threshold,\n"
+	"              __global uint *result)\n"
+	"{\n"
+	"  size_t  i = get_global_id(0);\n"
+	"  uint    sum = 0;\n"
+	"  int     j;\n"
+	"\n"
+	"  if (i >= nblocks)\n"
+	"    return;\n"
+	"  if ((((uint)i * 0x9e3779b1U) >> 16) % 1000 >= threshold)\n"
+	"    return;\n"
+	"  for (j=0; j < 8; j++)\n"
+	"  {\n"
+	"    uint4   v = buf[i * 8 + j];\n"
+	"    sum ^= v.x ^ v.y ^ v.z ^ v.w;\n"
+	"  }\n"
+	"  if (sum == 0xdeadbeefU)\n"
+	"    *result = sum;\n"
+	"}\n";
+
+static double
+zerocopy_kernel(cl_command_queue cmdq, cl_kernel kernel, cl_mem buf,
+				cl_uint threshold, cl_uint num_waits, cl_event *waits)
+{
+	cl_ulong	nblocks = buffer_size / DMA_ZEROCOPY_BLOCK_SIZE;
+	size_t		lwork_sz = 256;
+	size_t		gwork_sz = (nblocks + lwork_sz - 1) & ~(lwork_sz - 1);
+	cl_event	ev;
+	double		elapsed;
+	cl_int		rc;
+
+	rc = clSetKernelArg(kernel, 0, sizeof(cl_mem), &buf);
+	if (rc == CL_SUCCESS)
+		rc = clSetKernelArg(kernel, 1, sizeof(cl_ulong), &nblocks);
+	if (rc == CL_SUCCESS)
+		rc = clSetKernelArg(kernel, 2, sizeof(cl_uint), &threshold);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clSetKernelArg (%s)", opencl_strerror(rc));
+
+	rc = clEnqueueNDRangeKernel(cmdq,
+								kernel,
+								1,
+								NULL,
+								&gwork_sz,
+								&lwork_sz,
+								num_waits,
+								waits,
+								&ev);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clEnqueueNDRangeKernel (%s)",
+				   opencl_strerror(rc));
+	rc = clWaitForEvents(1, &ev);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clWaitForEvents (%s)", opencl_strerror(rc));
+	elapsed = (double) event_duration(ev) / 1.0e9;
+	clReleaseEvent(ev);
+
+	return elapsed;
+}
+
+static void
+run_zerocopy(const char *namebuf, cl_context context, cl_command_queue cmdq,
+			 cl_device_id device)
+{
+	dma_zerocopy_result *results;
+	double	   *fractions;
+	int			num_fractions;
+	dma_buffer	dbuf;
+	cl_program	program;
+	cl_kernel	kernel;
+	cl_mem		zmem;
+	cl_mem		result;
+	void	   *addr;
+	size_t		source_len = strlen(zerocopy_source);
+	cl_int		rc, i, j;
+
+	num_fractions = dma_parse_fractions(zerocopy_fractions, &fractions);
+	if (num_fractions < 0)
+		error_exit("invalid fraction list: %s", zerocopy_fractions);
+	results = calloc(num_fractions, sizeof(dma_zerocopy_result));
+	if (!results)
+		error_exit("out of memory (%s)", strerror(errno));
+
+	/* build the kernel */
+	program = clCreateProgramWithSource(context,
+										1,
+										&zerocopy_source,
+										&source_len,
+										&rc);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clCreateProgramWithSource (%s)",
+				   opencl_strerror(rc));
+	rc = clBuildProgram(program, 1, &device, NULL, NULL, NULL);
+	if (rc != CL_SUCCESS)
+	{
+		char	buffer[65536];
 
-	num_chunks = buffer_size / chunk_size;
-	ev = malloc(sizeof(cl_event) * (num_chunks + 1) * num_trial);
-	if (!ev)
-		error_exit("out of memory (%s)", strerror(rc));
+		if (rc == CL_BUILD_PROGRAM_FAILURE &&
+			clGetProgramBuildInfo(program,
+								  device,
+								  CL_PROGRAM_BUILD_LOG,
+								  sizeof(buffer),
+								  buffer,
+								  NULL) == CL_SUCCESS)
+			fputs(buffer, stderr);
+		error_exit("failed on clBuildProgram (%s)", opencl_strerror(rc));
+	}
+	kernel = clCreateKernel(program, "zerocopy_scan", &rc);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clCreateKernel (%s)", opencl_strerror(rc));
 
-	hmem = malloc(buffer_size);
-	if (!hmem)
-		error_exit("out of memory (%s)", strerror(rc));
+	result = clCreateBuffer(context,
+							CL_MEM_READ_WRITE,
+							sizeof(cl_uint),
+							NULL,
+							&rc);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clCreateBuffer (%s)", opencl_strerror(rc));
+	rc = clSetKernelArg(kernel, 3, sizeof(cl_mem), &result);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clSetKernelArg (%s)", opencl_strerror(rc));
 
-	dmem = clCreateBuffer(context,
-						  CL_MEM_READ_WRITE,
+	/* host buffer to be accessed by the kernel directly */
+	zmem = clCreateBuffer(context,
+						  CL_MEM_READ_ONLY |
+						  CL_MEM_ALLOC_HOST_PTR,
 						  buffer_size,
 						  NULL,
 						  &rc);
 	if (rc != CL_SUCCESS)
 		error_exit("failed on clCreateBuffer(size=%lu) (%s)",
 				   buffer_size, opencl_strerror(rc));
+	addr = clEnqueueMapBuffer(cmdq,
+							  zmem,
+							  CL_TRUE,
+							  CL_MAP_WRITE,
+							  0,
+							  buffer_size,
+							  0,
+							  NULL,
+							  NULL,
+							  &rc);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clEnqueueMapBuffer (%s)", opencl_strerror(rc));
+	memset(addr, 0x5a, buffer_size);
+	/* kernel must not access the buffer being mapped */
+	clEnqueueUnmapMemObject(cmdq, zmem, addr, 0, NULL, NULL);
+	clFinish(cmdq);
 
-	gettimeofday(&tv1, NULL);
+	/* pinned host buffer and device buffer for explicit copy */
+	if (setup_buffer(&dbuf, context, cmdq, DMA_HOSTMEM_PINNED) != 0)
+		error_exit("failed to allocate host buffer (%s)", strerror(errno));
+	memset(dbuf.hmem, 0x5a, buffer_size);
 
-	if (!is_blocking)
+	for (i=0; i < num_fractions; i++)
 	{
-		pinned = clCreateBuffer(context,
-								CL_MEM_READ_WRITE |
-								CL_MEM_USE_HOST_PTR,
-								buffer_size,
-								hmem,
-								&rc);
+		dma_zerocopy_result *zr = &results[i];
+		cl_uint		threshold = (cl_uint)(fractions[i] * 10.0 + 0.5);
+
+		zr->fraction = fractions[i];
+		for (j=0; j < num_trial; j++)
+		{
+			cl_event	ev;
+
+			zr->zerocopy_time += zerocopy_kernel(cmdq, kernel, zmem,
+												 threshold, 0, NULL);
+
+			rc = clEnqueueWriteBuffer(cmdq,
+									  dbuf.dmem,
+									  CL_FALSE,
+									  0,
+									  buffer_size,
+									  dbuf.hmem,
+									  0,
+									  NULL,
+									  &ev);
+			if (rc != CL_SUCCESS)
+				error_exit("failed on clEnqueueWriteBuffer (%s)",
+						   opencl_strerror(rc));
+			zr->kernel_time += zerocopy_kernel(cmdq, kernel, dbuf.dmem,
+											   threshold, 1, &ev);
+			zr->copy_time += (double) event_duration(ev) / 1.0e9;
+			clReleaseEvent(ev);
+		}
+	}
+
+	printf("zero-copy vs explicit copy test result\n"
+		   "device:         %s\n"
+		   "size:           %luMB\n"
+		   "ntrials:        %d\n",
+		   namebuf,
+		   buffer_size >> 20,
+		   num_trial);
+	dma_zerocopy_print(stdout, results, num_fractions,
+					   buffer_size, num_trial);
+
+	release_buffer(&dbuf);
+	clReleaseMemObject(zmem);
+	clReleaseMemObject(result);
+	clReleaseKernel(kernel);
+	clReleaseProgram(program);
+	free(results);
+	free(fractions);
+}
+
+/*
+ * run_scatter
+ *
+ * It sends scattered 8KB blocks of the registered host buffer to the
+ * device by three strategies; a DMA per block, gather of a batch into
+ * the pinned staging buffer by the thread pool then a DMA per batch, and
+ * a kernel that gathers the blocks from the host buffer directly (a copy
+ * of it on CL_MEM_ALLOC_HOST_PTR, which the kernel reads in place).
+ */
+static const char *sg_gather_source = DMA_SG_GATHER_OPENCL;
+
+static cl_kernel
+sg_gather_kernel(cl_context context, cl_device_id device,
+				 cl_program *p_program)
+{
+	cl_program	program;
+	cl_kernel	kernel;
+	char		options[80];
+	size_t		source_len = strlen(sg_gather_source);
+	cl_int		rc;
+
+	program = clCreateProgramWithSource(context,
+										1,
+										&sg_gather_source,
+										&source_len,
+										&rc);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clCreateProgramWithSource (%s)",
+				   opencl_strerror(rc));
+	snprintf(options, sizeof(options), "-DBLOCK_UNITS=%zu",
+			 DMA_SG_BLOCK_SIZE / (4 * sizeof(cl_uint)));
+	rc = clBuildProgram(program, 1, &device, options, NULL, NULL);
+	if (rc != CL_SUCCESS)
+	{
+		char	buffer[65536];
+
+		if (rc == CL_BUILD_PROGRAM_FAILURE &&
+			clGetProgramBuildInfo(program,
+								  device,
+								  CL_PROGRAM_BUILD_LOG,
+								  sizeof(buffer),
+								  buffer,
+								  NULL) == CL_SUCCESS)
+			fputs(buffer, stderr);
+		error_exit("failed on clBuildProgram (%s)", opencl_strerror(rc));
+	}
+	kernel = clCreateKernel(program, "sg_gather", &rc);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clCreateKernel (%s)", opencl_strerror(rc));
+	*p_program = program;
+
+	return kernel;
+}
+
+static void
+run_scatter(const char *namebuf, cl_context context, cl_command_queue cmdq,
+			cl_device_id device)
+{
+	dma_buffer	dbuf;
+	dma_hostmem	staging;
+	dma_sg_pool *pool;
+	dma_sg_result *results;
+	uint32_t   *blocks;
+	size_t	   *batches;
+	size_t		max_batch;
+	cl_program	program;
+	cl_kernel	kernel;
+	cl_mem		blocks_mem;
+	cl_mem		src_mem;
+	void	   *src_addr;
+	cl_uint		dev_blocks = buffer_size / DMA_SG_BLOCK_SIZE;
+	double		tv1;
+	int			num_blocks, num_batches, num_results = 0;
+	cl_int		rc, i, j, k;
+
+	num_blocks = dma_sg_blocks(sg_pattern, dev_blocks,
+							   DMA_SG_NUM_BLOCKS, &blocks);
+	if (num_blocks < 0)
+		error_exit("failed to build block list \"%s\" (%s)",
+				   sg_pattern, strerror(errno));
+	/* a pair of batches must fit in the device buffer */
+	num_batches = dma_parse_sizes(DMA_SG_BATCHES, dev_blocks / 2, &batches);
+	if (num_batches < 0)
+		error_exit("buffer size (-s) is too small for the batches");
+	max_batch = batches[num_batches - 1];
+	results = calloc(num_batches + 2, sizeof(dma_sg_result));
+	if (!results)
+		error_exit("out of memory (%s)", strerror(errno));
+
+	/* registered host buffer */
+	if (setup_buffer(&dbuf, context, cmdq, DMA_HOSTMEM_REGISTER) != 0)
+		error_exit("failed to allocate host buffer (%s)", strerror(errno));
+	if (dma_hostmem_alloc(&staging, DMA_HOSTMEM_PINNED,
+						  2 * max_batch * DMA_SG_BLOCK_SIZE,
+						  numa_node, &dbuf.driver) != 0)
+		error_exit("failed to allocate staging buffer (%s)",
+				   strerror(errno));
+	pool = dma_sg_pool_create(DMA_SG_THREADS);
+	if (!pool)
+		error_exit("failed to create gather threads (%s)", strerror(errno));
+
+	/* a DMA per block */
+	tv1 = dma_timer_now();
+	for (i=0; i < num_blocks; i++)
+	{
+		rc = clEnqueueWriteBuffer(cmdq,
+								  dbuf.dmem,
+								  CL_FALSE,
+								  (size_t)(i % dev_blocks) * DMA_SG_BLOCK_SIZE,
+								  DMA_SG_BLOCK_SIZE,
+								  dbuf.hmem +
+								  (size_t) blocks[i] * DMA_SG_BLOCK_SIZE,
+								  0,
+								  NULL,
+								  NULL);
 		if (rc != CL_SUCCESS)
-			error_exit("failed on clCreateBuffer(size=%lu) (%s)",
-					   buffer_size, opencl_strerror(rc));
+			error_exit("failed on clEnqueueWriteBuffer (%s)",
+					   opencl_strerror(rc));
 	}
+	rc = clFinish(cmdq);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clFinish (%s)", opencl_strerror(rc));
+	results[num_results].label = "per-block DMA";
+	results[num_results].batch = 1;
+	results[num_results].count = num_blocks;
+	results[num_results].elapsed = dma_timer_now() - tv1;
+	num_results++;
 
-	for (i=0, k=0; i < num_trial; i++)
+	/* gather into the staging buffer, double buffered */
+	for (j=0; j < num_batches; j++)
 	{
-		for (j=0; j < num_chunks; j++)
+		cl_event	events[2] = { NULL, NULL };
+		size_t		batch = batches[j];
+
+		tv1 = dma_timer_now();
+		for (i=0, k=0; i < num_blocks; i += batch, k ^= 1)
 		{
+			size_t	nb = (num_blocks - i < batch ? num_blocks - i : batch);
+			size_t	offset = k * max_batch * DMA_SG_BLOCK_SIZE;
+
+			/* the previous DMA from this stage must be done */
+			if (events[k])
+			{
+				rc = clWaitForEvents(1, &events[k]);
+				if (rc != CL_SUCCESS)
+					error_exit("failed on clWaitForEvents (%s)",
+							   opencl_strerror(rc));
+				clReleaseEvent(events[k]);
+			}
+			dma_sg_gather(pool, staging.addr + offset, dbuf.hmem,
+						  blocks + i, nb, DMA_SG_BLOCK_SIZE);
 			rc = clEnqueueWriteBuffer(cmdq,
-									  dmem,
-									  is_blocking,
-									  j * chunk_size,
-									  chunk_size,
-									  hmem + j * chunk_size,
-									  i > 0 ? 1 : 0,
-									  i > 0 ? &ev[k-1] : NULL,
-									  &ev[k+j]);
+									  dbuf.dmem,
+									  CL_FALSE,
+									  offset,
+									  nb * DMA_SG_BLOCK_SIZE,
+									  staging.addr + offset,
+									  0,
+									  NULL,
+									  &events[k]);
 			if (rc != CL_SUCCESS)
 				error_exit("failed on clEnqueueWriteBuffer (%s)",
 						   opencl_strerror(rc));
+			clFlush(cmdq);
+		}
+		rc = clFinish(cmdq);
+		if (rc != CL_SUCCESS)
+			error_exit("failed on clFinish (%s)", opencl_strerror(rc));
+		results[num_results].label = "gather + DMA";
+		results[num_results].batch = batch;
+		results[num_results].count = num_blocks;
+		results[num_results].elapsed = dma_timer_now() - tv1;
+		num_results++;
+		for (k=0; k < 2; k++)
+		{
+			if (events[k])
+				clReleaseEvent(events[k]);
 		}
+	}
 
-		rc = clEnqueueReadBuffer(cmdq,
-								 dmem,
-								 is_blocking,
-								 0,
-								 buffer_size,
-								 hmem,
-								 num_chunks,
-								 &ev[k],
-								 &ev[k+num_chunks]);
+	/*
+	 * device side gather over the host memory in place; a buffer of
+	 * CL_MEM_USE_HOST_PTR would be migrated to the device as a whole, so
+	 * the same contents are put on a buffer of CL_MEM_ALLOC_HOST_PTR.
+	 */
+	src_mem = clCreateBuffer(context,
+							 CL_MEM_READ_ONLY |
+							 CL_MEM_ALLOC_HOST_PTR,
+							 buffer_size,
+							 NULL,
+							 &rc);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clCreateBuffer(size=%lu) (%s)",
+				   buffer_size, opencl_strerror(rc));
+	src_addr = clEnqueueMapBuffer(cmdq,
+								  src_mem,
+								  CL_TRUE,
+								  CL_MAP_WRITE,
+								  0,
+								  buffer_size,
+								  0,
+								  NULL,
+								  NULL,
+								  &rc);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clEnqueueMapBuffer (%s)", opencl_strerror(rc));
+	memcpy(src_addr, dbuf.hmem, buffer_size);
+	/* kernel must not access the buffer being mapped */
+	clEnqueueUnmapMemObject(cmdq, src_mem, src_addr, 0, NULL, NULL);
+	clFinish(cmdq);
+
+	kernel = sg_gather_kernel(context, device, &program);
+	blocks_mem = clCreateBuffer(context,
+								CL_MEM_READ_ONLY,
+								sizeof(cl_uint) * num_blocks,
+								NULL,
+								&rc);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clCreateBuffer (%s)", opencl_strerror(rc));
+	rc = clSetKernelArg(kernel, 0, sizeof(cl_mem), &src_mem);
+	if (rc == CL_SUCCESS)
+		rc = clSetKernelArg(kernel, 1, sizeof(cl_mem), &blocks_mem);
+	if (rc == CL_SUCCESS)
+		rc = clSetKernelArg(kernel, 4, sizeof(cl_mem), &dbuf.dmem);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clSetKernelArg (%s)", opencl_strerror(rc));
+
+	/* block list is sent before the measurement */
+	rc = clEnqueueWriteBuffer(cmdq,
+							  blocks_mem,
+							  CL_TRUE,
+							  0,
+							  sizeof(cl_uint) * num_blocks,
+							  blocks,
+							  0,
+							  NULL,
+							  NULL);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clEnqueueWriteBuffer (%s)",
+				   opencl_strerror(rc));
+
+	tv1 = dma_timer_now();
+	for (i=0; i < num_blocks; i += max_batch)
+	{
+		cl_uint		base = i;
+		cl_uint		nb = (num_blocks - i < max_batch
+						  ? num_blocks - i : max_batch);
+		size_t		lwork_sz = 256;
+		size_t		gwork_sz = (size_t) nb *
+			(DMA_SG_BLOCK_SIZE / (4 * sizeof(cl_uint)));
+
+		rc = clSetKernelArg(kernel, 2, sizeof(cl_uint), &base);
+		if (rc == CL_SUCCESS)
+			rc = clSetKernelArg(kernel, 3, sizeof(cl_uint), &nb);
 		if (rc != CL_SUCCESS)
-			error_exit("failed on clEnqueueReadBuffer (%s)",
+			error_exit("failed on clSetKernelArg (%s)", opencl_strerror(rc));
+		rc = clEnqueueNDRangeKernel(cmdq,
+									kernel,
+									1,
+									NULL,
+									&gwork_sz,
+									&lwork_sz,
+									0,
+									NULL,
+									NULL);
+		if (rc != CL_SUCCESS)
+			error_exit("failed on clEnqueueNDRangeKernel (%s)",
 					   opencl_strerror(rc));
-		k += num_chunks + 1;
 	}
 	rc = clFinish(cmdq);
 	if (rc != CL_SUCCESS)
 		error_exit("failed on clFinish (%s)", opencl_strerror(rc));
+	results[num_results].label = "device gather";
+	results[num_results].batch = max_batch;
+	results[num_results].count = num_blocks;
+	results[num_results].elapsed = dma_timer_now() - tv1;
+	num_results++;
 
-	gettimeofday(&tv2, NULL);
+	printf("scatter-gather test result\n"
+		   "device:         %s\n"
+		   "pattern:        %s, %d blocks of %dKB over %uMB\n"
+		   "gather threads: %d\n",
+		   namebuf,
+		   sg_pattern, num_blocks, DMA_SG_BLOCK_SIZE >> 10,
+		   dev_blocks * (DMA_SG_BLOCK_SIZE >> 10) >> 10,
+		   DMA_SG_THREADS);
+	dma_sg_print(stdout, results, num_results, DMA_SG_BLOCK_SIZE);
 
-	printf("DMA send/recv test result\n"
+	clReleaseMemObject(blocks_mem);
+	clReleaseMemObject(src_mem);
+	clReleaseKernel(kernel);
+	clReleaseProgram(program);
+	dma_sg_pool_destroy(pool);
+	dma_hostmem_free(&staging, &dbuf.driver);
+	release_buffer(&dbuf);
+	free(results);
+	free(batches);
+	free(blocks);
+}
+
+/*
+ * run_submit
+ *
+ * It sends the buffer from 1 to submit_threads threads concurrently; each
+ * thread sends its own slice of the buffer by chunks through its own
+ * command queue, or the queue shared by all the threads. It reports the
+ * aggregate bandwidth and the latency of clEnqueueWriteBuffer calls for
+ * each number of threads, to see the scalability of the submission.
+ */
+typedef struct {
+	cl_command_queue cmdq;
+	dma_buffer *dbuf;
+	size_t		offset;			/* slice of the buffer */
+	size_t		length;
+	pthread_barrier_t *barrier;
+	dma_histogram enqueue;		/* latency of enqueue calls */
+} submit_worker;
+
+static void *
+submit_main(void *private)
+{
+	submit_worker *sw = private;
+	size_t		offset;
+	cl_int		rc, i;
+
+	dma_histogram_init(&sw->enqueue);
+	pthread_barrier_wait(sw->barrier);
+	for (i=0; i < num_trial; i++)
+	{
+		for (offset = sw->offset;
+			 offset < sw->offset + sw->length;
+			 offset += chunk_size)
+		{
+			double	tv1, tv2;
+
+			tv1 = dma_timer_now();
+			rc = clEnqueueWriteBuffer(sw->cmdq,
+									  sw->dbuf->dmem,
+									  is_blocking,
+									  offset,
+									  chunk_size,
+									  sw->dbuf->hmem + offset,
+									  0,
+									  NULL,
+									  NULL);
+			tv2 = dma_timer_now();
+			if (rc != CL_SUCCESS)
+				error_exit("failed on clEnqueueWriteBuffer (%s)",
+						   opencl_strerror(rc));
+			dma_histogram_add(&sw->enqueue,
+							  (uint64_t)((tv2 - tv1) * 1.0e9));
+		}
+	}
+	rc = clFinish(sw->cmdq);
+	if (rc != CL_SUCCESS)
+		error_exit("failed on clFinish (%s)", opencl_strerror(rc));
+
+	return NULL;
+}
+
+static void
+run_submit(const char *namebuf, cl_context context, cl_command_queue cmdq,
+		   cl_device_id device)
+{
+	submit_worker *workers;
+	pthread_t  *threads;
+	dma_buffer	dbuf;
+	double		base_speed = 0.0;
+	cl_int		num_chunks = buffer_size / chunk_size;
+	cl_int		rc, n, i;
+
+	workers = calloc(submit_threads, sizeof(submit_worker));
+	threads = calloc(submit_threads, sizeof(pthread_t));
+	if (!workers || !threads)
+		error_exit("out of memory (%s)", strerror(errno));
+	if (setup_buffer(&dbuf, context, cmdq, default_host_method()) != 0)
+		error_exit("failed to allocate host buffer (%s)", strerror(errno));
+	for (i=0; i < submit_threads; i++)
+	{
+		if (shared_queue)
+			workers[i].cmdq = cmdq;
+		else
+		{
+			workers[i].cmdq = clCreateCommandQueue(context,
+												   device,
+												   CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE,
+												   &rc);
+			if (rc != CL_SUCCESS)
+				error_exit("failed to create an opencl command queue (%s)",
+						   opencl_strerror(rc));
+		}
+		workers[i].dbuf = &dbuf;
+	}
+
+	printf("DMA submission scalability test result\n"
 		   "device:         %s\n"
 		   "size:           %luMB\n"
 		   "chunks:         %lu%s x %d\n"
 		   "ntrials:        %d\n"
-		   "total_size:     %luMB\n"
-		   "time:           %.2fs\n"
-		   "speed:          %.2fMB/s\n"
-		   "mode:           %s\n",
+		   "mode:           %s, %s queue\n",
 		   namebuf,
 		   buffer_size >> 20,
 		   chunk_size > (1UL<<20) ? chunk_size >> 20 : chunk_size >> 10,
 		   chunk_size > (1UL<<20) ? "MB" : "KB",
 		   num_chunks,
 		   num_trial,
-		   (buffer_size >> 20) * num_trial,
-		   (double)((tv2.tv_sec * 1000000 + tv2.tv_usec) -
-					(tv1.tv_sec * 1000000 + tv1.tv_usec)) / 1000000.0,
-		   (double)(((buffer_size >> 20) * num_trial) * 1000000) /
-           (double)((tv2.tv_sec * 1000000 + tv2.tv_usec) -
-                    (tv1.tv_sec * 1000000 + tv1.tv_usec)),
-		   is_blocking ? "sync" : "async");
+		   is_blocking ? "sync" : "async",
+		   shared_queue ? "shared" : "per-thread");
+	printf("%7s %12s %8s %12s %12s %12s\n",
+		   "threads", "speed[MB/s]", "speedup",
+		   "enq-p50[us]", "enq-p99[us]", "enq-max[us]");
 
-	/* release resources */
-	clReleaseMemObject(dmem);
-	free(hmem);
-	free(ev);
+	/* 1, 2, 4, ... and submit_threads */
+	for (n=1; ; n = (n * 2 < submit_threads ? n * 2 : submit_threads))
+	{
+		pthread_barrier_t barrier;
+		dma_histogram enqueue;
+		size_t		slice = (num_chunks / n) * chunk_size;
+		double		tv1, tv2, speed;
+
+		if (slice == 0)
+			error_exit("number of chunks (%d) is less than threads (%d)",
+					   num_chunks, n);
+		if (pthread_barrier_init(&barrier, NULL, n + 1) != 0)
+			error_exit("failed on pthread_barrier_init (%s)",
+					   strerror(errno));
+		for (i=0; i < n; i++)
+		{
+			workers[i].offset = i * slice;
+			workers[i].length = slice;
+			workers[i].barrier = &barrier;
+			if (pthread_create(&threads[i], NULL,
+							   submit_main, &workers[i]) != 0)
+				error_exit("failed on pthread_create (%s)", strerror(errno));
+		}
+		pthread_barrier_wait(&barrier);
+		tv1 = dma_timer_now();
+		for (i=0; i < n; i++)
+			pthread_join(threads[i], NULL);
+		tv2 = dma_timer_now();
+		pthread_barrier_destroy(&barrier);
+
+		dma_histogram_init(&enqueue);
+		for (i=0; i < n; i++)
+			dma_histogram_merge(&enqueue, &workers[i].enqueue);
+		speed = (double)((slice * n * num_trial) >> 20) / (tv2 - tv1);
+		if (n == 1)
+			base_speed = speed;
+		printf("%7d %12.2f %7.2fx %12.1f %12.1f %12.1f\n",
+			   n, speed, speed / base_speed,
+			   (double)dma_histogram_percentile(&enqueue, 50.0) / 1000.0,
+			   (double)dma_histogram_percentile(&enqueue, 99.0) / 1000.0,
+			   (double)enqueue.max / 1000.0);
+		if (n == submit_threads)
+			break;
+	}
+
+	for (i=0; i < submit_threads; i++)
+	{
+		if (!shared_queue)
+			clReleaseCommandQueue(workers[i].cmdq);
+	}
+	release_buffer(&dbuf);
+	free(workers);
+	free(threads);
 }
 
 static void usage(const char *cmdname)
@@ -146,11 +2082,46 @@ static void usage(const char *cmdname)
 			"\n"
 			"options:\n"
 			"  -p <platform index>        (default: 1)\n"
-			"  -d <device index>          (default: 1)\n"
-			"  -m (sync|async)            (default: sync)\n"
+			"  -d <device index>[,...]   (default: 1; or all)\n"
+			"  -m (sync|async|zerocopy)   (default: sync)\n"
 			"  -n <number of trials>      (default: 100)\n"
+			"  -w <number of warm-ups>    (default: 1)\n"
+			"  -R <number of runs>        (measured runs; default: 1)\n"
+			"  --ci=<percent>             (stop runs once 95%% CI is within\n"
+			"                              the percent of the mean)\n"
+			"  --verify[=<threads>]       (verify the data read back by\n"
+			"                              CRC32C on the threads; default: 2)\n"
+			"  -T <threads>               (submission scalability test from\n"
+			"                              1 to the threads)\n"
+			"  --shared-queue             (-T with a single command queue)\n"
 			"  -s <size of buffer in MB>  (default: 128 = 128MB)\n"
-			"  -c <size of chunks in KB>  (default: buffer size)\n",
+			"  -c <size of chunks in KB>  (default: buffer size)\n"
+			"  -q <number of queues>      (pipeline mode; default: off)\n"
+			"  -a <strategy>[,...]        (host memory strategies: malloc,\n"
+			"                              register, pinned, hugetlb, thp,\n"
+			"                              mlock or all)\n"
+			"  -N <numa node>[,...]      (NUMA node of host buffer; or all)\n"
+			"  -P                         (run the devices concurrently)\n"
+			"  -C <cpu list>              (CPUs of the submitting thread;\n"
+			"                              default: CPUs of the NUMA node)\n"
+			"  --sweep[=<size>,...]       (chunk size sweep from 4KB to\n"
+			"                              buffer size, plus custom points)\n"
+			"  --format=(csv|json)        (format of sweep or ops;\n"
+			"                              default: csv)\n"
+			"  --ops[=<bytes>,...]        (calls/sec of small transfers;\n"
+			"                              default: 4 to 64k bytes)\n"
+			"  --strided=<width>,<pitch>[,<rows>]\n"
+			"                             (2D DMA vs host gather vs a copy\n"
+			"                              per row; default rows: 16384)\n"
+			"  --scatter=<pattern>        (scattered 8KB blocks; random,\n"
+			"                              clustered or file of block ids)\n"
+			"  -f <file>                  (stream the file to the device;\n"
+			"                              default chunk size: 4MB)\n"
+			"  --ring=<num slots>         (ring of chunks for -f; default: 4)\n"
+			"  --host-device              (-f on host memory stand-in)\n"
+			"  --host-stub                (-a on the stub driver; no GPU)\n"
+			"  --fraction=<percent>[,...] (fractions read on zerocopy;\n"
+			"                              default: " DMA_ZEROCOPY_FRACTIONS ")\n",
 			cmdname);
 	exit(1);
 }
@@ -165,8 +2136,31 @@ int main(int argc, char *argv[])
 	cl_command_queue cmdq;
 	cl_int			c, rc;
 	char			namebuf[1024];
+	const char	   *device_list = "1";
+	const char	   *node_list = NULL;
+	uint64_t		device_mask;
+	uint64_t		node_mask = 0;
+	cpu_set_t		cpuset;
+	int				host_device = 0;
+	int				host_stub = 0;
+	static struct option long_options[] = {
+		{"sweep",	optional_argument,	NULL,	1000},
+		{"format",	required_argument,	NULL,	1001},
+		{"ring",	required_argument,	NULL,	1003},
+		{"host-device", no_argument,	NULL,	1004},
+		{"host-stub", no_argument,		NULL,	1012},
+		{"fraction", required_argument,	NULL,	1005},
+		{"ci",		required_argument,	NULL,	1006},
+		{"verify",	optional_argument,	NULL,	1007},
+		{"shared-queue", no_argument,	NULL,	1008},
+		{"ops",		optional_argument,	NULL,	1009},
+		{"strided",	required_argument,	NULL,	1010},
+		{"scatter",	required_argument,	NULL,	1011},
+		{NULL,		0,					NULL,	0},
+	};
 
-	while ((c = getopt(argc, argv, "p:d:m:n:s:c:")) >= 0)
+	while ((c = getopt_long(argc, argv, "p:d:m:n:s:c:q:a:N:C:Pf:w:R:T:",
+							long_options, NULL)) >= 0)
 	{
 		switch (c)
 		{
@@ -174,25 +2168,117 @@ int main(int argc, char *argv[])
 				platform_idx = atoi(optarg);
 				break;
 			case 'd':
-				device_idx = atoi(optarg);
+				device_list = optarg;
 				break;
 			case 'm':
 				if (strcmp(optarg, "sync") == 0)
 					is_blocking = CL_TRUE;
 				else if (strcmp(optarg, "async") == 0)
 					is_blocking = CL_FALSE;
+				else if (strcmp(optarg, "zerocopy") == 0)
+					is_zerocopy = 1;
 				else
 					usage(basename(argv[0]));
 				break;
 			case 'n':
 				num_trial = atoi(optarg);
 				break;
+			case 'w':
+				num_warmup = atoi(optarg);
+				if (num_warmup < 0)
+					usage(basename(argv[0]));
+				break;
+			case 'R':
+				max_runs = atoi(optarg);
+				if (max_runs < 1)
+					usage(basename(argv[0]));
+				break;
 			case 's':
 				buffer_size = atoi(optarg) << 20;
 				break;
 			case 'c':
 				chunk_size = atoi(optarg) << 10;
 				break;
+			case 'q':
+				num_queues = atoi(optarg);
+				if (num_queues < 1)
+					usage(basename(argv[0]));
+				break;
+			case 'a':
+				if (dma_hostmem_parse(optarg, &host_methods) != 0)
+					usage(basename(argv[0]));
+				break;
+			case 'N':
+				node_list = optarg;
+				break;
+			case 'P':
+				parallel_mode = 1;
+				break;
+			case 'f':
+				filename = optarg;
+				break;
+			case 'T':
+				submit_threads = atoi(optarg);
+				if (submit_threads < 1)
+					usage(basename(argv[0]));
+				break;
+			case 'C':
+				if (dma_parse_cpulist(optarg, &cpuset) != 0)
+					usage(basename(argv[0]));
+				cpus_bound = 1;
+				break;
+			case 1000:	/* --sweep */
+				sweep_mode = 1;
+				sweep_points = optarg;
+				break;
+			case 1001:	/* --format */
+				if (strcmp(optarg, "csv") == 0)
+					sweep_format = DMA_FORMAT_CSV;
+				else if (strcmp(optarg, "json") == 0)
+					sweep_format = DMA_FORMAT_JSON;
+				else
+					usage(basename(argv[0]));
+				break;
+			case 1003:	/* --ring */
+				num_slots = atoi(optarg);
+				if (num_slots < 2)
+					usage(basename(argv[0]));
+				break;
+			case 1004:	/* --host-device */
+				host_device = 1;
+				break;
+			case 1012:	/* --host-stub */
+				host_stub = 1;
+				break;
+			case 1005:	/* --fraction */
+				zerocopy_fractions = optarg;
+				break;
+			case 1006:	/* --ci */
+				ci_target = atof(optarg);
+				if (ci_target <= 0.0)
+					usage(basename(argv[0]));
+				break;
+			case 1007:	/* --verify */
+				verify_threads = (optarg ? atoi(optarg) : DMA_VERIFY_THREADS);
+				if (verify_threads < 1)
+					usage(basename(argv[0]));
+				break;
+			case 1008:	/* --shared-queue */
+				shared_queue = 1;
+				break;
+			case 1009:	/* --ops */
+				ops_mode = 1;
+				if (optarg)
+					ops_sizes = optarg;
+				break;
+			case 1010:	/* --strided */
+				if (dma_parse_strided(optarg, &strided_width,
+									  &strided_pitch, &strided_rows) != 0)
+					usage(basename(argv[0]));
+				break;
+			case 1011:	/* --scatter */
+				sg_pattern = optarg;
+				break;
 			default:
 				usage(basename(argv[0]));
 				break;
@@ -201,7 +2287,130 @@ int main(int argc, char *argv[])
 	if (optind != argc)
 		usage(basename(argv[0]));
 
-	if (chunk_size == 0)
+	if (host_stub)
+	{
+		if (host_methods == 0)
+			usage(basename(argv[0]));
+		if (sweep_mode || parallel_mode || num_queues > 0 ||
+			filename || is_zerocopy || submit_threads > 0 ||
+			ops_mode || strided_width > 0 || sg_pattern)
+		{
+			fprintf(stderr, "--host-stub is supported only with -a\n");
+			return 1;
+		}
+		if (chunk_size == 0)
+			chunk_size = buffer_size;
+		else if (buffer_size % chunk_size != 0 || buffer_size < chunk_size)
+		{
+			fprintf(stderr, "chunk_size (-c) must be aligned "
+					"to buffer_size\n");
+			return 1;
+		}
+	}
+	if (verify_threads > 0 &&
+		(sweep_mode || host_methods != 0 || parallel_mode ||
+		 num_queues > 0 || filename || is_zerocopy || submit_threads > 0 ||
+		 ops_mode || strided_width > 0 || sg_pattern || host_stub))
+	{
+		fprintf(stderr, "--verify is supported only in sync/async mode\n");
+		return 1;
+	}
+	if (sg_pattern &&
+		(sweep_mode || host_methods != 0 || parallel_mode ||
+		 num_queues > 0 || filename || is_zerocopy ||
+		 submit_threads > 0 || ops_mode || strided_width > 0))
+	{
+		fprintf(stderr, "--scatter cannot be used with other test modes\n");
+		return 1;
+	}
+	if (strided_width > 0)
+	{
+		if (sweep_mode || host_methods != 0 || parallel_mode ||
+			num_queues > 0 || filename || is_zerocopy ||
+			submit_threads > 0 || ops_mode)
+		{
+			fprintf(stderr, "--strided cannot be used with other "
+					"test modes\n");
+			return 1;
+		}
+		if (strided_rows == 0)
+			strided_rows = (buffer_size / strided_pitch < DMA_STRIDED_ROWS
+							? buffer_size / strided_pitch : DMA_STRIDED_ROWS);
+		if (strided_rows == 0 ||
+			strided_rows > buffer_size / strided_pitch)
+		{
+			fprintf(stderr, "rows x pitch of --strided must fit "
+					"in the buffer size (-s)\n");
+			return 1;
+		}
+	}
+	if (ops_mode &&
+		(sweep_mode || host_methods != 0 || parallel_mode ||
+		 num_queues > 0 || filename || is_zerocopy || submit_threads > 0))
+	{
+		fprintf(stderr, "--ops cannot be used with other test modes\n");
+		return 1;
+	}
+	if (submit_threads > 0 &&
+		(sweep_mode || host_methods != 0 || parallel_mode ||
+		 num_queues > 0 || filename || is_zerocopy))
+	{
+		fprintf(stderr, "-T is supported only in sync/async mode\n");
+		return 1;
+	}
+	if (is_zerocopy &&
+		(sweep_mode || host_methods != 0 || parallel_mode ||
+		 num_queues > 0 || filename))
+	{
+		fprintf(stderr, "zerocopy mode does not support --sweep, -a, -P, "
+				"-q or -f\n");
+		return 1;
+	}
+	if (filename)
+	{
+		if (sweep_mode || host_methods != 0 || parallel_mode ||
+			num_queues > 0)
+		{
+			fprintf(stderr, "-f is supported only in sync/async mode\n");
+			return 1;
+		}
+		if (chunk_size == 0)
+			chunk_size = (buffer_size < DMA_STREAM_CHUNK_SIZE
+						  ? buffer_size : DMA_STREAM_CHUNK_SIZE);
+		if (chunk_size % DMA_STREAM_ALIGN != 0)
+		{
+			fprintf(stderr, "chunk_size (-c) must be aligned to 4KB "
+					"for O_DIRECT\n");
+			return 1;
+		}
+	}
+	else if (host_device)
+		usage(basename(argv[0]));
+
+	if (sweep_mode || host_methods != 0)
+	{
+		if (num_queues > 0)
+		{
+			fprintf(stderr, "--sweep or -a is not supported "
+					"in pipeline mode\n");
+			return 1;
+		}
+		if (chunk_size == 0)
+			chunk_size = buffer_size;
+	}
+	else if (num_queues > 0)
+	{
+		if (chunk_size == 0)
+			chunk_size = buffer_size / num_queues;
+		if (chunk_size == 0 ||
+			buffer_size % ((size_t)num_queues * chunk_size) != 0)
+		{
+			fprintf(stderr, "buffer_size (-s) must be aligned to "
+					"chunk_size (-c) x number of queues (-q)\n");
+			return 1;
+		}
+	}
+	else if (chunk_size == 0)
 		chunk_size = buffer_size;
 	else if (buffer_size % chunk_size != 0 || buffer_size < chunk_size)
 	{
@@ -209,6 +2418,24 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	if (host_device)
+	{
+		if (dma_stream_stub(stdout, filename, chunk_size, num_slots,
+							buffer_size) != 0)
+			error_exit("failed to read \"%s\" (%s)",
+					   filename, strerror(errno));
+		return 0;
+	}
+
+	if (host_stub)
+	{
+		fprintf(stderr, "host memory strategies on stub (%luMB x %d)\n",
+				buffer_size >> 20, num_trial);
+		dma_hostmem_stub(stdout, host_methods, buffer_size,
+						 chunk_size, num_trial);
+		return 0;
+	}
+
 	/*
 	 * Initialize OpenCL platform/device
 	 */
@@ -231,38 +2458,93 @@ int main(int argc, char *argv[])
 						&device_num);
 	if (rc != CL_SUCCESS)
 		error_exit("failed on clGetDeviceIDs (%s)\n", opencl_strerror(rc));
-	if (device_idx < 1 || device_idx > device_num)
-		error_exit("opencl device index %d did not exist", device_idx);
 
-	/* Get name of opencl device */
-	rc = clGetDeviceInfo(device_ids[device_idx - 1],
-						 CL_DEVICE_NAME,
-						 sizeof(namebuf), namebuf, NULL);
-	if (rc != CL_SUCCESS)
-		error_exit("failed on clGetDeviceInfo (%s)", opencl_strerror(rc));
+	/* device index is 1-origin */
+	if (dma_parse_idlist(device_list, device_num + 1, &device_mask) != 0 ||
+		(strcmp(device_list, "all") != 0 && (device_mask & 1UL) != 0))
+		error_exit("opencl device index %s did not exist", device_list);
+	device_mask &= ~1UL;
+	if (node_list &&
+		dma_parse_idlist(node_list, dma_numa_num_nodes(), &node_mask) != 0)
+		error_exit("invalid numa node list: %s", node_list);
 
-	/* Construct an OpenCL context */
-	context = clCreateContext(NULL,
-                              1,
-                              &device_ids[device_idx - 1],
-                              NULL,
-                              NULL,
-                              &rc);
-	if (rc != CL_SUCCESS)
-		error_exit("failed to create an opencl context (%s)",
-				   opencl_strerror(rc));
+	if (cpus_bound && dma_bind_cpus(&cpuset) != 0)
+		error_exit("failed on sched_setaffinity (%s)", strerror(errno));
 
-	/* Construct an OpenCL command queue */
-	cmdq = clCreateCommandQueue(context,
-								device_ids[device_idx - 1],
-								CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE,
-								&rc);
-	if (rc != CL_SUCCESS)
-		error_exit("failed to create an opencl command queue (%s)",
-				   opencl_strerror(rc));
+	/* concurrent run on the multiple devices */
+	if (parallel_mode)
+	{
+		if (sweep_mode || host_methods != 0 || num_queues > 0 ||
+			(node_mask & (node_mask - 1)) != 0)
+		{
+			fprintf(stderr, "-P is supported only in sync/async mode "
+					"with a single numa node\n");
+			return 1;
+		}
+		if (node_mask != 0)
+		{
+			numa_node = __builtin_ctzll(node_mask);
+			bind_node_cpus(numa_node);
+		}
+		run_parallel(device_ids, device_mask);
+		return 0;
+	}
+
+	/* node x device matrix, if multiple devices or nodes are given */
+	if ((device_mask & (device_mask - 1)) != 0 ||
+		(node_mask & (node_mask - 1)) != 0)
+	{
+		if (sweep_mode || host_methods != 0 || num_queues > 0 ||
+			filename || is_zerocopy || submit_threads > 0 || ops_mode ||
+			strided_width > 0 || sg_pattern)
+		{
+			fprintf(stderr, "multiple devices or numa nodes are "
+					"supported only in sync/async mode\n");
+			return 1;
+		}
+		if (verify_threads > 0)
+		{
+			fprintf(stderr, "--verify is supported only with a single "
+					"device and numa node\n");
+			return 1;
+		}
+		if (node_mask == 0)
+			dma_parse_idlist("all", dma_numa_num_nodes(), &node_mask);
+		run_numa(device_ids, device_mask, node_mask);
+		return 0;
+	}
+
+	device_idx = __builtin_ctzll(device_mask);
+	if (node_mask != 0)
+	{
+		numa_node = __builtin_ctzll(node_mask);
+		bind_node_cpus(numa_node);
+	}
+	open_device(device_ids[device_idx - 1], namebuf, sizeof(namebuf),
+				&context, &cmdq);
+	device_numa_node = opencl_device_numa_node(device_ids[device_idx - 1]);
 
 	/* do the job */
-	run_test(namebuf, context, cmdq);
+	if (sweep_mode)
+		run_sweep(namebuf, context, cmdq);
+	else if (ops_mode)
+		run_ops(namebuf, context, cmdq);
+	else if (strided_width > 0)
+		run_strided(namebuf, context, cmdq);
+	else if (sg_pattern)
+		run_scatter(namebuf, context, cmdq, device_ids[device_idx - 1]);
+	else if (host_methods != 0)
+		run_hostmem(namebuf, context, cmdq);
+	else if (num_queues > 0)
+		run_pipeline(namebuf, context, device_ids[device_idx - 1]);
+	else if (filename)
+		run_file(namebuf, context, cmdq);
+	else if (is_zerocopy)
+		run_zerocopy(namebuf, context, cmdq, device_ids[device_idx - 1]);
+	else if (submit_threads > 0)
+		run_submit(namebuf, context, cmdq, device_ids[device_idx - 1]);
+	else
+		run_test(namebuf, context, cmdq);
 
 	/* cleanup resources */
 	clReleaseCommandQueue(cmdq);
@@ -0,0 +1,85 @@
+/* gputest--1.0.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION gputest" to load this file. \quit
+
+CREATE FUNCTION gputest_init_opencl()
+  RETURNS void
+  AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION gputest_dmasend_opencl(OUT bytes bigint,
+                                       OUT seconds float8,
+                                       OUT gb_per_sec float8)
+  RETURNS record
+  AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION gputest_cleanup_opencl()
+  RETURNS void
+  AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION gputest_dmasend_chunks(loops int4 DEFAULT 1,
+                                       OUT run int4,
+                                       OUT chunk_offset bigint,
+                                       OUT bytes bigint,
+                                       OUT enqueue_us float8,
+                                       OUT start_us float8,
+                                       OUT end_us float8,
+                                       OUT stream int4,
+                                       OUT device int4)
+  RETURNS SETOF record
+  AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+
+CREATE FUNCTION gputest_dmasend_summary(loops int4 DEFAULT 1,
+                                        OUT chunks bigint,
+                                        OUT bytes bigint,
+                                        OUT seconds float8,
+                                        OUT gb_per_sec float8,
+                                        OUT enqueue_p50_us float8,
+                                        OUT enqueue_p99_us float8,
+                                        OUT dma_p50_us float8,
+                                        OUT dma_p90_us float8,
+                                        OUT dma_p99_us float8,
+                                        OUT dma_max_us float8)
+  RETURNS record
+  AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+
+CREATE FUNCTION gputest_dmasend_relation(regclass,
+                                         OUT pages bigint,
+                                         OUT hit_ratio float8,
+                                         OUT bytes bigint,
+                                         OUT seconds float8,
+                                         OUT pages_per_sec float8)
+  RETURNS record
+  AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+
+CREATE FUNCTION gputest_scatter_gather(pattern text, nblocks int4)
+  RETURNS void
+  AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+
+CREATE FUNCTION gputest_dmasend_worker(nblocks int4, nrequests int4)
+  RETURNS void
+  AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+
+CREATE FUNCTION gputest_stat(OUT pid int4,
+                             OUT bytes_h2d bigint,
+                             OUT bytes_d2h bigint,
+                             OUT transfers bigint,
+                             OUT latency_total_us bigint,
+                             OUT latency_max_us bigint,
+                             OUT register_time_us bigint)
+  RETURNS SETOF record
+  AS 'MODULE_PATHNAME' LANGUAGE C;
+
+-- benchmarks hold the devices and read any relation or server-side file,
+-- so they are not executable by PUBLIC; grant them as needed
+REVOKE ALL ON FUNCTION gputest_init_opencl() FROM PUBLIC;
+REVOKE ALL ON FUNCTION gputest_dmasend_opencl() FROM PUBLIC;
+REVOKE ALL ON FUNCTION gputest_cleanup_opencl() FROM PUBLIC;
+REVOKE ALL ON FUNCTION gputest_dmasend_chunks(int4) FROM PUBLIC;
+REVOKE ALL ON FUNCTION gputest_dmasend_summary(int4) FROM PUBLIC;
+REVOKE ALL ON FUNCTION gputest_dmasend_relation(regclass) FROM PUBLIC;
+REVOKE ALL ON FUNCTION gputest_scatter_gather(text, int4) FROM PUBLIC;
+REVOKE ALL ON FUNCTION gputest_dmasend_worker(int4, int4) FROM PUBLIC;
+
+CREATE VIEW pg_stat_gputest AS
+  SELECT * FROM gputest_stat();
@@ -5,10 +5,31 @@
 #define GPUTEST_OPENCL	1
 
 #include "postgres.h"
+#include "access/heapam.h"
+#include "catalog/pg_authid.h"
 #include "fmgr.h"
+#include "funcapi.h"
 #include "miscadmin.h"
+#include "pgstat.h"
+#include "port/atomics.h"
+#include "postmaster/autovacuum.h"
+#include "postmaster/bgworker.h"
+#include "replication/walsender.h"
+#include "storage/buf_internals.h"
 #include "storage/bufmgr.h"
 #include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/smgr.h"
+#include "storage/spin.h"
+#include "utils/acl.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include <pthread.h>
+#include <signal.h>
 #include <sys/time.h>
 #ifdef GPUTEST_CUDA
 #include <cuda.h>
@@ -16,6 +37,7 @@
 #ifdef GPUTEST_OPENCL
 #include <CL/cl.h>
 #endif
+#include "dmautil.h"
 
 PG_MODULE_MAGIC;
 
@@ -23,18 +45,169 @@ PG_MODULE_MAGIC;
 extern Datum gputest_init_opencl(PG_FUNCTION_ARGS);
 extern Datum gputest_dmasend_opencl(PG_FUNCTION_ARGS);
 extern Datum gputest_cleanup_opencl(PG_FUNCTION_ARGS);
+extern Datum gputest_dmasend_chunks(PG_FUNCTION_ARGS);
+extern Datum gputest_dmasend_summary(PG_FUNCTION_ARGS);
+extern Datum gputest_dmasend_relation(PG_FUNCTION_ARGS);
+extern Datum gputest_stat(PG_FUNCTION_ARGS);
+extern Datum gputest_scatter_gather(PG_FUNCTION_ARGS);
+extern Datum gputest_dmasend_worker(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT void gputest_dma_worker_main(Datum arg)
+	pg_attribute_noreturn();
 extern void  _PG_init(void);
 
 static shmem_startup_hook_type shmem_startup_hook_next;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type shmem_request_hook_next;
+#endif
+
+#if PG_VERSION_NUM >= 140000
+#define GPUTEST_ROLE_READ_SERVER_FILES	ROLE_PG_READ_SERVER_FILES
+#else
+#define GPUTEST_ROLE_READ_SERVER_FILES	DEFAULT_ROLE_READ_SERVER_FILES
+#endif
+
+#if PG_VERSION_NUM < 100000
+#define GPUTEST_WAIT_LATCH(latch,events,timeout)						\
+	WaitLatch((latch),(events),(timeout))
+#else
+#define GPUTEST_WAIT_LATCH(latch,events,timeout)						\
+	WaitLatch((latch),(events),(timeout),PG_WAIT_EXTENSION)
+#endif
 
 #define TIMEVAL_DIFF(tv2,tv1)											\
 	(((double)((tv2)->tv_sec * 1000000L + (tv2)->tv_usec) -				\
 	  (double)((tv1)->tv_sec * 1000000L + (tv1)->tv_usec)) / 1000000.0)
 
+/*
+ * DMA statistics
+ *
+ * Every process has its own slot of counters on the shared memory, on
+ * a separate cache line. Slot 0 is for the DMA worker, and the backends
+ * use MyBackendId. Only the owner process updates the slot, so plain
+ * read and write of the atomic variables are enough for the counters,
+ * without any locked instructions; pg_stat_gputest reads the slots without
+ * locks. latency_max is raised by a compare-and-exchange loop, so it never
+ * goes back even if the slot is written by someone else.
+ */
+typedef struct
+{
+	pg_atomic_uint32 pid;			/* 0, if not used */
+	pg_atomic_uint64 bytes_h2d;
+	pg_atomic_uint64 bytes_d2h;
+	pg_atomic_uint64 num_transfers;
+	pg_atomic_uint64 latency_sum;	/* usec */
+	pg_atomic_uint64 latency_max;	/* usec */
+	pg_atomic_uint64 register_time;	/* usec */
+} gputest_stat_counters;
+
+typedef union
+{
+	gputest_stat_counters c;
+	char		pad[PG_CACHE_LINE_SIZE];
+} gputest_stat_slot;
+
+/* slot 0 is for the DMA worker, and backend ids start at 1 */
+#define GPUTEST_STAT_NUM_SLOTS		(MaxBackends + 1)
+
+/*
+ * MaxBackends is not computed yet on _PG_init of PG14 or older, where the
+ * shared memory is requested; it is valid on the shmem_request_hook.
+ */
+#if PG_VERSION_NUM >= 150000
+#define GPUTEST_STAT_REQUEST_SLOTS	GPUTEST_STAT_NUM_SLOTS
+#elif PG_VERSION_NUM >= 120000
+#define GPUTEST_STAT_REQUEST_SLOTS										\
+	(1 + MaxConnections + autovacuum_max_workers + 1 +					\
+	 max_worker_processes + max_wal_senders)
+#else
+#define GPUTEST_STAT_REQUEST_SLOTS										\
+	(1 + MaxConnections + autovacuum_max_workers + 1 + max_worker_processes)
+#endif
+
+static gputest_stat_slot *stat_slots = NULL;
+static gputest_stat_counters *my_stat = NULL;
+
+static void
+gputest_stat_detach(int code, Datum arg)
+{
+	if (my_stat)
+		pg_atomic_write_u32(&my_stat->pid, 0);
+	my_stat = NULL;
+}
+
+/* assigns the slot of the counters to this process */
+static gputest_stat_counters *
+gputest_stat_attach(int index)
+{
+	gputest_stat_counters *c;
+
+	if (my_stat)
+		return my_stat;
+	if (!stat_slots || index < 0 || index >= GPUTEST_STAT_NUM_SLOTS)
+		return NULL;
+	c = &stat_slots[index].c;
+	pg_atomic_write_u64(&c->bytes_h2d, 0);
+	pg_atomic_write_u64(&c->bytes_d2h, 0);
+	pg_atomic_write_u64(&c->num_transfers, 0);
+	pg_atomic_write_u64(&c->latency_sum, 0);
+	pg_atomic_write_u64(&c->latency_max, 0);
+	pg_atomic_write_u64(&c->register_time, 0);
+	pg_atomic_write_u32(&c->pid, MyProcPid);
+	before_shmem_exit(gputest_stat_detach, 0);
+	my_stat = c;
+
+	return c;
+}
+
+#define GPUTEST_STAT_ADD(c,field,value)									\
+	pg_atomic_write_u64(&(c)->field,									\
+						pg_atomic_read_u64(&(c)->field) + (value))
+
+/*
+ * gputest_stat_count
+ *
+ * It counts count transfers of the total bytes, and their latency.
+ */
+static inline void
+gputest_stat_count(uint64 bytes_h2d, uint64 bytes_d2h, uint64 count,
+				   uint64 latency_sum, uint64 latency_max)
+{
+	gputest_stat_counters *c = (my_stat ? my_stat :
+								gputest_stat_attach(MyBackendId));
+	uint64		oldval;
+
+	if (!c)
+		return;
+	GPUTEST_STAT_ADD(c, bytes_h2d, bytes_h2d);
+	GPUTEST_STAT_ADD(c, bytes_d2h, bytes_d2h);
+	GPUTEST_STAT_ADD(c, num_transfers, count);
+	GPUTEST_STAT_ADD(c, latency_sum, latency_sum);
+
+	oldval = pg_atomic_read_u64(&c->latency_max);
+	while (latency_max > oldval)
+	{
+		/* oldval is updated on failure */
+		if (pg_atomic_compare_exchange_u64(&c->latency_max,
+										   &oldval, latency_max))
+			break;
+	}
+}
+
+static inline void
+gputest_stat_register(double elapsed)
+{
+	gputest_stat_counters *c = (my_stat ? my_stat :
+								gputest_stat_attach(MyBackendId));
+
+	if (c)
+		GPUTEST_STAT_ADD(c, register_time, (uint64)(elapsed * 1000000.0));
+}
+
 #ifdef GPUTEST_CUDA
 static bool			cuda_initialized = false;
 static CUdevice		cuda_device;
 static CUcontext	cuda_context = NULL;
+static Size			cuda_registered = 0;	/* BufferBlocks registered here */
 
 /* why CUDA 6.5 lacks declaration? */
 extern CUresult cuGetErrorString(CUresult error, const char** pStr);
@@ -57,6 +230,7 @@ cuda_strerror(CUresult rc)
 static cl_platform_id	opencl_platform_id;
 static cl_device_id		opencl_device_id;
 static cl_context		opencl_context = NULL;
+static cl_mem			opencl_buffer_blocks = NULL;	/* BufferBlocks */
 #endif
 
 Datum
@@ -89,11 +263,15 @@ gputest_init_opencl(PG_FUNCTION_ARGS)
 			elog(ERROR, "failed on cuCtxSetCurrent: %s", cuda_strerror(rc));
 
 		gettimeofday(&tv1, NULL);
+		/* mapped also, for gputest_scatter_gather to read it in place */
 		rc = cuMemHostRegister(BufferBlocks, NBuffers * (Size) BLCKSZ,
-							   CU_MEMHOSTREGISTER_PORTABLE);
+							   CU_MEMHOSTREGISTER_PORTABLE |
+							   CU_MEMHOSTREGISTER_DEVICEMAP);
 		if (rc != CUDA_SUCCESS)
 			elog(ERROR, "cuMemHostRegister: %s", cuda_strerror(rc));
+		cuda_registered = NBuffers * (Size) BLCKSZ;
 		gettimeofday(&tv2, NULL);
+		gputest_stat_register(TIMEVAL_DIFF(&tv2, &tv1));
 		elog(INFO, "cuMemHostRegister takes %.2fsec to map %zuGB",
 			 TIMEVAL_DIFF(&tv2, &tv1), ((Size)NBuffers * (Size) BLCKSZ) >> 30);
 	}
@@ -137,6 +315,7 @@ gputest_init_opencl(PG_FUNCTION_ARGS)
 	if (rc != CL_SUCCESS)
 		elog(ERROR, "failed on clCreateBuffer: %d", rc);
 	gettimeofday(&tv2, NULL);
+	gputest_stat_register(TIMEVAL_DIFF(&tv2, &tv1));
 	elog(LOG, "clCreateBuffer takes %.2fsec to map %zuGB",
 		 TIMEVAL_DIFF(&tv2, &tv1), ((Size)NBuffers * (Size) BLCKSZ) >> 30);
 #endif
@@ -144,21 +323,69 @@ gputest_init_opencl(PG_FUNCTION_ARGS)
 }
 PG_FUNCTION_INFO_V1(gputest_init_opencl);
 
-Datum
-gputest_dmasend_opencl(PG_FUNCTION_ARGS)
-{
+/*
+ * Per-backend DMA resources
+ *
+ * gputest_dmasend_opencl keeps the context, a pool of streams, device
+ * buffers and events across the calls, as long as gputest.dma_* are not
+ * changed. They are released on exit of the backend.
+ */
+#define GPUTEST_MAX_STREAMS		16
+#define GPUTEST_MAX_BUFFERS		16
+
+static int		dma_unit_size;		/* MB */
+static int		dma_num_streams;
+static int		dma_num_buffers;
+
 #ifdef GPUTEST_CUDA
+static CUcontext	dma_context = NULL;
+static Size			dma_unit_sz = 0;	/* 0 until the setup completes */
+static int			dma_nstreams;
+static int			dma_nbuffers;
+static CUstream		dma_streams[GPUTEST_MAX_STREAMS];
+static CUdeviceptr	dma_buffers[GPUTEST_MAX_BUFFERS];
+static CUevent		dma_events[GPUTEST_MAX_BUFFERS];	/* buffer is free */
+static CUevent	   *dma_timing = NULL;	/* start/end of chunks, and base */
+static int			dma_ntiming = 0;
+static int			dma_ntiming_max = 0;
+static char		   *dma_staging = NULL;	/* pinned, a unit per buffer */
+static bool			dma_exit_registered = false;
+static double		dma_cold_latency = -1.0;	/* sec */
+static double		dma_warm_latency = 0.0;		/* sum of warm calls */
+static int			dma_warm_count = 0;
+
+static void
+gputest_dma_exit(int code, Datum arg)
+{
+	/* streams, buffers and events go away with the context */
+	if (dma_context)
+		cuCtxDestroy(dma_context);
+	dma_context = NULL;
+}
+
+/*
+ * gputest_dma_setup
+ *
+ * It makes the cached resources current, or builds them if none or if
+ * gputest.dma_* were changed. Returns true if it was a cold call.
+ */
+static bool
+gputest_dma_setup(void)
+{
 	CUdevice	device;
-	CUcontext	context;
-	CUstream	stream;
-	CUdeviceptr	daddr;
-	CUevent		start;
-	CUevent		stop;
 	CUresult	rc;
-	int			loop;
-	float		elapsed;
-	Size		unitsz = 100 * 1024 * 1024; //100MB
-	Size		offset;
+	int			i;
+
+	if (dma_context &&
+		dma_unit_sz == (Size) dma_unit_size << 20 &&
+		dma_nstreams == dma_num_streams &&
+		dma_nbuffers == dma_num_buffers)
+	{
+		rc = cuCtxSetCurrent(dma_context);
+		if (rc != CUDA_SUCCESS)
+			elog(ERROR, "failed on cuCtxSetCurrent: %s", cuda_strerror(rc));
+		return false;
+	}
 
 	if (!cuda_initialized)
 	{
@@ -168,78 +395,402 @@ gputest_dmasend_opencl(PG_FUNCTION_ARGS)
 		cuda_initialized = true;
 	}
 
+	if (!dma_exit_registered)
+	{
+		before_shmem_exit(gputest_dma_exit, 0);
+		dma_exit_registered = true;
+	}
+
+	if (dma_context)
+	{
+		rc = cuCtxDestroy(dma_context);
+		if (rc != CUDA_SUCCESS)
+			elog(ERROR, "failed on cuCtxDestroy: %s", cuda_strerror(rc));
+		dma_context = NULL;
+	}
+	dma_unit_sz = 0;
+	dma_ntiming = 0;	/* events went away with the context */
+	dma_staging = NULL;	/* so did the staging buffer */
+
 	rc = cuDeviceGet(&device, 0);
 	if (rc != CUDA_SUCCESS)
 		elog(ERROR, "failed on cuDeviceGet: %s", cuda_strerror(rc));
 
-	rc = cuCtxCreate(&context, 0, device);
+	rc = cuCtxCreate(&dma_context, 0, device);
 	if (rc != CUDA_SUCCESS)
+	{
+		dma_context = NULL;
 		elog(ERROR, "failed on cuCtxCreate: %s", cuda_strerror(rc));
+	}
 
-	rc = cuCtxSetCurrent(context);
-	if (rc != CUDA_SUCCESS)
-		elog(ERROR, "failed on cuCtxSetCurrent: %s", cuda_strerror(rc));
+	for (i=0; i < dma_num_streams; i++)
+	{
+		rc = cuStreamCreate(&dma_streams[i], CU_STREAM_DEFAULT);
+		if (rc != CUDA_SUCCESS)
+			elog(ERROR, "failed on cuStreamCreate: %s", cuda_strerror(rc));
+	}
 
-	rc = cuStreamCreate(&stream, CU_STREAM_DEFAULT);
-	if (rc != CUDA_SUCCESS)
-        elog(ERROR, "failed on cuStreamCreate: %s", cuda_strerror(rc));
+	for (i=0; i < dma_num_buffers; i++)
+	{
+		rc = cuMemAlloc(&dma_buffers[i], (Size) dma_unit_size << 20);
+		if (rc != CUDA_SUCCESS)
+			elog(ERROR, "failed on cuMemAlloc: %s", cuda_strerror(rc));
+	}
 
-	rc = cuMemAlloc(&daddr, unitsz);
-	if (rc != CUDA_SUCCESS)
-		elog(ERROR, "failed on cuMemAlloc: %s", cuda_strerror(rc));
+	for (i=0; i < dma_num_buffers; i++)
+	{
+		rc = cuEventCreate(&dma_events[i], CU_EVENT_DISABLE_TIMING);
+		if (rc != CUDA_SUCCESS)
+			elog(ERROR, "failed on cuEventCreate: %s", cuda_strerror(rc));
+	}
 
-	rc = cuEventCreate(&start, CU_EVENT_DEFAULT);
-	if (rc != CUDA_SUCCESS)
-		elog(ERROR, "failed on cuEventCreate: %s", cuda_strerror(rc));
+	dma_nstreams = dma_num_streams;
+	dma_nbuffers = dma_num_buffers;
+	dma_unit_sz = (Size) dma_unit_size << 20;
+
+	return true;
+}
+
+/*
+ * gputest_dma_staging
+ *
+ * It returns the pinned staging buffer, a unit per device buffer, for the
+ * regions not registered on this backend.
+ */
+static char *
+gputest_dma_staging(void)
+{
+	CUresult	rc;
+
+	if (!dma_staging)
+	{
+		rc = cuMemHostAlloc((void **)&dma_staging,
+							dma_nbuffers * dma_unit_sz, 0);
+		if (rc != CUDA_SUCCESS)
+		{
+			dma_staging = NULL;
+			elog(ERROR, "failed on cuMemHostAlloc: %s", cuda_strerror(rc));
+		}
+	}
+	return dma_staging;
+}
+
+/*
+ * gputest_dma_timing
+ *
+ * It makes at least nevents timing events on dma_timing; they are kept
+ * with the context.
+ */
+static void
+gputest_dma_timing(int nevents)
+{
+	CUresult	rc;
+
+	if (dma_ntiming_max < nevents)
+	{
+		CUevent	   *temp = MemoryContextAlloc(TopMemoryContext,
+											  sizeof(CUevent) * nevents);
+
+		if (dma_timing)
+		{
+			memcpy(temp, dma_timing, sizeof(CUevent) * dma_ntiming);
+			pfree(dma_timing);
+		}
+		dma_timing = temp;
+		dma_ntiming_max = nevents;
+	}
+	while (dma_ntiming < nevents)
+	{
+		rc = cuEventCreate(&dma_timing[dma_ntiming], CU_EVENT_DEFAULT);
+		if (rc != CUDA_SUCCESS)
+			elog(ERROR, "failed on cuEventCreate: %s", cuda_strerror(rc));
+		dma_ntiming++;
+	}
+}
+
+/*
+ * gputest_dma_latency
+ *
+ * It returns the latency in usec of a DMA, from its enqueue on the host
+ * to its end event. The base event was recorded at base_at on the host,
+ * on an idle stream.
+ */
+static uint64
+gputest_dma_latency(CUevent base, double base_at, CUevent end, double sent_at)
+{
+	CUresult	rc;
+	float		msec;
+	double		latency;
 
-	rc = cuEventCreate(&stop, CU_EVENT_DEFAULT);
+	rc = cuEventElapsedTime(&msec, base, end);
 	if (rc != CUDA_SUCCESS)
-		elog(ERROR, "failed on cuEventCreate: %s", cuda_strerror(rc));
+		elog(ERROR, "failed on cuEventElapsedTime: %s", cuda_strerror(rc));
+	latency = (double) msec * 1000.0 - (sent_at - base_at) * 1000000.0;
+
+	return latency > 0.0 ? (uint64) latency : 0;
+}
+#endif
+
+/*
+ * Per-chunk statistics of gputest_dma_run
+ */
+typedef struct
+{
+	int			run;
+	Size		offset;
+	Size		length;
+	double		enqueue;		/* usec spent to enqueue the DMA */
+	double		start;			/* usec since beginning of the run */
+	double		end;
+	int			stream;
+	int			device;
+} gputest_chunk_stat;
+
+#ifdef GPUTEST_CUDA
+/*
+ * gputest_dma_run
+ *
+ * It sends the whole of BufferBlocks by the cached resources, and waits for
+ * completion. End of every chunk is recorded by an event, for its latency.
+ * If stats is given, start of every chunk is recorded as well, and both are
+ * filled on the stats after the synchronization.
+ * Chunks beyond the region registered by gputest_init_opencl are copied to
+ * the staging buffer, then sent from there. Returns number of such chunks.
+ */
+static int
+gputest_dma_run(int run, gputest_chunk_stat *stats)
+{
+	Size		total = NBuffers * (Size) BLCKSZ;
+	Size		unitsz = dma_unit_sz;
+	int			nchunks = (total + unitsz - 1) / unitsz;
+	Size		offset;
+	CUevent		base;
+	CUresult	rc;
+	double		tv1;
+	double		base_at;
+	double	   *sent_at;		/* enqueue time of each chunk */
+	uint64		latency;
+	uint64		latency_sum = 0;
+	uint64		latency_max = 0;
+	float		msec;
+	int			index;
+	int			num_staged = 0;
+
+	/* two events per chunk and a base */
+	gputest_dma_timing(2 * nchunks + 1);
+	base = dma_timing[2 * nchunks];
+	sent_at = palloc(sizeof(double) * nchunks);
 
-	rc = cuEventRecord(start, stream);
+	/* all the streams start after the base */
+	rc = cuEventRecord(base, dma_streams[0]);
 	if (rc != CUDA_SUCCESS)
 		elog(ERROR, "failed on cuEventRecord: %s", cuda_strerror(rc));
+	base_at = dma_timer_now();
+	for (index = 1; index < dma_nstreams; index++)
+	{
+		rc = cuStreamWaitEvent(dma_streams[index], base, 0);
+		if (rc != CUDA_SUCCESS)
+			elog(ERROR, "failed on cuStreamWaitEvent: %s",
+				 cuda_strerror(rc));
+	}
 
-	for (loop = 0; loop < 1; loop++)
+	for (offset = 0, index = 0; offset < total; offset += unitsz, index++)
 	{
-		for (offset = 0;
-			 offset < NBuffers * (Size) BLCKSZ - unitsz;
-			 offset += unitsz)
+		CUstream	stream = dma_streams[index % dma_nstreams];
+		int			k = index % dma_nbuffers;
+		Size		length = Min(unitsz, total - offset);
+		const char *haddr = BufferBlocks + offset;
+		bool		staged = (offset + length > cuda_registered);
+
+		/* the previous DMA into this buffer must be done */
+		if (index >= dma_nbuffers && staged)
 		{
-			rc = cuMemcpyHtoDAsync(daddr,
-								   BufferBlocks + offset,
-								   unitsz,
-								   stream);
+			/* also from the staging slot, which is overwritten by the host */
+			rc = cuEventSynchronize(dma_events[k]);
 			if (rc != CUDA_SUCCESS)
-				elog(ERROR, "failed on cuMemcpyHtoDAsync: %s",
+				elog(ERROR, "failed on cuEventSynchronize: %s",
+					 cuda_strerror(rc));
+		}
+		else if (index >= dma_nbuffers)
+		{
+			rc = cuStreamWaitEvent(stream, dma_events[k], 0);
+			if (rc != CUDA_SUCCESS)
+				elog(ERROR, "failed on cuStreamWaitEvent: %s",
 					 cuda_strerror(rc));
 		}
+		if (stats)
+		{
+			rc = cuEventRecord(dma_timing[2 * index], stream);
+			if (rc != CUDA_SUCCESS)
+				elog(ERROR, "failed on cuEventRecord: %s", cuda_strerror(rc));
+		}
+		tv1 = dma_timer_now();
+		sent_at[index] = tv1;
+		if (staged)
+		{
+			char   *stage = gputest_dma_staging() + k * unitsz;
+
+			memcpy(stage, haddr, length);
+			haddr = stage;
+			num_staged++;
+		}
+		rc = cuMemcpyHtoDAsync(dma_buffers[k],
+							   haddr,
+							   length,
+							   stream);
+		if (rc != CUDA_SUCCESS)
+			elog(ERROR, "failed on cuMemcpyHtoDAsync: %s",
+				 cuda_strerror(rc));
+		if (stats)
+		{
+			stats[index].run = run;
+			stats[index].offset = offset;
+			stats[index].length = length;
+			stats[index].enqueue = (dma_timer_now() - tv1) * 1000000.0;
+			stats[index].stream = index % dma_nstreams;
+			stats[index].device = 0;
+		}
+		rc = cuEventRecord(dma_timing[2 * index + 1], stream);
+		if (rc != CUDA_SUCCESS)
+			elog(ERROR, "failed on cuEventRecord: %s", cuda_strerror(rc));
+		rc = cuEventRecord(dma_events[k], stream);
+		if (rc != CUDA_SUCCESS)
+			elog(ERROR, "failed on cuEventRecord: %s", cuda_strerror(rc));
 	}
-	rc = cuEventRecord(stop, stream);
+	rc = cuCtxSynchronize();
 	if (rc != CUDA_SUCCESS)
-		elog(ERROR, "failed on cuEventRecord: %s", cuda_strerror(rc));
+		elog(ERROR, "failed on cuCtxSynchronize: %s", cuda_strerror(rc));
 
-	rc = cuStreamSynchronize(stream);
-	if (rc !=  CUDA_SUCCESS)
-		elog(ERROR, "failed on cuStreamSynchronize: %s", cuda_strerror(rc));
+	/* every chunk has its own completion on the end event */
+	for (index = 0; index < nchunks; index++)
+	{
+		latency = gputest_dma_latency(base, base_at,
+									  dma_timing[2 * index + 1],
+									  sent_at[index]);
+		latency_sum += latency;
+		latency_max = Max(latency_max, latency);
+	}
+	gputest_stat_count(total, 0, nchunks, latency_sum, latency_max);
+	pfree(sent_at);
 
-	rc = cuEventElapsedTime (&elapsed, start, stop);
-	if (rc !=  CUDA_SUCCESS)
-		elog(ERROR, "failed on cuEventElapsedTime: %s", cuda_strerror(rc));
-	elapsed /= 1000000.0;	/* sec */
+	if (stats)
+	{
+		for (index = 0; index < nchunks; index++)
+		{
+			rc = cuEventElapsedTime(&msec, base, dma_timing[2 * index]);
+			if (rc != CUDA_SUCCESS)
+				elog(ERROR, "failed on cuEventElapsedTime: %s",
+					 cuda_strerror(rc));
+			stats[index].start = (double) msec * 1000.0;
+			rc = cuEventElapsedTime(&msec, base, dma_timing[2 * index + 1]);
+			if (rc != CUDA_SUCCESS)
+				elog(ERROR, "failed on cuEventElapsedTime: %s",
+					 cuda_strerror(rc));
+			stats[index].end = (double) msec * 1000.0;
+		}
+	}
+	return num_staged;
+}
+#endif
+
+/*
+ * gputest_dma_chunks
+ *
+ * It runs gputest_dma_run nloops times and returns the statistics of all
+ * the chunks, on a single allocation; it may exceed MaxAllocSize with many
+ * loops of small units.
+ */
+static gputest_chunk_stat *
+gputest_dma_chunks(int nloops, Size *p_count)
+{
+#ifdef GPUTEST_CUDA
+	gputest_chunk_stat *stats;
+	Size		total = NBuffers * (Size) BLCKSZ;
+	Size		nchunks;
+	int			loop;
 
-	rc = cuMemFree(daddr);
-	if (rc !=  CUDA_SUCCESS)
-		elog(ERROR, "failed on cuMemFree: %s", cuda_strerror(rc));
+	if (nloops < 1)
+		elog(ERROR, "number of loops must be positive");
 
-	elog(INFO, "%zu GB DMA took %.2f sec (%.2f GB/sec)",
-		 (loop * NBuffers * (Size) BLCKSZ) >> 30,
-		 elapsed,
-		 (double)((loop * NBuffers * (Size) BLCKSZ) >> 30) / elapsed);
+	gputest_dma_setup();
+	nchunks = (total + dma_unit_sz - 1) / dma_unit_sz;
+	stats = MemoryContextAllocHuge(CurrentMemoryContext,
+								   sizeof(gputest_chunk_stat) *
+								   nchunks * (Size) nloops);
+	for (loop = 0; loop < nloops; loop++)
+		gputest_dma_run(loop, stats + loop * nchunks);
+	*p_count = nchunks * (Size) nloops;
 
-	rc = cuCtxDestroy(context);
-	if (rc != CUDA_SUCCESS)
-		elog(ERROR, "failed on cuCtxDestroy: %s", cuda_strerror(rc));
+	return stats;
+#endif
+#ifdef GPUTEST_OPENCL
+	elog(ERROR, "per-chunk statistics are supported only on CUDA");
+	return NULL;
+#endif
+}
+
+/*
+ * gputest_dmasend_opencl()
+ *
+ * It sends the whole of BufferBlocks to the device by units of
+ * gputest.dma_unit_size, round-robin across gputest.dma_streams streams
+ * into gputest.dma_buffers rotating device buffers, then returns a row of
+ * bytes, seconds and GB/sec. It shall be declared as:
+ *
+ *   CREATE FUNCTION gputest_dmasend_opencl(OUT bytes bigint,
+ *                                          OUT seconds float8,
+ *                                          OUT gb_per_sec float8)
+ *     RETURNS record AS 'gputest' LANGUAGE C;
+ *
+ * OpenCL build only registers BufferBlocks, and returns the rate of it.
+ */
+Datum
+gputest_dmasend_opencl(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[3];
+	bool		isnull[3];
+	Size		total = NBuffers * (Size) BLCKSZ;
+	double		elapsed;
+#ifdef GPUTEST_CUDA
+	Size		unitsz;
+	bool		cold;
+	int			num_staged;
+	double		tv1, tv2, tv3, tv4;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tv1 = dma_timer_now();
+	cold = gputest_dma_setup();
+	tv2 = dma_timer_now();
+	unitsz = dma_unit_sz;
+	num_staged = gputest_dma_run(0, NULL);
+	tv3 = dma_timer_now();
+	elapsed = tv3 - tv2;
+
+	elog(INFO, "%zu bytes DMA by %d streams x %d buffers of %zuMB took %.2f sec (%.2f GB/sec)",
+		 total, dma_nstreams, dma_nbuffers, unitsz >> 20, elapsed,
+		 (double) total / (double)(1UL << 30) / elapsed);
+	if (num_staged > 0)
+		elog(INFO, "%d chunks were sent through the staging buffer; run gputest_init_opencl to register BufferBlocks",
+			 num_staged);
+
+	tv4 = dma_timer_now();
+	if (cold)
+		dma_cold_latency = tv4 - tv1;
+	else
+	{
+		dma_warm_latency += tv4 - tv1;
+		dma_warm_count++;
+	}
+	elog(INFO, "%s call: setup %.3f ms, total %.3f ms",
+		 cold ? "cold" : "warm", (tv2 - tv1) * 1000.0, (tv4 - tv1) * 1000.0);
+	if (dma_cold_latency >= 0.0 && dma_warm_count > 0)
+		elog(INFO, "latency of cold call %.3f ms, warm calls %.3f ms (avg of %d)",
+			 dma_cold_latency * 1000.0,
+			 dma_warm_latency * 1000.0 / (double) dma_warm_count,
+			 dma_warm_count);
 #endif
 #ifdef GPUTEST_OPENCL
 	cl_int			rc;
@@ -272,105 +823,1356 @@ gputest_dmasend_opencl(PG_FUNCTION_ARGS)
 	(void) clCreateBuffer(opencl_context,
 						  CL_MEM_READ_WRITE |
 						  CL_MEM_USE_HOST_PTR,
-						  NBuffers * (Size) BLCKSZ,
+						  total,
 						  BufferBlocks,
 						  &rc);
 	if (rc != CL_SUCCESS)
 		elog(ERROR, "failed on clCreateBuffer: %d", rc);
 	gettimeofday(&tv2, NULL);
+	elapsed = TIMEVAL_DIFF(&tv2, &tv1);
+	gputest_stat_register(elapsed);
 	elog(LOG, "clCreateBuffer takes %.2fsec to map %zuGB",
-		 TIMEVAL_DIFF(&tv2, &tv1), ((Size)NBuffers * (Size) BLCKSZ) >> 30);
+		 elapsed, total >> 30);
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
 #endif
-	PG_RETURN_NULL();
+	memset(isnull, 0, sizeof(isnull));
+	values[0] = Int64GetDatum(total);
+	values[1] = Float8GetDatum(elapsed);
+	values[2] = Float8GetDatum((double) total / (double)(1UL << 30) / elapsed);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc,
+													   values,
+													   isnull)));
 }
 PG_FUNCTION_INFO_V1(gputest_dmasend_opencl);
 
+/*
+ * gputest_dmasend_chunks(loops int4)
+ *
+ * It sends BufferBlocks loops times like gputest_dmasend_opencl, then
+ * returns a row for each chunk. Rows are put on the tuplestore after the
+ * measurement. It shall be declared as:
+ *
+ *   CREATE FUNCTION gputest_dmasend_chunks(loops int4 DEFAULT 1,
+ *                                          OUT run int4,
+ *                                          OUT chunk_offset bigint,
+ *                                          OUT bytes bigint,
+ *                                          OUT enqueue_us float8,
+ *                                          OUT start_us float8,
+ *                                          OUT end_us float8,
+ *                                          OUT stream int4,
+ *                                          OUT device int4)
+ *     RETURNS SETOF record AS 'gputest' LANGUAGE C;
+ */
 Datum
-gputest_cleanup_opencl(PG_FUNCTION_ARGS)
+gputest_dmasend_chunks(PG_FUNCTION_ARGS)
 {
-#ifdef GPUTEST_CUDA
-	CUresult	rc;
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	int32		nloops = PG_GETARG_INT32(0);
+	gputest_chunk_stat *stats;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext oldcxt;
+	Datum		values[8];
+	bool		isnull[8];
+	Size		count;
+	Size		i;
 
-	if (!cuda_initialized)
+	if (!rsinfo || !IsA(rsinfo, ReturnSetInfo) ||
+		(rsinfo->allowedModes & SFRM_Materialize) == 0)
+		elog(ERROR, "set-valued function called in context that cannot accept a set");
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	stats = gputest_dma_chunks(nloops, &count);
+
+	oldcxt = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcxt);
+
+	memset(isnull, 0, sizeof(isnull));
+	for (i=0; i < count; i++)
 	{
-		rc = cuInit(0);
-		if (rc != CUDA_SUCCESS)
-			elog(ERROR, "failed on cuInit: %s", cuda_strerror(rc));
-		cuda_initialized = true;
+		values[0] = Int32GetDatum(stats[i].run);
+		values[1] = Int64GetDatum(stats[i].offset);
+		values[2] = Int64GetDatum(stats[i].length);
+		values[3] = Float8GetDatum(stats[i].enqueue);
+		values[4] = Float8GetDatum(stats[i].start);
+		values[5] = Float8GetDatum(stats[i].end);
+		values[6] = Int32GetDatum(stats[i].stream);
+		values[7] = Int32GetDatum(stats[i].device);
+		tuplestore_putvalues(tupstore, tupdesc, values, isnull);
 	}
+	tuplestore_donestoring(tupstore);
+	pfree(stats);
 
-	if (cuda_context)
+	return (Datum) 0;
+}
+PG_FUNCTION_INFO_V1(gputest_dmasend_chunks);
+
+/*
+ * gputest_dmasend_summary(loops int4)
+ *
+ * It sends BufferBlocks loops times like gputest_dmasend_opencl, then
+ * returns a row of the throughput and the percentiles of enqueue time and
+ * DMA time per chunk. It shall be declared as:
+ *
+ *   CREATE FUNCTION gputest_dmasend_summary(loops int4 DEFAULT 1,
+ *                                           OUT chunks bigint,
+ *                                           OUT bytes bigint,
+ *                                           OUT seconds float8,
+ *                                           OUT gb_per_sec float8,
+ *                                           OUT enqueue_p50_us float8,
+ *                                           OUT enqueue_p99_us float8,
+ *                                           OUT dma_p50_us float8,
+ *                                           OUT dma_p90_us float8,
+ *                                           OUT dma_p99_us float8,
+ *                                           OUT dma_max_us float8)
+ *     RETURNS record AS 'gputest' LANGUAGE C;
+ */
+Datum
+gputest_dmasend_summary(PG_FUNCTION_ARGS)
+{
+	int32		nloops = PG_GETARG_INT32(0);
+	gputest_chunk_stat *stats;
+	dma_histogram *enqueue;
+	dma_histogram *dma;
+	TupleDesc	tupdesc;
+	Datum		values[10];
+	bool		isnull[10];
+	Size		bytes = 0;
+	double		seconds = 0.0;
+	double		span = 0.0;
+	Size		count;
+	Size		i;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	stats = gputest_dma_chunks(nloops, &count);
+
+	enqueue = palloc(sizeof(dma_histogram));
+	dma = palloc(sizeof(dma_histogram));
+	dma_histogram_init(enqueue);
+	dma_histogram_init(dma);
+	for (i=0; i < count; i++)
 	{
-		rc = cuCtxDestroy(cuda_context);
-		if (rc != CUDA_SUCCESS)
-			elog(ERROR, "failed on cuCtxDestroy: %s", cuda_strerror(rc));
-		cuda_context = NULL;
+		/* a run lasts until its last chunk completes */
+		if (i > 0 && stats[i].run != stats[i-1].run)
+		{
+			seconds += span / 1000000.0;
+			span = 0.0;
+		}
+		span = Max(span, stats[i].end);
+		bytes += stats[i].length;
+		dma_histogram_add(enqueue, (uint64) (stats[i].enqueue * 1000.0));
+		dma_histogram_add(dma, (uint64) ((stats[i].end -
+										  stats[i].start) * 1000.0));
 	}
-	else
-		elog(INFO, "no cuda context exists");
-#endif
-#ifdef GPUTEST_OPENCL
+	seconds += span / 1000000.0;
+
+	memset(isnull, 0, sizeof(isnull));
+	values[0] = Int64GetDatum(count);
+	values[1] = Int64GetDatum(bytes);
+	values[2] = Float8GetDatum(seconds);
+	values[3] = Float8GetDatum((double) bytes / (double)(1UL << 30) / seconds);
+	values[4] = Float8GetDatum(dma_histogram_percentile(enqueue, 50.0) / 1000.0);
+	values[5] = Float8GetDatum(dma_histogram_percentile(enqueue, 99.0) / 1000.0);
+	values[6] = Float8GetDatum(dma_histogram_percentile(dma, 50.0) / 1000.0);
+	values[7] = Float8GetDatum(dma_histogram_percentile(dma, 90.0) / 1000.0);
+	values[8] = Float8GetDatum(dma_histogram_percentile(dma, 99.0) / 1000.0);
+	values[9] = Float8GetDatum(dma->max / 1000.0);
 
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc,
+													   values,
+													   isnull)));
+}
+PG_FUNCTION_INFO_V1(gputest_dmasend_summary);
 
+/*
+ * gputest_dmasend_relation(regclass)
+ *
+ * It sends the blocks of the relation to the device. Blocks resident on
+ * the shared buffer are sent straight from BufferBlocks, and the adjacent
+ * ones are merged into a DMA. Other blocks are read into the pinned staging
+ * buffer with read-ahead, then sent at the end of the unit. A unit of
+ * gputest.dma_unit_size is packed into a device buffer, and the units are
+ * round-robin across the streams like gputest_dmasend_opencl.
+ * Unless BufferBlocks is registered by gputest_init_opencl beforehand, the
+ * resident blocks are copied to the staging buffer as well. The resident
+ * blocks sent straight stay pinned until their DMA is done; they are
+ * limited to 1/GPUTEST_PIN_FRACTION of the shared buffer in total, and
+ * the rest are copied to the staging buffer.
+ * It shall be declared as:
+ *
+ *   CREATE FUNCTION gputest_dmasend_relation(regclass,
+ *                                            OUT pages bigint,
+ *                                            OUT hit_ratio float8,
+ *                                            OUT bytes bigint,
+ *                                            OUT seconds float8,
+ *                                            OUT pages_per_sec float8)
+ *     RETURNS record AS 'gputest' LANGUAGE C;
+ */
+#define GPUTEST_READAHEAD		64		/* blocks */
+#define GPUTEST_PIN_FRACTION	4
 
+#ifdef GPUTEST_CUDA
+/*
+ * RelationOpenSmgr was removed at PG15; the smgr shall be fetched on every
+ * use, because a relcache flush may close it.
+ */
+static inline SMgrRelation
+gputest_relation_smgr(Relation rel)
+{
+#if PG_VERSION_NUM >= 150000
+	return RelationGetSmgr(rel);
+#else
+	RelationOpenSmgr(rel);
+	return rel->rd_smgr;
 #endif
-	PG_RETURN_NULL();
 }
-PG_FUNCTION_INFO_V1(gputest_cleanup_opencl);
 
+/*
+ * enqueues a DMA from the host memory to the device buffer; *sent_at is
+ * set on the first DMA of the unit.
+ */
 static void
-gputest_init(void)
+gputest_relation_send(CUstream stream, CUdeviceptr daddr,
+					  const char *haddr, Size length, double *sent_at)
 {
-#ifdef GPUTEST_CUDA
-	int			n_devices;
-	CUdevice	devices[10];
-	CUcontext	context;
 	CUresult	rc;
-	struct timeval tv1, tv2;
 
-	if (shmem_startup_hook_next)
-		(*shmem_startup_hook_next)();
-
-	elog(LOG, "Loading GPU Tests");
+	if (length == 0)
+		return;
+	if (*sent_at == 0.0)
+		*sent_at = dma_timer_now();
+	rc = cuMemcpyHtoDAsync(daddr, haddr, length, stream);
+	if (rc != CUDA_SUCCESS)
+		elog(ERROR, "failed on cuMemcpyHtoDAsync: %s", cuda_strerror(rc));
+}
+#endif
+
+Datum
+gputest_dmasend_relation(PG_FUNCTION_ARGS)
+{
+#ifdef GPUTEST_CUDA
+	Oid			relid = PG_GETARG_OID(0);
+	Relation	rel;
+	BlockNumber	nblocks;
+	BlockNumber	blkno;
+	BlockNumber	prefetch;
+	TupleDesc	tupdesc;
+	Datum		values[5];
+	bool		isnull[5];
+	Buffer	   *pins;			/* pinned buffers of each unit */
+	int		   *num_pins;
+	int			max_pins;		/* pinned buffers per unit */
+	double	   *sent_at;		/* enqueue time of each unit */
+	CUevent		base;
+	double		base_at;
+	uint64		latency;		/* usec */
+	int			num_units;
+	int			unit_pages;
+	int			index;
+	uint64		num_hits = 0;
+	Size		bytes = 0;
+	char	   *staging;
+	double		tv1, tv2, elapsed;
+	CUresult	rc;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	gputest_dma_setup();
+	unit_pages = dma_unit_sz / BLCKSZ;
+	staging = gputest_dma_staging();
+	max_pins = Min(unit_pages,
+				   NBuffers / (GPUTEST_PIN_FRACTION * dma_nbuffers));
+	pins = palloc(sizeof(Buffer) * max_pins * dma_nbuffers);
+	num_pins = palloc0(sizeof(int) * dma_nbuffers);
+	sent_at = palloc0(sizeof(double) * dma_nbuffers);
+
+	/* end event of each unit slot, and a base */
+	gputest_dma_timing(dma_nbuffers + 1);
+	base = dma_timing[dma_nbuffers];
+
+	rel = relation_open(relid, AccessShareLock);
+	if (rel->rd_rel->relkind != RELKIND_RELATION &&
+		rel->rd_rel->relkind != RELKIND_INDEX &&
+		rel->rd_rel->relkind != RELKIND_TOASTVALUE &&
+		rel->rd_rel->relkind != RELKIND_MATVIEW)
+		elog(ERROR, "\"%s\" has no storage", RelationGetRelationName(rel));
+	/* resident blocks of local buffers are not on BufferBlocks */
+	if (RelationUsesLocalBuffers(rel))
+		elog(ERROR, "\"%s\" is a temporary relation",
+			 RelationGetRelationName(rel));
+	nblocks = RelationGetNumberOfBlocks(rel);
+
+	tv1 = dma_timer_now();
+	rc = cuEventRecord(base, dma_streams[0]);
+	if (rc != CUDA_SUCCESS)
+		elog(ERROR, "failed on cuEventRecord: %s", cuda_strerror(rc));
+	base_at = dma_timer_now();
+	prefetch = 0;
+	for (blkno = 0, index = 0; blkno < nblocks; index++)
+	{
+		CUstream	stream = dma_streams[index % dma_nstreams];
+		CUdeviceptr	dbuf = dma_buffers[index % dma_nbuffers];
+		int			k = index % dma_nbuffers;
+		char	   *stage = staging + k * dma_unit_sz;
+		Buffer	   *unit_pins = pins + k * max_pins;
+		const char *run = NULL;	/* run of resident blocks */
+		Size		run_len = 0;
+		Size		dpos = 0;		/* offset on the device buffer */
+		Size		spos = 0;		/* offset on the staging buffer */
+		int			i;
+
+		/* the previous unit on this slot must be sent */
+		if (index >= dma_nbuffers)
+		{
+			rc = cuEventSynchronize(dma_events[k]);
+			if (rc != CUDA_SUCCESS)
+				elog(ERROR, "failed on cuEventSynchronize: %s",
+					 cuda_strerror(rc));
+			latency = gputest_dma_latency(base, base_at,
+										  dma_timing[k], sent_at[k]);
+			gputest_stat_count(0, 0, 1, latency, latency);
+		}
+		for (i=0; i < num_pins[k]; i++)
+			ReleaseBuffer(unit_pins[i]);
+		num_pins[k] = 0;
+		sent_at[k] = 0.0;
+
+		for (i=0; i < unit_pages && blkno < nblocks; i++, blkno++)
+		{
+			BufferTag	tag;
+			uint32		hash;
+			LWLock	   *lock;
+			int			buf_id;
+
+			CHECK_FOR_INTERRUPTS();
+
+			/* read-ahead of the blocks not on the shared buffer */
+			for (; prefetch < Min(blkno + GPUTEST_READAHEAD, nblocks);
+				 prefetch++)
+				PrefetchBuffer(rel, MAIN_FORKNUM, prefetch);
+
+			INIT_BUFFERTAG(tag, gputest_relation_smgr(rel)->smgr_rnode.node,
+						   MAIN_FORKNUM, blkno);
+			hash = BufTableHashCode(&tag);
+			lock = BufMappingPartitionLock(hash);
+			LWLockAcquire(lock, LW_SHARED);
+			buf_id = BufTableLookup(&tag, hash);
+			LWLockRelease(lock);
+
+			if (buf_id >= 0 &&
+				(cuda_registered == 0 || num_pins[k] >= max_pins))
+			{
+				Buffer		buffer;
+
+				/*
+				 * not registered, or too many pins already; it is copied
+				 * under a short-lived pin
+				 */
+				buffer = ReadBufferExtended(rel, MAIN_FORKNUM, blkno,
+											RBM_NORMAL, NULL);
+				memcpy(stage + spos, BufferGetBlock(buffer), BLCKSZ);
+				ReleaseBuffer(buffer);
+				spos += BLCKSZ;
+				num_hits++;
+			}
+			else if (buf_id >= 0)
+			{
+				Buffer		buffer;
+				char	   *page;
+
+				/* pin it until the DMA is done; it hits the shared buffer */
+				buffer = ReadBufferExtended(rel, MAIN_FORKNUM, blkno,
+											RBM_NORMAL, NULL);
+				unit_pins[num_pins[k]++] = buffer;
+				page = BufferGetBlock(buffer);
+				if (run && run + run_len == page)
+					run_len += BLCKSZ;
+				else
+				{
+					gputest_relation_send(stream, dbuf + dpos, run, run_len,
+										  &sent_at[k]);
+					dpos += run_len;
+					run = page;
+					run_len = BLCKSZ;
+				}
+				num_hits++;
+			}
+			else
+			{
+				smgrread(gputest_relation_smgr(rel), MAIN_FORKNUM, blkno,
+						 stage + spos);
+				spos += BLCKSZ;
+			}
+		}
+		gputest_relation_send(stream, dbuf + dpos, run, run_len,
+							  &sent_at[k]);
+		dpos += run_len;
+		gputest_relation_send(stream, dbuf + dpos, stage, spos,
+							  &sent_at[k]);
+		dpos += spos;
+		bytes += dpos;
+		gputest_stat_count(dpos, 0, 0, 0, 0);
+
+		rc = cuEventRecord(dma_timing[k], stream);
+		if (rc != CUDA_SUCCESS)
+			elog(ERROR, "failed on cuEventRecord: %s", cuda_strerror(rc));
+		rc = cuEventRecord(dma_events[k], stream);
+		if (rc != CUDA_SUCCESS)
+			elog(ERROR, "failed on cuEventRecord: %s", cuda_strerror(rc));
+	}
+	num_units = index;
+	rc = cuCtxSynchronize();
+	if (rc != CUDA_SUCCESS)
+		elog(ERROR, "failed on cuCtxSynchronize: %s", cuda_strerror(rc));
+
+	tv2 = dma_timer_now();
+	elapsed = tv2 - tv1;
+	for (index = Max(0, index - dma_nbuffers); index < num_units; index++)
+	{
+		int		k = index % dma_nbuffers;
+
+		latency = gputest_dma_latency(base, base_at,
+									  dma_timing[k], sent_at[k]);
+		gputest_stat_count(0, 0, 1, latency, latency);
+	}
+
+	for (index = 0; index < dma_nbuffers; index++)
+	{
+		int		i;
+
+		for (i=0; i < num_pins[index]; i++)
+			ReleaseBuffer(pins[index * max_pins + i]);
+	}
+	elog(INFO, "%u pages of \"%s\" (%.1f%% hit, %zu bytes) took %.2f sec (%.0f pages/sec)",
+		 nblocks, RelationGetRelationName(rel),
+		 nblocks > 0 ? 100.0 * (double) num_hits / (double) nblocks : 0.0,
+		 bytes, elapsed, (double) nblocks / elapsed);
+	relation_close(rel, AccessShareLock);
+
+	memset(isnull, 0, sizeof(isnull));
+	values[0] = Int64GetDatum(nblocks);
+	values[1] = Float8GetDatum(nblocks > 0 ? (double) num_hits /
+							   (double) nblocks : 0.0);
+	values[2] = Int64GetDatum(bytes);
+	values[3] = Float8GetDatum(elapsed);
+	values[4] = Float8GetDatum((double) nblocks / elapsed);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc,
+													   values,
+													   isnull)));
+#endif
+#ifdef GPUTEST_OPENCL
+	elog(ERROR, "gputest_dmasend_relation is supported only on CUDA");
+	PG_RETURN_NULL();
+#endif
+}
+PG_FUNCTION_INFO_V1(gputest_dmasend_relation);
+
+/*
+ * gputest_stat()
+ *
+ * It returns the counters of the processes that have sent something by
+ * gputest; pg_stat_gputest is a view on it.
+ */
+Datum
+gputest_stat(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext oldcxt;
+	Datum		values[7];
+	bool		isnull[7];
+	int			i;
+
+	if (!rsinfo || !IsA(rsinfo, ReturnSetInfo) ||
+		(rsinfo->allowedModes & SFRM_Materialize) == 0)
+		elog(ERROR, "set-valued function called in context that cannot accept a set");
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	oldcxt = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcxt);
+
+	memset(isnull, 0, sizeof(isnull));
+	for (i=0; stat_slots && i < GPUTEST_STAT_NUM_SLOTS; i++)
+	{
+		gputest_stat_counters *c = &stat_slots[i].c;
+		uint32		pid = pg_atomic_read_u32(&c->pid);
+
+		if (pid == 0)
+			continue;
+		values[0] = Int32GetDatum(pid);
+		values[1] = Int64GetDatum(pg_atomic_read_u64(&c->bytes_h2d));
+		values[2] = Int64GetDatum(pg_atomic_read_u64(&c->bytes_d2h));
+		values[3] = Int64GetDatum(pg_atomic_read_u64(&c->num_transfers));
+		values[4] = Int64GetDatum(pg_atomic_read_u64(&c->latency_sum));
+		values[5] = Int64GetDatum(pg_atomic_read_u64(&c->latency_max));
+		values[6] = Int64GetDatum(pg_atomic_read_u64(&c->register_time));
+		tuplestore_putvalues(tupstore, tupdesc, values, isnull);
+	}
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+PG_FUNCTION_INFO_V1(gputest_stat);
+
+Datum
+gputest_cleanup_opencl(PG_FUNCTION_ARGS)
+{
+#ifdef GPUTEST_CUDA
+	CUresult	rc;
+
+	if (!cuda_initialized)
+	{
+		rc = cuInit(0);
+		if (rc != CUDA_SUCCESS)
+			elog(ERROR, "failed on cuInit: %s", cuda_strerror(rc));
+		cuda_initialized = true;
+	}
+
+	if (cuda_context)
+	{
+		/* registration of BufferBlocks goes away with the context */
+		if (cuda_registered > 0)
+		{
+			rc = cuCtxSetCurrent(cuda_context);
+			if (rc != CUDA_SUCCESS)
+				elog(ERROR, "failed on cuCtxSetCurrent: %s",
+					 cuda_strerror(rc));
+			rc = cuMemHostUnregister(BufferBlocks);
+			if (rc != CUDA_SUCCESS)
+				elog(ERROR, "failed on cuMemHostUnregister: %s",
+					 cuda_strerror(rc));
+			cuda_registered = 0;
+		}
+		rc = cuCtxDestroy(cuda_context);
+		if (rc != CUDA_SUCCESS)
+			elog(ERROR, "failed on cuCtxDestroy: %s", cuda_strerror(rc));
+		cuda_context = NULL;
+	}
+	else
+		elog(INFO, "no cuda context exists");
+#endif
+#ifdef GPUTEST_OPENCL
+
+
+
+#endif
+	PG_RETURN_NULL();
+}
+PG_FUNCTION_INFO_V1(gputest_cleanup_opencl);
+
+/*
+ * Resources of gputest_scatter_gather
+ */
+typedef struct
+{
+#ifdef GPUTEST_CUDA
+	CUstream	stream;
+	CUmodule	module;
+	CUdeviceptr	dmem;
+	CUdeviceptr	blocks_dmem;
+	CUevent		events[2];
+#endif
+#ifdef GPUTEST_OPENCL
+	cl_command_queue cmdq;
+	cl_program	program;
+	cl_kernel	kernel;
+	cl_mem		dmem;
+	cl_mem		staging_mem;
+	cl_mem		blocks_mem;
+	cl_event	events[2];
+#endif
+	char	   *staging;		/* pinned staging buffer */
+	dma_sg_pool *pool;
+} gputest_sg_state;
+
+static void
+gputest_sg_release(gputest_sg_state *sg)
+{
+	int			k;
+
+	if (sg->pool)
+		dma_sg_pool_destroy(sg->pool);
+#ifdef GPUTEST_CUDA
+	if (sg->stream)
+		cuStreamSynchronize(sg->stream);
+	for (k=0; k < 2; k++)
+	{
+		if (sg->events[k])
+			cuEventDestroy(sg->events[k]);
+	}
+	if (sg->blocks_dmem)
+		cuMemFree(sg->blocks_dmem);
+	if (sg->module)
+		cuModuleUnload(sg->module);
+	if (sg->staging)
+		cuMemFreeHost(sg->staging);
+	if (sg->dmem)
+		cuMemFree(sg->dmem);
+	if (sg->stream)
+		cuStreamDestroy(sg->stream);
+#endif
+#ifdef GPUTEST_OPENCL
+	if (sg->cmdq)
+		clFinish(sg->cmdq);
+	for (k=0; k < 2; k++)
+	{
+		if (sg->events[k])
+			clReleaseEvent(sg->events[k]);
+	}
+	if (sg->blocks_mem)
+		clReleaseMemObject(sg->blocks_mem);
+	if (sg->kernel)
+		clReleaseKernel(sg->kernel);
+	if (sg->program)
+		clReleaseProgram(sg->program);
+	if (sg->staging)
+	{
+		clEnqueueUnmapMemObject(sg->cmdq, sg->staging_mem, sg->staging,
+								0, NULL, NULL);
+		clFinish(sg->cmdq);
+	}
+	if (sg->staging_mem)
+		clReleaseMemObject(sg->staging_mem);
+	if (sg->dmem)
+		clReleaseMemObject(sg->dmem);
+	if (sg->cmdq)
+		clReleaseCommandQueue(sg->cmdq);
+#endif
+	memset(sg, 0, sizeof(gputest_sg_state));
+}
+
+/*
+ * gputest_scatter_gather(pattern text, nblocks int4)
+ *
+ * It sends nblocks scattered blocks of the shared buffer to the device by
+ * a DMA per block, by gather of the batches into a pinned staging buffer
+ * then a DMA per batch, and by a kernel that gathers the blocks from
+ * BufferBlocks in place, then reports blocks/sec of each strategy.
+ * pattern is "random", "clustered" or a file of block numbers.
+ *
+ * On CUDA, BufferBlocks shall be registered by gputest_init_opencl, and
+ * the kernel reads it through the mapped device pointer. On OpenCL, the
+ * kernel can read BufferBlocks in place only if the device shares the host
+ * memory; elsewhere a buffer of BufferBlocks would be migrated to the
+ * device as a whole, so the device gather is skipped.
+ */
+Datum
+gputest_scatter_gather(PG_FUNCTION_ARGS)
+{
+	char	   *pattern = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	int32		nblocks = PG_GETARG_INT32(1);
+	gputest_sg_state *sg;
+	uint32	   *blocks;
+	size_t	   *batches;
+	size_t		max_batch;
+	dma_sg_result *results;
+	sigset_t	sigmask, oldmask;
+	int			num_blocks, num_batches, num_results = 0;
+	int			i, j, k;
+	double		tv1;
+#ifdef GPUTEST_CUDA
+	static const char *source = DMA_SG_GATHER_PTX;
+	CUfunction	kernel;
+	CUdeviceptr	src;
+	CUresult	rc;
+#endif
+#ifdef GPUTEST_OPENCL
+	static const char *source = DMA_SG_GATHER_OPENCL;
+	size_t		source_len = strlen(source);
+	char		options[80];
+	cl_bool		unified = CL_FALSE;
+	cl_int		rc;
+#endif
+
+	if (nblocks < 1)
+		elog(ERROR, "number of blocks must be positive");
+	/* other patterns are read as a server-side file */
+	if (strcmp(pattern, "random") != 0 &&
+		strcmp(pattern, "clustered") != 0)
+	{
+#if PG_VERSION_NUM >= 110000
+		if (!has_privs_of_role(GetUserId(), GPUTEST_ROLE_READ_SERVER_FILES))
+			elog(ERROR, "must be superuser or a member of pg_read_server_files to read a block list file");
+#else
+		if (!superuser())
+			elog(ERROR, "must be superuser to read a block list file");
+#endif
+	}
+
+	/* block list and batch sizes, copied to palloc'ed memory */
+	num_blocks = dma_sg_blocks(pattern, NBuffers, nblocks, &blocks);
+	if (num_blocks < 0)
+		elog(ERROR, "failed to build block list \"%s\": %m", pattern);
+	else
+	{
+		uint32	   *temp = palloc(sizeof(uint32) * num_blocks);
+
+		memcpy(temp, blocks, sizeof(uint32) * num_blocks);
+		free(blocks);
+		blocks = temp;
+	}
+	num_batches = dma_parse_sizes(DMA_SG_BATCHES, NBuffers, &batches);
+	if (num_batches < 0)
+		elog(ERROR, "shared_buffers is too small for the batches");
+	else
+	{
+		size_t	   *temp = palloc(sizeof(size_t) * num_batches);
+
+		memcpy(temp, batches, sizeof(size_t) * num_batches);
+		free(batches);
+		batches = temp;
+	}
+	max_batch = batches[num_batches - 1];
+	results = palloc0(sizeof(dma_sg_result) * (num_batches + 2));
+
+#ifdef GPUTEST_CUDA
+	if (!cuda_context || cuda_registered == 0)
+		elog(ERROR, "BufferBlocks is not registered; run gputest_init_opencl first");
+	rc = cuCtxSetCurrent(cuda_context);
+	if (rc != CUDA_SUCCESS)
+		elog(ERROR, "failed on cuCtxSetCurrent: %s", cuda_strerror(rc));
+	/* BufferBlocks is mapped on the device by the registration */
+	rc = cuMemHostGetDevicePointer(&src, BufferBlocks, 0);
+	if (rc != CUDA_SUCCESS)
+		elog(ERROR, "failed on cuMemHostGetDevicePointer: %s",
+			 cuda_strerror(rc));
+#endif
+#ifdef GPUTEST_OPENCL
+	if (!opencl_context)
+	{
+		rc = clGetPlatformIDs(1, &opencl_platform_id, NULL);
+		if (rc != CL_SUCCESS)
+			elog(ERROR, "failed on clGetPlatformIDs: %d", rc);
+
+		rc = clGetDeviceIDs(opencl_platform_id,
+							CL_DEVICE_TYPE_ALL,
+							1,
+							&opencl_device_id,
+							NULL);
+		if (rc != CL_SUCCESS)
+			elog(ERROR, "failed on clGetDeviceIDs: %d", rc);
+
+		opencl_context = clCreateContext(NULL,
+										 1,
+										 &opencl_device_id,
+										 NULL,
+										 NULL,
+										 &rc);
+		if (rc != CL_SUCCESS)
+			elog(ERROR, "failed on clCreateContext: %d", rc);
+	}
+	rc = clGetDeviceInfo(opencl_device_id,
+						 CL_DEVICE_HOST_UNIFIED_MEMORY,
+						 sizeof(cl_bool),
+						 &unified,
+						 NULL);
+	if (rc != CL_SUCCESS)
+		elog(ERROR, "failed on clGetDeviceInfo: %d", rc);
+	/* registration of BufferBlocks takes long, so it is kept */
+	if (unified && !opencl_buffer_blocks)
+	{
+		opencl_buffer_blocks = clCreateBuffer(opencl_context,
+											  CL_MEM_READ_WRITE |
+											  CL_MEM_USE_HOST_PTR,
+											  NBuffers * (Size) BLCKSZ,
+											  BufferBlocks,
+											  &rc);
+		if (rc != CL_SUCCESS)
+			elog(ERROR, "failed on clCreateBuffer: %d", rc);
+	}
+#endif
+
+	/* resources are released on error, including the gather threads */
+	sg = palloc0(sizeof(gputest_sg_state));
+	PG_TRY();
+	{
+#ifdef GPUTEST_CUDA
+		rc = cuStreamCreate(&sg->stream, CU_STREAM_NON_BLOCKING);
+		if (rc != CUDA_SUCCESS)
+			elog(ERROR, "failed on cuStreamCreate: %s", cuda_strerror(rc));
+
+		/* a pair of batches on the device and on the staging buffer */
+		rc = cuMemAlloc(&sg->dmem, 2 * max_batch * BLCKSZ);
+		if (rc != CUDA_SUCCESS)
+			elog(ERROR, "failed on cuMemAlloc: %s", cuda_strerror(rc));
+		rc = cuMemHostAlloc((void **)&sg->staging,
+							2 * max_batch * BLCKSZ, 0);
+		if (rc != CUDA_SUCCESS)
+		{
+			sg->staging = NULL;
+			elog(ERROR, "failed on cuMemHostAlloc: %s", cuda_strerror(rc));
+		}
+		for (k=0; k < 2; k++)
+		{
+			rc = cuEventCreate(&sg->events[k], CU_EVENT_DISABLE_TIMING);
+			if (rc != CUDA_SUCCESS)
+				elog(ERROR, "failed on cuEventCreate: %s",
+					 cuda_strerror(rc));
+		}
+#endif
+#ifdef GPUTEST_OPENCL
+		sg->cmdq = clCreateCommandQueue(opencl_context, opencl_device_id,
+										0, &rc);
+		if (rc != CL_SUCCESS)
+			elog(ERROR, "failed on clCreateCommandQueue: %d", rc);
+
+		/* a pair of batches on the device and on the staging buffer */
+		sg->dmem = clCreateBuffer(opencl_context,
+								  CL_MEM_READ_WRITE,
+								  2 * max_batch * BLCKSZ,
+								  NULL,
+								  &rc);
+		if (rc != CL_SUCCESS)
+			elog(ERROR, "failed on clCreateBuffer: %d", rc);
+		sg->staging_mem = clCreateBuffer(opencl_context,
+										 CL_MEM_READ_WRITE |
+										 CL_MEM_ALLOC_HOST_PTR,
+										 2 * max_batch * BLCKSZ,
+										 NULL,
+										 &rc);
+		if (rc != CL_SUCCESS)
+			elog(ERROR, "failed on clCreateBuffer: %d", rc);
+		sg->staging = clEnqueueMapBuffer(sg->cmdq,
+										 sg->staging_mem,
+										 CL_TRUE,
+										 CL_MAP_READ | CL_MAP_WRITE,
+										 0,
+										 2 * max_batch * BLCKSZ,
+										 0,
+										 NULL,
+										 NULL,
+										 &rc);
+		if (rc != CL_SUCCESS)
+			elog(ERROR, "failed on clEnqueueMapBuffer: %d", rc);
+#endif
+
+		/* workers must not receive the signals of the backend */
+		sigfillset(&sigmask);
+		pthread_sigmask(SIG_SETMASK, &sigmask, &oldmask);
+		sg->pool = dma_sg_pool_create(DMA_SG_THREADS);
+		pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+		if (!sg->pool)
+			elog(ERROR, "failed to create gather threads: %m");
+
+		/* a DMA per block */
+		tv1 = dma_timer_now();
+		for (i=0; i < num_blocks; i++)
+		{
+			Size	offset = (i % (2 * max_batch)) * BLCKSZ;
+			char   *haddr = BufferBlocks + (Size) blocks[i] * BLCKSZ;
+
+			CHECK_FOR_INTERRUPTS();
+#ifdef GPUTEST_CUDA
+			rc = cuMemcpyHtoDAsync(sg->dmem + offset, haddr, BLCKSZ,
+								   sg->stream);
+			if (rc != CUDA_SUCCESS)
+				elog(ERROR, "failed on cuMemcpyHtoDAsync: %s",
+					 cuda_strerror(rc));
+#endif
+#ifdef GPUTEST_OPENCL
+			rc = clEnqueueWriteBuffer(sg->cmdq,
+									  sg->dmem,
+									  CL_FALSE,
+									  offset,
+									  BLCKSZ,
+									  haddr,
+									  0,
+									  NULL,
+									  NULL);
+			if (rc != CL_SUCCESS)
+				elog(ERROR, "failed on clEnqueueWriteBuffer: %d", rc);
+#endif
+		}
+#ifdef GPUTEST_CUDA
+		rc = cuStreamSynchronize(sg->stream);
+		if (rc != CUDA_SUCCESS)
+			elog(ERROR, "failed on cuStreamSynchronize: %s",
+				 cuda_strerror(rc));
+#endif
+#ifdef GPUTEST_OPENCL
+		rc = clFinish(sg->cmdq);
+		if (rc != CL_SUCCESS)
+			elog(ERROR, "failed on clFinish: %d", rc);
+#endif
+		results[num_results].label = "per-block DMA";
+		results[num_results].batch = 1;
+		results[num_results].count = num_blocks;
+		results[num_results].elapsed = dma_timer_now() - tv1;
+		num_results++;
+
+		/* gather into the staging buffer, double buffered */
+		for (j=0; j < num_batches; j++)
+		{
+			int			batch = batches[j];
+
+			tv1 = dma_timer_now();
+			for (i=0, k=0; i < num_blocks; i += batch, k ^= 1)
+			{
+				int		nb = Min(num_blocks - i, batch);
+				Size	offset = k * max_batch * BLCKSZ;
+
+				/* the previous DMA from this stage must be done */
+#ifdef GPUTEST_CUDA
+				rc = cuEventSynchronize(sg->events[k]);
+				if (rc != CUDA_SUCCESS)
+					elog(ERROR, "failed on cuEventSynchronize: %s",
+						 cuda_strerror(rc));
+#endif
+#ifdef GPUTEST_OPENCL
+				if (sg->events[k])
+				{
+					rc = clWaitForEvents(1, &sg->events[k]);
+					if (rc != CL_SUCCESS)
+						elog(ERROR, "failed on clWaitForEvents: %d", rc);
+					clReleaseEvent(sg->events[k]);
+					sg->events[k] = NULL;
+				}
+#endif
+				CHECK_FOR_INTERRUPTS();
+				dma_sg_gather(sg->pool, sg->staging + offset, BufferBlocks,
+							  blocks + i, nb, BLCKSZ);
+#ifdef GPUTEST_CUDA
+				rc = cuMemcpyHtoDAsync(sg->dmem + offset,
+									   sg->staging + offset,
+									   nb * BLCKSZ,
+									   sg->stream);
+				if (rc != CUDA_SUCCESS)
+					elog(ERROR, "failed on cuMemcpyHtoDAsync: %s",
+						 cuda_strerror(rc));
+				rc = cuEventRecord(sg->events[k], sg->stream);
+				if (rc != CUDA_SUCCESS)
+					elog(ERROR, "failed on cuEventRecord: %s",
+						 cuda_strerror(rc));
+#endif
+#ifdef GPUTEST_OPENCL
+				rc = clEnqueueWriteBuffer(sg->cmdq,
+										  sg->dmem,
+										  CL_FALSE,
+										  offset,
+										  nb * BLCKSZ,
+										  sg->staging + offset,
+										  0,
+										  NULL,
+										  &sg->events[k]);
+				if (rc != CL_SUCCESS)
+					elog(ERROR, "failed on clEnqueueWriteBuffer: %d", rc);
+				clFlush(sg->cmdq);
+#endif
+			}
+#ifdef GPUTEST_CUDA
+			rc = cuStreamSynchronize(sg->stream);
+			if (rc != CUDA_SUCCESS)
+				elog(ERROR, "failed on cuStreamSynchronize: %s",
+					 cuda_strerror(rc));
+#endif
+#ifdef GPUTEST_OPENCL
+			rc = clFinish(sg->cmdq);
+			if (rc != CL_SUCCESS)
+				elog(ERROR, "failed on clFinish: %d", rc);
+			for (k=0; k < 2; k++)
+			{
+				if (sg->events[k])
+					clReleaseEvent(sg->events[k]);
+				sg->events[k] = NULL;
+			}
+#endif
+			results[num_results].label = "gather + DMA";
+			results[num_results].batch = batch;
+			results[num_results].count = num_blocks;
+			results[num_results].elapsed = dma_timer_now() - tv1;
+			num_results++;
+		}
+
+		/* device side gather over BufferBlocks in place */
+#ifdef GPUTEST_CUDA
+		rc = cuModuleLoadData(&sg->module, source);
+		if (rc != CUDA_SUCCESS)
+			elog(ERROR, "failed on cuModuleLoadData: %s", cuda_strerror(rc));
+		rc = cuModuleGetFunction(&kernel, sg->module, "sg_gather");
+		if (rc != CUDA_SUCCESS)
+			elog(ERROR, "failed on cuModuleGetFunction: %s",
+				 cuda_strerror(rc));
+		rc = cuMemAlloc(&sg->blocks_dmem, sizeof(uint32) * num_blocks);
+		if (rc != CUDA_SUCCESS)
+			elog(ERROR, "failed on cuMemAlloc: %s", cuda_strerror(rc));
+		/* block list is sent before the measurement */
+		rc = cuMemcpyHtoD(sg->blocks_dmem, blocks,
+						  sizeof(uint32) * num_blocks);
+		if (rc != CUDA_SUCCESS)
+			elog(ERROR, "failed on cuMemcpyHtoD: %s", cuda_strerror(rc));
+
+		tv1 = dma_timer_now();
+		for (i=0; i < num_blocks; i += 2 * max_batch)
+		{
+			uint32		base = i;
+			uint32		nb = Min(num_blocks - i, 2 * max_batch);
+			uint32		units = BLCKSZ / 16;
+			void	   *kern_args[6];
+
+			CHECK_FOR_INTERRUPTS();
+			kern_args[0] = &src;
+			kern_args[1] = &sg->blocks_dmem;
+			kern_args[2] = &base;
+			kern_args[3] = &nb;
+			kern_args[4] = &units;
+			kern_args[5] = &sg->dmem;
+			rc = cuLaunchKernel(kernel,
+								(nb * units + 255) / 256, 1, 1,
+								256, 1, 1,
+								0,
+								sg->stream,
+								kern_args,
+								NULL);
+			if (rc != CUDA_SUCCESS)
+				elog(ERROR, "failed on cuLaunchKernel: %s",
+					 cuda_strerror(rc));
+		}
+		rc = cuStreamSynchronize(sg->stream);
+		if (rc != CUDA_SUCCESS)
+			elog(ERROR, "failed on cuStreamSynchronize: %s",
+				 cuda_strerror(rc));
+		results[num_results].label = "device gather";
+		results[num_results].batch = 2 * max_batch;
+		results[num_results].count = num_blocks;
+		results[num_results].elapsed = dma_timer_now() - tv1;
+		num_results++;
+#endif
+#ifdef GPUTEST_OPENCL
+		if (!unified)
+			elog(INFO, "device gather is skipped; BufferBlocks is not readable in place by a discrete OpenCL device");
+		else
+		{
+			sg->program = clCreateProgramWithSource(opencl_context,
+													1,
+													&source,
+													&source_len,
+													&rc);
+			if (rc != CL_SUCCESS)
+				elog(ERROR, "failed on clCreateProgramWithSource: %d", rc);
+			snprintf(options, sizeof(options),
+					 "-DBLOCK_UNITS=%d", BLCKSZ / 16);
+			rc = clBuildProgram(sg->program, 1, &opencl_device_id, options,
+								NULL, NULL);
+			if (rc != CL_SUCCESS)
+				elog(ERROR, "failed on clBuildProgram: %d", rc);
+			sg->kernel = clCreateKernel(sg->program, "sg_gather", &rc);
+			if (rc != CL_SUCCESS)
+				elog(ERROR, "failed on clCreateKernel: %d", rc);
+			sg->blocks_mem = clCreateBuffer(opencl_context,
+											CL_MEM_READ_ONLY,
+											sizeof(cl_uint) * num_blocks,
+											NULL,
+											&rc);
+			if (rc != CL_SUCCESS)
+				elog(ERROR, "failed on clCreateBuffer: %d", rc);
+			rc = clSetKernelArg(sg->kernel, 0, sizeof(cl_mem),
+								&opencl_buffer_blocks);
+			if (rc == CL_SUCCESS)
+				rc = clSetKernelArg(sg->kernel, 1, sizeof(cl_mem),
+									&sg->blocks_mem);
+			if (rc == CL_SUCCESS)
+				rc = clSetKernelArg(sg->kernel, 4, sizeof(cl_mem),
+									&sg->dmem);
+			if (rc != CL_SUCCESS)
+				elog(ERROR, "failed on clSetKernelArg: %d", rc);
+
+			/* block list is sent before the measurement */
+			rc = clEnqueueWriteBuffer(sg->cmdq,
+									  sg->blocks_mem,
+									  CL_TRUE,
+									  0,
+									  sizeof(cl_uint) * num_blocks,
+									  blocks,
+									  0,
+									  NULL,
+									  NULL);
+			if (rc != CL_SUCCESS)
+				elog(ERROR, "failed on clEnqueueWriteBuffer: %d", rc);
+
+			tv1 = dma_timer_now();
+			for (i=0; i < num_blocks; i += 2 * max_batch)
+			{
+				cl_uint		base = i;
+				cl_uint		nb = Min(num_blocks - i, 2 * max_batch);
+				size_t		lwork_sz = 256;
+				size_t		gwork_sz = (size_t) nb * (BLCKSZ / 16);
+
+				CHECK_FOR_INTERRUPTS();
+				rc = clSetKernelArg(sg->kernel, 2, sizeof(cl_uint), &base);
+				if (rc == CL_SUCCESS)
+					rc = clSetKernelArg(sg->kernel, 3, sizeof(cl_uint), &nb);
+				if (rc != CL_SUCCESS)
+					elog(ERROR, "failed on clSetKernelArg: %d", rc);
+				rc = clEnqueueNDRangeKernel(sg->cmdq,
+											sg->kernel,
+											1,
+											NULL,
+											&gwork_sz,
+											&lwork_sz,
+											0,
+											NULL,
+											NULL);
+				if (rc != CL_SUCCESS)
+					elog(ERROR, "failed on clEnqueueNDRangeKernel: %d", rc);
+			}
+			rc = clFinish(sg->cmdq);
+			if (rc != CL_SUCCESS)
+				elog(ERROR, "failed on clFinish: %d", rc);
+			results[num_results].label = "device gather";
+			results[num_results].batch = 2 * max_batch;
+			results[num_results].count = num_blocks;
+			results[num_results].elapsed = dma_timer_now() - tv1;
+			num_results++;
+		}
+#endif
+
+		for (i=0; i < num_results; i++)
+		{
+			dma_sg_result *sr = &results[i];
+
+			elog(INFO, "%s (batch=%d): %.0f blocks/sec (%.2f MB/s)",
+				 sr->label, sr->batch,
+				 (double) sr->count / sr->elapsed,
+				 (double)(sr->count * BLCKSZ) / (double)(1UL << 20) /
+				 sr->elapsed);
+		}
+	}
+	PG_CATCH();
+	{
+		gputest_sg_release(sg);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	gputest_sg_release(sg);
+
+	PG_RETURN_NULL();
+}
+PG_FUNCTION_INFO_V1(gputest_scatter_gather);
+
+/*
+ * DMA worker
+ *
+ * A background worker owns a context, a set of command queues (streams)
+ * and a device buffer per device, and serves DMA requests of the backends.
+ * A backend puts its requests on the ring in shared memory, then waits on
+ * its own latch until the worker marks them done. So, backends never pay
+ * for the context setup nor hold device memory by themselves.
+ */
+#define GPUTEST_MAX_DEVICES		8
+#define GPUTEST_DMA_QUEUES		4			/* queues per device */
+#define GPUTEST_DMA_RING_SIZE	64
+#define GPUTEST_DMA_SLOT_SIZE	(4UL << 20)	/* a slot of device buffer */
+#define GPUTEST_DMA_NSLOTS		32			/* slots per device */
+#define GPUTEST_DMA_DEPTH		4			/* requests per backend */
+
+#define DMAREQ_FREE				0
+#define DMAREQ_PENDING			1			/* put by a backend */
+#define DMAREQ_RUNNING			2			/* submitted by the worker */
+#define DMAREQ_DONE				3			/* to be freed by the backend */
+
+typedef struct
+{
+	int			state;
+	int			device;			/* device index */
+	int			dest_slot;		/* slot of the device buffer */
+	BlockNumber	blkno;			/* first block in BufferBlocks */
+	int			nblocks;
+	Latch	   *latch;			/* latch of the requester */
+	bool		abandoned;		/* requester has gone; worker frees it */
+	bool		failed;
+	bool		deferred;		/* waited for the registration */
+} gputest_dma_request;
+
+typedef struct
+{
+	slock_t		lock;
+	Latch	   *worker_latch;	/* NULL, if worker is not ready */
+	int			num_devices;
+	Size		registered;		/* watermark of BufferBlocks registration */
+	uint64		head;			/* next request to be put by backends */
+	uint64		tail;			/* next request to be taken by worker */
+	gputest_dma_request ring[GPUTEST_DMA_RING_SIZE];
+} gputest_dma_queue;
+
+static gputest_dma_queue *dma_queue = NULL;
+static volatile sig_atomic_t worker_got_sigterm = false;
+
+#ifdef GPUTEST_CUDA
+static CUcontext	worker_contexts[GPUTEST_MAX_DEVICES];
+static CUstream		worker_streams[GPUTEST_MAX_DEVICES][GPUTEST_DMA_QUEUES];
+static CUdeviceptr	worker_dmem[GPUTEST_MAX_DEVICES];
+static CUevent		worker_events[GPUTEST_MAX_DEVICES][GPUTEST_DMA_RING_SIZE];
+#endif
+#ifdef GPUTEST_OPENCL
+static cl_context	worker_contexts[GPUTEST_MAX_DEVICES];
+static cl_command_queue worker_queues[GPUTEST_MAX_DEVICES][GPUTEST_DMA_QUEUES];
+static cl_mem		worker_dmem[GPUTEST_MAX_DEVICES];
+static cl_mem	   *worker_hmem[GPUTEST_MAX_DEVICES];	/* per chunk */
+static cl_event		worker_events[GPUTEST_DMA_RING_SIZE];
+#endif
+static double		worker_submit_at[GPUTEST_DMA_RING_SIZE];
+static bool			worker_inflight[GPUTEST_DMA_RING_SIZE];
+static int			worker_num_inflight = 0;
+
+/*
+ * Registration of BufferBlocks
+ *
+ * BufferBlocks is registered by chunks of gputest.register_chunk_size on
+ * gputest.register_threads threads, while the worker already serves the
+ * requests. Chunks are taken in order, and the worker publishes the length
+ * of the registered prefix (watermark) on the shared memory; requests on
+ * the region beyond the watermark are deferred until it gets registered.
+ */
+static int		register_chunk_size;	/* MB */
+static int		register_threads;
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	Size		chunk_sz;
+	int			num_chunks;
+	int			next_chunk;		/* next chunk to be registered */
+	int			num_prefix;		/* chunks registered from the head */
+	bool	   *done;
+	int			num_devices;
+	int			error;			/* error code of the driver, if any */
+	int			num_threads;
+	pthread_t  *threads;
+	struct timeval tv_start;
+} gputest_register_state;
+
+static gputest_register_state reg_state;
+static bool		worker_registering = false;
+static Size		worker_registered = 0;	/* local copy of the watermark */
+
+static void
+gputest_worker_sigterm(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	worker_got_sigterm = true;
+	SetLatch(MyLatch);
+	errno = save_errno;
+}
+
+/*
+ * gputest_worker_exit
+ *
+ * Requests not completed yet are failed, so backends never wait for the
+ * worker that is gone.
+ */
+static void
+gputest_worker_exit(int code, Datum arg)
+{
+	Latch	   *latches[GPUTEST_DMA_RING_SIZE];
+	int			num_latches = 0;
+	int			i;
+
+	SpinLockAcquire(&dma_queue->lock);
+	dma_queue->worker_latch = NULL;
+	for (i=0; i < GPUTEST_DMA_RING_SIZE; i++)
+	{
+		gputest_dma_request *req = &dma_queue->ring[i];
+
+		if (req->state != DMAREQ_PENDING &&
+			req->state != DMAREQ_RUNNING)
+			continue;
+		if (req->abandoned)
+			req->state = DMAREQ_FREE;
+		else
+		{
+			req->state = DMAREQ_DONE;
+			req->failed = true;
+			latches[num_latches++] = req->latch;
+		}
+	}
+	dma_queue->tail = dma_queue->head;
+	SpinLockRelease(&dma_queue->lock);
+
+	for (i=0; i < num_latches; i++)
+		SetLatch(latches[i]);
+}
+
+/*
+ * gputest_worker_setup
+ *
+ * It builds a context, command queues and device buffer for each device,
+ * and the events of the ring slots on CUDA. Returns number of the devices.
+ */
+static int
+gputest_worker_setup(void)
+{
+	int			num_devices;
+	int			i, j;
+#ifdef GPUTEST_CUDA
+	CUdevice	device;
+	CUresult	rc;
 
 	rc = cuInit(0);
 	if (rc != CUDA_SUCCESS)
 		elog(ERROR, "failed on cuInit: %s", cuda_strerror(rc));
-
-	rc = cuDeviceGetCount(&n_devices);
+	rc = cuDeviceGetCount(&num_devices);
 	if (rc != CUDA_SUCCESS)
 		elog(ERROR, "failed on cuDeviceGetCount: %s", cuda_strerror(rc));
-	if (n_devices < 1)
+	if (num_devices < 1)
 		elog(ERROR, "no cuda device found");
+	num_devices = Min(num_devices, GPUTEST_MAX_DEVICES);
 
-	rc = cuDeviceGet(devices, 0);
-	if (rc != CUDA_SUCCESS)
-		elog(ERROR, "failed on cuDeviceGet: %s", cuda_strerror(rc));
+	for (i=0; i < num_devices; i++)
+	{
+		rc = cuDeviceGet(&device, i);
+		if (rc != CUDA_SUCCESS)
+			elog(ERROR, "failed on cuDeviceGet: %s", cuda_strerror(rc));
 
-	rc = cuCtxCreate(&context, 0, devices[0]);
-	if (rc != CUDA_SUCCESS)
-		elog(ERROR, "failed on cuCtxCreate: %s", cuda_strerror(rc));
+		rc = cuCtxCreate(&worker_contexts[i], 0, device);
+		if (rc != CUDA_SUCCESS)
+			elog(ERROR, "failed on cuCtxCreate: %s", cuda_strerror(rc));
 
-	rc = cuCtxSetCurrent(context);
-	if (rc != CUDA_SUCCESS)
-		elog(ERROR, "failed on cuCtxSetCurrent: %s", cuda_strerror(rc));
+		for (j=0; j < GPUTEST_DMA_QUEUES; j++)
+		{
+			rc = cuStreamCreate(&worker_streams[i][j], CU_STREAM_NON_BLOCKING);
+			if (rc != CUDA_SUCCESS)
+				elog(ERROR, "failed on cuStreamCreate: %s",
+					 cuda_strerror(rc));
+		}
+		rc = cuMemAlloc(&worker_dmem[i],
+						GPUTEST_DMA_NSLOTS * GPUTEST_DMA_SLOT_SIZE);
+		if (rc != CUDA_SUCCESS)
+			elog(ERROR, "failed on cuMemAlloc: %s", cuda_strerror(rc));
 
-	elog(LOG, "%p %zu", BufferBlocks, NBuffers * (Size) BLCKSZ);
-	gettimeofday(&tv1, NULL);
-	rc = cuMemHostRegister(BufferBlocks, NBuffers * (Size) BLCKSZ,
-						   CU_MEMHOSTREGISTER_PORTABLE);
-	if (rc != CUDA_SUCCESS)
-		elog(ERROR, "cuMemHostRegister: %s", cuda_strerror(rc));
-	gettimeofday(&tv2, NULL);
-	elog(LOG, "cuMemHostRegister takes %.2fsec to map %zuGB",
-		 TIMEVAL_DIFF(&tv2, &tv1), ((Size)NBuffers * (Size) BLCKSZ) >> 30);
+		/* an event per ring slot, reused by the requests */
+		for (j=0; j < GPUTEST_DMA_RING_SIZE; j++)
+		{
+			rc = cuEventCreate(&worker_events[i][j], CU_EVENT_DISABLE_TIMING);
+			if (rc != CUDA_SUCCESS)
+				elog(ERROR, "failed on cuEventCreate: %s",
+					 cuda_strerror(rc));
+		}
+	}
 #endif
 #ifdef GPUTEST_OPENCL
 	cl_platform_id	platform_id;
-	cl_device_id	device_id;
-	cl_context		context;
+	cl_device_id	device_ids[GPUTEST_MAX_DEVICES];
+	cl_uint			num_ids;
 	cl_int			rc;
-	struct timeval	tv1, tv2;
 
 	rc = clGetPlatformIDs(1, &platform_id, NULL);
 	if (rc != CL_SUCCESS)
@@ -378,42 +2180,772 @@ gputest_init(void)
 
 	rc = clGetDeviceIDs(platform_id,
 						CL_DEVICE_TYPE_ALL,
-						1,
-						&device_id,
-						NULL);
+						GPUTEST_MAX_DEVICES,
+						device_ids,
+						&num_ids);
 	if (rc != CL_SUCCESS)
 		elog(ERROR, "failed on clGetDeviceIDs: %d", rc);
+	num_devices = Min(num_ids, GPUTEST_MAX_DEVICES);
 
-	context = clCreateContext(NULL,
-							  1,
-							  &device_id,
-							  NULL,
-							  NULL,
-							  &rc);
-	if (rc != CL_SUCCESS)
-		elog(ERROR, "failed on clCreateContext: %d", rc);
+	for (i=0; i < num_devices; i++)
+	{
+		worker_contexts[i] = clCreateContext(NULL,
+											 1,
+											 &device_ids[i],
+											 NULL,
+											 NULL,
+											 &rc);
+		if (rc != CL_SUCCESS)
+			elog(ERROR, "failed on clCreateContext: %d", rc);
+
+		for (j=0; j < GPUTEST_DMA_QUEUES; j++)
+		{
+			worker_queues[i][j] = clCreateCommandQueue(worker_contexts[i],
+													   device_ids[i],
+													   0,
+													   &rc);
+			if (rc != CL_SUCCESS)
+				elog(ERROR, "failed on clCreateCommandQueue: %d", rc);
+		}
+		worker_dmem[i] = clCreateBuffer(worker_contexts[i],
+										CL_MEM_READ_WRITE,
+										GPUTEST_DMA_NSLOTS *
+										GPUTEST_DMA_SLOT_SIZE,
+										NULL,
+										&rc);
+		if (rc != CL_SUCCESS)
+			elog(ERROR, "failed on clCreateBuffer: %d", rc);
+	}
+#endif
+	return num_devices;
+}
+
+/*
+ * gputest_register_main
+ *
+ * Body of the registration threads; it must not call any PostgreSQL
+ * functions.
+ */
+static void *
+gputest_register_main(void *arg)
+{
+	gputest_register_state *rs = arg;
+	Size		total = NBuffers * (Size) BLCKSZ;
+	int			index;
+#ifdef GPUTEST_CUDA
+	CUresult	rc;
+
+	/* portable registration is visible from all the contexts */
+	rc = cuCtxSetCurrent(worker_contexts[0]);
+	if (rc != CUDA_SUCCESS)
+	{
+		pthread_mutex_lock(&rs->lock);
+		rs->error = rc;
+		pthread_mutex_unlock(&rs->lock);
+		return NULL;
+	}
+#endif
+#ifdef GPUTEST_OPENCL
+	cl_int		rc = CL_SUCCESS;
+	int			i;
+#endif
+
+	for (;;)
+	{
+		Size		offset;
+		Size		length;
+
+		pthread_mutex_lock(&rs->lock);
+		if (rs->error != 0 || rs->next_chunk >= rs->num_chunks)
+		{
+			pthread_mutex_unlock(&rs->lock);
+			break;
+		}
+		index = rs->next_chunk++;
+		pthread_mutex_unlock(&rs->lock);
+
+		offset = index * rs->chunk_sz;
+		length = Min(rs->chunk_sz, total - offset);
+#ifdef GPUTEST_CUDA
+		rc = cuMemHostRegister(BufferBlocks + offset, length,
+							   CU_MEMHOSTREGISTER_PORTABLE);
+#endif
+#ifdef GPUTEST_OPENCL
+		for (i=0; i < rs->num_devices; i++)
+		{
+			worker_hmem[i][index] = clCreateBuffer(worker_contexts[i],
+												   CL_MEM_READ_WRITE |
+												   CL_MEM_USE_HOST_PTR,
+												   length,
+												   BufferBlocks + offset,
+												   &rc);
+			if (rc != CL_SUCCESS)
+				break;
+		}
+#endif
+		pthread_mutex_lock(&rs->lock);
+		if (rc != 0)
+			rs->error = rc;
+		else
+			rs->done[index] = true;
+		pthread_mutex_unlock(&rs->lock);
+	}
+	return NULL;
+}
+
+static void
+gputest_register_start(int num_devices)
+{
+	gputest_register_state *rs = &reg_state;
+	Size		total = NBuffers * (Size) BLCKSZ;
+	sigset_t	sigmask, oldmask;
+	int			i;
+
+	memset(rs, 0, sizeof(gputest_register_state));
+	pthread_mutex_init(&rs->lock, NULL);
+	rs->chunk_sz = (Size) register_chunk_size << 20;
+	rs->num_chunks = (total + rs->chunk_sz - 1) / rs->chunk_sz;
+	rs->done = palloc0(sizeof(bool) * rs->num_chunks);
+	rs->num_devices = num_devices;
+	rs->num_threads = Min(register_threads, rs->num_chunks);
+	rs->threads = palloc0(sizeof(pthread_t) * rs->num_threads);
+#ifdef GPUTEST_OPENCL
+	for (i=0; i < num_devices; i++)
+		worker_hmem[i] = palloc0(sizeof(cl_mem) * rs->num_chunks);
+#endif
+	gettimeofday(&rs->tv_start, NULL);
+
+	/* threads must not receive the signals of the worker */
+	sigfillset(&sigmask);
+	pthread_sigmask(SIG_SETMASK, &sigmask, &oldmask);
+	for (i=0; i < rs->num_threads; i++)
+	{
+		errno = pthread_create(&rs->threads[i], NULL,
+							   gputest_register_main, rs);
+		if (errno != 0)
+		{
+			pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+			elog(ERROR, "failed on pthread_create: %m");
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+	worker_registering = true;
+}
+
+/*
+ * gputest_register_poll
+ *
+ * It publishes the watermark of the registration, and joins the threads
+ * once all the chunks get registered.
+ */
+static void
+gputest_register_poll(void)
+{
+	gputest_register_state *rs = &reg_state;
+	Size		total = NBuffers * (Size) BLCKSZ;
+	struct timeval tv;
+	int			error;
+	int			i;
+
+	pthread_mutex_lock(&rs->lock);
+	while (rs->num_prefix < rs->num_chunks && rs->done[rs->num_prefix])
+		rs->num_prefix++;
+	error = rs->error;
+	pthread_mutex_unlock(&rs->lock);
+
+	if (error != 0)
+		elog(ERROR, "failed to register BufferBlocks: %d", error);
+
+	if (worker_registered != Min(rs->num_prefix * rs->chunk_sz, total))
+	{
+		worker_registered = Min(rs->num_prefix * rs->chunk_sz, total);
+		SpinLockAcquire(&dma_queue->lock);
+		dma_queue->registered = worker_registered;
+		SpinLockRelease(&dma_queue->lock);
+	}
+
+	if (rs->num_prefix == rs->num_chunks)
+	{
+		for (i=0; i < rs->num_threads; i++)
+			pthread_join(rs->threads[i], NULL);
+		gettimeofday(&tv, NULL);
+		gputest_stat_register(TIMEVAL_DIFF(&tv, &rs->tv_start));
+		elog(LOG, "registration of %zuGB by %d threads took %.2fsec",
+			 total >> 30, rs->num_threads, TIMEVAL_DIFF(&tv, &rs->tv_start));
+		worker_registering = false;
+	}
+}
+
+/*
+ * enqueues the DMA of the request at the ring index; the region must be
+ * under the watermark.
+ */
+static void
+gputest_worker_submit(gputest_dma_request *req, int index, int queue)
+{
+	Size		offset = req->dest_slot * GPUTEST_DMA_SLOT_SIZE;
+	Size		length = req->nblocks * (Size) BLCKSZ;
+	Size		start = req->blkno * (Size) BLCKSZ;
+#ifdef GPUTEST_CUDA
+	char	   *haddr = BufferBlocks + start;
+	CUstream	stream = worker_streams[req->device][queue];
+	CUresult	rc;
+
+	rc = cuCtxSetCurrent(worker_contexts[req->device]);
+	if (rc != CUDA_SUCCESS)
+		elog(ERROR, "failed on cuCtxSetCurrent: %s", cuda_strerror(rc));
+	rc = cuMemcpyHtoDAsync(worker_dmem[req->device] + offset,
+						   haddr, length, stream);
+	if (rc != CUDA_SUCCESS)
+		elog(ERROR, "failed on cuMemcpyHtoDAsync: %s", cuda_strerror(rc));
+	rc = cuEventRecord(worker_events[req->device][index], stream);
+	if (rc != CUDA_SUCCESS)
+		elog(ERROR, "failed on cuEventRecord: %s", cuda_strerror(rc));
+#endif
+#ifdef GPUTEST_OPENCL
+	cl_command_queue cmdq = worker_queues[req->device][queue];
+	cl_int		rc;
+
+	Size		chunk_sz = reg_state.chunk_sz;
+	Size		pos = start;
+	Size		dest = offset;
+	Size		remain = length;
+
+	/*
+	 * copies from the registered chunks; a region may span two of them.
+	 * The queue is in-order, so the event of the last copy is enough.
+	 */
+	while (remain > 0)
+	{
+		int		chunk = pos / chunk_sz;
+		Size	nbytes = Min(remain, chunk_sz - pos % chunk_sz);
+
+		rc = clEnqueueCopyBuffer(cmdq,
+								 worker_hmem[req->device][chunk],
+								 worker_dmem[req->device],
+								 pos % chunk_sz,
+								 dest,
+								 nbytes,
+								 0,
+								 NULL,
+								 nbytes == remain
+								 ? &worker_events[index] : NULL);
+		if (rc != CL_SUCCESS)
+			elog(ERROR, "failed on clEnqueueCopyBuffer: %d", rc);
+		pos += nbytes;
+		dest += nbytes;
+		remain -= nbytes;
+	}
+	clFlush(cmdq);
+#endif
+	worker_submit_at[index] = dma_timer_now();
+	worker_inflight[index] = true;
+	worker_num_inflight++;
+}
+
+/*
+ * checks whether the DMA of the request at the ring index is completed;
+ * it blocks until completion if wait is true.
+ */
+static bool
+gputest_worker_done(gputest_dma_request *req, int index, bool wait)
+{
+#ifdef GPUTEST_CUDA
+	CUevent		event = worker_events[req->device][index];
+	CUresult	rc;
+
+	if (wait)
+	{
+		rc = cuEventSynchronize(event);
+		if (rc != CUDA_SUCCESS)
+			elog(ERROR, "failed on cuEventSynchronize: %s",
+				 cuda_strerror(rc));
+	}
+	else
+	{
+		rc = cuEventQuery(event);
+		if (rc == CUDA_ERROR_NOT_READY)
+			return false;
+		if (rc != CUDA_SUCCESS)
+			elog(ERROR, "failed on cuEventQuery: %s", cuda_strerror(rc));
+	}
+#endif
+#ifdef GPUTEST_OPENCL
+	cl_int		status;
+	cl_int		rc;
+
+	if (wait)
+	{
+		rc = clWaitForEvents(1, &worker_events[index]);
+		if (rc != CL_SUCCESS)
+			elog(ERROR, "failed on clWaitForEvents: %d", rc);
+	}
+	else
+	{
+		rc = clGetEventInfo(worker_events[index],
+							CL_EVENT_COMMAND_EXECUTION_STATUS,
+							sizeof(cl_int),
+							&status,
+							NULL);
+		if (rc != CL_SUCCESS)
+			elog(ERROR, "failed on clGetEventInfo: %d", rc);
+		if (status < 0)
+			elog(ERROR, "DMA failed on the device: %d", status);
+		if (status != CL_COMPLETE)
+			return false;
+	}
+	clReleaseEvent(worker_events[index]);
+#endif
+	return true;
+}
+
+/* marks the request at the ring index done, and wakes up the requester */
+static void
+gputest_worker_complete(gputest_dma_request *req, int index)
+{
+	Latch	   *latch = NULL;
+	uint64		latency;
+
+	latency = (dma_timer_now() - worker_submit_at[index]) * 1000000.0;
+	gputest_stat_count(req->nblocks * (Size) BLCKSZ, 0, 1,
+					   latency, latency);
+	worker_inflight[index] = false;
+	worker_num_inflight--;
+
+	SpinLockAcquire(&dma_queue->lock);
+	if (req->abandoned)
+		req->state = DMAREQ_FREE;
+	else
+	{
+		req->state = DMAREQ_DONE;
+		latch = req->latch;
+	}
+	SpinLockRelease(&dma_queue->lock);
+	if (latch)
+		SetLatch(latch);
+}
+
+void
+gputest_dma_worker_main(Datum arg)
+{
+	int			num_devices;
+	int			queue = 0;
+
+	pqsignal(SIGTERM, gputest_worker_sigterm);
+	BackgroundWorkerUnblockSignals();
+	before_shmem_exit(gputest_worker_exit, 0);
+	gputest_stat_attach(0);
+
+	num_devices = gputest_worker_setup();
+	gputest_register_start(num_devices);
+
+	SpinLockAcquire(&dma_queue->lock);
+	dma_queue->num_devices = num_devices;
+	dma_queue->registered = 0;
+	dma_queue->tail = dma_queue->head;
+	dma_queue->worker_latch = MyLatch;
+	SpinLockRelease(&dma_queue->lock);
+	elog(LOG, "gputest DMA worker is ready on %d device(s)", num_devices);
+
+	/*
+	 * The ring is kept in flight; every wakeup takes the new requests and
+	 * completes the ones already done, so a long request never holds the
+	 * requests behind it.
+	 */
+	while (!worker_got_sigterm)
+	{
+		int			claimed[GPUTEST_DMA_RING_SIZE];
+		int			num_claimed;
+		uint64		pos;
+		bool		progress = false;
+		int			index;
+		int			i;
+		int			rc;
+
+		ResetLatch(MyLatch);
+		if (worker_registering)
+			gputest_register_poll();
+
+		/*
+		 * takes the pending requests in order; the ones beyond the watermark
+		 * stay pending, but do not hold the requests behind them.
+		 */
+		num_claimed = 0;
+		SpinLockAcquire(&dma_queue->lock);
+		for (pos = dma_queue->tail; pos < dma_queue->head; pos++)
+		{
+			gputest_dma_request *req
+				= &dma_queue->ring[pos % GPUTEST_DMA_RING_SIZE];
+
+			if (req->state != DMAREQ_PENDING)
+				continue;
+			if ((req->blkno + (Size) req->nblocks) * BLCKSZ >
+				worker_registered)
+			{
+				req->deferred = true;
+				continue;
+			}
+			req->state = DMAREQ_RUNNING;
+			claimed[num_claimed++] = pos % GPUTEST_DMA_RING_SIZE;
+		}
+		while (dma_queue->tail < dma_queue->head &&
+			   dma_queue->ring[dma_queue->tail % GPUTEST_DMA_RING_SIZE].state
+			   != DMAREQ_PENDING)
+			dma_queue->tail++;
+		SpinLockRelease(&dma_queue->lock);
+
+		/* the worker only reads the fields of the running requests */
+		for (i=0; i < num_claimed; i++)
+		{
+			gputest_worker_submit(&dma_queue->ring[claimed[i]],
+								  claimed[i], queue);
+			queue = (queue + 1) % GPUTEST_DMA_QUEUES;
+			progress = true;
+		}
+
+		/* completes the requests already done, in any order */
+		for (index=0; index < GPUTEST_DMA_RING_SIZE; index++)
+		{
+			gputest_dma_request *req = &dma_queue->ring[index];
+
+			if (worker_inflight[index] &&
+				gputest_worker_done(req, index, false))
+			{
+				gputest_worker_complete(req, index);
+				progress = true;
+			}
+		}
+		if (progress)
+			continue;
+
+		if (worker_num_inflight > 0)
+		{
+			gputest_dma_request *req;
+			int			oldest = -1;
+
+			/*
+			 * Nothing to do but the requests in flight; blocks on the oldest
+			 * one only, then looks at the ring again.
+			 */
+			for (i=0; i < GPUTEST_DMA_RING_SIZE; i++)
+			{
+				if (worker_inflight[i] &&
+					(oldest < 0 ||
+					 worker_submit_at[i] < worker_submit_at[oldest]))
+					oldest = i;
+			}
+			index = oldest;
+			req = &dma_queue->ring[index];
+			gputest_worker_done(req, index, true);
+			gputest_worker_complete(req, index);
+			continue;
+		}
+
+		/*
+		 * wakes up periodically to publish the watermark, and to take the
+		 * deferred requests under it
+		 */
+		rc = GPUTEST_WAIT_LATCH(MyLatch,
+								WL_LATCH_SET | WL_POSTMASTER_DEATH |
+								(worker_registering ? WL_TIMEOUT : 0),
+								worker_registering ? 100L : -1L);
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+	}
+	proc_exit(0);
+}
+
+/*
+ * gputest_dmasend_worker(nblocks int4, nrequests int4)
+ *
+ * It sends nrequests chunks of nblocks blocks of the shared buffer through
+ * the DMA worker, keeping GPUTEST_DMA_DEPTH requests in flight, then
+ * reports the throughput. Run it on multiple backends concurrently to see
+ * the scalability.
+ */
+static void
+gputest_abandon_requests(int *indexes, int count)
+{
+	int			i;
+
+	SpinLockAcquire(&dma_queue->lock);
+	for (i=0; i < count; i++)
+	{
+		gputest_dma_request *req = &dma_queue->ring[indexes[i]];
+
+		if (req->state == DMAREQ_DONE)
+			req->state = DMAREQ_FREE;
+		else
+			req->abandoned = true;
+	}
+	SpinLockRelease(&dma_queue->lock);
+}
+
+Datum
+gputest_dmasend_worker(PG_FUNCTION_ARGS)
+{
+	int32		nblocks = PG_GETARG_INT32(0);
+	int32		nrequests = PG_GETARG_INT32(1);
+	int			indexes[GPUTEST_DMA_DEPTH];
+	int			num_inflight = 0;
+	int			num_submitted = 0;
+	int			num_completed = 0;
+	int			num_failed = 0;
+	int			num_deferred = 0;
+	struct timeval tv1, tv2;
+	Size		total;
+
+	if (nblocks < 1 || nblocks > NBuffers ||
+		nblocks * (Size) BLCKSZ > GPUTEST_DMA_SLOT_SIZE)
+		elog(ERROR, "nblocks must be between 1 and %lu",
+			 Min(NBuffers, GPUTEST_DMA_SLOT_SIZE / BLCKSZ));
+	if (nrequests < 1)
+		elog(ERROR, "nrequests must be positive");
+	if (!dma_queue || !dma_queue->worker_latch)
+		elog(ERROR, "gputest DMA worker is not running");
 
 	gettimeofday(&tv1, NULL);
-	(void) clCreateBuffer(context,
-						  CL_MEM_READ_WRITE |
-						  CL_MEM_USE_HOST_PTR,
-						  NBuffers * (Size) BLCKSZ,
-						  BufferBlocks,
-						  &rc);
-	if (rc != CL_SUCCESS)
-		elog(ERROR, "failed on clCreateBuffer: %d", rc);
+	PG_TRY();
+	{
+		while (num_completed < nrequests)
+		{
+			Latch  *worker_latch;
+			int		i, rc;
+
+			ResetLatch(MyLatch);
+
+			SpinLockAcquire(&dma_queue->lock);
+			if (!dma_queue->worker_latch)
+			{
+				SpinLockRelease(&dma_queue->lock);
+				elog(ERROR, "gputest DMA worker has gone");
+			}
+			/* puts new requests, as long as ring has free entries */
+			while (num_inflight < GPUTEST_DMA_DEPTH &&
+				   num_submitted < nrequests)
+			{
+				uint64	pos = dma_queue->head;
+				gputest_dma_request *req
+					= &dma_queue->ring[pos % GPUTEST_DMA_RING_SIZE];
+
+				if (req->state != DMAREQ_FREE)
+					break;
+				req->device = num_submitted % dma_queue->num_devices;
+				req->dest_slot = (MyProcPid + num_submitted) %
+					GPUTEST_DMA_NSLOTS;
+				req->blkno = ((uint64) num_submitted * nblocks) %
+					(NBuffers - nblocks + 1);
+				req->nblocks = nblocks;
+				req->latch = MyLatch;
+				req->abandoned = false;
+				req->failed = false;
+				req->deferred = false;
+				req->state = DMAREQ_PENDING;
+				indexes[num_inflight++] = pos % GPUTEST_DMA_RING_SIZE;
+				dma_queue->head = pos + 1;
+				num_submitted++;
+			}
+			/* picks up the completed requests */
+			for (i=0; i < num_inflight; i++)
+			{
+				gputest_dma_request *req = &dma_queue->ring[indexes[i]];
+
+				if (req->state != DMAREQ_DONE)
+					continue;
+				if (req->failed)
+					num_failed++;
+				if (req->deferred)
+					num_deferred++;
+				req->state = DMAREQ_FREE;
+				indexes[i--] = indexes[--num_inflight];
+				num_completed++;
+			}
+			worker_latch = dma_queue->worker_latch;
+			SpinLockRelease(&dma_queue->lock);
+			SetLatch(worker_latch);
+
+			if (num_failed > 0)
+				elog(ERROR, "gputest DMA worker failed on the request");
+			if (num_completed < nrequests)
+			{
+				rc = GPUTEST_WAIT_LATCH(MyLatch,
+										WL_LATCH_SET | WL_TIMEOUT |
+										WL_POSTMASTER_DEATH,
+										1000L);
+				if (rc & WL_POSTMASTER_DEATH)
+					proc_exit(1);
+				CHECK_FOR_INTERRUPTS();
+			}
+		}
+	}
+	PG_CATCH();
+	{
+		/* worker frees the requests still in progress */
+		gputest_abandon_requests(indexes, num_inflight);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
 	gettimeofday(&tv2, NULL);
-	elog(LOG, "clCreateBuffer takes %.2fsec to map %zuGB",
-		 TIMEVAL_DIFF(&tv2, &tv1), ((Size)NBuffers * (Size) BLCKSZ) >> 30);
+
+	total = (Size) nrequests * nblocks * BLCKSZ;
+	elog(INFO, "%zu MB DMA by %d requests took %.2f sec (%.2f GB/sec)",
+		 total >> 20, nrequests,
+		 TIMEVAL_DIFF(&tv2, &tv1),
+		 (double) total / (double)(1UL << 30) / TIMEVAL_DIFF(&tv2, &tv1));
+	if (num_deferred > 0)
+		elog(INFO, "%d requests were deferred until registration of the region",
+			 num_deferred);
+
+	PG_RETURN_NULL();
+}
+PG_FUNCTION_INFO_V1(gputest_dmasend_worker);
+
+static void
+gputest_init(void)
+{
+	bool		found;
+
+	if (shmem_startup_hook_next)
+		(*shmem_startup_hook_next)();
+
+	elog(LOG, "Loading GPU Tests");
+
+	/*
+	 * GPU context is owned by the DMA worker; one built on the postmaster
+	 * is not usable on the forked processes.
+	 */
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	dma_queue = ShmemInitStruct("gputest DMA queue",
+								sizeof(gputest_dma_queue),
+								&found);
+	if (!found)
+	{
+		memset(dma_queue, 0, sizeof(gputest_dma_queue));
+		SpinLockInit(&dma_queue->lock);
+	}
+	stat_slots = ShmemInitStruct("gputest DMA statistics",
+								 sizeof(gputest_stat_slot) *
+								 GPUTEST_STAT_NUM_SLOTS + PG_CACHE_LINE_SIZE,
+								 &found);
+	stat_slots = (gputest_stat_slot *) CACHELINEALIGN(stat_slots);
+	if (!found)
+	{
+		int		i;
+
+		for (i=0; i < GPUTEST_STAT_NUM_SLOTS; i++)
+		{
+			gputest_stat_counters *c = &stat_slots[i].c;
+
+			pg_atomic_init_u32(&c->pid, 0);
+			pg_atomic_init_u64(&c->bytes_h2d, 0);
+			pg_atomic_init_u64(&c->bytes_d2h, 0);
+			pg_atomic_init_u64(&c->num_transfers, 0);
+			pg_atomic_init_u64(&c->latency_sum, 0);
+			pg_atomic_init_u64(&c->latency_max, 0);
+			pg_atomic_init_u64(&c->register_time, 0);
+		}
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * gputest_shmem_request
+ *
+ * PG15 or later accepts the requests of shared memory only on the
+ * shmem_request_hook; older ones on _PG_init.
+ */
+static void
+gputest_shmem_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (shmem_request_hook_next)
+		(*shmem_request_hook_next)();
 #endif
+	RequestAddinShmemSpace(MAXALIGN(sizeof(gputest_dma_queue)));
+	RequestAddinShmemSpace(MAXALIGN(sizeof(gputest_stat_slot) *
+									GPUTEST_STAT_REQUEST_SLOTS +
+									PG_CACHE_LINE_SIZE));
 }
 
 void
 _PG_init(void)
 {
+	BackgroundWorker worker;
+
 	if (!process_shared_preload_libraries_in_progress)
 		elog(ERROR, "gputest must be loaded via shared_preload_libraries");
 
+	DefineCustomIntVariable("gputest.register_chunk_size",
+							"Size of chunks to register BufferBlocks",
+							NULL,
+							&register_chunk_size,
+							1024,
+							1,
+							INT_MAX,
+							PGC_POSTMASTER,
+							GUC_UNIT_MB,
+							NULL, NULL, NULL);
+	DefineCustomIntVariable("gputest.register_threads",
+							"Number of threads to register BufferBlocks",
+							NULL,
+							&register_threads,
+							4,
+							1,
+							64,
+							PGC_POSTMASTER,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("gputest.dma_unit_size",
+							"Size of DMA units of gputest_dmasend_opencl",
+							NULL,
+							&dma_unit_size,
+							100,
+							1,
+							4096,
+							PGC_USERSET,
+							GUC_UNIT_MB,
+							NULL, NULL, NULL);
+	DefineCustomIntVariable("gputest.dma_streams",
+							"Number of streams of gputest_dmasend_opencl",
+							NULL,
+							&dma_num_streams,
+							1,
+							1,
+							GPUTEST_MAX_STREAMS,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+	DefineCustomIntVariable("gputest.dma_buffers",
+							"Number of device buffers of gputest_dmasend_opencl",
+							NULL,
+							&dma_num_buffers,
+							1,
+							1,
+							GPUTEST_MAX_BUFFERS,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+
+#if PG_VERSION_NUM >= 150000
+	shmem_request_hook_next = shmem_request_hook;
+	shmem_request_hook = gputest_shmem_request;
+#else
+	gputest_shmem_request();
+#endif
+
+	memset(&worker, 0, sizeof(BackgroundWorker));
+	snprintf(worker.bgw_name, sizeof(worker.bgw_name),
+			 "gputest DMA worker");
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_PostmasterStart;
+	worker.bgw_restart_time = 10;
+	snprintf(worker.bgw_library_name, sizeof(worker.bgw_library_name),
+			 "gputest");
+	snprintf(worker.bgw_function_name, sizeof(worker.bgw_function_name),
+			 "gputest_dma_worker_main");
+	RegisterBackgroundWorker(&worker);
+
 	shmem_startup_hook_next = shmem_startup_hook;
-    shmem_startup_hook = gputest_init;	
+	shmem_startup_hook = gputest_init;
 }
@@ -1,13 +1,325 @@
 #include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define KERNEL_READ		0
+#define KERNEL_WRITE	1
+#define KERNEL_TRIAD	2
+
+#define BLOCK_SIZE		(1UL << 20)		/* unit of rate limiting */
+
+static const char *kernel_names[] = { "read", "write", "triad" };
+
+/*
+ * Bandwidth generator
+ *
+ * Each worker runs the streaming loop on its own part of the buffer;
+ * stores bypass the cache (non-temporal) so that they consume the DRAM
+ * bandwidth. If rate is given, each worker sleeps once it runs ahead of
+ * its share of the rate.
+ */
+typedef struct {
+	double	   *a;
+	double	   *b;
+	double	   *c;
+	size_t		nitems;			/* number of doubles in a, b and c */
+	double		rate;			/* bytes per sec, or 0 if unlimited */
+	uint64_t	bytes;			/* bytes moved; updated atomically */
+	double		sink;			/* result of read, not to be optimized out */
+} worker_state;
+
+static int		kernel = KERNEL_TRIAD;
+
+static double
+timer_now(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+/* returns bytes moved by the kernel on the nitems doubles */
+static size_t
+kernel_bytes(size_t nitems)
+{
+	return nitems * sizeof(double) * (kernel == KERNEL_TRIAD ? 3 : 1);
+}
+
+static double
+stream_generic(double *a, const double *b, const double *c, size_t n)
+{
+	double		sum = 0.0;
+	size_t		i;
+
+	switch (kernel)
+	{
+		case KERNEL_READ:
+			for (i=0; i < n; i++)
+				sum += b[i];
+			break;
+		case KERNEL_WRITE:
+			for (i=0; i < n; i++)
+				a[i] = 1.0;
+			break;
+		default:
+			for (i=0; i < n; i++)
+				a[i] = b[i] + 3.0 * c[i];
+			break;
+	}
+	return sum;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx512f")))
+static double
+stream_avx512(double *a, const double *b, const double *c, size_t n)
+{
+	__m512d		sum = _mm512_setzero_pd();
+	__m512d		scalar = _mm512_set1_pd(3.0);
+	size_t		i;
+
+	switch (kernel)
+	{
+		case KERNEL_READ:
+			for (i=0; i < n; i += 8)
+				sum = _mm512_add_pd(sum, _mm512_load_pd(b + i));
+			break;
+		case KERNEL_WRITE:
+			for (i=0; i < n; i += 8)
+				_mm512_stream_pd(a + i, _mm512_set1_pd(1.0));
+			break;
+		default:
+			for (i=0; i < n; i += 8)
+				_mm512_stream_pd(a + i,
+								 _mm512_fmadd_pd(scalar,
+												 _mm512_load_pd(c + i),
+												 _mm512_load_pd(b + i)));
+			break;
+	}
+	_mm_sfence();
+	return _mm512_reduce_add_pd(sum);
+}
+
+__attribute__((target("avx2,fma")))
+static double
+stream_avx2(double *a, const double *b, const double *c, size_t n)
+{
+	__m256d		sum = _mm256_setzero_pd();
+	__m256d		scalar = _mm256_set1_pd(3.0);
+	double		temp[4];
+	size_t		i;
+
+	switch (kernel)
+	{
+		case KERNEL_READ:
+			for (i=0; i < n; i += 4)
+				sum = _mm256_add_pd(sum, _mm256_load_pd(b + i));
+			break;
+		case KERNEL_WRITE:
+			for (i=0; i < n; i += 4)
+				_mm256_stream_pd(a + i, _mm256_set1_pd(1.0));
+			break;
+		default:
+			for (i=0; i < n; i += 4)
+				_mm256_stream_pd(a + i,
+								 _mm256_fmadd_pd(scalar,
+												 _mm256_load_pd(c + i),
+												 _mm256_load_pd(b + i)));
+			break;
+	}
+	_mm_sfence();
+	_mm256_storeu_pd(temp, sum);
+	return temp[0] + temp[1] + temp[2] + temp[3];
+}
+
+static double
+stream_sse2(double *a, const double *b, const double *c, size_t n)
+{
+	__m128d		sum = _mm_setzero_pd();
+	__m128d		scalar = _mm_set1_pd(3.0);
+	double		temp[2];
+	size_t		i;
+
+	switch (kernel)
+	{
+		case KERNEL_READ:
+			for (i=0; i < n; i += 2)
+				sum = _mm_add_pd(sum, _mm_load_pd(b + i));
+			break;
+		case KERNEL_WRITE:
+			for (i=0; i < n; i += 2)
+				_mm_stream_pd(a + i, _mm_set1_pd(1.0));
+			break;
+		default:
+			for (i=0; i < n; i += 2)
+				_mm_stream_pd(a + i,
+							  _mm_add_pd(_mm_load_pd(b + i),
+										 _mm_mul_pd(scalar,
+													_mm_load_pd(c + i))));
+			break;
+	}
+	_mm_sfence();
+	_mm_storeu_pd(temp, sum);
+	return temp[0] + temp[1];
+}
+#endif
+
+static double (*stream_func)(double *a, const double *b,
+							 const double *c, size_t n) = stream_generic;
+static const char *stream_name = "generic";
+
+static void
+stream_init(void)
+{
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+	{
+		stream_func = stream_avx512;
+		stream_name = "avx512";
+	}
+	else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+	{
+		stream_func = stream_avx2;
+		stream_name = "avx2";
+	}
+	else
+	{
+		stream_func = stream_sse2;
+		stream_name = "sse2";
+	}
+#endif
+}
+
+static void *
+worker_main(void *private)
+{
+	worker_state *ws = private;
+	size_t		block_items = BLOCK_SIZE / sizeof(double);
+	size_t		offset = 0;
+	uint64_t	total = 0;
+	double		tv_start = timer_now();
+
+	for (;;)
+	{
+		size_t		n = ws->nitems - offset;
+
+		if (n > block_items)
+			n = block_items;
+		ws->sink += stream_func(ws->a + offset, ws->b + offset,
+								ws->c + offset, n);
+		total += kernel_bytes(n);
+		__atomic_store_n(&ws->bytes, total, __ATOMIC_RELAXED);
+		offset = (offset + n < ws->nitems ? offset + n : 0);
+
+		/* rate limiting */
+		if (ws->rate > 0.0)
+		{
+			double	ahead = (double) total / ws->rate -
+				(timer_now() - tv_start);
+
+			if (ahead > 0.0)
+			{
+				struct timespec	ts;
+
+				ts.tv_sec = (time_t) ahead;
+				ts.tv_nsec = (long)((ahead - (double) ts.tv_sec) * 1.0e9);
+				nanosleep(&ts, NULL);
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * run_workers
+ *
+ * It splits the buffer into the threads, then prints the achieved
+ * bandwidth every second; never returns.
+ */
+static void
+run_workers(char *buffer, size_t size, int num_threads, double rate)
+{
+	worker_state *workers;
+	pthread_t  *threads;
+	size_t		nitems;
+	uint64_t	last = 0;
+	double		tv_last;
+	int			i;
+
+	/* each thread has 3 arrays, aligned to the block size */
+	nitems = (size / num_threads / 3) & ~(BLOCK_SIZE - 1);
+	nitems /= sizeof(double);
+	if (nitems == 0)
+	{
+		printf("buffer is too small for %d threads\n", num_threads);
+		exit(1);
+	}
+	workers = calloc(num_threads, sizeof(worker_state));
+	threads = calloc(num_threads, sizeof(pthread_t));
+	if (!workers || !threads)
+	{
+		printf("out of memory\n");
+		exit(1);
+	}
+	stream_init();
+
+	for (i=0; i < num_threads; i++)
+	{
+		worker_state *ws = &workers[i];
+		double	   *base = (double *)(buffer + 3 * i * nitems *
+									  sizeof(double));
+
+		ws->a = base;
+		ws->b = base + nitems;
+		ws->c = base + 2 * nitems;
+		ws->nitems = nitems;
+		ws->rate = rate / num_threads;
+		if (pthread_create(&threads[i], NULL, worker_main, ws) != 0)
+		{
+			printf("failed on pthread_create : %s\n", strerror(errno));
+			exit(1);
+		}
+	}
+	if (rate > 0.0)
+		printf("%d threads, %s kernel (%s), limited to %.2fGB/s\n",
+			   num_threads, kernel_names[kernel], stream_name, rate / 1.0e9);
+	else
+		printf("%d threads, %s kernel (%s), unlimited\n",
+			   num_threads, kernel_names[kernel], stream_name);
+
+	tv_last = timer_now();
+	for (;;)
+	{
+		uint64_t	curr = 0;
+		double		tv_curr;
+
+		sleep(1);
+		for (i=0; i < num_threads; i++)
+			curr += __atomic_load_n(&workers[i].bytes, __ATOMIC_RELAXED);
+		tv_curr = timer_now();
+		printf("%.2fGB/s\n",
+			   (double)(curr - last) / (tv_curr - tv_last) / 1.0e9);
+		fflush(stdout);
+		last = curr;
+		tv_last = tv_curr;
+	}
+}
 
 static int usage(int argc, char * const argv[])
 {
-	printf("usage: %s -s <size>\n", argv[0]);
+	printf("usage: %s -s <size> [-t <threads> [-b <GB/s>] "
+		   "[-k read|write|triad]]\n", argv[0]);
 
 	exit(0);
 }
@@ -16,9 +328,11 @@ int main(int argc, char * const argv[])
 {
 	size_t		size = (1UL << 30);	/* 1GB */
 	char	   *buffer;
+	int			num_threads = 0;
+	double		rate = 0.0;		/* bytes per sec */
 	int			c;
 
-	while ((c = getopt(argc, argv, "s:")) != -1)
+	while ((c = getopt(argc, argv, "s:t:b:k:")) != -1)
 	{
 		if (c == 's')
 		{
@@ -37,12 +351,35 @@ int main(int argc, char * const argv[])
 			else
 				usage(argc, argv);
 		}
+		else if (c == 't')
+		{
+			num_threads = atoi(optarg);
+			if (num_threads < 1)
+				usage(argc, argv);
+		}
+		else if (c == 'b')
+		{
+			rate = atof(optarg) * 1.0e9;
+			if (rate <= 0.0)
+				usage(argc, argv);
+		}
+		else if (c == 'k')
+		{
+			for (kernel=0; kernel < 3; kernel++)
+			{
+				if (strcmp(optarg, kernel_names[kernel]) == 0)
+					break;
+			}
+			if (kernel == 3)
+				usage(argc, argv);
+		}
 		else
 			usage(argc, argv);
 	}
 
-	/* memory allocation */
-	buffer = malloc(size);
+	/* memory allocation; aligned for the vector loads */
+	if (posix_memalign((void **)&buffer, BLOCK_SIZE, size) != 0)
+		buffer = NULL;
 	if (!buffer)
 	{
 		printf("failed to allocate %lu bytes : %s\n", size, strerror(errno));
@@ -58,6 +395,10 @@ int main(int argc, char * const argv[])
 	}
 	printf("OK, %s allocated and pinned %lu bytes\n", argv[0], size);
 
+	/* bandwidth pressure, if -t is given */
+	if (num_threads > 0)
+		run_workers(buffer, size, num_threads, rate);
+
 	/* infinite sleep */
 	for (;;)
 		sleep(60);
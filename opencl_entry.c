@@ -373,6 +373,122 @@ cl_int clEnqueueWriteBuffer(cl_command_queue command_queue,
 									 event);
 }
 
+cl_int clEnqueueWriteBufferRect(cl_command_queue command_queue,
+								cl_mem buffer,
+								cl_bool blocking_write,
+								const size_t *buffer_origin,
+								const size_t *host_origin,
+								const size_t *region,
+								size_t buffer_row_pitch,
+								size_t buffer_slice_pitch,
+								size_t host_row_pitch,
+								size_t host_slice_pitch,
+								const void *ptr,
+								cl_uint num_events_in_wait_list,
+								const cl_event *event_wait_list,
+								cl_event *event)
+{
+	static cl_int (*p_clEnqueueWriteBufferRect)(
+		cl_command_queue command_queue,
+		cl_mem buffer,
+		cl_bool blocking_write,
+		const size_t *buffer_origin,
+		const size_t *host_origin,
+		const size_t *region,
+		size_t buffer_row_pitch,
+		size_t buffer_slice_pitch,
+		size_t host_row_pitch,
+		size_t host_slice_pitch,
+		const void *ptr,
+		cl_uint num_events_in_wait_list,
+		const cl_event *event_wait_list,
+		cl_event *event) = NULL;
+
+	if (!p_clEnqueueWriteBufferRect)
+		p_clEnqueueWriteBufferRect
+			= get_opencl_function("clEnqueueWriteBufferRect");
+
+	return (*p_clEnqueueWriteBufferRect)(command_queue,
+										 buffer,
+										 blocking_write,
+										 buffer_origin,
+										 host_origin,
+										 region,
+										 buffer_row_pitch,
+										 buffer_slice_pitch,
+										 host_row_pitch,
+										 host_slice_pitch,
+										 ptr,
+										 num_events_in_wait_list,
+										 event_wait_list,
+										 event);
+}
+
+void *clEnqueueMapBuffer(cl_command_queue command_queue,
+						 cl_mem buffer,
+						 cl_bool blocking_map,
+						 cl_map_flags map_flags,
+						 size_t offset,
+						 size_t size,
+						 cl_uint num_events_in_wait_list,
+						 const cl_event *event_wait_list,
+						 cl_event *event,
+						 cl_int *errcode_ret)
+{
+	static void *(*p_clEnqueueMapBuffer)(
+		cl_command_queue command_queue,
+		cl_mem buffer,
+		cl_bool blocking_map,
+		cl_map_flags map_flags,
+		size_t offset,
+		size_t size,
+		cl_uint num_events_in_wait_list,
+		const cl_event *event_wait_list,
+		cl_event *event,
+		cl_int *errcode_ret) = NULL;
+
+	if (!p_clEnqueueMapBuffer)
+		p_clEnqueueMapBuffer = get_opencl_function("clEnqueueMapBuffer");
+
+	return (*p_clEnqueueMapBuffer)(command_queue,
+								   buffer,
+								   blocking_map,
+								   map_flags,
+								   offset,
+								   size,
+								   num_events_in_wait_list,
+								   event_wait_list,
+								   event,
+								   errcode_ret);
+}
+
+cl_int clEnqueueUnmapMemObject(cl_command_queue command_queue,
+							   cl_mem memobj,
+							   void *mapped_ptr,
+							   cl_uint num_events_in_wait_list,
+							   const cl_event *event_wait_list,
+							   cl_event *event)
+{
+	static cl_int (*p_clEnqueueUnmapMemObject)(
+		cl_command_queue command_queue,
+		cl_mem memobj,
+		void *mapped_ptr,
+		cl_uint num_events_in_wait_list,
+		const cl_event *event_wait_list,
+		cl_event *event) = NULL;
+
+	if (!p_clEnqueueUnmapMemObject)
+		p_clEnqueueUnmapMemObject
+			= get_opencl_function("clEnqueueUnmapMemObject");
+
+	return (*p_clEnqueueUnmapMemObject)(command_queue,
+										memobj,
+										mapped_ptr,
+										num_events_in_wait_list,
+										event_wait_list,
+										event);
+}
+
 cl_int clReleaseMemObject(cl_mem memobj)
 {
 	static cl_int (*p_clReleaseMemObject)(cl_mem memobj) = NULL;
@@ -534,6 +650,40 @@ cl_int clReleaseEvent(cl_event event)
 	return (*p_clReleaseEvent)(event);
 }
 
+cl_int clGetEventProfilingInfo(cl_event event,
+							   cl_profiling_info param_name,
+							   size_t param_value_size,
+							   void *param_value,
+							   size_t *param_value_size_ret)
+{
+	static cl_int (*p_clGetEventProfilingInfo)(
+		cl_event event,
+		cl_profiling_info param_name,
+		size_t param_value_size,
+		void *param_value,
+		size_t *param_value_size_ret) = NULL;
+
+	if (!p_clGetEventProfilingInfo)
+		p_clGetEventProfilingInfo
+			= get_opencl_function("clGetEventProfilingInfo");
+
+	return (*p_clGetEventProfilingInfo)(event,
+										param_name,
+										param_value_size,
+										param_value,
+										param_value_size_ret);
+}
+
+cl_int clFlush(cl_command_queue command_queue)
+{
+	static cl_int (*p_clFlush)(cl_command_queue command_queue) = NULL;
+
+	if (!p_clFlush)
+		p_clFlush = get_opencl_function("clFlush");
+
+	return (*p_clFlush)(command_queue);
+}
+
 cl_int clFinish(cl_command_queue command_queue)
 {
 	static cl_int (*p_clFinish)(cl_command_queue command_queue) = NULL;